@@ -2,12 +2,41 @@
 # How to add a new map?
 # 1. give it a name, e.g, "OSM"
 # 2. add it to map list, with ';' as separator. see function map_list()
-# 3. create two functions, one named <map_name>(), another named <map_name>_url().
+# 3. create function <map_name>(), and url template or function <map_name>_url.
 #
 # Function <map_name>() is used to configure the map, where image-type is used to 
 # (1) verify content-type of HTTP download, (2) and as file extension
+# Optional "store" selects how tiles are saved: "dir" (default) saves each tile as
+# <z>/<x>/<y>.<ext>, "pack" appends all tiles of the map to one pack file, which is
+# much faster to copy and wastes less space on SD card. e.g.:
+#	"min-zoom=1; max-zoom=17; image-type=png; store=pack"
+# Optional "disk-quota-mb" limits disk space of the tiles of the map. When it is
+# exceeded, least recently viewed tiles are removed in background, except tiles in
+# batch download regions that are pinned. e.g.: "...; disk-quota-mb=500"
+# Optional "scrub" sets what to do with corrupt (e.g., truncated) tiles, which are
+# checked in background: "quarantine" (default) moves them to <map dir>/.quarantine,
+# "redownload" also downloads them again, "off" disables checking. e.g.:
+#	"...; scrub=redownload"
+# Optional "dl-max-conns" (1..16, default 4) limits concurrent downloads, and
+# "dl-min-delay-ms" (default 0) sets the least pause after each download. Within
+# these limits, both are adapted to the tile server: faster while it responds well,
+# slower on errors, and it waits as long as the server asks with Retry-After.
+# Be polite to servers that don't want heavy use. e.g.:
+#	"...; dl-max-conns=2; dl-min-delay-ms=1000"
+# Optional "max-age-days" (default 0: never) refreshes tiles older than that when
+# they are shown, or when the time the server allows to cache them is over, if it's
+# longer. Unchanged tiles are not downloaded again (ETag, Last-Modified). Tiles
+# downloaded before this option was set are refreshed when they are shown. e.g.:
+#	"...; max-age-days=30"
 #
-# Function <map_name>_url() is used to format url for downloading. 
+# <map_name>_url is used to format url for downloading. For most maps it's a string,
+# where z, x, y in braces are replaced by zoom level and tile numbers. Braces may
+# hold integer expressions with + - * / % ^ (power) and parentheses, e.g.:
+#	OSM_url = "http://tile.openstreetmap.org/{z}/{x}/{y}.png"
+#	Another_url = "http://host/tile?x={x}&y={2^(z-1)-1-y}&z={17-z}"
+# Templates are compiled once and formatted without Python, which is much faster
+# for batch download. For urls templates can't express, define a function instead:
+#	def <map_name>_url(zoom, x, y): return "..."
 #
 # Please NOTE: 
 # 1. respect to the map licenses!
@@ -20,31 +49,24 @@ def map_list():
 
 ##########################################################################################
 def OSM():
-	return "min-zoom=1; max-zoom=17; image-type=png"
+	return "min-zoom=1; max-zoom=17; image-type=png; dl-max-conns=2; max-age-days=30"
 
-def OSM_url(zoom, x, y):
-	return "http://tile.openstreetmap.org/" + `zoom` + "/" + `x` + "/" + `y` + ".png"
+OSM_url = "http://tile.openstreetmap.org/{z}/{x}/{y}.png"
 
 ##########################################################################################
 def OpenCycle():
 	return "min-zoom=0; max-zoom=17; image-type=png"
    
-def OpenCycle_url(zoom, x, y):
-	return "http://a.andy.sandbox.cloudmade.com/tiles/cycle/" + `zoom` + "/" + `x` + "/" + `y` + ".png"
+OpenCycle_url = "http://a.andy.sandbox.cloudmade.com/tiles/cycle/{z}/{x}/{y}.png"
 
 ##########################################################################################
 def GoogleMap():
-	return "min-zoom=1; max-zoom=17; image-type=png"
+	return "min-zoom=1; max-zoom=17; image-type=png; dl-max-conns=2"
 
-def GoogleMap_url(zoom, x, y):
-	zoom = 17 - zoom
-	return "http://mt.google.com/mt/v=w2.92&hl=en&x=" + `x` + "&y=" + `y` + "&zoom=" + `zoom` + "&s=Gali"
+GoogleMap_url = "http://mt.google.com/mt/v=w2.92&hl=en&x={x}&y={y}&zoom={17-z}&s=Gali"
 
 ##########################################################################################
 def YahooSat():
 	return "min-zoom=1; max-zoom=17; image-type=jpg"
 
-def YahooSat_url(zoom, x, y):
-	y = (1 << (zoom-1)) - 1 - y
-	zoom += 1
-	return "http://aerial.maps.yimg.com/ximg?t=a&v=1.9&s=256&x=" + `x` + "&y=" + `y` + "&z=" + `zoom` + "&r=1"
+YahooSat_url = "http://aerial.maps.yimg.com/ximg?t=a&v=1.9&s=256&x={x}&y={2^(z-1)-1-y}&z={z+1}&r=1"
@@ -1,13 +1,16 @@
+#include <dirent.h>
+
 #include "omgps.h"
 #include "tile.h"
 #include "util.h"
 #include "xpm_image.h"
 #include "customized.h"
 #include "network.h"
+#include "track.h"
 
 static mouse_handler_t mouse_dlarea_handler;
 
-static GtkWidget *lockview_button, *title_label;
+static GtkWidget *lockview_button, *pin_button, *title_label;
 #define NUM_BUTTON 6
 static char *level_add_button_labels[NUM_BUTTON] = { "+1", "+2", "+3", "+4", "+5", "+6"};
 static char *level_add_button_data[NUM_BUTTON] = { "1", "2", "3", "4", "5", "6" };
@@ -17,6 +20,12 @@ static coord_t dlarea_wgs84_tl, dlarea_wgs84_br;
 static gboolean draw_dlarea_with_wgs84 = FALSE;
 static gboolean dl_area_choosed = FALSE;
 
+/* download along a recorded track instead of the area, buffered by metres */
+static GtkWidget *track_list, *buffer_list;
+#define NUM_BUFFER 5
+static char *buffer_labels[NUM_BUFFER] = { "200 m", "500 m", "1 km", "2 km", "5 km" };
+static int buffer_metres[NUM_BUFFER] = { 200, 500, 1000, 2000, 5000 };
+
 static GtkWidget *batchlist_notebook;
 
 static GtkWidget *batchlist_treeview, *batchlist_treeview_sw;
@@ -62,9 +71,11 @@ void dl_tiles_update_buttons_on_zoom_changed()
 }
 
 /**
- * <topleft> and <botright>: tile pixel
+ * <topleft> and <botright>: tile pixel.
+ * If <corridor_m> > 0, download tiles within <corridor_m> metres of <path> instead.
  */
-static void tile_batch_download(int levels, coord_t tl_wgs84, coord_t br_wgs84)
+static void tile_batch_download(int levels, coord_t tl_wgs84, coord_t br_wgs84,
+	const coord_t *path, int path_len, int corridor_m)
 {
 	map_repo_t *repo = g_view.fglayer.repo;
 	int zoom = repo->zoom;
@@ -72,7 +83,7 @@ static void tile_batch_download(int levels, coord_t tl_wgs84, coord_t br_wgs84)
 	if (zoom + levels > repo->max_zoom)
 		levels = repo->max_zoom - zoom;
 
-	batch_dl_t *batch = (batch_dl_t*)malloc(sizeof(batch_dl_t));
+	batch_dl_t *batch = (batch_dl_t*)calloc(1, sizeof(batch_dl_t));
 	if (! batch) {
 		warn_dialog("batch download:\n\nunable to allocate memory!");
 		return;
@@ -83,57 +94,80 @@ static void tile_batch_download(int levels, coord_t tl_wgs84, coord_t br_wgs84)
 	batch->max_zoom = zoom + levels;
 	batch->tl_wgs84 = tl_wgs84;
 	batch->br_wgs84 = br_wgs84;
+	batch->corridor_m = corridor_m;
+	batch->path = path;
+	batch->path_len = path_len;
 
 	/* prepare */
 
 	int exists_size = batch_download_prepare(batch);
 
 	if (exists_size < 0) {
+		batch_download_free(batch);
 		warn_dialog("batch download:\nallocate memory failed!");
 		return;
 	}
 	float size_est;
 
 	/* MB */
-	if (batch->num_in_range == batch->num_dl_total)
+	if (batch->num_tiles == batch->num_dl_total)
 		size_est = batch->num_dl_total * 0.01; // estimate
 	else {
-		int average_size = exists_size / (batch->num_in_range - batch->num_dl_total);
+		int average_size = exists_size / (batch->num_tiles - batch->num_dl_total);
 		size_est = 1.0 * average_size * batch->num_dl_total / (1024 * 1024);
 	}
 
 	char buf[128];
 	if (batch->num_dl_total == 0) {
-		snprintf(buf, sizeof(buf), "total %d tiles, already on disk.", batch->num_in_range);
+		snprintf(buf, sizeof(buf), "total %d tiles, already on disk.", batch->num_tiles);
+		batch_download_free(batch);
 		info_dialog(buf);
 		return;
 	}
 
-	/* Assume each download takes 1 second */
-	int seconds = (int)ceil((1 + 1000.0 / DL_SLEEP_MS) * batch->num_dl_total / TILE_DL_THREADS_LIMIT);
+	/* measured by recent downloads from the same host, see tile_dl_host.c.
+	 * If nothing is measured, assume each download takes 1 second */
+	double rate = 0;
+	char *url = mapcfg_get_dl_url(repo, batch->levels[0].zoom,
+		batch->levels[0].tl_tile.x, batch->levels[0].tl_tile.y);
+	if (url) {
+		rate = dl_host_rate(url, repo->dl_max_conns);
+		free(url);
+	}
+	if (rate <= 0)
+		rate = 1000.0 * MIN(DL_HOST_INIT_LIMIT, repo->dl_max_conns) / (1000 + DL_SLEEP_MS);
+	int seconds = (int)ceil(batch->num_dl_total / rate);
 	int h = seconds / 3600;
 	int remains = seconds - h * 3600;
 	int m = remains / 60;
 	int s = remains - m * 60;
 
 	snprintf(buf, sizeof(buf), "tiles: %d of %d, disk space: ~%.2fMB, time: > %d:%d:%d",
-		batch->num_dl_total, batch->num_in_range, size_est, h, m, s);
+		batch->num_dl_total, batch->num_tiles, size_est, h, m, s);
 
 	if (! confirm_dialog(buf)) {
-		free(batch);
+		batch_download_free(batch);
 		return;
 	}
 
 	/* batch download */
 
-	log_info("batch download: map=%s, zoom=%d, +levels=%d", repo->name, zoom, levels);
+	log_info("batch download: map=%s, zoom=%d, +levels=%d, corridor=%dm", repo->name, zoom,
+		levels, corridor_m);
 	log_info("%s", buf);
 
+	if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(pin_button)))
+		batch_download_pin(batch);
+
 	batch_download(batch);
 }
 
 void update_batch_dl_status()
 {
+	/* batches resumed on start up, before UI is created */
+	if (! batchlist_store || ! g_view.fglayer.repo)
+		return;
+
 	tile_downloader_t *td = (tile_downloader_t *)g_view.fglayer.repo->downloader;
 	assert(td);
 
@@ -152,7 +186,10 @@ void update_batch_dl_status()
 	char failed_percent[32];
 
 	for (b = td->batches; b; b=b->next) {
-		snprintf(levels, sizeof(levels), "%d - %d", b->min_zoom, b->max_zoom);
+		if (b->corridor_m > 0)
+			snprintf(levels, sizeof(levels), "%d - %d, track", b->min_zoom, b->max_zoom);
+		else
+			snprintf(levels, sizeof(levels), "%d - %d", b->min_zoom, b->max_zoom);
 		snprintf(failed_percent, sizeof(failed_percent), "%.1f%%",
 			100.0 * b->num_dl_failed / b->num_dl_total);
 		done_percent = 100 * b->num_dl_done / b->num_dl_total;
@@ -233,21 +270,55 @@ static void dlarea_mouse_released(point_t point, guint time)
 	dlarea_pressed = FALSE;
 }
 
+/**
+ * Download tiles along track record file <file>.
+ */
+static void track_batch_download(int levels, char *file)
+{
+	coord_t none = {0, 0};
+	int count;
+
+	coord_t *path = track_read_points(file, &count);
+	if (! path) {
+		warn_dialog("Unable to read track file, or it has no records.");
+		return;
+	}
+
+	int i = gtk_combo_box_get_active(GTK_COMBO_BOX(buffer_list));
+	int corridor_m = buffer_metres[(i >= 0 && i < NUM_BUFFER)? i : 0];
+
+	tile_batch_download(levels, none, none, path, count, corridor_m);
+
+	free(path);
+}
+
 static void dlarea_level_button_clicked(GtkWidget *widget, gpointer data)
 {
 	log_debug("dlarea_level_button_clicked");
 	char *levels_mark = (char *)data;
 	int levels = levels_mark[0] - '0';
 
-	if (! dl_area_choosed || ! AREA_BIG_ENOUGH()) {
+	char *track = NULL;
+	if (gtk_combo_box_get_active(GTK_COMBO_BOX(track_list)) > 0)
+		track = gtk_combo_box_get_active_text(GTK_COMBO_BOX(track_list));
+
+	if (! track && (! dl_area_choosed || ! AREA_BIG_ENOUGH())) {
 		warn_dialog("Download area is not specified!");
 		return;
 	}
 
 	log_debug("guess network connecting...");
 	if (! guess_network_is_connecting(TRUE)) {
-		if (! confirm_dialog("Seems no network connection,\ncontinue?"))
+		if (! confirm_dialog("Seems no network connection,\ncontinue?")) {
+			g_free(track);
 			return;
+		}
+	}
+
+	if (track) {
+		track_batch_download(levels, track);
+		g_free(track);
+		return;
 	}
 
 	GdkRectangle rect;
@@ -266,7 +337,7 @@ static void dlarea_level_button_clicked(GtkWidget *widget, gpointer data)
 	coord_t br_wgs84 = tilepixel_to_wgs84(br, zoom, repo);
 
 	/* try download... */
-	tile_batch_download(levels, tl_wgs84, br_wgs84);
+	tile_batch_download(levels, tl_wgs84, br_wgs84, NULL, 0, 0);
 }
 
 static void reset_dlarea_data()
@@ -314,6 +385,37 @@ static void toggle_dl_ctx_state(gboolean enable)
 	}
 }
 
+/**
+ * List track record files, the first item means downloading the area.
+ */
+static void update_track_list()
+{
+	GtkComboBox *combo = GTK_COMBO_BOX(track_list);
+	GtkTreeModel *model = gtk_combo_box_get_model(combo);
+	int n = gtk_tree_model_iter_n_children(model, NULL);
+	int len, ext_len = strlen(TRACK_FILE_EXT);
+	struct dirent *ep;
+	char *fname;
+
+	while (--n > 0)
+		gtk_combo_box_remove_text(combo, n);
+	gtk_combo_box_set_active(combo, 0);
+
+	DIR *dp = opendir(g_context.track_dir);
+	if (! dp)
+		return;
+
+	while ((ep = readdir(dp))) {
+		fname = ep->d_name;
+		len = strlen(fname);
+		if (ep->d_type == DT_REG && len > ext_len &&
+			strcmp(&fname[len-ext_len], TRACK_FILE_EXT) == 0)
+			gtk_combo_box_append_text(combo, fname);
+	}
+
+	closedir(dp);
+}
+
 void ctx_tab_dl_tiles_on_show()
 {
 	//toggle_fullscreen(TRUE);
@@ -325,6 +427,8 @@ void ctx_tab_dl_tiles_on_show()
 	dl_area_choosed = FALSE;
 	draw_dlarea_with_wgs84 = FALSE;
 
+	update_track_list();
+
 	char buf[128];
 	snprintf(buf, sizeof(buf), "<span weight='bold'>Download map tiles: %s</span>",
 		g_view.fglayer.repo->name);
@@ -533,6 +637,8 @@ GtkWidget * ctx_tab_dl_tiles_create()
 	lockview_button = gtk_toggle_button_new_with_label("lock view");
 	g_signal_connect (G_OBJECT (lockview_button), "toggled",
 			G_CALLBACK (lockview_button_toggled), NULL);
+	/* pinned tiles are not removed when disk quota is exceeded */
+	pin_button = gtk_check_button_new_with_label("pin");
 	GtkWidget *close_button = gtk_button_new_with_label("close");
 	g_signal_connect (G_OBJECT (close_button), "clicked",
 			G_CALLBACK (close_button_clicked), NULL);
@@ -543,7 +649,7 @@ GtkWidget * ctx_tab_dl_tiles_create()
 	gtk_box_pack_start(GTK_BOX(button_vbox), hbox, FALSE, FALSE, 10);
 
 	GtkWidget *tip_label = gtk_label_new("To choose download area: lock view then"
-		" drag a rectangle on map.");
+		" drag a rectangle on map, or choose a track to download along it.");
 	gtk_label_set_justify(GTK_LABEL(tip_label), GTK_JUSTIFY_LEFT);
 	gtk_misc_set_alignment(GTK_MISC(tip_label), 0, 0.5);
 	gtk_label_set_line_wrap(GTK_LABEL(tip_label), TRUE);
@@ -560,8 +666,26 @@ GtkWidget * ctx_tab_dl_tiles_create()
 			G_CALLBACK (dlarea_level_button_clicked), level_add_button_data[i]);
 	}
 
+	/* along track */
+	GtkWidget *track_hbox = gtk_hbox_new(FALSE, 3);
+	gtk_box_pack_start(GTK_BOX(button_vbox), track_hbox, FALSE, FALSE, 5);
+
+	track_list = gtk_combo_box_new_text();
+	gtk_combo_box_append_text(GTK_COMBO_BOX(track_list), "-- area, or track --");
+	gtk_combo_box_set_active(GTK_COMBO_BOX(track_list), 0);
+
+	buffer_list = gtk_combo_box_new_text();
+	for (i=0; i<NUM_BUFFER; i++)
+		gtk_combo_box_append_text(GTK_COMBO_BOX(buffer_list), buffer_labels[i]);
+	gtk_combo_box_set_active(GTK_COMBO_BOX(buffer_list), 1);
+
+	gtk_box_pack_start(GTK_BOX(track_hbox), track_list, TRUE, TRUE, 0);
+	gtk_box_pack_start(GTK_BOX(track_hbox), gtk_label_new("within"), FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(track_hbox), buffer_list, FALSE, FALSE, 0);
+
 	gtk_container_add(GTK_CONTAINER (hbox), lockview_button);
 	gtk_container_add(GTK_CONTAINER (hbox), hbox_1);
+	gtk_container_add(GTK_CONTAINER (hbox), pin_button);
 	gtk_container_add(GTK_CONTAINER (hbox), close_button);
 
 	batchlist_notebook = gtk_notebook_new();
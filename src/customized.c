@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <gtk/gtk.h>
 #include <glib.h>
 
@@ -42,6 +43,12 @@ static inline void configure_dialog(GtkWidget *dialog)
 
 void warn_dialog(char *msg)
 {
+	/* headless, see tile bundle tool of main.c */
+	if (! g_window) {
+		fprintf(stderr, "%s\n", msg);
+		return;
+	}
+
 	GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(g_window),
 		GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
 		GTK_MESSAGE_WARNING, GTK_BUTTONS_CLOSE, "%s", msg);
@@ -52,6 +59,12 @@ void warn_dialog(char *msg)
 
 void info_dialog(char *msg)
 {
+	/* headless, see tile bundle tool of main.c */
+	if (! g_window) {
+		fprintf(stderr, "%s\n", msg);
+		return;
+	}
+
 	GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(g_window),
 		GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
 		GTK_MESSAGE_INFO, GTK_BUTTONS_OK, "%s", msg);
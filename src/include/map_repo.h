@@ -8,12 +8,48 @@
 #define MAP_MAX_BG_COLORS	5
 #define MAX_ZOOM_LEVELS		30
 
+/* max depth of evaluation stack of url template expressions */
+#define URL_TEMPLATE_MAX_STACK	16
+/* max length of formatted url */
+#define URL_TEMPLATE_MAX_URL	1024
+
+/* compiled url template, see url_template.c */
+typedef struct __url_template_op_t
+{
+	int code;
+	int len;
+	gint64 value;
+} url_template_op_t;
+
+typedef struct __url_template_t
+{
+	char *text;
+	url_template_op_t *ops;
+	int count;
+	int capacity;
+} url_template_t;
+
 typedef struct __map_repo_t
 {
 	char *name;
 	int min_zoom;
 	int max_zoom;
 	char *image_type;
+	/* tile storage backend: NULL or "dir": one file per tile, "pack": pack file */
+	char *store_type;
+	/* corrupt tiles found by scrubber: NULL or "quarantine", "redownload", or "off" */
+	char *scrub;
+	/* disk quota (MB) of tiles, 0: unlimited */
+	int disk_quota_mb;
+	/* max concurrent downloads, and least delay (ms) after each download,
+	 * the actual ones are adapted per host, see tile_dl_host.c */
+	int dl_max_conns;
+	int dl_min_delay_ms;
+	/* days a tile is fresh, then it is revalidated when shown, 0: never */
+	int max_age_days;
+	/* url is formatted by compiled template if <map_name>_url is a string,
+	 * or else by python function <map_name>_url(zoom, x, y) */
+	url_template_t *url_template;
 	PyObject *urlfunc;
 
 	/* additional runtime data */
@@ -26,6 +62,9 @@ typedef struct __map_repo_t
 	float lon_fix;
 
 	void *downloader;
+	void *store;
+	void *quota;
+	void *meta;
 
 } map_repo_t;
 
@@ -39,4 +78,10 @@ extern void mapcfg_iterate_maplist(iterate_maplist_func f, void *arg);
 extern map_repo_t *mapcfg_get_ith_repo(int ith);
 extern char *mapcfg_get_dl_url(map_repo_t *repo, int zoom, int x, int y);
 
+/******************* url_template.c *********************/
+
+extern url_template_t * url_template_compile(const char *template, char *errbuf, int errbuf_len);
+extern int url_template_format(const url_template_t *t, int zoom, int x, int y, char *buf, int len);
+extern void url_template_free(url_template_t *t);
+
 #endif /* TILE_CONFIG_H_ */
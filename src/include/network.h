@@ -1,14 +1,55 @@
 #ifndef NETWORK_H_
 #define NETWORK_H_
 
+#include <time.h>
 #include <glib.h>
+#include <zlib.h>
 
 #define PING_IPV4_ADDRESS	"208.67.222.222"
 
+/* seconds a resolved address is cached, getaddrinfo() doesn't tell the real TTL */
+#define DNS_CACHE_TTL			300
+/* seconds a failed resolution is cached */
+#define DNS_CACHE_NEGATIVE_TTL	30
+/* default resolve timeout (seconds) */
+#define DNS_RESOLVE_TIMEOUT		10
+#define DNS_CACHE_MAX			32
+
+struct addrinfo;
+
+/* same as getaddrinfo()/freeaddrinfo(), replaceable for testing */
+typedef int (*dns_resolve_func_t)(const char *host, const char *service,
+	const struct addrinfo *hints, struct addrinfo **res);
+typedef void (*dns_free_func_t)(struct addrinfo *res);
+
+typedef struct __dns_entry_t
+{
+	char *host;
+	char *port;
+	int family;
+	int socktype;
+	int protocol;
+
+	/* own copy, NULL if resolution failed */
+	struct addrinfo *info;
+	time_t expire;
+	/* a resolver thread is working on it */
+	gboolean resolving;
+	/* callers waiting for the resolver, it can't be freed until they are done */
+	int waiters;
+
+	struct __dns_entry_t *next;
+} dns_entry_t;
+
 extern int count_network_interfaces();
 
 extern struct addrinfo * get_remote_addr(char *host, char * port, int family, int socktype,
 		int protocol, int resolve_timeout);
+extern struct addrinfo * get_remote_addr_nowait(char *host, char *port, int family, int socktype,
+		int protocol, gboolean *pending);
+extern void free_remote_addr(struct addrinfo *info);
+extern void dns_cache_set_resolver(dns_resolve_func_t resolve_func, dns_free_func_t free_func);
+extern void dns_cache_cleanup();
 
 extern int connect_remote_with_timeouts(char *host, char *port, int family, int socktype, int protocol,
 		int resolv_timeout, int connect_timeout, int send_timeout, int recv_timeout);
@@ -21,6 +62,9 @@ extern int parse_http_url(char *url, char **host, char **port, char **path);
 
 /* make sure enough space for error messages! */
 #define HTTP_GET_RESULT_ERR_BUF_LEN	128
+/* validators of conditional request, longer ETag is ignored */
+#define HTTP_ETAG_LEN			80
+#define HTTP_DATE_LEN			32
 
 typedef struct __http_get_result_t
 {
@@ -28,6 +72,12 @@ typedef struct __http_get_result_t
 	int http_code;
 	int content_length;
 	char content_type[32];
+	/* seconds from header Retry-After of 429/503 response, 0: not set */
+	int retry_after;
+	/* validators and freshness (seconds, from Cache-Control or Expires, 0: not set) */
+	char etag[HTTP_ETAG_LEN];
+	char last_modified[HTTP_DATE_LEN];
+	int max_age;
 	char err_buf[HTTP_GET_RESULT_ERR_BUF_LEN];
 } http_get_result_t;
 
@@ -40,6 +90,9 @@ typedef enum
 	HTTP_GET_ERROR_WRITE_REMOTE,
 	HTTP_GET_ERROR_NOT_200_OK,
 	HTTP_GET_ERROR_WRITE_FILE,
+	HTTP_GET_ERROR_DECODE,
+	/* 304 response of a conditional request, not an error */
+	HTTP_GET_ERROR_NOT_MODIFIED,
 } HTTP_GET_ERROR_NO_T;
 
 #define HTTP_GET_ERROR_URL_ERR			"bad url format"
@@ -48,8 +101,75 @@ typedef enum
 #define HTTP_GET_ERROR_WRITE_REMOTE_ERR	"failed to send request to remote host"
 #define HTTP_GET_ERROR_NOT_200_OK_ERR	"remote host returns HTTP code"
 #define HTTP_GET_ERROR_WRITE_FILE_ERR	"failed to write data to local file"
+#define HTTP_GET_ERROR_DECODE_ERR		"failed to decode gzip/deflate content"
+#define HTTP_GET_ERROR_NOT_MODIFIED_ERR	"not modified"
+
+/* buffered reader of a response, reads from socket in large blocks */
+#define HTTP_READ_BUF_SIZE		8192
+#define HTTP_HEADER_LINE_MAX	1024
+
+typedef struct __http_reader_t
+{
+	int fd;
+	/* unread bytes are buf[start, end) */
+	int start;
+	int end;
+	char buf[HTTP_READ_BUF_SIZE];
+
+	/* instead of <fd>: response in memory, see http_parse_response() */
+	const char *mem;
+	int mem_len;
+	int mem_pos;
+	/* no more data after <mem> */
+	gboolean closed;
+	/* reached the end of <mem> but wanted more */
+	gboolean starved;
+} http_reader_t;
+
+/* body sink, decodes Content-Encoding while streaming to file */
+typedef struct __http_body_t
+{
+	/* -1: discard */
+	int fd;
+	gboolean inflating;
+	gboolean raw_tried;
+	gboolean stream_end;
+	z_stream zs;
+	/* decoded bytes */
+	int written;
+} http_body_t;
+
+/* idle keep-alive connection */
+typedef struct __http_conn_t
+{
+	char host[64];
+	char port[8];
+	int fd;
+	time_t idle_since;
+	struct __http_conn_t *next;
+} http_conn_t;
+
+/* idle keep-alive connections kept per host:port, and in total */
+#define HTTP_POOL_MAX_PER_HOST	4
+#define HTTP_POOL_MAX			16
+/* seconds, most servers close idle connections after 15 seconds or so */
+#define HTTP_POOL_IDLE_TIMEOUT	10
+/* bytes of error response body that are read out to keep the connection */
+#define HTTP_DRAIN_MAX			8192
+
+/* see http_parse_response() */
+#define HTTP_PARSE_PENDING		-1
 
 extern void http_get(char *url, int fd, int con_timeout, int timeout, http_get_result_t *result);
+extern void http_result_init(http_get_result_t *result);
+extern void http_result_set_error(http_get_result_t *result, int error_no);
+extern int http_format_request(char *buf, int len, char *host, char *path, const char *etag,
+	const char *last_modified);
+extern int http_parse_response(const char *data, int len, gboolean closed, int fd,
+	http_get_result_t *result, gboolean *no_response, gboolean *keep_alive);
+extern int http_pool_acquire(char *host, char *port);
+extern void http_pool_release(char *host, char *port, int sock_fd);
+extern void http_pool_cleanup();
 
 
 #endif /* NETWORK_H_ */
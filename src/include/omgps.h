@@ -50,6 +50,11 @@ typedef struct __cfg_t
 
 	char *last_map_name;
 	char *last_sound_file;
+
+	/* per layer tile cache budget, 0: auto */
+	int tile_cache_kb;
+	/* raw tile image cache budget, shared by all layers */
+	int tile_l2_cache_kb;
 } cfg_t;
 
 typedef struct __map_view_tile_layer_t
@@ -99,6 +104,9 @@ typedef struct __map_view_t
 	map_view_tile_layer_t fglayer;
 	map_view_tile_layer_t bglayer;
 
+	/* L2: raw tile images of all layers */
+	tilecache_t *blob_cache;
+
 	/* sky map for SVs */
 	GdkPixbuf *sky_pixbuf;
 
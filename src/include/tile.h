@@ -5,39 +5,413 @@
 #ifndef TILE_H_
 #define TILE_H_
 
-#define TILE_DL_THREADS_LIMIT		3
+/* concurrent downloads per map, see map config "dl-max-conns" */
+#define TILE_DL_CONNS_LIMIT		16
 #define TILE_DL_USER_LIBCURL		0
-#define TILE_CACHE_CAPACITY			6
+/* decoded RGB tile: rowstride * height */
+#define TILE_DECODED_BYTES			(TILE_SIZE * TILE_SIZE * 3)
 
-typedef struct __tile_t
+/* tiles around the view that are kept for panning and prefetching */
+#define TILE_CACHE_PREFETCH_MARGIN	1
+
+/* used before drawing area is configured, 480x640 view: (3+2) * (4+2) tiles */
+#define TILE_CACHE_DEFAULT_BUDGET	(30 * TILE_DECODED_BYTES)
+
+/* raw (compressed) tile images, shared by all layers */
+#define TILE_L2_CACHE_DEFAULT_KB	4096
+
+/* decode worker threads */
+#define TILE_LOADER_THREADS			2
+/* about 2 screens of tiles of 2 layers */
+#define TILE_LOADER_MAX_PENDING		64
+/* upper bound, the actual count is also limited by tile cache budget */
+#define TILE_LOADER_MAX_PREFETCH	32
+
+/* zoom levels to look up for a cached ancestor of a missing tile */
+#define TILE_FALLBACK_LEVELS		4
+
+/* negative lookup cache: slots (power of 2) and expiry (seconds) */
+#define TILE_ABSENT_SLOTS			512
+#define TILE_ABSENT_TTL				30
+#define TILE_ABSENT_DL_TTL			60
+
+/**
+ * Cache entry header, embedded as the first member of cached objects.
+ * The links are owned by tile cache.
+ */
+typedef struct __tilecache_node_t
 {
+	map_repo_t *repo;
 	int zoom;
 	int x;
 	int y;
-	char *path;
-	char *url;
+
+	/* bytes accounted by tile cache */
+	int size;
+
+	struct __tilecache_node_t *hash_next;
+	struct __tilecache_node_t *lru_prev;
+	struct __tilecache_node_t *lru_next;
+} tilecache_node_t;
+
+/* L1: decoded tile */
+typedef struct __tile_t
+{
+	tilecache_node_t node;
+
 	GdkPixbuf *pixbuf;
-	gboolean cached;
+
+	/* holders: tile cache and each tilecache_acquire() caller.
+	 * The last tile_release() frees the tile */
+	volatile gint refcount;
+
+	/* synthesized from neighbouring zoom levels, to be replaced by the real one */
+	gboolean provisional;
 } tile_t;
 
-struct __tilecache_slot_t;
+/* L2: raw PNG/JPEG bytes of a tile */
+typedef struct __tile_blob_t
+{
+	tilecache_node_t node;
+	guchar *data;
+} tile_blob_t;
+
+/* drops the reference that tile cache holds */
+typedef void (*tilecache_release_func_t)(tilecache_node_t *node);
+
+typedef enum
+{
+	/* empty slot */
+	TILE_ABSENT_NONE = 0,
+	/* no tile file, download is not tried */
+	TILE_ABSENT_LOCAL,
+	/* no tile file, can't download or download failed */
+	TILE_ABSENT_REMOTE,
+	/* being downloaded */
+	TILE_ABSENT_DOWNLOADING
+} TILE_ABSENT_STATE;
+
+/* decoded pixbuf of a tile image, shared by tiles with identical bytes */
+typedef struct __tile_shared_pixbuf_t
+{
+	guint64 hash;
+	int len;
+	/* weak reference, cleared when the pixbuf is finalized */
+	GdkPixbuf *pixbuf;
+} tile_shared_pixbuf_t;
+
+#define TILE_SHARED_PIXBUF_SLOTS	64
+
+/* negative lookup cache entry */
+typedef struct __tile_absent_t
+{
+	map_repo_t *repo;
+	int zoom;
+	int x;
+	int y;
+	TILE_ABSENT_STATE state;
+	time_t expire;
+} tile_absent_t;
 
 typedef struct __tilecache_t
 {
 	pthread_mutex_t lock;
 	int count;
-	int capacity;
-	struct __tilecache_slot_t *head;
-	struct __tilecache_slot_t *tail;
+
+	/* accounted bytes of all entries */
+	int size;
+	int budget;
+
+	/* estimated bytes per entry, to size hash buckets */
+	int entry_bytes;
+	tilecache_release_func_t release_func;
+
+	/* hash buckets, bucket_count is power of 2 */
+	tilecache_node_t **buckets;
+	int bucket_count;
+
+	/* recency list: head is the least recently used one */
+	tilecache_node_t *head;
+	tilecache_node_t *tail;
 } tilecache_t;
 
+typedef enum
+{
+	TILE_STORE_DIR,
+	TILE_STORE_PACK
+} TILE_STORE_TYPE;
+
+/* pack index file header, followed by <capacity> slots */
+typedef struct __tile_pack_index_head_t
+{
+	char magic[8];
+	guint32 capacity;
+	guint32 count;
+	/* set only when the store is closed, see pack_open_index() */
+	guint32 clean;
+	guint32 reserved;
+} tile_pack_index_head_t;
+
+/* pack index slot, <zoom> is stored as zoom + 1, 0 means empty slot */
+typedef struct __tile_pack_slot_t
+{
+	guint32 zoom;
+	guint32 x;
+	guint32 y;
+	guint32 len;
+	guint64 offset;
+} tile_pack_slot_t;
+
+/* pack file record header, followed by <len> bytes of raw image */
+typedef struct __tile_pack_record_t
+{
+	guint32 magic;
+	guint32 zoom;
+	guint32 x;
+	guint32 y;
+	guint32 len;
+} tile_pack_record_t;
+
+/* presence bitmap block: 64 * 64 tiles */
+#define TILE_PRESENCE_BLOCK_SHIFT	6
+#define TILE_PRESENCE_BLOCK_WORDS	((1 << (TILE_PRESENCE_BLOCK_SHIFT * 2)) / 32)
+#define TILE_PRESENCE_BUCKETS		256
+
+typedef struct __tile_presence_block_t
+{
+	gint32 bx;
+	gint32 by;
+	guint32 bits[TILE_PRESENCE_BLOCK_WORDS];
+	struct __tile_presence_block_t *next;
+} tile_presence_block_t;
+
+/* sparse presence bitmap of one zoom level */
+typedef struct __tile_presence_t
+{
+	int count;
+	int block_count;
+	/* changed since loaded from or saved to file */
+	gboolean dirty;
+	tile_presence_block_t *buckets[TILE_PRESENCE_BUCKETS];
+} tile_presence_t;
+
+/* content hash index of recently committed tiles, to store identical tiles once */
+typedef struct __tile_dedup_t
+{
+	guint64 hash;
+	gint32 len;
+	/* hits - misses of colliding tiles, the entry is replaced at 0 */
+	gint32 hits;
+	/* dir: the tile file that is hardlinked */
+	gint32 zoom;
+	gint32 x;
+	gint32 y;
+	/* pack: offset of image bytes */
+	guint64 offset;
+} tile_dedup_t;
+
+#define TILE_DEDUP_SLOTS	1024
+
+/* per map repository tile storage */
+typedef struct __tile_store_t
+{
+	map_repo_t *repo;
+	TILE_STORE_TYPE type;
+
+	/* pack: readers share the index, appending and growing index are exclusive */
+	pthread_rwlock_t lock;
+	int data_fd;
+	guint64 data_size;
+
+	int index_fd;
+	size_t index_size;
+	tile_pack_index_head_t *index;
+	tile_pack_slot_t *slots;
+
+	/* dir: loaded on first use of each zoom level, protected by <lock> */
+	tile_presence_t *presence[MAX_ZOOM_LEVELS];
+
+	/* <TILE_DEDUP_SLOTS>, direct-mapped on hash, protected by <lock> */
+	tile_dedup_t *dedup;
+} tile_store_t;
+
+/* entry of tile_store_list() */
+typedef struct __tile_store_entry_t
+{
+	gint32 zoom;
+	gint32 x;
+	gint32 y;
+	gint32 size;
+	/* last access time (seconds) */
+	guint32 atime;
+} tile_store_entry_t;
+
+/* access log record */
+typedef struct __tile_access_t
+{
+	gint32 zoom;
+	gint32 x;
+	gint32 y;
+	guint32 time;
+} tile_access_t;
+
+/* tile range of a pinned batch region at one zoom level */
+typedef struct __tile_pin_t
+{
+	int zoom;
+	int x1, y1, x2, y2;
+	struct __tile_pin_t *next;
+} tile_pin_t;
+
+/* buffered access log records */
+#define TILE_ACCESS_BUF_SIZE		256
+/* seconds between two rounds of pruner */
+#define TILE_QUOTA_PRUNE_INTERVAL	300
+/* prune down to this percent of quota */
+#define TILE_QUOTA_LOW_WATERMARK	90
+/* pause downloading if free space of file system is less than this */
+#define TILE_MIN_FREE_KB			2048
+
+/* per map repository disk quota */
+typedef struct __tile_quota_t
+{
+	map_repo_t *repo;
+
+	pthread_mutex_t lock;
+
+	/* 0: unlimited */
+	guint64 quota_bytes;
+	/* -1: not counted yet */
+	gint64 usage_bytes;
+	int tile_count;
+	/* usage is loaded from file, which is removed on first change */
+	gboolean usage_saved;
+	/* usage of a map without quota is wanted for display, see tile_quota_get_usage() */
+	gboolean count_wanted;
+
+	tile_access_t access_buf[TILE_ACCESS_BUF_SIZE];
+	int access_count;
+
+	tile_pin_t *pins;
+} tile_quota_t;
+
+/* same as HTTP_ETAG_LEN and HTTP_DATE_LEN of network.h */
+#define TILE_META_ETAG_LEN			80
+#define TILE_META_DATE_LEN			32
+#define TILE_META_INIT_BUCKETS		1024
+/* upper bound of map config "max-age-days" */
+#define TILE_META_MAX_AGE_DAYS		3650
+
+/* record of <dir>/tiles.meta, see tile_meta.c */
+typedef struct __tile_meta_t
+{
+	gint32 zoom;
+	gint32 x;
+	gint32 y;
+	/* time (seconds) of download or last revalidation */
+	guint32 fetched;
+	/* seconds, from Cache-Control or Expires, 0: not given */
+	guint32 max_age;
+	char etag[TILE_META_ETAG_LEN];
+	char last_modified[TILE_META_DATE_LEN];
+} tile_meta_t;
+
+/* in memory index of meta file, the validators are read from file when needed */
+typedef struct __tile_meta_entry_t
+{
+	gint32 zoom;
+	gint32 x;
+	gint32 y;
+	guint32 fetched;
+	guint32 max_age;
+	/* record number in meta file */
+	guint32 rec;
+	struct __tile_meta_entry_t *next;
+} tile_meta_entry_t;
+
+/* per map repository tile metadata */
+typedef struct __tile_meta_index_t
+{
+	map_repo_t *repo;
+
+	pthread_mutex_t lock;
+
+	/* meta file is loaded on first use, -1 if it can't be opened */
+	gboolean loaded;
+	int fd;
+	/* records in file, including the overwritten ones */
+	guint32 rec_count;
+
+	int count;
+	int bucket_count;
+	tile_meta_entry_t **buckets;
+} tile_meta_index_t;
+
+/* tiles checked in a row before scrubber pauses */
+#define TILE_SCRUB_BATCH			16
+/* pause (ms) of scrubber, also while tile loader is busy */
+#define TILE_SCRUB_PAUSE_MS			1000
+/* seconds between two passes over the tiles of a map */
+#define TILE_SCRUB_INTERVAL			(24 * 3600)
+/* seconds between two checks of due maps */
+#define TILE_SCRUB_CHECK_INTERVAL	3600
+
+/* result of tile_image_check() */
+typedef enum
+{
+	TILE_IMAGE_OK,
+	/* PNG or JPEG, but truncated or corrupt */
+	TILE_IMAGE_BAD,
+	/* neither PNG nor JPEG, can't be checked */
+	TILE_IMAGE_UNKNOWN
+} TILE_IMAGE_CHECK;
+/* seconds to wait after start up */
+#define TILE_SCRUB_START_DELAY		60
+
 #define MAX_FG_DL				10
+/* queued front-end tasks within this many tiles out of view are kept, see tile_sched.c */
+#define TILE_SCHED_MARGIN		2
+/* queued background tasks, see add_background_download_task() */
+#define MAX_BG_DL				50
 #define MAX_UNFINISHED_BATCH_DL	5
+/* initial delay after each download, adapted per host, see tile_dl_host.c */
 #define DL_SLEEP_MS				500
 
+/* default of map config "dl-max-conns" */
+#define DL_DEFAULT_CONNS		4
+/* concurrent downloads of a new host */
+#define DL_HOST_INIT_LIMIT		2
+#define DL_HOST_MAX_DELAY_MS	30000
+/* least delay after a failure */
+#define DL_HOST_BACKOFF_MS		1000
+/* seconds, cap of Retry-After */
+#define DL_HOST_MAX_RETRY_AFTER	600
+/* latency is healthy within this factor of the least one seen */
+#define DL_HOST_LATENCY_FACTOR	3
+#define DL_HOST_MAX				16
+
+/* transfers in flight of all maps, see tile_dl_engine.c */
+#define DL_ENGINE_MAX_XFERS		48
+/* seconds, same as http_get() timeouts used for tiles before */
+#define DL_ENGINE_CONNECT_TIMEOUT	15
+#define DL_ENGINE_IO_TIMEOUT		15
+/* larger responses are refused, no tile is that large */
+#define DL_ENGINE_MAX_RESPONSE	(4 << 20)
+
 #define BATCH_DL_MAX_FAILS		20
+/* zoom levels of a batch, see ctx_dl_tiles.c */
+#define BATCH_DL_MAX_LEVELS		8
+/* tiles of a batch range, 8 MB journal bitmap */
+#define BATCH_DL_MAX_TILES		(1 << 26)
+/* batch tasks queued ahead of download engine per map, see tile_downloader_refill() */
+#define BATCH_DL_WINDOW			32
+/* max pinned tile ranges per zoom level of a corridor batch, see tile_dl.c */
+#define BATCH_DL_MAX_CORRIDOR_PINS	64
+/* done tiles between two writes of batch journal, see tile_dl.c */
+#define BATCH_JOURNAL_CHECKPOINT	32
 
 struct __dl_task_t;
+struct __http_get_result_t;
 struct __batch_dl_bulk_t;
 
 typedef enum
@@ -54,10 +428,42 @@ typedef struct __dl_task_t
 	int zoom;
 	int x;
 	int y;
+	/* revalidate an existing tile, see tile_meta.c */
+	gboolean refresh;
+	/* number of the tile in its batch range, see batch_journal_t */
+	int index;
+	/* temp file to download to, see tile_store_tmp_path() */
 	char *path;
 	char *url;
 } dl_task_t;
 
+/* on disk progress of a batch, to resume it after restart, see tile_dl.c */
+typedef struct __batch_journal_t
+{
+	/* <dir>/.batches/<name>, fd is -1 if not journaled */
+	char *path;
+	int fd;
+	/* bit i is set if the i-th tile of the range (level by level, see
+	 * batch_level_t) is done: on disk or downloaded */
+	guint8 *bits;
+	int bits_len;
+	/* bytes of <bits> changed since last write */
+	int dirty_lo;
+	int dirty_hi;
+	int pending;
+} batch_journal_t;
+
+/* tiles of a batch at one zoom level, column by column */
+typedef struct __batch_level_t
+{
+	int zoom;
+	point_t tl_tile;
+	int cols;
+	int rows;
+	/* number of the first tile of this level in the batch range */
+	int first;
+} batch_level_t;
+
 typedef struct __batch_dl_t
 {
 	BATCH_DL_STATE state;
@@ -69,70 +475,169 @@ typedef struct __batch_dl_t
 	int min_zoom;
 	int max_zoom;
 
-	/* at most 6 levels, so the max size of this array is at most
-	 * several 4096-byte memroy pages */
-	dl_task_t *tasks;
+	/* corridor batch: only tiles within <corridor_m> metres of <path> are
+	 * downloaded, the region is the bounding box of the corridor. 0: rectangle.
+	 * <path> is owned by caller and only used by batch_download_prepare() */
+	int corridor_m;
+	const coord_t *path;
+	int path_len;
+	/* tiles of the range in the corridor, until the batch is queued */
+	guint8 *mask;
+
+	/* the range, tasks are created from it when they are about to be downloaded,
+	 * see tile_downloader_refill() */
+	batch_level_t levels[BATCH_DL_MAX_LEVELS];
+	int num_levels;
+	/* number of the next tile of the range to queue */
+	int cursor;
+	/* number of tasks taken by download engine */
 	int cur_task_id;
 
 	int num_in_range;
+	/* tiles of the batch: in range, or in corridor */
+	int num_tiles;
 	int num_dl_total;
 	int num_dl_done;
 	int num_dl_failed;
 
+	batch_journal_t journal;
+
 	struct __batch_dl_t *prev;
 	struct __batch_dl_t *next;
 } batch_dl_t;
 
-typedef struct __front_task_t
+typedef enum
+{
+	/* out of view and not owned by a batch or background: drop */
+	TILE_SCHED_NONE = -1,
+	/* in view, nearest to view center first */
+	TILE_SCHED_VISIBLE = 0,
+	/* within <TILE_SCHED_MARGIN> tiles out of view */
+	TILE_SCHED_PREFETCH,
+	TILE_SCHED_BATCH,
+	TILE_SCHED_BACKGROUND,
+	TILE_SCHED_CLASSES
+} TILE_SCHED_CLASS;
+
+/* task <index> of <batch>, it is downloaded by an entry of another batch */
+typedef struct __tile_sched_share_t
+{
+	batch_dl_t *batch;
+	int index;
+	struct __tile_sched_share_t *next;
+} tile_sched_share_t;
+
+typedef struct __tile_sched_entry_t
 {
 	dl_task_t task;
-	struct __front_task_t *next;
-} front_task_t;
 
-typedef struct __dl_thread_t
+	/* requested by front-end, see add_front_download_task() */
+	gboolean front;
+	/* class when it is not wanted by front-end: batch, background or none */
+	TILE_SCHED_CLASS base;
+	TILE_SCHED_CLASS klass;
+	/* square distance to view center in 1/16 tile, for visible and prefetch */
+	guint32 rank;
+	/* FIFO on same class and rank */
+	guint32 seq;
+
+	/* owner batch, NULL for front-end and background tasks */
+	batch_dl_t *batch;
+	/* other batches that want the tile, see tile_downloader_refill() */
+	tile_sched_share_t *shares;
+
+	int heap_index;
+	struct __tile_sched_entry_t *hash_next;
+} tile_sched_entry_t;
+
+typedef void (*tile_sched_drop_func_t)(tile_sched_entry_t *e, void *arg);
+
+/**
+ * Download queue of a downloader: a binary heap ordered by (class, rank, seq),
+ * and a hash table on (zoom, x, y) for duplicate check.
+ */
+typedef struct __tile_sched_t
 {
-	/* id in downloader's thread list */
-	int id;
-	/* the downloader that owns dl thread */
-	struct __tile_downloader_t *downloader;
-	pthread_t tid;
-} dl_thread_t;
+	tile_sched_entry_t **heap;
+	int count;
+	int capacity;
+
+	/* power of 2 */
+	tile_sched_entry_t **buckets;
+	int bucket_count;
+
+	int class_count[TILE_SCHED_CLASSES];
+	guint32 seq;
+
+	/* current view of the repository */
+	gboolean has_view;
+	int zoom;
+	point_t tl_tile;
+	point_t br_tile;
+	/* view center in 1/16 tile */
+	int cx;
+	int cy;
+
+	/* called on entries removed without being popped */
+	tile_sched_drop_func_t drop;
+	void *drop_arg;
+} tile_sched_t;
 
 /**
  * Per map repository downloader.
- * Each downloader can create and maintain up to <TILE_DL_THREADS_LIMIT>
- * dl threads of type <dl_thread_t>. One or more batches can be queued to a repository's
- * downloader.
+ * Its tasks are downloaded by the download engine (see tile_dl_engine.c), at most
+ * <repo->dl_max_conns> at the same time. One or more batches can be queued to a
+ * repository's downloader.
  */
 typedef struct __tile_downloader_t
 {
 	map_repo_t *repo;
 
 	pthread_mutex_t lock;
-	pthread_cond_t cv;
 
 	gboolean stop;
 
 	/* unfinished or beding processing */
 	batch_dl_t *batches;
 	batch_dl_t *batches_tail;
-	batch_dl_t *cur_batch;
 
 	int batch_count;
 	int unfinished_batch_count;
 
-	int dl_threads_count;
+	/* tasks taken by download engine, including the ones in delay after download */
+	int active;
 
-	/* from tasks are allocated by caller */
-	int front_task_count;
-	front_task_t *front_tasks;
-	front_task_t *front_tasks_tail;
-
-	/* If a slot is not used, set it as -1 */
-	dl_thread_t dl_threads[TILE_DL_THREADS_LIMIT];
+	/* front-end, batch and background tasks */
+	tile_sched_t sched;
 
 } tile_downloader_t;
 
+/**
+ * Download rate control of a host. Concurrency is raised by one after <limit>
+ * healthy downloads and halved on failure, like TCP congestion window.
+ */
+typedef struct __dl_host_t
+{
+	char name[64];
+
+	/* allowed and current concurrent downloads */
+	int limit;
+	int active;
+	/* healthy downloads since <limit> changed */
+	int good;
+
+	/* sleep after each download */
+	int delay_ms;
+	/* smoothed and least latency */
+	int srtt_ms;
+	int min_rtt_ms;
+
+	/* no download starts before this time (monotonic ms): back off or Retry-After */
+	gint64 hold_until;
+
+	struct __dl_host_t *next;
+} dl_host_t;
+
 typedef struct __update_ui_thread_t
 {
 	pthread_t thread_tid;
@@ -142,22 +647,156 @@ typedef struct __update_ui_thread_t
 
 /******************* tile_cache.c *********************/
 
-extern tilecache_t * tilecache_new(int capacity);
+extern tilecache_t * tilecache_new(int budget);
+extern void tilecache_set_budget(tilecache_t *cache, int budget);
 extern void tilecache_cleanup(tilecache_t *cache, gboolean free_cache);
-extern tile_t* tilecache_get(tilecache_t *cache, int zoom, int x, int y);
+extern tile_t* tilecache_acquire(tilecache_t *cache, map_repo_t *repo, int zoom, int x, int y);
 extern gboolean tilecache_add(tilecache_t *cache, tile_t *tile);
 
+extern tile_t* tile_new(map_repo_t *repo, int zoom, int x, int y, GdkPixbuf *pixbuf);
+extern void tile_release(tile_t *tile);
+
+extern tilecache_t * tilecache_l2_new(int budget);
+extern gboolean tilecache_l2_put(tilecache_t *cache, map_repo_t *repo, int zoom, int x, int y,
+	guchar *data, int len);
+extern guchar* tilecache_l2_get(tilecache_t *cache, map_repo_t *repo, int zoom, int x, int y, int *len);
+extern void tilecache_l2_remove(tilecache_t *cache, map_repo_t *repo, int zoom, int x, int y);
+extern void tilecache_invalidate(tilecache_t *cache, map_repo_t *repo, int zoom, int x, int y);
+
+extern guint64 tile_content_hash(const guchar *data, int len);
+extern GdkPixbuf * tilecache_shared_pixbuf_get(guint64 hash, int len);
+extern void tilecache_shared_pixbuf_put(guint64 hash, int len, GdkPixbuf *pixbuf);
+
+extern gboolean tilecache_absent_test(map_repo_t *repo, int zoom, int x, int y, gboolean dl_if_absent);
+extern void tilecache_absent_set(map_repo_t *repo, int zoom, int x, int y, TILE_ABSENT_STATE state);
+extern void tilecache_absent_clear(map_repo_t *repo, int zoom, int x, int y);
+
+/******************* tile_loader.c ********************/
+
+extern void tile_loader_module_init();
+extern void tile_loader_module_cleanup();
+extern tile_t * tile_load(tilecache_t *tile_cache, map_repo_t *repo, int zoom, int x, int y,
+	gboolean dl_if_absent);
+extern void tile_loader_request(tilecache_t *tile_cache, map_repo_t *repo, int zoom, int x, int y,
+	gboolean dl_if_absent);
+extern void tile_loader_prefetch(tilecache_t *tile_cache, map_repo_t *repo, int zoom, int x, int y);
+extern void tile_loader_cancel_prefetch();
+extern gboolean tile_loader_is_idle();
+
+extern void map_tile_loaded_callback_func(map_repo_t *repo, int zoom, int x, int y);
+
+/******************* tile_store.c *********************/
+
+extern void tile_store_module_init();
+extern void tile_store_module_cleanup();
+extern gboolean format_tile_file_path(map_repo_t *repo, int zoom, int x, int y, char *buf, int buflen);
+extern gboolean tile_store_exists(map_repo_t *repo, int zoom, int x, int y);
+extern int tile_store_stat(map_repo_t *repo, int zoom, int x, int y);
+extern guchar * tile_store_read(map_repo_t *repo, int zoom, int x, int y, int *len, gboolean *absent);
+extern guchar * tile_store_peek(map_repo_t *repo, int zoom, int x, int y, int *len, gboolean *absent);
+extern gboolean tile_store_tmp_path(map_repo_t *repo, int zoom, int x, int y, char *buf, int buflen);
+extern gboolean tile_store_commit(map_repo_t *repo, int zoom, int x, int y, const char *tmp_path);
+extern int tile_store_remove(map_repo_t *repo, int zoom, int x, int y);
+extern tile_store_entry_t * tile_store_list(map_repo_t *repo, int *count);
+extern guint64 tile_store_garbage_size(map_repo_t *repo);
+extern gboolean tile_store_compact(map_repo_t *repo);
+
+/******************* tile_quota.c *********************/
+
+extern void tile_quota_module_init();
+extern void tile_quota_module_cleanup();
+extern void tile_quota_touch(map_repo_t *repo, int zoom, int x, int y);
+extern void tile_quota_on_commit(map_repo_t *repo, int zoom, int x, int y, int size, int old_size);
+extern void tile_quota_on_remove(map_repo_t *repo, int size);
+extern gboolean tile_quota_check_space(map_repo_t *repo);
+extern void tile_quota_pin(map_repo_t *repo, int zoom, int x1, int y1, int x2, int y2);
+extern void tile_quota_save_pins(map_repo_t *repo);
+extern gboolean tile_quota_get_usage(map_repo_t *repo, gint64 *usage_bytes, guint64 *quota_bytes,
+	int *tile_count);
+
+/******************* tile_scrub.c *********************/
+
+extern void tile_scrub_module_init();
+extern void tile_scrub_module_cleanup();
+extern TILE_IMAGE_CHECK tile_image_check(const guchar *data, int len);
+
+/******************* tile_bundle.c ********************/
+
+extern int tile_bundle_export(map_repo_t *repo, const char *path, int min_zoom, int max_zoom,
+	coord_t tl_wgs84, coord_t br_wgs84);
+extern int tile_bundle_import(map_repo_t *repo, const char *path, int *skipped);
+
+/******************* tile_meta.c **********************/
+
+extern void tile_meta_module_init();
+extern void tile_meta_module_cleanup();
+extern void tile_meta_update(map_repo_t *repo, int zoom, int x, int y,
+	struct __http_get_result_t *result);
+extern gboolean tile_meta_get(map_repo_t *repo, int zoom, int x, int y, tile_meta_t *meta);
+extern gboolean tile_meta_is_stale(map_repo_t *repo, int zoom, int x, int y);
+
+/******************* tile_corridor.c ******************/
+
+extern gboolean tile_corridor_bounds(const coord_t *path, int count, int buffer_m,
+	coord_t *tl_wgs84, coord_t *br_wgs84);
+extern int tile_corridor_mark(map_repo_t *repo, const coord_t *path, int count, int buffer_m,
+	int zoom, point_t tl_tile, int cols, int rows, guint8 *bits, int first);
+
+/******************* tile_sched.c *********************/
+
+extern void tile_sched_init(tile_sched_t *s, tile_sched_drop_func_t drop, void *drop_arg);
+extern void tile_sched_cleanup(tile_sched_t *s);
+extern tile_sched_entry_t * tile_sched_find(tile_sched_t *s, int zoom, int x, int y);
+extern gboolean tile_sched_add(tile_sched_t *s, tile_sched_entry_t *e);
+extern tile_sched_entry_t * tile_sched_peek(tile_sched_t *s);
+extern tile_sched_entry_t * tile_sched_pop(tile_sched_t *s);
+extern void tile_sched_update(tile_sched_t *s, tile_sched_entry_t *e);
+extern void tile_sched_filter(tile_sched_t *s, gboolean (*keep)(tile_sched_entry_t *e, void *arg),
+	void *arg);
+extern void tile_sched_set_view(tile_sched_t *s, int zoom, point_t tl_tile, point_t br_tile,
+	point_t center_pixel);
+
+/******************* tile_dl_host.c *******************/
+
+extern gboolean dl_host_try_acquire(const char *url, int max_limit, dl_host_t **host, int *wait_ms);
+extern int dl_host_feedback(dl_host_t *host, struct __http_get_result_t *result, int latency_ms,
+	int min_delay_ms);
+extern void dl_host_put(dl_host_t *host);
+extern double dl_host_rate(const char *url, int max_limit);
+extern void dl_host_cleanup();
+
+/******************* tile_dl_engine.c *****************/
+
+extern void dl_engine_start();
+extern void dl_engine_stop();
+extern void dl_engine_wakeup();
+
 /******************* tile_dl.c ************************/
 
 extern void tile_downloader_module_init();
 extern void tile_downloader_module_cleanup();
 
-extern gboolean format_tile_file_path(map_repo_t *repo, int zoom, int x, int y, char *buf, int buflen);
-extern void add_front_download_task(map_repo_t *repo, int zoom, int x, int y, char *path, char *url);
+extern gboolean add_front_download_task(map_repo_t *repo, int zoom, int x, int y, char *path, char *url);
+extern gboolean promote_front_download_task(map_repo_t *repo, int zoom, int x, int y);
+extern void tile_downloader_set_view(map_repo_t *repo, int zoom, point_t tl_tile, point_t br_tile,
+	point_t center_pixel);
+extern gboolean add_background_download_task(map_repo_t *repo, int zoom, int x, int y, char *path, char *url);
+extern gboolean add_refresh_download_task(map_repo_t *repo, int zoom, int x, int y, char *path, char *url);
+
+extern tile_sched_entry_t * tile_downloader_take(tile_downloader_t *td, dl_host_t **host, int *wait_ms);
+extern int tile_download_begin(map_repo_t *repo, dl_task_t *task, int *file_fd);
+extern int tile_download_end(map_repo_t *repo, dl_task_t *task, int file_fd,
+	struct __http_get_result_t *result);
+extern void tile_downloader_done(tile_downloader_t *td, tile_sched_entry_t *e, int ret);
+extern void tile_downloader_abort(tile_downloader_t *td, tile_sched_entry_t *e);
+extern void tile_downloader_put(tile_downloader_t *td);
+extern void tile_downloader_refill(tile_downloader_t *td);
 
 extern gboolean batch_download_check();
 extern int batch_download_prepare(batch_dl_t *batch);
 extern void batch_download(batch_dl_t *batch);
+extern void batch_download_pin(batch_dl_t *batch);
+extern void batch_download_free(batch_dl_t *batch);
 
 extern update_ui_thread_t * tile_downloader_start_update_ui_thread(map_repo_t *cur_repo);
 
@@ -1,6 +1,8 @@
 #ifndef TRACK_H_
 #define TRACK_H_
 
+#define TRACK_FILE_EXT	".txt"
+
 #define TRACK_HEAD_LABEL_1 "start time: "
 #define TRACK_HEAD_LABEL_2 "end time: "
 #define TRACK_HEAD_LABEL_3 "record count: "
@@ -61,5 +63,6 @@ extern void track_cleanup();
 extern gboolean track_save(gboolean all, gboolean free);
 extern void track_draw(GdkPixmap *canvas, gboolean refresh, GdkRectangle *rect);
 extern void track_replay_centralize();
+extern coord_t * track_read_points(const char *file, int *count);
 
 #endif /* TRACK_H_ */
@@ -63,6 +63,7 @@ extern void gps_log(log_level_t level, const char *fmt,...);
 
 extern int format_time(struct tm * t, char *buf, int buf_len);
 extern void sleep_ms(long ms);
+extern gint64 monotonic_ms();
 extern int wait_ms(long span_ms, pthread_cond_t *cond, pthread_mutex_t *mutex, gboolean lock);
 extern gboolean exec_linux_cmd(char *candidates[], int n, char *args[]);
 
@@ -64,10 +64,23 @@ static void cleanup()
 
 	if (g_init_status >= MAP_INITED) {
 
+		/* before tile downloader and store */
+		tile_scrub_module_cleanup();
+
 		tile_downloader_module_cleanup();
 
+		/* before tile caches are freed */
+		tile_loader_module_cleanup();
+
 		map_cleanup();
 
+		tile_quota_module_cleanup();
+
+		/* after tile downloader, before tile store */
+		tile_meta_module_cleanup();
+
+		tile_store_module_cleanup();
+
 		drawing_cleanup();
 
 		g_cfg->last_center_lat = g_view.center_wgs84.lat;
@@ -100,6 +113,8 @@ END:
 	dbus_cleanup();
 #endif
 
+	dns_cache_cleanup();
+
 	py_ext_cleanup();
 
 	close_log();
@@ -448,9 +463,19 @@ static void init(gboolean log2console)
 
 	init_g_context_vars();
 
+	tile_store_module_init();
+
+	tile_quota_module_init();
+
+	tile_meta_module_init();
+
 	/* Initialize tile downloader */
 	tile_downloader_module_init();
 
+	tile_loader_module_init();
+
+	tile_scrub_module_init();
+
 	g_init_status = DOWNLOADER_INITED;
 
 	/* init UI */
@@ -479,6 +504,128 @@ static void init(gboolean log2console)
 #endif
 }
 
+static void bundle_usage()
+{
+	fprintf(stderr,
+		"usage:\n"
+		"  omgps --export-tiles <map> <bundle file> <min zoom> <max zoom> <lat1,lon1,lat2,lon2>\n"
+		"  omgps --import-tiles <map> <bundle file>\n");
+}
+
+/**
+ * Headless tile bundle export/import, see tile_bundle.c.
+ * Same config, maps dir and tile store as GUI, without GTK. The pid file is locked
+ * as well, so it does not write a store while the GUI is running.
+ */
+static int tile_bundle_tool(int argc, char **argv)
+{
+	gboolean export = (strcmp(argv[1], "--export-tiles") == 0);
+	int min_zoom = 0, max_zoom = 0;
+	coord_t tl, br;
+	double lat1, lon1, lat2, lon2;
+	int ret = 1;
+
+	if ((export && argc != 7) || (! export && argc != 4)) {
+		bundle_usage();
+		return 1;
+	}
+
+	if (export) {
+		min_zoom = atoi(argv[4]);
+		max_zoom = atoi(argv[5]);
+		if (sscanf(argv[6], "%lf,%lf,%lf,%lf", &lat1, &lon1, &lat2, &lon2) != 4 ||
+			fabs(lat1) > 90 || fabs(lat2) > 90 || fabs(lon1) > 180 || fabs(lon2) > 180) {
+			fprintf(stderr, "invalid bbox: %s\n", argv[6]);
+			return 1;
+		}
+		tl.lat = MAX(lat1, lat2);
+		tl.lon = MIN(lon1, lon2);
+		br.lat = MIN(lat1, lat2);
+		br.lon = MAX(lon1, lon2);
+	}
+
+	init_pthread_key();
+
+	pthread_context_t *ctx = register_thread("main thread", NULL, NULL);
+	ctx->is_main_thread = TRUE;
+
+	setlocale(LC_ALL, "C");
+
+	create_dirs();
+
+	create_pid_file();
+
+	link_config_files();
+
+	if (! open_log(NULL)) {
+		fprintf(stderr, "Can not open log\n");
+		goto END;
+	}
+
+	py_ext_init();
+
+	thread_context_clear_errbuf();
+	if (! mapcfg_load()) {
+		fprintf(stderr, "%s\n", thread_context_get_errbuf());
+		goto END;
+	}
+
+	/* lat_fix/lon_fix of maps */
+	thread_context_clear_errbuf();
+	g_cfg = settings_load();
+
+	map_repo_t *repo = mapcfg_get_repo(argv[2]);
+	if (! repo) {
+		fprintf(stderr, "no such map: %s\n", argv[2]);
+		mapcfg_cleanup();
+		goto END;
+	}
+
+	tile_store_module_init();
+
+	if (export) {
+		min_zoom = MAX(min_zoom, repo->min_zoom);
+		max_zoom = MIN(max_zoom, repo->max_zoom);
+		int n = (min_zoom <= max_zoom)?
+			tile_bundle_export(repo, argv[3], min_zoom, max_zoom, tl, br) : 0;
+		if (n >= 0) {
+			printf("exported %d tiles of map %s, zoom %d-%d, to %s\n",
+				n, repo->name, min_zoom, max_zoom, argv[3]);
+			ret = 0;
+		}
+	} else {
+		int skipped = 0;
+		int n = tile_bundle_import(repo, argv[3], &skipped);
+		if (n >= 0) {
+			printf("imported %d tiles to map %s, %d existing tiles skipped\n",
+				n, repo->name, skipped);
+			ret = 0;
+		}
+	}
+
+	if (ret != 0)
+		fprintf(stderr, "failed, see log for details\n");
+
+	tile_store_module_cleanup();
+
+	mapcfg_cleanup();
+
+END:
+
+	py_ext_cleanup();
+
+	close_log();
+
+	if (pid_fd > 0) {
+		flock(pid_fd, LOCK_UN);
+		close(pid_fd);
+		unlink(pid_file);
+		pid_fd = 0;
+	}
+
+	return ret;
+}
+
 int main(int argc, char **argv)
 {
 	gboolean log2console = TRUE;
@@ -487,6 +634,11 @@ int main(int argc, char **argv)
 			log2console = FALSE;
 	}
 
+	/* headless, before any GTK initialization */
+	if (argc >= 2 && (strcmp(argv[1], "--export-tiles") == 0 ||
+		strcmp(argv[1], "--import-tiles") == 0))
+		return tile_bundle_tool(argc, argv);
+
 	g_type_init();
 
 	if (! g_thread_supported ())
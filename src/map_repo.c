@@ -35,6 +35,8 @@ static map_repo_t* parse_map_config_details(char *map_name, char *map_cfg_str,
 	repo->min_zoom = 0;
 	repo->max_zoom = 0;
 	repo->image_type = NULL;
+	repo->dl_max_conns = DL_DEFAULT_CONNS;
+	repo->dl_min_delay_ms = 0;
 
 	char *bak = strdup(map_cfg_str);
 	char *sep = ";";
@@ -56,6 +58,18 @@ static map_repo_t* parse_map_config_details(char *map_name, char *map_cfg_str,
 				repo->max_zoom = *value? atoi(value) : -1;
 			} else if (strcmp(key, "image-type") == 0) {
 				repo->image_type = *value? strdup(trim(value)) : NULL;
+			} else if (strcmp(key, "store") == 0) {
+				repo->store_type = *value? strdup(trim(value)) : NULL;
+			} else if (strcmp(key, "scrub") == 0) {
+				repo->scrub = *value? strdup(trim(value)) : NULL;
+			} else if (strcmp(key, "disk-quota-mb") == 0) {
+				repo->disk_quota_mb = *value? atoi(value) : 0;
+			} else if (strcmp(key, "dl-max-conns") == 0) {
+				repo->dl_max_conns = *value? atoi(value) : -1;
+			} else if (strcmp(key, "dl-min-delay-ms") == 0) {
+				repo->dl_min_delay_ms = *value? atoi(value) : -1;
+			} else if (strcmp(key, "max-age-days") == 0) {
+				repo->max_age_days = *value? atoi(value) : -1;
 			}
 		}
 		p = strtok_r(NULL, sep, &saveptr);
@@ -79,6 +93,48 @@ static map_repo_t* parse_map_config_details(char *map_name, char *map_cfg_str,
 		goto END;
 	}
 
+	if (repo->store_type && strcmp(repo->store_type, "dir") != 0 &&
+			strcmp(repo->store_type, "pack") != 0) {
+		snprintf(errbuf, errbuf_len, "load map config: %s\n\nunknown store: %s",
+			map_name, repo->store_type);
+		ok = FALSE;
+		goto END;
+	}
+
+	if (repo->scrub && strcmp(repo->scrub, "off") != 0 &&
+			strcmp(repo->scrub, "quarantine") != 0 && strcmp(repo->scrub, "redownload") != 0) {
+		snprintf(errbuf, errbuf_len, "load map config: %s\n\nunknown scrub: %s",
+			map_name, repo->scrub);
+		ok = FALSE;
+		goto END;
+	}
+
+	if (repo->disk_quota_mb < 0) {
+		snprintf(errbuf, errbuf_len, "load map config: %s\n\ninvalid disk quota", map_name);
+		ok = FALSE;
+		goto END;
+	}
+
+	if (repo->dl_max_conns < 1 || repo->dl_max_conns > TILE_DL_CONNS_LIMIT) {
+		snprintf(errbuf, errbuf_len, "load map config: %s\n\ndl-max-conns must be 1..%d",
+			map_name, TILE_DL_CONNS_LIMIT);
+		ok = FALSE;
+		goto END;
+	}
+
+	if (repo->dl_min_delay_ms < 0 || repo->dl_min_delay_ms > DL_HOST_MAX_DELAY_MS) {
+		snprintf(errbuf, errbuf_len, "load map config: %s\n\ninvalid dl-min-delay-ms", map_name);
+		ok = FALSE;
+		goto END;
+	}
+
+	if (repo->max_age_days < 0 || repo->max_age_days > TILE_META_MAX_AGE_DAYS) {
+		snprintf(errbuf, errbuf_len, "load map config: %s\n\nmax-age-days must be 0..%d",
+			map_name, TILE_META_MAX_AGE_DAYS);
+		ok = FALSE;
+		goto END;
+	}
+
 END:
 
 	if (! ok) {
@@ -129,7 +185,19 @@ static map_repo_t * parse_map_from_python(char *map_name)
 	sprintf(buf, "%s%s", func_name, MAP_CFG_FUNC_URL);
 
 	repo->urlfunc = PyObject_GetAttrString(pModule, buf);
-	if (! repo->urlfunc || ! PyCallable_Check(repo->urlfunc)) {
+	if (repo->urlfunc && PyString_Check(repo->urlfunc)) {
+		/* url template, formatted without python */
+		char err[128];
+		repo->url_template = url_template_compile(PyString_AsString(repo->urlfunc), err, sizeof(err));
+		Py_DECREF(repo->urlfunc);
+		repo->urlfunc = NULL;
+		if (! repo->url_template) {
+			snprintf(errbuf, ERRBUF_LEN, "Map config: bad url template: %s\n\n%s", buf, err);
+			free(repo);
+			repo = NULL;
+			goto END;
+		}
+	} else if (! repo->urlfunc || ! PyCallable_Check(repo->urlfunc)) {
 		snprintf(errbuf, ERRBUF_LEN, "Map config: can't find function: %s\n", buf);
 		free(repo);
 		repo = NULL;
@@ -269,6 +337,16 @@ END:
  */
 char *mapcfg_get_dl_url(map_repo_t *repo, int zoom, int x, int y)
 {
+	if (repo->url_template) {
+		char buf[URL_TEMPLATE_MAX_URL];
+		if (url_template_format(repo->url_template, zoom, x, y, buf, sizeof(buf)) < 0) {
+			char *errbuf = thread_context_get_errbuf();
+			snprintf(errbuf, ERRBUF_LEN, "Get download url failed: map name=%s", repo->name);
+			return NULL;
+		}
+		return strdup(buf);
+	}
+
 	PyObject *urlfunc = repo->urlfunc;
 	if (! urlfunc)
 		return NULL;
@@ -325,6 +403,7 @@ void mapcfg_cleanup()
 			if (e->repo->urlfunc) {
 				Py_DECREF(e->repo->urlfunc);
 			}
+			url_template_free(e->repo->url_template);
 			if (e->repo->name)
 				free(e->repo->name);
 			free(e->repo);
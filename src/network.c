@@ -12,12 +12,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
 #include <assert.h>
 #include <glib.h>
+#include <zlib.h>
 
 #if (HAVE_SYS_CAPABILITY_H)
 #undef _POSIX_SOURCE
@@ -54,31 +59,317 @@ static uint16_t in_checkksum(uint16_t *addr, int len)
 }
 
 /**
- * FIXME: resolve_timeout
+ * DNS cache, process-wide.
+ *
+ * getaddrinfo() blocks, and can't be timed out. It is run by a detached resolver
+ * thread, the caller waits up to <resolve_timeout> seconds. The result is
+ * cached <DNS_CACHE_TTL> seconds (<DNS_CACHE_NEGATIVE_TTL> seconds if it failed),
+ * so a timed out lookup still fills the cache for next callers. Callers of the
+ * same name share one lookup. While an expired entry is being refreshed, the old
+ * addresses are returned if the refresh times out or fails.
  */
-struct addrinfo * get_remote_addr(char *host, char * port, int family, int socktype,
-	int protocol, int resolve_timeout)
+
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_cv = PTHREAD_COND_INITIALIZER;
+static dns_entry_t *dns_entries = NULL;
+static int dns_entry_count = 0;
+
+static dns_resolve_func_t dns_resolve = getaddrinfo;
+static dns_free_func_t dns_free = freeaddrinfo;
+
+/**
+ * For testing: resolve with a stub instead of getaddrinfo().
+ * Cached entries are dropped.
+ */
+void dns_cache_set_resolver(dns_resolve_func_t resolve_func, dns_free_func_t free_func)
+{
+	dns_cache_cleanup();
+
+	LOCK_MUTEX(&dns_lock);
+	dns_resolve = resolve_func? resolve_func : getaddrinfo;
+	dns_free = free_func? free_func : freeaddrinfo;
+	UNLOCK_MUTEX(&dns_lock);
+}
+
+/**
+ * Deep copy, each node and its address are allocated as one block.
+ */
+static struct addrinfo * copy_addrinfo(struct addrinfo *info)
+{
+	struct addrinfo *head = NULL, **tail = &head, *ai;
+
+	for (; info; info = info->ai_next) {
+		ai = (struct addrinfo *)malloc(sizeof(struct addrinfo) + info->ai_addrlen);
+		if (! ai)
+			break;
+		memcpy(ai, info, sizeof(struct addrinfo));
+		ai->ai_addr = (struct sockaddr *)(ai + 1);
+		memcpy(ai->ai_addr, info->ai_addr, info->ai_addrlen);
+		ai->ai_canonname = info->ai_canonname? strdup(info->ai_canonname) : NULL;
+		ai->ai_next = NULL;
+		*tail = ai;
+		tail = &(ai->ai_next);
+	}
+
+	return head;
+}
+
+/**
+ * Free addresses returned by get_remote_addr().
+ */
+void free_remote_addr(struct addrinfo *info)
+{
+	struct addrinfo *next;
+
+	for (; info; info = next) {
+		next = info->ai_next;
+		if (info->ai_canonname)
+			free(info->ai_canonname);
+		free(info);
+	}
+}
+
+static void free_dns_entry(dns_entry_t *e)
 {
-	struct addrinfo hints, *info = NULL;
+	free_remote_addr(e->info);
+	free(e->host);
+	free(e->port);
+	free(e);
+}
+
+static void* dns_resolve_routine(void *arg)
+{
+	dns_entry_t *e = (dns_entry_t *)arg;
+	struct addrinfo hints, *info = NULL, *copy = NULL;
+
+	/* detached and short living, don't let the signal handler stop it */
+	sigset_t sig_set;
+	sigemptyset(&sig_set);
+	sigaddset(&sig_set, SIGINT);
+	sigaddset(&sig_set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sig_set, NULL);
+
 	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_family = family;
-	hints.ai_socktype = socktype;
-	hints.ai_protocol = protocol;
+	hints.ai_family = e->family;
+	hints.ai_socktype = e->socktype;
+	hints.ai_protocol = e->protocol;
 	hints.ai_flags = AI_CANONNAME;
 
-	int ret = getaddrinfo(host, port, &hints, &info);
-	if (ret != 0) {
-		if (info) {
-			freeaddrinfo(info);
-			info = NULL;
+	/* <e> is not freed while it is resolving */
+	int ret = (*dns_resolve)(e->host, e->port, &hints, &info);
+	if (ret == 0 && info) {
+		copy = copy_addrinfo(info);
+		(*dns_free)(info);
+	} else if (ret != 0) {
+		log_warn("resolve %s failed: %s", e->host, gai_strerror(ret));
+	}
+
+	LOCK_MUTEX(&dns_lock);
+
+	if (copy) {
+		free_remote_addr(e->info);
+		e->info = copy;
+		e->expire = time(NULL) + DNS_CACHE_TTL;
+	} else {
+		/* keep the old addresses if any, retry later */
+		e->expire = time(NULL) + DNS_CACHE_NEGATIVE_TTL;
+	}
+	e->resolving = FALSE;
+
+	pthread_cond_broadcast(&dns_cv);
+	UNLOCK_MUTEX(&dns_lock);
+
+	return NULL;
+}
+
+/**
+ * Caller must hold dns lock.
+ */
+static dns_entry_t * dns_find_entry(char *host, char *port, int family, int socktype, int protocol)
+{
+	dns_entry_t *e;
+
+	for (e = dns_entries; e; e = e->next) {
+		if (e->family == family && e->socktype == socktype && e->protocol == protocol &&
+			strcmp(e->host, host) == 0 &&
+			((! e->port && ! port) || (e->port && port && strcmp(e->port, port) == 0)))
+			return e;
+	}
+	return NULL;
+}
+
+/**
+ * Caller must hold dns lock. When the cache is full, the entry that expires first
+ * and is not being resolved is dropped.
+ */
+static dns_entry_t * dns_new_entry(char *host, char *port, int family, int socktype, int protocol)
+{
+	dns_entry_t *e, **link, **victim = NULL;
+
+	if (dns_entry_count >= DNS_CACHE_MAX) {
+		for (link = &dns_entries; *link; link = &((*link)->next)) {
+			if (! (*link)->resolving && (*link)->waiters == 0 &&
+				(! victim || (*link)->expire < (*victim)->expire))
+				victim = link;
 		}
+		if (! victim)
+			return NULL;
+		e = *victim;
+		*victim = e->next;
+		free_dns_entry(e);
+		--dns_entry_count;
 	}
+
+	e = (dns_entry_t *)calloc(1, sizeof(dns_entry_t));
+	if (! e)
+		return NULL;
+
+	e->host = strdup(host);
+	e->port = port? strdup(port) : NULL;
+	e->family = family;
+	e->socktype = socktype;
+	e->protocol = protocol;
+
+	e->next = dns_entries;
+	dns_entries = e;
+	++dns_entry_count;
+
+	return e;
+}
+
+/**
+ * Caller must hold dns lock.
+ */
+static void dns_start_resolve(dns_entry_t *e)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+
+	if (e->resolving)
+		return;
+
+	e->resolving = TRUE;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&tid, &attr, dns_resolve_routine, e) != 0) {
+		log_error("create resolver thread failed");
+		e->resolving = FALSE;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/**
+ * Return a copy of resolved addresses, or NULL if failed or timed out. Caller must
+ * free it with free_remote_addr(). Unit of <resolve_timeout>: second.
+ */
+struct addrinfo * get_remote_addr(char *host, char * port, int family, int socktype,
+	int protocol, int resolve_timeout)
+{
+	struct addrinfo *info = NULL;
+	struct timespec deadline;
+	dns_entry_t *e;
+
+	if (resolve_timeout <= 0)
+		resolve_timeout = DNS_RESOLVE_TIMEOUT;
+
+	LOCK_MUTEX(&dns_lock);
+
+	e = dns_find_entry(host, port, family, socktype, protocol);
+
+	if (e && ! e->resolving && time(NULL) < e->expire)
+		goto END;
+
+	if (! e && ! (e = dns_new_entry(host, port, family, socktype, protocol)))
+		goto END;
+
+	dns_start_resolve(e);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += resolve_timeout;
+
+	++(e->waiters);
+	while (e->resolving) {
+		if (pthread_cond_timedwait(&dns_cv, &dns_lock, &deadline) == ETIMEDOUT) {
+			log_warn("resolve %s: timed out", host);
+			break;
+		}
+	}
+	--(e->waiters);
+
+END:
+
+	if (e)
+		info = copy_addrinfo(e->info);
+
+	UNLOCK_MUTEX(&dns_lock);
+
 	return info;
 }
 
+/**
+ * Same as get_remote_addr(), but never waits, for event driven callers.
+ * Cached addresses are returned even if expired, a refresh is started then.
+ * If nothing is cached, a lookup is started, <*pending> is set and NULL is
+ * returned: try again later.
+ */
+struct addrinfo * get_remote_addr_nowait(char *host, char *port, int family, int socktype,
+	int protocol, gboolean *pending)
+{
+	struct addrinfo *info = NULL;
+	dns_entry_t *e;
+
+	*pending = FALSE;
+
+	LOCK_MUTEX(&dns_lock);
+
+	e = dns_find_entry(host, port, family, socktype, protocol);
+
+	if (! e && ! (e = dns_new_entry(host, port, family, socktype, protocol)))
+		goto END;
+
+	if (time(NULL) >= e->expire)
+		dns_start_resolve(e);
+
+	if (e->info)
+		info = copy_addrinfo(e->info);
+	else
+		*pending = e->resolving;
+
+END:
+
+	UNLOCK_MUTEX(&dns_lock);
+
+	return info;
+}
+
+/**
+ * Drop all cached entries. Entries that are being resolved are left to
+ * their resolver threads.
+ */
+void dns_cache_cleanup()
+{
+	dns_entry_t *e, **link;
+
+	LOCK_MUTEX(&dns_lock);
+
+	link = &dns_entries;
+	while ((e = *link)) {
+		if (e->resolving || e->waiters > 0) {
+			link = &(e->next);
+		} else {
+			*link = e->next;
+			free_dns_entry(e);
+			--dns_entry_count;
+		}
+	}
+
+	UNLOCK_MUTEX(&dns_lock);
+}
+
 /**
  * return sock fd, < 0: error.
  * unit of timeouts: second.
+ * Addresses are tried in order until one is connected.
  */
 int connect_remote_with_timeouts(char *host, char *port, int family, int socktype, int protocol,
 	int resolve_timeout, int connect_timeout, int send_timeout, int recv_timeout)
@@ -92,9 +383,6 @@ int connect_remote_with_timeouts(char *host, char *port, int family, int socktyp
 	if (addr_info == NULL)
 		return -1;
 
-	c_timeout.tv_sec = connect_timeout;
-	c_timeout.tv_usec = 0;
-
 	s_timeout.tv_sec = send_timeout;
 	s_timeout.tv_usec = 0;
 
@@ -103,86 +391,93 @@ int connect_remote_with_timeouts(char *host, char *port, int family, int socktyp
 
 	for (rp = addr_info; rp != NULL; rp = rp->ai_next) {
 
+		if (sock_fd >= 0) {
+			close(sock_fd);
+			sock_fd = -1;
+		}
+
+		/* select() may modify it */
+		c_timeout.tv_sec = connect_timeout;
+		c_timeout.tv_usec = 0;
+
 		sock_fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
 
 		if (sock_fd == -1) {
 			ret = -2;
-			goto END;
+			continue;
 		}
 
 		flags = fcntl(sock_fd, F_GETFL, 0);
 		if (flags < 0) {
 			ret = -3;
-			goto END;
+			continue;
 		}
 
 		if (fcntl(sock_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
 			ret = -4;
-			goto END;
+			continue;
 		}
 
 		/* Ignore setsockopt() failures -- use default */
-		setsockopt(sock_fd, IPPROTO_TCP, SO_SNDTIMEO, &s_timeout, sizeof(struct timeval));
-		setsockopt(sock_fd, IPPROTO_TCP, SO_RCVTIMEO, &r_timeout, sizeof(struct timeval));
+		setsockopt(sock_fd, SOL_SOCKET, SO_SNDTIMEO, &s_timeout, sizeof(struct timeval));
+		setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &r_timeout, sizeof(struct timeval));
 
-		ret = connect(sock_fd, addr_info->ai_addr, addr_info->ai_addrlen);
+		ret = connect(sock_fd, rp->ai_addr, rp->ai_addrlen);
 
-		if (ret == 0) {
-			if (fcntl(sock_fd, F_SETFL, flags) < 0) {
-				ret = -5;
-				goto END;
-			}
-		} else if (ret < 0 && errno != EINPROGRESS) {
+		if (ret < 0 && errno != EINPROGRESS) {
 			ret = -6;
-			goto END;
+			continue;
 		}
 
-		/* non-blocking listen */
-		fd_set rs, ws, es;
-		FD_ZERO(&rs);
-		FD_SET(sock_fd, &rs);
-		ws = es = rs;
-
-		ret = select(sock_fd + 1, &rs, &ws, &es, &c_timeout);
 		if (ret < 0) {
-			ret = -7;
-			goto END;
-		} else if (0 == ret) {
-			ret = -8;
-			goto END;
-		}
+			/* non-blocking listen */
+			fd_set rs, ws, es;
+			FD_ZERO(&rs);
+			FD_SET(sock_fd, &rs);
+			ws = es = rs;
+
+			ret = select(sock_fd + 1, &rs, &ws, &es, &c_timeout);
+			if (ret < 0) {
+				ret = -7;
+				continue;
+			} else if (0 == ret) {
+				ret = -8;
+				continue;
+			}
 
-		if (!FD_ISSET(sock_fd, &rs) && !FD_ISSET(sock_fd, &ws)) {
-			ret = -9;
-			goto END;
-		}
+			if (!FD_ISSET(sock_fd, &rs) && !FD_ISSET(sock_fd, &ws)) {
+				ret = -9;
+				continue;
+			}
 
-		int err;
-		socklen_t len = sizeof(int);
-		if (getsockopt(sock_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
-			ret = -10;
-			goto END;
-		}
+			int err;
+			socklen_t len = sizeof(int);
+			if (getsockopt(sock_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+				ret = -10;
+				continue;
+			}
 
-		if (err != 0) {
-			ret = -11;
-			goto END;
+			if (err != 0) {
+				ret = -11;
+				continue;
+			}
 		}
 
 		/* socket is ready for read/write, reset to blocking mode */
 		if (fcntl(sock_fd, F_SETFL, flags) < 0) {
 			ret = -12;
-			goto END;
+			continue;
 		}
-	}
 
-END:
+		ret = 0;
+		break;
+	}
 
-	freeaddrinfo(addr_info);
+	free_remote_addr(addr_info);
 	addr_info = NULL;
 
 	if (ret < 0) {
-		if (sock_fd > 0) {
+		if (sock_fd >= 0) {
 			close(sock_fd);
 			sock_fd = -1;
 		}
@@ -287,7 +582,7 @@ int ping (char *host)
 		free(msg.msg_name);
 	}
 
-	free(ai);
+	free_remote_addr(ai);
 	close(sockfd);
 
 	return ret;
@@ -352,9 +647,9 @@ int parse_http_url(char *url, char **host, char **port, char **path)
 		if (*pport == '\0')
 			pport = "80";
 		else {
-			char c = *pport;
-			for (; c; c = *(++pport)) {
-				if (c <'0' || c > '9')
+			char *q = pport;
+			for (; *q; q++) {
+				if (*q <'0' || *q > '9')
 					return -6;
 			}
 		}
@@ -369,185 +664,716 @@ int parse_http_url(char *url, char **host, char **port, char **path)
 	return 0;
 }
 
-static int read_http_header_line(int sock_fd, char *buf, int buflen)
+static int write_fd(int fd, char *buf, int buf_len)
 {
-	int len, i=0, state = 0;
-	char c;
+	int written = 0;
+	int len;
 
-	while ((len = read(sock_fd, &c, 1)) >= 0) {
-		if (state == 0) {
-			if (c == '\r') {
-				state = 1;
-			} else {
-				buf[i++] = c;
-			}
-		} else if (state == 1) {
-			/* some site (e.g, yahoo map) returns bad header line: \r\r\n
-			 * Even wireshark unable to recognize it correctly */
-			if (c == '\r')
-				;
-			else if (c == '\n')
-				break;
-			else
-				return -1;
-		}
-		if (i == buflen)
-			return -2;
+	while((len = write(fd, &buf[written], buf_len - written)) > 0) {
+		written += len;
+		if (written == buf_len)
+			break;
 	}
 
 	if (len < 0)
-		return -3;
+		return len;
+
+	return 0;
+}
+
+/**
+ * Keep-alive connections, shared by download engine and http_get().
+ *
+ * A connection is put back to the idle pool only after its response has been
+ * read exactly to the end (framed by Content-Length or chunked encoding), and
+ * nothing is left in the read buffer, and server does not ask
+ * to close it. There is only one request at a time on a connection (no
+ * pipelining), so a response never gets mixed up with the next one. Idle
+ * connections are closed after <HTTP_POOL_IDLE_TIMEOUT> seconds, or if server
+ * has closed them. A request on a reused connection that is closed by server
+ * before response is retried once on a new connection.
+ */
 
-	buf[i] = '\0';
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static http_conn_t *idle_conns = NULL;
+static int idle_count = 0;
 
-	return i;
+/**
+ * An idle connection is readable only if it is closed by remote (or remote
+ * sends something unexpected), either way it can't be used.
+ */
+static inline gboolean conn_is_broken(int sock_fd)
+{
+	struct pollfd pfd;
+	pfd.fd = sock_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return (poll(&pfd, 1, 0) != 0);
 }
 
-static int write_fd(int fd, char *buf, int buf_len)
+/**
+ * Return socket fd of an idle connection to host:port, or -1.
+ * Expired ones are closed. The socket is in blocking mode.
+ */
+int http_pool_acquire(char *host, char *port)
 {
-	int written = 0;
+	http_conn_t *c, **link, *found = NULL;
+	int sock_fd;
+	time_t now;
+
+AGAIN:
+
+	now = time(NULL);
+	LOCK_MUTEX(&pool_lock);
+
+	/* the most recently used one is at head */
+	link = &idle_conns;
+	while ((c = *link)) {
+		if (now - c->idle_since >= HTTP_POOL_IDLE_TIMEOUT) {
+			*link = c->next;
+			--idle_count;
+			close(c->fd);
+			free(c);
+		} else if (! found && strcmp(c->host, host) == 0 && strcmp(c->port, port) == 0) {
+			*link = c->next;
+			--idle_count;
+			found = c;
+		} else {
+			link = &(c->next);
+		}
+	}
+
+	UNLOCK_MUTEX(&pool_lock);
+
+	if (! found)
+		return -1;
+
+	sock_fd = found->fd;
+	free(found);
+	found = NULL;
+
+	if (conn_is_broken(sock_fd)) {
+		close(sock_fd);
+		goto AGAIN;
+	}
+
+	return sock_fd;
+}
+
+/**
+ * Put a connection back to idle pool, <sock_fd> must be in blocking mode.
+ */
+void http_pool_release(char *host, char *port, int sock_fd)
+{
+	http_conn_t *c;
+	int n = 0;
+
+	if (strlen(host) >= sizeof(c->host) || strlen(port) >= sizeof(c->port)) {
+		close(sock_fd);
+		return;
+	}
+
+	LOCK_MUTEX(&pool_lock);
+
+	for (c = idle_conns; c; c = c->next) {
+		if (strcmp(c->host, host) == 0 && strcmp(c->port, port) == 0)
+			++n;
+	}
+
+	if (n >= HTTP_POOL_MAX_PER_HOST || idle_count >= HTTP_POOL_MAX ||
+		! (c = (http_conn_t *)malloc(sizeof(http_conn_t)))) {
+		UNLOCK_MUTEX(&pool_lock);
+		close(sock_fd);
+		return;
+	}
+
+	strcpy(c->host, host);
+	strcpy(c->port, port);
+	c->fd = sock_fd;
+	c->idle_since = time(NULL);
+	c->next = idle_conns;
+	idle_conns = c;
+	++idle_count;
+
+	UNLOCK_MUTEX(&pool_lock);
+}
+
+/**
+ * Close all idle connections.
+ */
+void http_pool_cleanup()
+{
+	http_conn_t *c, *next;
+
+	LOCK_MUTEX(&pool_lock);
+
+	for (c = idle_conns; c; c = next) {
+		next = c->next;
+		close(c->fd);
+		free(c);
+	}
+	idle_conns = NULL;
+	idle_count = 0;
+
+	UNLOCK_MUTEX(&pool_lock);
+}
+
+/**
+ * Same as write_fd(), but a connection closed by remote fails with EPIPE
+ * instead of raising SIGPIPE, which is likely for reused connections.
+ */
+static int send_all(int sock_fd, char *buf, int buf_len)
+{
+	int sent = 0;
 	int len;
 
-	while((len = write(fd, &buf[written], buf_len - written)) > 0) {
-		written += len;
-		if (written == buf_len)
+	while (sent < buf_len) {
+		len = send(sock_fd, &buf[sent], buf_len - sent, MSG_NOSIGNAL);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			return -1;
+		sent += len;
+	}
+
+	return 0;
+}
+
+/**
+ * Buffered reading of response, see http_reader_t.
+ * Return bytes read, 0 on EOF, < 0 on error.
+ */
+static int reader_raw(http_reader_t *r, char *buf, int len)
+{
+	int n;
+
+	/* in memory response, see http_parse_response() */
+	if (r->mem) {
+		n = MIN(len, r->mem_len - r->mem_pos);
+		if (n == 0 && ! r->closed)
+			r->starved = TRUE;
+		memcpy(buf, r->mem + r->mem_pos, n);
+		r->mem_pos += n;
+		return n;
+	}
+
+	do {
+		n = read(r->fd, buf, len);
+	} while (n < 0 && errno == EINTR);
+
+	return n;
+}
+
+static int reader_fill(http_reader_t *r)
+{
+	int n;
+
+	if (r->start > 0) {
+		memmove(r->buf, r->buf + r->start, r->end - r->start);
+		r->end -= r->start;
+		r->start = 0;
+	}
+
+	n = reader_raw(r, r->buf + r->end, sizeof(r->buf) - r->end);
+
+	if (n > 0)
+		r->end += n;
+
+	return n;
+}
+
+/**
+ * Read a line without line terminator into <line>.
+ * Return length of the line, or < 0 on error:
+ * -2: line too long, -3: read error,
+ * -4: connection is closed by remote and nothing is buffered.
+ */
+static int reader_line(http_reader_t *r, char *line, int len)
+{
+	char *nl;
+	int n, l;
+
+	while (! (nl = memchr(r->buf + r->start, '\n', r->end - r->start))) {
+		if (r->end - r->start >= len)
+			return -2;
+		n = reader_fill(r);
+		if (n == 0 || (n < 0 && (errno == ECONNRESET || errno == EPIPE)))
+			return (r->end == r->start)? -4 : -3;
+		else if (n < 0)
+			return -3;
+	}
+
+	n = nl - (r->buf + r->start);
+
+	/* some site (e.g, yahoo map) returns bad header line: \r\r\n
+	 * Even wireshark unable to recognize it correctly */
+	for (l = n; l > 0 && r->buf[r->start + l - 1] == '\r'; l--)
+		;
+
+	if (l >= len)
+		return -2;
+
+	memcpy(line, r->buf + r->start, l);
+	line[l] = '\0';
+	r->start += n + 1;
+
+	return l;
+}
+
+/**
+ * Read at most <len> bytes. Buffered bytes first, then directly from socket,
+ * so that it never reads beyond <len>.
+ */
+static int reader_read(http_reader_t *r, char *buf, int len)
+{
+	int n;
+
+	if (r->end > r->start) {
+		n = MIN(len, r->end - r->start);
+		memcpy(buf, r->buf + r->start, n);
+		r->start += n;
+		return n;
+	}
+
+	return reader_raw(r, buf, len);
+}
+
+/**
+ * Decode (gzip/deflate) body data and write it to file, see http_body_t.
+ */
+static int body_write(http_body_t *b, char *data, int len)
+{
+	char out[4096];
+	int n, ret;
+
+	if (! b->inflating) {
+		if (b->fd >= 0 && write_fd(b->fd, data, len) < 0)
+			return HTTP_GET_ERROR_WRITE_FILE;
+		b->written += len;
+		return HTTP_GET_ERROR_NONE;
+	}
+
+	/* trailing bytes after the compressed stream are ignored */
+	if (b->stream_end)
+		return HTTP_GET_ERROR_NONE;
+
+	b->zs.next_in = (Bytef *)data;
+	b->zs.avail_in = len;
+
+	while (b->zs.avail_in > 0) {
+		b->zs.next_out = (Bytef *)out;
+		b->zs.avail_out = sizeof(out);
+
+		ret = inflate(&(b->zs), Z_NO_FLUSH);
+
+		/* "deflate" is raw deflate data on some servers, instead of zlib format */
+		if (ret == Z_DATA_ERROR && ! b->raw_tried && b->zs.total_out == 0) {
+			b->raw_tried = TRUE;
+			if (inflateReset2(&(b->zs), -MAX_WBITS) != Z_OK)
+				return HTTP_GET_ERROR_DECODE;
+			b->zs.next_in = (Bytef *)data;
+			b->zs.avail_in = len;
+			continue;
+		}
+
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+			return HTTP_GET_ERROR_DECODE;
+
+		n = sizeof(out) - b->zs.avail_out;
+		if (n > 0) {
+			if (b->fd >= 0 && write_fd(b->fd, out, n) < 0)
+				return HTTP_GET_ERROR_WRITE_FILE;
+			b->written += n;
+		}
+
+		if (ret == Z_STREAM_END) {
+			b->stream_end = TRUE;
+			break;
+		}
+
+		if (ret == Z_BUF_ERROR && n == 0)
 			break;
 	}
 
-	if (len < 0)
-		return len;
+	return HTTP_GET_ERROR_NONE;
+}
 
-	return 0;
+/**
+ * Read <len> bytes of body, or until connection is closed if <len> < 0.
+ */
+static int read_http_body(http_reader_t *r, http_body_t *b, int len)
+{
+	char buf[4096];
+	int n, total = 0, error_no;
+
+	while (len < 0 || total < len) {
+		n = reader_read(r, buf, (len < 0)? sizeof(buf) : MIN(sizeof(buf), len - total));
+		if (n == 0 && len < 0)
+			break;
+		if (n <= 0)
+			return HTTP_GET_ERROR_READ_REMOTE;
+
+		if ((error_no = body_write(b, buf, n)) != HTTP_GET_ERROR_NONE)
+			return error_no;
+
+		total += n;
+	}
+
+	return HTTP_GET_ERROR_NONE;
 }
 
 /**
- * @ref: http://www.w3.org/Protocols/rfc2616/rfc2616.html
- * NOTE: just a simple implementation for downloading images
- * don't support (1) HTTPS (2) FTP (3) proxy
+ * Chunked transfer coding: chunks of "<hex size>[;ext]\r\n<data>\r\n", ends with a
+ * zero-size chunk, optional trailer lines and an empty line.
  */
-void http_get(char *url, int fd, int con_timeout, int timeout, http_get_result_t *result)
+static int read_chunked_body(http_reader_t *r, http_body_t *b)
 {
-	char *_url = strdup(url);
+	char line[HTTP_HEADER_LINE_MAX];
+	char *end;
+	long size;
+	int n, error_no;
 
-	/* no error */
-	result->error_no = HTTP_GET_ERROR_NONE;
-	result->content_length = 0;
-	result->content_type[0] = '\0';
-	result->http_code = 0;
+	while (1) {
+		if (reader_line(r, line, sizeof(line)) < 0)
+			return HTTP_GET_ERROR_READ_REMOTE;
 
-	char *host, *port, *path;
-	int sock_fd = 0;
+		size = strtol(line, &end, 16);
+		if (end == line || size < 0 || size > G_MAXINT)
+			return HTTP_GET_ERROR_READ_REMOTE;
 
-	if (parse_http_url(_url, &host, &port, &path) < 0) {
-		result->error_no = HTTP_GET_ERROR_URL;
-		goto END;
+		if (size == 0)
+			break;
+
+		if ((error_no = read_http_body(r, b, (int)size)) != HTTP_GET_ERROR_NONE)
+			return error_no;
+
+		/* CRLF after chunk data */
+		if (reader_line(r, line, sizeof(line)) != 0)
+			return HTTP_GET_ERROR_READ_REMOTE;
 	}
 
-	sock_fd = connect_remote_with_timeouts(host, port, AF_UNSPEC, SOCK_STREAM, 0,
-			10, con_timeout, timeout, timeout);
+	/* trailers */
+	while ((n = reader_line(r, line, sizeof(line))) > 0)
+		;
 
-	if (sock_fd <= 0) {
-		result->error_no = HTTP_GET_ERROR_CONNECT;
-		goto END;
+	return (n == 0)? HTTP_GET_ERROR_NONE : HTTP_GET_ERROR_READ_REMOTE;
+}
+
+/**
+ * Retry-After: delta seconds or HTTP-date. Return seconds, 0 if invalid or past.
+ */
+static int parse_retry_after(char *value)
+{
+	struct tm tm;
+	char *end;
+	long n;
+
+	n = strtol(value, &end, 10);
+	if (end != value && *end == '\0')
+		return (int)MAX(MIN(n, G_MAXINT), 0);
+
+	memset(&tm, 0, sizeof(tm));
+	if (! strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+		return 0;
+
+	n = (long)(timegm(&tm) - time(NULL));
+	return (n > 0)? (int)MIN(n, G_MAXINT) : 0;
+}
+
+/**
+ * Cache-Control: max-age, or 0 for no-cache and no-store. Return -1 if not set.
+ */
+static int parse_cache_control(char *value)
+{
+	char *p;
+	long n;
+
+	if (strcasestr(value, "no-cache") || strcasestr(value, "no-store"))
+		return 0;
+
+	/* not s-maxage */
+	for (p = value; (p = strcasestr(p, "max-age=")); p += 8) {
+		if (p == value || p[-1] == ' ' || p[-1] == ',') {
+			n = strtol(p + 8, NULL, 10);
+			return (int)MAX(MIN(n, G_MAXINT), 0);
+		}
 	}
 
-	char buf[1024];
-	snprintf(buf, sizeof(buf), "GET /%s HTTP/1.1\r\n"
+	return -1;
+}
+
+/**
+ * Format GET request of <path> on <host>. It is conditional if <etag> or
+ * <last_modified> is not empty. Return its length, -1 if <buf> is too small.
+ */
+int http_format_request(char *buf, int len, char *host, char *path, const char *etag,
+	const char *last_modified)
+{
+	char cond[HTTP_ETAG_LEN + HTTP_DATE_LEN + 48];
+	int n = 0;
+
+	cond[0] = '\0';
+	if (etag && *etag)
+		n += snprintf(cond + n, sizeof(cond) - n, "If-None-Match: %s\r\n", etag);
+	if (last_modified && *last_modified)
+		n += snprintf(cond + n, sizeof(cond) - n, "If-Modified-Since: %s\r\n", last_modified);
+
+	n = snprintf(buf, len, "GET /%s HTTP/1.1\r\n"
 		"User-Agent: %s\r\n"
 		"Host: %s\r\n"
 		"Accept: */*\r\n"
-		"\r\n", path, "omgps", host);
+		"Accept-Encoding: gzip, deflate\r\n"
+		"Connection: keep-alive\r\n"
+		"%s"
+		"\r\n", path, "omgps", host, cond);
 
-	/* send request */
-	if (write_fd(sock_fd, buf, strlen(buf)) < 0) {
-		close(sock_fd);
-		result->error_no = HTTP_GET_ERROR_WRITE_REMOTE;
-		goto END;
-	}
+	return (n < 0 || n >= len)? -1 : n;
+}
 
-	char header_buf[256];
+static inline gboolean reader_drained(http_reader_t *r)
+{
+	return (r->start == r->end) && (! r->mem || r->mem_pos == r->mem_len);
+}
+
+/**
+ * Read the response from <reader>, write decoded body to <fd>.
+ * <no_response>: the connection is closed by remote before any byte of response.
+ * <keep_alive>: the response is completely read, the connection can be reused.
+ * Return error no.
+ */
+static int http_read_response(http_reader_t *reader, int fd, http_get_result_t *result,
+	gboolean *no_response, gboolean *keep_alive)
+{
+	char header_buf[HTTP_HEADER_LINE_MAX];
+	int ret, error_no;
+	http_body_t body;
+
+	*no_response = FALSE;
+	*keep_alive = FALSE;
+
+	memset(&body, 0, sizeof(body));
+	body.fd = fd;
 
 	/* status line */
-	int ret = read_http_header_line(sock_fd, header_buf, sizeof(header_buf));
+	ret = reader_line(reader, header_buf, sizeof(header_buf));
 	if (ret <= 0) {
-		result->error_no = HTTP_GET_ERROR_READ_REMOTE;
-		goto END;
+		*no_response = (ret == -4);
+		return HTTP_GET_ERROR_READ_REMOTE;
 	}
 
 	//log_debug("status line=%s\n", header_buf);
 
-	char http_version[32], reason_phrase[64];
+	char http_version[32];
 	int code;
-	if (sscanf(header_buf, "%s %d %s", http_version, &code, reason_phrase) != 3) {
-		result->error_no = HTTP_GET_ERROR_READ_REMOTE;
-		goto END;
-	}
+	if (sscanf(header_buf, "%31s %d", http_version, &code) != 2)
+		return HTTP_GET_ERROR_READ_REMOTE;
 
 	result->http_code = code;
 
-	if (code != 200) {
-		result->error_no = HTTP_GET_ERROR_NOT_200_OK;
-		goto END;
-	}
-
-	int content_length = 0;
+	int content_length = -1;
 	char *content_type = NULL;
-
+	gboolean chunked = FALSE;
+	gboolean bad_coding = FALSE;
+	/* HTTP/1.1 is persistent by default, HTTP/1.0 only if asked */
+	gboolean persistent = (strcmp(http_version, "HTTP/1.1") == 0);
 	char *p;
 
 	#define CL "Content-Length:"
 	#define CT "Content-Type:"
+	#define CN "Connection:"
+	#define TE "Transfer-Encoding:"
+	#define CE "Content-Encoding:"
+	#define RA "Retry-After:"
+	#define ET "ETag:"
+	#define LM "Last-Modified:"
+	#define CC "Cache-Control:"
+	#define EX "Expires:"
 	#define CL_LEN 15
 	#define CT_LEN 13
+	#define CN_LEN 11
+	#define TE_LEN 18
+	#define CE_LEN 17
+	#define RA_LEN 12
+	#define ET_LEN 5
+	#define LM_LEN 14
+	#define CC_LEN 14
+	#define EX_LEN 8
+
+	int max_age = -1, expires = -1;
 
 	/* read other headers, until <= 0 */
-	while ((ret = read_http_header_line(sock_fd, header_buf, sizeof(header_buf))) > 0) {
-		if ((p = strstr(header_buf, CL)) != NULL) {
+	while ((ret = reader_line(reader, header_buf, sizeof(header_buf))) > 0) {
+		if (strncasecmp(header_buf, CL, CL_LEN) == 0) {
 			sscanf(&header_buf[CL_LEN], "%d", &content_length);
-		} else if ((p = strstr(header_buf, CT)) != NULL) {
-			content_type = trim(strdup(&header_buf[CT_LEN]));
+		} else if (strncasecmp(header_buf, CT, CT_LEN) == 0) {
+			if (content_type)
+				free(content_type);
+			content_type = strdup(trim(&header_buf[CT_LEN]));
+		} else if (strncasecmp(header_buf, CN, CN_LEN) == 0) {
+			p = &header_buf[CN_LEN];
+			if (strcasestr(p, "close"))
+				persistent = FALSE;
+			else if (strcasestr(p, "keep-alive"))
+				persistent = TRUE;
+		} else if (strncasecmp(header_buf, TE, TE_LEN) == 0) {
+			p = trim(&header_buf[TE_LEN]);
+			if (strcasestr(p, "chunked"))
+				chunked = TRUE;
+			else if (strcasecmp(p, "identity") != 0)
+				bad_coding = TRUE;
+		} else if (strncasecmp(header_buf, CE, CE_LEN) == 0) {
+			p = trim(&header_buf[CE_LEN]);
+			if (strcasecmp(p, "gzip") == 0 || strcasecmp(p, "x-gzip") == 0 ||
+				strcasecmp(p, "deflate") == 0)
+				body.inflating = TRUE;
+			else if (strcasecmp(p, "identity") != 0)
+				bad_coding = TRUE;
+		} else if (strncasecmp(header_buf, RA, RA_LEN) == 0) {
+			result->retry_after = parse_retry_after(trim(&header_buf[RA_LEN]));
+		} else if (strncasecmp(header_buf, ET, ET_LEN) == 0) {
+			p = trim(&header_buf[ET_LEN]);
+			if (strlen(p) < sizeof(result->etag))
+				strcpy(result->etag, p);
+		} else if (strncasecmp(header_buf, LM, LM_LEN) == 0) {
+			p = trim(&header_buf[LM_LEN]);
+			if (strlen(p) < sizeof(result->last_modified))
+				strcpy(result->last_modified, p);
+		} else if (strncasecmp(header_buf, CC, CC_LEN) == 0) {
+			max_age = parse_cache_control(trim(&header_buf[CC_LEN]));
+		} else if (strncasecmp(header_buf, EX, EX_LEN) == 0) {
+			/* same format as Retry-After, a past or bad date means expired */
+			expires = parse_retry_after(trim(&header_buf[EX_LEN]));
 		}
 	}
 
+	/* max-age overrides Expires */
+	result->max_age = (max_age >= 0)? max_age : MAX(expires, 0);
+
 	/* bad http header */
-	if (ret < 0 || content_length <= 0 || ! content_type)  {
-		result->error_no = HTTP_GET_ERROR_READ_REMOTE;
+	if (ret < 0) {
+		error_no = HTTP_GET_ERROR_READ_REMOTE;
 		goto END;
 	} else {
 		/* ret == 0: last header line: empty line with \r\n */
 	}
 
-	result->content_length = content_length;
-	strcpy(result->content_type, content_type);
+	/* chunked overrides Content-Length */
+	if (chunked)
+		content_length = -1;
 
-	int len, total = 0;
+	if (code == 304) {
+		/* never has a body */
+		error_no = HTTP_GET_ERROR_NOT_MODIFIED;
+		*keep_alive = persistent && reader_drained(reader);
+		goto END;
+	}
 
-	/* read real data */
-	while ((len = read(sock_fd, buf, sizeof(buf))) > 0) {
-		total += len;
-		if (total > content_length) {
-			result->error_no = HTTP_GET_ERROR_READ_REMOTE;
-			goto END;
-		}
+	if (code != 200) {
+		error_no = HTTP_GET_ERROR_NOT_200_OK;
+		/* read out short body of error response to keep the connection */
+		body.fd = -1;
+		body.inflating = FALSE;
+		if (persistent && ! chunked && content_length >= 0 && content_length <= HTTP_DRAIN_MAX &&
+			read_http_body(reader, &body, content_length) == HTTP_GET_ERROR_NONE &&
+			reader_drained(reader))
+			*keep_alive = TRUE;
+		goto END;
+	}
 
-		if (write_fd(fd, buf, len) < 0) {
-			result->error_no = HTTP_GET_ERROR_WRITE_FILE;
-			goto END;
-		}
-		if (total == content_length)
-			break;
+	if (bad_coding || ! content_type || content_length == 0) {
+		error_no = HTTP_GET_ERROR_READ_REMOTE;
+		goto END;
 	}
 
-	if (len < 0) {
-		result->error_no = HTTP_GET_ERROR_READ_REMOTE;
+	snprintf(result->content_type, sizeof(result->content_type), "%s", content_type);
+
+	if (body.inflating && inflateInit2(&(body.zs), MAX_WBITS + 32) != Z_OK) {
+		body.inflating = FALSE;
+		error_no = HTTP_GET_ERROR_DECODE;
 		goto END;
 	}
 
+	/* read real data. Without length, the body ends when connection is closed */
+	if (chunked)
+		error_no = read_chunked_body(reader, &body);
+	else
+		error_no = read_http_body(reader, &body, content_length);
+
+	if (error_no == HTTP_GET_ERROR_NONE) {
+		if ((body.inflating && ! body.stream_end) || body.written == 0)
+			error_no = body.inflating? HTTP_GET_ERROR_DECODE : HTTP_GET_ERROR_READ_REMOTE;
+		else
+			result->content_length = body.written;
+	}
+
+	if (body.inflating)
+		inflateEnd(&(body.zs));
+
+	if (error_no == HTTP_GET_ERROR_NONE)
+		*keep_alive = persistent && (chunked || content_length > 0) &&
+			reader_drained(reader);
+
 END:
 
-	free(_url);
+	if (content_type)
+		free(content_type);
+
+	return error_no;
+}
+
+/**
+ * Send the request and read the response on <sock_fd>, see http_read_response().
+ */
+static int http_exchange(int sock_fd, char *host, char *path, int fd, http_get_result_t *result,
+	gboolean *no_response, gboolean *keep_alive)
+{
+	char buf[1024];
+	int len;
+	http_reader_t reader;
+
+	*no_response = FALSE;
+	*keep_alive = FALSE;
+
+	reader.fd = sock_fd;
+	reader.start = reader.end = 0;
+	reader.mem = NULL;
+
+	if ((len = http_format_request(buf, sizeof(buf), host, path, NULL, NULL)) < 0)
+		return HTTP_GET_ERROR_URL;
+
+	/* send request */
+	if (send_all(sock_fd, buf, len) < 0) {
+		*no_response = TRUE;
+		return HTTP_GET_ERROR_WRITE_REMOTE;
+	}
+
+	return http_read_response(&reader, fd, result, no_response, keep_alive);
+}
+
+/**
+ * No error.
+ */
+void http_result_init(http_get_result_t *result)
+{
+	result->error_no = HTTP_GET_ERROR_NONE;
+	result->content_length = 0;
+	result->content_type[0] = '\0';
+	result->http_code = 0;
+	result->retry_after = 0;
+	result->etag[0] = '\0';
+	result->last_modified[0] = '\0';
+	result->max_age = 0;
+	result->err_buf[0] = '\0';
+}
 
-	switch(result->error_no) {
+/**
+ * Set <error_no> and its message.
+ */
+void http_result_set_error(http_get_result_t *result, int error_no)
+{
+	result->error_no = error_no;
+
+	switch(error_no) {
 	case HTTP_GET_ERROR_URL:
 		strcpy(result->err_buf, HTTP_GET_ERROR_URL_ERR);
 		break;
@@ -566,12 +1392,110 @@ END:
 	case HTTP_GET_ERROR_WRITE_FILE:
 		strcpy(result->err_buf, HTTP_GET_ERROR_WRITE_FILE_ERR);
 		break;
+	case HTTP_GET_ERROR_DECODE:
+		strcpy(result->err_buf, HTTP_GET_ERROR_DECODE_ERR);
+		break;
+	case HTTP_GET_ERROR_NOT_MODIFIED:
+		strcpy(result->err_buf, HTTP_GET_ERROR_NOT_MODIFIED_ERR);
+		break;
 	default:
 		break;
 	}
+}
 
-	if (sock_fd > 0)
-		close(sock_fd);
+/**
+ * Parse a response that has been read into memory by an event driven caller,
+ * see tile_dl_engine.c. <closed>: the connection is closed by remote after <data>.
+ * Decoded body is written to <fd>, -1 to discard, e.g., to check if it is complete.
+ * Return HTTP_PARSE_PENDING if more data is needed, else error no as http_get().
+ */
+int http_parse_response(const char *data, int len, gboolean closed, int fd,
+	http_get_result_t *result, gboolean *no_response, gboolean *keep_alive)
+{
+	http_reader_t reader;
+	int error_no;
+
+	reader.fd = -1;
+	reader.start = reader.end = 0;
+	reader.mem = data;
+	reader.mem_len = len;
+	reader.mem_pos = 0;
+	reader.closed = closed;
+	reader.starved = FALSE;
+
+	http_result_init(result);
+
+	error_no = http_read_response(&reader, fd, result, no_response, keep_alive);
+
+	if (reader.starved) {
+		*keep_alive = FALSE;
+		return HTTP_PARSE_PENDING;
+	}
+
+	http_result_set_error(result, error_no);
+
+	return error_no;
+}
+
+/**
+ * @ref: http://www.w3.org/Protocols/rfc2616/rfc2616.html
+ * NOTE: just a simple implementation for downloading images
+ * don't support (1) HTTPS (2) FTP (3) proxy
+ */
+void http_get(char *url, int fd, int con_timeout, int timeout, http_get_result_t *result)
+{
+	char *_url = strdup(url);
+
+	/* no error */
+	http_result_init(result);
+
+	char *host, *port, *path;
+	int sock_fd = -1;
+	gboolean reused, no_response, keep_alive;
+	int attempt;
+
+	if (parse_http_url(_url, &host, &port, &path) < 0) {
+		result->error_no = HTTP_GET_ERROR_URL;
+		goto END;
+	}
+
+	for (attempt = 0; attempt < 2; attempt++) {
+		/* retry on a new connection */
+		sock_fd = (attempt == 0)? http_pool_acquire(host, port) : -1;
+		reused = (sock_fd >= 0);
+
+		if (reused) {
+			struct timeval tv = {timeout, 0};
+			setsockopt(sock_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(struct timeval));
+			setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(struct timeval));
+		} else {
+			sock_fd = connect_remote_with_timeouts(host, port, AF_UNSPEC, SOCK_STREAM, 0,
+					10, con_timeout, timeout, timeout);
+			if (sock_fd <= 0) {
+				sock_fd = -1;
+				result->error_no = HTTP_GET_ERROR_CONNECT;
+				goto END;
+			}
+		}
+
+		result->error_no = http_exchange(sock_fd, host, path, fd, result, &no_response, &keep_alive);
+
+		if (keep_alive)
+			http_pool_release(host, port, sock_fd);
+		else
+			close(sock_fd);
+		sock_fd = -1;
+
+		/* idle connection has been closed by server */
+		if (! (reused && no_response))
+			break;
+	}
+
+END:
+
+	free(_url);
+
+	http_result_set_error(result, result->error_no);
 }
 
 gboolean guess_network_is_connecting()
@@ -30,6 +30,11 @@
 
 #define key_sound_cfg_file		"sound-cfg-file"
 
+/* per layer decoded tile cache budget, 0: sized from screen geometry */
+#define key_tile_cache_kb		"tile-cache-kb"
+/* raw tile image cache budget, 0: TILE_L2_CACHE_DEFAULT_KB */
+#define key_tile_l2_cache_kb	"tile-l2-cache-kb"
+
 static cfg_t cfg =
 {
 	.last_map_name = NULL,
@@ -44,6 +49,9 @@ static cfg_t cfg =
 
 	.agps_user = NULL,
 	.agps_pwd = NULL,
+
+	.tile_cache_kb = 0,
+	.tile_l2_cache_kb = 0,
 };
 
 static char *settings_file = NULL;
@@ -77,6 +85,12 @@ static gboolean check_settings()
 	if (cfg.last_pacc >= max_pacc || cfg.last_pacc <= 0)
 		cfg.last_pacc = 10000;
 
+	if (cfg.tile_cache_kb < 0)
+		cfg.tile_cache_kb = 0;
+
+	if (cfg.tile_l2_cache_kb < 0)
+		cfg.tile_l2_cache_kb = 0;
+
 	cfg.agps_user = trim(cfg.agps_user);
 	cfg.agps_pwd = trim(cfg.agps_pwd);
 
@@ -188,6 +202,10 @@ static gboolean parse_line(char *line, int len)
 		cfg.agps_user = value? strdup(value) : NULL;
 	else if (IS_KEY(key_agps_pwd))
 		cfg.agps_pwd = value? strdup(value) : NULL;
+	else if (IS_KEY(key_tile_cache_kb))
+		cfg.tile_cache_kb = value? atoi(value) : 0;
+	else if (IS_KEY(key_tile_l2_cache_kb))
+		cfg.tile_l2_cache_kb = value? atoi(value) : 0;
 	else if (strncmp(key, map_cfg_prefix, strlen(map_cfg_prefix)) == 0) {
 		if (value) {
 			parse_map_config(key, value);
@@ -304,6 +322,8 @@ static void save_cfg(FILE *fp)
 	fprintf(fp, key_agps_user" = %s\n", cfg.agps_user == NULL? "" : cfg.agps_user);
 	fprintf(fp, key_agps_pwd" = %s\n",	cfg.agps_pwd == NULL? "" : cfg.agps_pwd);
 	fprintf(fp, key_sound_cfg_file" = %s\n", cfg.last_sound_file? cfg.last_sound_file : "");
+	fprintf(fp, key_tile_cache_kb" = %d\n", cfg.tile_cache_kb);
+	fprintf(fp, key_tile_l2_cache_kb" = %d\n", cfg.tile_l2_cache_kb);
 
 	mapcfg_iterate_maplist(save_map_config, fp);
 }
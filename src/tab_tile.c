@@ -22,6 +22,7 @@ typedef enum
 	COL_ML_BG,
 	COL_ML_DOWNLOADING,
 	COL_ML_LATLON_FIX,
+	COL_ML_DISK_USAGE,
 	COL_ML_REPO,
 	COL_ML_TYPE,
 	COL_ML_COUNT,
@@ -54,6 +55,33 @@ static gboolean maplist_update_batch_info (GtkTreeModel *model,
 	return FALSE;
 }
 
+static void format_disk_usage(map_repo_t *repo, char *buf, int buflen)
+{
+	gint64 usage;
+	guint64 quota;
+	int count;
+
+	if (! tile_quota_get_usage(repo, &usage, &quota, &count))
+		snprintf(buf, buflen, "...");
+	else if (quota > 0)
+		snprintf(buf, buflen, "%.1f / %.0fMB", usage / 1048576.0, quota / 1048576.0);
+	else
+		snprintf(buf, buflen, "%.1fMB", usage / 1048576.0);
+}
+
+static gboolean maplist_update_disk_usage (GtkTreeModel *model,
+	GtkTreePath *path, GtkTreeIter *iter, gpointer data)
+{
+	map_repo_t *repo = NULL;
+	char buf[32];
+
+	gtk_tree_model_get (model, iter, COL_ML_REPO, &repo, -1);
+	format_disk_usage(repo, buf, sizeof(buf));
+	gtk_list_store_set (GTK_LIST_STORE (model), iter, COL_ML_DISK_USAGE, buf, -1);
+
+	return FALSE;
+}
+
 static void show_rulers_button_toggled(GtkWidget *widget, gpointer data)
 {
 	g_context.show_rulers = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget));
@@ -79,6 +107,8 @@ void tile_tab_on_show()
 	gtk_widget_set_sensitive(clear_bg_button, g_view.bglayer.repo != NULL);
 	gtk_widget_set_sensitive(dl_button, FALSE);
 	gtk_widget_set_sensitive(fixmap_button, FALSE);
+
+	gtk_tree_model_foreach(GTK_TREE_MODEL(maplist_store), maplist_update_disk_usage, NULL);
 }
 
 static gboolean set_fg_map(GtkTreeModel *model, GtkTreePath *path, GtkTreeIter *iter, gpointer data)
@@ -219,6 +249,9 @@ static void add_map_to_table(map_repo_t *repo, void *arg)
 	else
 		buf[0] = '\0';
 
+	char usage[32];
+	format_disk_usage(repo, usage, sizeof(usage));
+
 	/* NOTE: COL_ML_ACTIVATABLE */
 	gtk_list_store_set (maplist_store, &iter,
 		COL_ML_MAP_NAME, repo->name,
@@ -226,6 +259,7 @@ static void add_map_to_table(map_repo_t *repo, void *arg)
 		COL_ML_BG, (type == LAYER_TYPE_BG)? yes_image : NULL,
 		COL_ML_DOWNLOADING, NULL,
 		COL_ML_LATLON_FIX, buf,
+		COL_ML_DISK_USAGE, usage,
 		COL_ML_REPO, repo,
 		COL_ML_TYPE, type,
 		-1);
@@ -328,11 +362,15 @@ static void create_maplist_treeview()
 	col = gtk_tree_view_column_new_with_attributes ("Lat/lon fix(°)", cell, "text", COL_ML_LATLON_FIX, NULL);
 	gtk_tree_view_append_column (GTK_TREE_VIEW(maplist_treeview), col);
 
+	cell = gtk_cell_renderer_text_new();
+	col = gtk_tree_view_column_new_with_attributes ("Disk", cell, "text", COL_ML_DISK_USAGE, NULL);
+	gtk_tree_view_append_column (GTK_TREE_VIEW(maplist_treeview), col);
+
 	/* populate map list */
 
 	maplist_store = gtk_list_store_new (COL_ML_COUNT,
 		G_TYPE_STRING, GDK_TYPE_PIXBUF, GDK_TYPE_PIXBUF, GDK_TYPE_PIXBUF,
-		G_TYPE_STRING, G_TYPE_POINTER, G_TYPE_INT);
+		G_TYPE_STRING, G_TYPE_STRING, G_TYPE_POINTER, G_TYPE_INT);
 
 	gtk_tree_view_set_model(GTK_TREE_VIEW(maplist_treeview), GTK_TREE_MODEL(maplist_store));
 
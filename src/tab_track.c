@@ -6,8 +6,6 @@
 #include "track.h"
 #include "customized.h"
 
-#define TRACK_FILE_EXT	".txt"
-
 static char *track_file_path = NULL;
 static char *track_file_name = NULL;
 static track_group_t *tracks = NULL;
@@ -590,6 +588,66 @@ END:
 	}
 }
 
+/**
+ * Read positions of track record file <file> in track dir, e.g., for batch
+ * download along the track. Return NULL if there are no records.
+ * Caller must free the returned array.
+ */
+coord_t * track_read_points(const char *file, int *count)
+{
+	char fullpath[256];
+	U4 start_time, end_time, record_count = 0, time_offset;
+	coord_t *points = NULL, *p;
+	int capacity, n = 0;
+	double lat, lon;
+
+	*count = 0;
+
+	snprintf(fullpath, sizeof(fullpath), "%s/%s", g_context.track_dir, file);
+
+	FILE *fp = fopen(fullpath, "r");
+	if (! fp)
+		return NULL;
+
+	/* head */
+	if (fscanf(fp, TRACK_HEAD_LABEL_1"%u\n", &start_time) != 1 ||
+		fscanf(fp, TRACK_HEAD_LABEL_2"%u\n", &end_time) != 1 ||
+		fscanf(fp, TRACK_HEAD_LABEL_3"%u\n", &record_count) != 1) {
+		log_warn("track file %s: bad head", fullpath);
+		goto END;
+	}
+
+	/* record count is not updated until the track is saved */
+	capacity = MIN(MAX(record_count, 64), 1 << 20);
+
+	if (! (points = (coord_t *)malloc(capacity * sizeof(coord_t))))
+		goto END;
+
+	while (fscanf(fp, "%lf\t%lf\t%u\n", &lat, &lon, &time_offset) == 3) {
+		if (n == capacity) {
+			if (! (p = (coord_t *)realloc(points, 2 * capacity * sizeof(coord_t))))
+				break;
+			points = p;
+			capacity *= 2;
+		}
+		points[n].lat = lat;
+		points[n].lon = lon;
+		++n;
+	}
+
+	if (n == 0) {
+		free(points);
+		points = NULL;
+	}
+
+END:
+
+	fclose(fp);
+
+	*count = n;
+	return points;
+}
+
 static void export_gpx_button_clicked(GtkWidget *widget, gpointer data)
 {
 	GtkTreeIter iter;
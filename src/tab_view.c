@@ -31,6 +31,9 @@ static guchar *pixel_rgb_table = NULL;
 
 static int screen_w = 0, screen_h = 0;
 
+/* motion of view center of last pan, in pixels */
+static point_t pan_vector = {0, 0};
+
 static U4 drawingarea_event_masks =
 	GDK_BUTTON_PRESS_MASK |
 	GDK_BUTTON_RELEASE_MASK |
@@ -98,6 +101,9 @@ void map_cleanup()
 
 	tilecache_cleanup(g_view.bglayer.tile_cache, TRUE);
 	g_view.bglayer.tile_cache = NULL;
+
+	tilecache_cleanup(g_view.blob_cache, TRUE);
+	g_view.blob_cache = NULL;
 }
 
 /**
@@ -177,101 +183,152 @@ static gboolean map_update_view_range(map_view_tile_layer_t *tile_layer)
 	tile_layer->br_tile.x = view_br_tile_x;
 	tile_layer->br_tile.y = view_br_tile_y;
 
+	/* re-order or drop queued downloads of previous view */
+	tile_downloader_set_view(tile_layer->repo, tile_layer->repo->zoom,
+		tile_layer->tl_tile, tile_layer->br_tile, tile_layer->center_pixel);
+
 	return TRUE;
 }
 
 /**
- * NOTE: caller must not hold download lock when call this function!
+ * Find the layer that shows tile (<repo>, <zoom>, <x>, <y>), and the tile's
+ * rectangle that is in view (window coordinate). Caller must hold UI lock.
  */
-void map_front_download_callback_func(map_repo_t *repo, int zoom, int x, int y)
+static map_view_tile_layer_t * map_find_tile_area(map_repo_t *repo, int zoom, int x, int y,
+	GdkRectangle *area)
 {
-	LOCK_UI();
+	map_view_tile_layer_t *layer = NULL;
 
 	if (g_tab_id != TAB_ID_MAIN_VIEW)
-		goto END;
-
-	GdkRectangle tile_rect = {0, 0, TILE_SIZE, TILE_SIZE};
-	map_view_tile_layer_t *layer = NULL;
-	GdkRectangle area;
-	gboolean update_fg = FALSE;
-	gboolean update_bg = FALSE;
+		return NULL;
 
-	if ((repo == g_view.fglayer.repo)) {
+	if (repo == g_view.fglayer.repo)
 		layer = &g_view.fglayer;
-		update_fg = TRUE;
-	} else if (repo == g_view.bglayer.repo) {
+	else if (repo == g_view.bglayer.repo)
 		layer = &g_view.bglayer;
-		update_bg = TRUE;
-	}
 
-	if (layer && zoom == layer->repo->zoom) {
-		tile_rect.x = x * TILE_SIZE - layer->tl_pixel.x;
-		tile_rect.y = y * TILE_SIZE - layer->tl_pixel.y;
-		GdkRectangle view_rect = { 0,  0, g_view.width, g_view.height};
+	if (! layer || zoom != layer->repo->zoom)
+		return NULL;
 
-		/* NOTE: intersect with fg layer */
-		if (gdk_rectangle_intersect(&tile_rect, &view_rect, &area)) {
-			map_invalidate_pixbuf(&area, update_fg, update_bg, FALSE);
-			(*map_redraw_view_func)();
-		}
-	}
+	GdkRectangle tile_rect = {x * TILE_SIZE - layer->tl_pixel.x,
+		y * TILE_SIZE - layer->tl_pixel.y, TILE_SIZE, TILE_SIZE};
 
-END:
+	/* NOTE: intersect with layer's visible area */
+	if (! gdk_rectangle_intersect(&tile_rect, &layer->visible, area))
+		return NULL;
 
-	UNLOCK_UI();
+	return layer;
 }
 
-static tile_t * get_tile(tilecache_t *tile_cache, map_repo_t *repo, int tx, int ty, gboolean dl_if_absent)
+/**
+ * NOTE: caller must not hold download lock when call this function!
+ * Called only if the tile is downloaded. The tile is decoded by tile loader, see map_tile_loaded_callback_func().
+ */
+void map_front_download_callback_func(map_repo_t *repo, int zoom, int x, int y)
 {
-	tile_t *tile = NULL;
+	GdkRectangle area;
 
-	tile = tilecache_get(tile_cache, repo->zoom, tx, ty);
-	if (tile != NULL)
-		return tile;
+	tilecache_absent_clear(repo, zoom, x, y);
 
-	/* file path */
-	char buf[256];
-	struct stat st;
+	LOCK_UI();
 
-	/* this also create tile path */
-	if (! format_tile_file_path(repo, repo->zoom, tx, ty, buf, sizeof(buf)))
-		return NULL;
+	/* a refreshed tile replaces the cached one */
+	tilecache_l2_remove(g_view.blob_cache, repo, zoom, x, y);
 
-	if (stat(buf, &st) != 0) {
-		if (dl_if_absent && count_network_interfaces() > 0) {
-			/* SPECIAL NOTE: also synchronize access to Python interpreter! */
-			char * url = mapcfg_get_dl_url(repo, repo->zoom, tx, ty);
-			if (! url) {
-				log_warn("download tile: can't get url for map: %s", repo->name);
-				return NULL;
-			}
-			add_front_download_task(repo, repo->zoom, tx, ty, strdup(buf), url);
-		}
-	} else {
-		//log_debug("file: %s", buf);
-		GError *error = NULL;
-		GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(buf, &error);
-		if (pixbuf) {
-			tile = (tile_t*) malloc(sizeof(tile_t));
-			if (tile == NULL) {
-				log_warn("allocate memory for tile_t failed\n");
-				return NULL;
+	map_view_tile_layer_t *layer = map_find_tile_area(repo, zoom, x, y, &area);
+	if (layer) {
+		tilecache_invalidate(layer->tile_cache, repo, zoom, x, y);
+		tile_loader_request(layer->tile_cache, repo, zoom, x, y, FALSE);
+	}
+
+	UNLOCK_UI();
+}
+
+/**
+ * Synthesize a provisional tile from cached tiles of neighbouring zoom levels:
+ * crop and upscale the nearest cached ancestor at zoom-1..zoom-N, else compose
+ * the downsampled children at zoom+1. Return an acquired tile or NULL.
+ */
+static tile_t * synthesize_tile(tilecache_t *tile_cache, map_repo_t *repo, int tx, int ty)
+{
+	GdkPixbuf *pixbuf = NULL;
+	tile_t *t;
+	int i, k;
+
+	for (k = 1; k <= TILE_FALLBACK_LEVELS && repo->zoom - k >= repo->min_zoom; k++) {
+		t = tilecache_acquire(tile_cache, repo, repo->zoom - k, tx >> k, ty >> k);
+		if (! t)
+			continue;
+
+		/* size of the part of the ancestor that covers this tile */
+		int size = TILE_SIZE >> k;
+		int mask = (1 << k) - 1;
+		GdkPixbuf *part = gdk_pixbuf_new_subpixbuf(t->pixbuf,
+			(tx & mask) * size, (ty & mask) * size, size, size);
+		pixbuf = gdk_pixbuf_scale_simple(part, TILE_SIZE, TILE_SIZE, GDK_INTERP_BILINEAR);
+
+		g_object_unref(part);
+		tile_release(t);
+		break;
+	}
+
+	if (! pixbuf && repo->zoom < repo->max_zoom) {
+		int half = TILE_SIZE >> 1;
+		int qx, qy;
+
+		for (i = 0; i < 4; i++) {
+			qx = i & 1;
+			qy = i >> 1;
+			t = tilecache_acquire(tile_cache, repo, repo->zoom + 1, (tx << 1) + qx, (ty << 1) + qy);
+			if (! t)
+				continue;
+
+			if (! pixbuf) {
+				pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, TILE_SIZE, TILE_SIZE);
+				/* same as drawingarea_bggc */
+				gdk_pixbuf_fill(pixbuf, 0xFFFFFFFF);
 			}
 
-			tile->cached = FALSE;
-			tile->zoom = repo->zoom;
-			tile->x = tx;
-			tile->y = ty;
-			tile->pixbuf = pixbuf;
+			gdk_pixbuf_scale(t->pixbuf, pixbuf, qx * half, qy * half, half, half,
+				qx * half, qy * half, 0.5, 0.5, GDK_INTERP_BILINEAR);
 
-			if (! tilecache_add(tile_cache, tile))
-				log_warn("add tile to cache failed.");
-		} else {
-			log_warn("load image failed: %s\n", error->message);
-			g_error_free(error);
+			tile_release(t);
 		}
 	}
 
+	if (! pixbuf)
+		return NULL;
+
+	t = tile_new(repo, repo->zoom, tx, ty, pixbuf);
+	if (! t) {
+		g_object_unref(pixbuf);
+		return NULL;
+	}
+	t->provisional = TRUE;
+
+	/* rejected if the real tile has just been loaded, draw it anyway */
+	tilecache_add(tile_cache, t);
+
+	return t;
+}
+
+/**
+ * Return an acquired tile, caller must release it.
+ * Don't decode on UI thread: on cache miss, queue a load request and return a
+ * provisional tile if possible, the tile's rectangle will be redrawn when the
+ * real one is loaded.
+ */
+static tile_t * get_tile(tilecache_t *tile_cache, map_repo_t *repo, int tx, int ty, gboolean dl_if_absent)
+{
+	tile_t *tile = tilecache_acquire(tile_cache, repo, repo->zoom, tx, ty);
+
+	if ((tile == NULL || tile->provisional) &&
+		! tilecache_absent_test(repo, repo->zoom, tx, ty, dl_if_absent))
+		tile_loader_request(tile_cache, repo, repo->zoom, tx, ty, dl_if_absent);
+
+	if (tile == NULL)
+		tile = synthesize_tile(tile_cache, repo, tx, ty);
+
 	return tile;
 }
 
@@ -302,15 +359,15 @@ static void map_update_tile_pixbuf(map_view_tile_layer_t *layer, gboolean is_fg,
 
 	for (i=0; i<layer->tile_rows; i++) { /* row */
 		for (j=0; j<layer->tile_cols; j++) { /* col */
-			tile = get_tile(layer->tile_cache, repo,
-				layer->tl_tile.x + j, layer->tl_tile.y + i, dl_if_absent);
-
 			tile_rect.x = offset_x + j * ts;
 			tile_rect.y = offset_y + i * ts;
 
 			if (! gdk_rectangle_intersect(&view_rect, &tile_rect, &tile_draw_rect))
 				continue;
 
+			tile = get_tile(layer->tile_cache, repo,
+				layer->tl_tile.x + j, layer->tl_tile.y + i, dl_if_absent);
+
 			src_x = tile_draw_rect.x - tile_rect.x;
 			src_y = tile_draw_rect.y - tile_rect.y;
 			dest_x = tile_draw_rect.x;
@@ -345,12 +402,8 @@ static void map_update_tile_pixbuf(map_view_tile_layer_t *layer, gboolean is_fg,
 						GDK_RGB_DITHER_MAX, pixel, gdk_pixbuf_get_rowstride (tile->pixbuf));
 				}
 #endif
-				if (! tile->cached) {
-					g_object_unref(tile->pixbuf);
-					tile->pixbuf = NULL;
-					free(tile);
-					tile = NULL;
-				}
+				tile_release(tile);
+				tile = NULL;
 			} else {
 				gdk_draw_rectangle (g_view.pixmap, gc, TRUE, dest_x, dest_y,
 					tile_draw_rect.width, tile_draw_rect.height);
@@ -491,6 +544,142 @@ static void map_invalidate_pixbuf(GdkRectangle *area, gboolean update_fg,
 		g_view.tile_pixbuf_valid = FALSE;
 	}
 }
+
+/**
+ * Called by tile loader threads: draw the loaded tile to layer's pixbuf,
+ * re-compose overlay, and invalidate only that tile's rectangle.
+ */
+void map_tile_loaded_callback_func(map_repo_t *repo, int zoom, int x, int y)
+{
+	GdkRectangle area;
+
+	LOCK_UI();
+
+	map_view_tile_layer_t *layer = map_find_tile_area(repo, zoom, x, y, &area);
+	if (! layer)
+		goto END;
+
+	gboolean is_fg = (layer == &g_view.fglayer);
+	gboolean alpha_blending = g_view.tile_pixbuf_valid && TEST_ALPHA_BLENDING(zoom);
+
+	/* bg layer is not shown */
+	if (! is_fg && ! alpha_blending)
+		goto END;
+
+	tile_t *tile = tilecache_acquire(layer->tile_cache, repo, zoom, x, y);
+	if (! tile)
+		goto END;
+
+	gdk_draw_pixbuf (g_view.pixmap, g_context.drawingarea_bggc, tile->pixbuf,
+		area.x - (x * TILE_SIZE - layer->tl_pixel.x), area.y - (y * TILE_SIZE - layer->tl_pixel.y),
+		area.x, area.y, area.width, area.height, GDK_RGB_DITHER_NONE, -1, -1);
+
+	tile_release(tile);
+
+	gdk_pixbuf_get_from_drawable (layer->tile_pixbuf, g_view.pixmap, NULL,
+		area.x, area.y, area.x, area.y, area.width, area.height);
+
+	if (alpha_blending)
+		map_overlay_alpha_blending(&area);
+
+	gtk_widget_queue_draw_area(drawingarea, area.x, area.y, area.width, area.height);
+
+END:
+
+	UNLOCK_UI();
+}
+
+/* don't predict from GPS velocity when almost stopped, m/s */
+#define PREFETCH_MIN_SPEED	1.0
+/* sin(22.5 degree): ignore minor component of motion direction */
+#define PREFETCH_MIN_SIN	0.38
+
+/**
+ * Predict motion direction of the view: from GPS velocity while tracking with
+ * cursor kept in view, else from last pan. Return FALSE if unknown.
+ */
+static gboolean map_predict_motion(double *dx, double *dy)
+{
+	if (POLL_STATE_TEST(RUNNING) && g_context.cursor_in_view &&
+		! isnan(g_gpsdata.speed_2d) && ! isnan(g_gpsdata.heading_2d) &&
+		g_gpsdata.speed_2d >= PREFETCH_MIN_SPEED) {
+		/* heading: clockwise from north, tile y grows southward */
+		double rad = g_gpsdata.heading_2d * M_PI / 180;
+		*dx = sin(rad);
+		*dy = -cos(rad);
+		return TRUE;
+	}
+
+	if (pan_vector.x == 0 && pan_vector.y == 0)
+		return FALSE;
+
+	*dx = pan_vector.x;
+	*dy = pan_vector.y;
+	return TRUE;
+}
+
+/**
+ * Queue the next ring of tiles in direction (<sx>, <sy>), each is -1, 0 or 1.
+ * Prefetched tiles must not evict visible ones, so the count is bounded by
+ * the free part of tile cache budget.
+ */
+static void map_prefetch_layer(map_view_tile_layer_t *layer, int sx, int sy)
+{
+	map_repo_t *repo = layer->repo;
+	int max_tile_no = (1 << repo->zoom);
+	int limit = layer->tile_cache->budget / TILE_DECODED_BYTES -
+		layer->tile_rows * layer->tile_cols;
+	int x, y;
+
+	/* column band, includes the corner */
+	if (sx != 0) {
+		x = (sx > 0)? layer->br_tile.x + 1 : layer->tl_tile.x - 1;
+		int y0 = layer->tl_tile.y - (sy < 0);
+		int y1 = layer->br_tile.y + (sy > 0);
+		if (x >= 0 && x < max_tile_no) {
+			for (y = y0; y <= y1 && limit > 0; y++) {
+				if (y >= 0 && y < max_tile_no) {
+					tile_loader_prefetch(layer->tile_cache, repo, repo->zoom, x, y);
+					--limit;
+				}
+			}
+		}
+	}
+
+	/* row band */
+	if (sy != 0) {
+		y = (sy > 0)? layer->br_tile.y + 1 : layer->tl_tile.y - 1;
+		if (y >= 0 && y < max_tile_no) {
+			for (x = layer->tl_tile.x; x <= layer->br_tile.x && limit > 0; x++) {
+				tile_loader_prefetch(layer->tile_cache, repo, repo->zoom, x, y);
+				--limit;
+			}
+		}
+	}
+}
+
+/**
+ * Replace pending prefetches with the ones of current prediction.
+ */
+static void map_prefetch()
+{
+	double dx, dy;
+
+	tile_loader_cancel_prefetch();
+
+	if (! map_predict_motion(&dx, &dy))
+		return;
+
+	double len = sqrt(dx * dx + dy * dy);
+	int sx = (fabs(dx) >= PREFETCH_MIN_SIN * len)? (dx > 0? 1 : -1) : 0;
+	int sy = (fabs(dy) >= PREFETCH_MIN_SIN * len)? (dy > 0? 1 : -1) : 0;
+
+	map_prefetch_layer(&g_view.fglayer, sx, sy);
+
+	if (g_view.tile_pixbuf_valid)
+		map_prefetch_layer(&g_view.bglayer, sx, sy);
+}
+
 /**
  * Call this function when the backend tile_pixmap needs to be re-constructed.
  */
@@ -500,6 +689,8 @@ void map_invalidate_view(gboolean redraw)
 		map_invalidate_pixbuf(NULL, TRUE, TRUE, g_context.dl_if_absent);
 		/* For "keep cursor in view" */
 		poll_ui_on_view_range_changed();
+		/* after visible tiles are requested */
+		map_prefetch();
 	} else {
 		gdk_draw_rectangle (drawingarea->window, g_context.drawingarea_bggc,
 			TRUE, 0, 0, g_view.width, g_view.height);
@@ -577,6 +768,28 @@ static void zoom_button_released(GtkWidget *widget, gpointer data)
 	stop = TRUE;
 }
 
+/**
+ * Per layer tile cache budget (bytes).
+ * If user does not configure it, it is sized to hold all tiles that may be
+ * partially visible in current view, plus a ring of prefetch margin.
+ */
+static void map_update_tile_cache_budget()
+{
+	int budget;
+
+	if (g_cfg->tile_cache_kb > 0) {
+		budget = g_cfg->tile_cache_kb * 1024;
+	} else {
+		int margin = TILE_CACHE_PREFETCH_MARGIN << 1;
+		int cols = (g_view.width + TILE_SIZE - 1) / TILE_SIZE + 1 + margin;
+		int rows = (g_view.height + TILE_SIZE - 1) / TILE_SIZE + 1 + margin;
+		budget = cols * rows * TILE_DECODED_BYTES;
+	}
+
+	tilecache_set_budget(g_view.fglayer.tile_cache, budget);
+	tilecache_set_budget(g_view.bglayer.tile_cache, budget);
+}
+
 static gboolean drawing_area_configure_event (GtkWidget *widget, GdkEventConfigure *evt, gpointer data)
 {
 	static int w = 0, h = 0;
@@ -584,6 +797,8 @@ static gboolean drawing_area_configure_event (GtkWidget *widget, GdkEventConfigu
 	g_view.width = evt->width;
 	g_view.height = evt->height;
 
+	map_update_tile_cache_budget();
+
 	/* create with screen display size to avoid frequently create/destroy.
 	 * User may change display orientation */
 	GdkScreen *screen = gdk_screen_get_default();
@@ -839,6 +1054,8 @@ static void mouse_released(point_t point, guint time)
 
 	g_view.fglayer.center_pixel.x = center_x;
 	g_view.fglayer.center_pixel.y = center_y;
+	pan_vector.x = -diff_x;
+	pan_vector.y = -diff_y;
 	g_view.center_wgs84 = tilepixel_to_wgs84(g_view.fglayer.center_pixel,
 		g_view.fglayer.repo->zoom, g_view.fglayer.repo);
 
@@ -876,8 +1093,11 @@ gboolean map_init()
 	}
 
 	/* tile cache */
-	g_view.fglayer.tile_cache = tilecache_new(TILE_CACHE_CAPACITY);
-	g_view.bglayer.tile_cache = tilecache_new(TILE_CACHE_CAPACITY);
+	g_view.fglayer.tile_cache = tilecache_new(TILE_CACHE_DEFAULT_BUDGET);
+	g_view.bglayer.tile_cache = tilecache_new(TILE_CACHE_DEFAULT_BUDGET);
+
+	int l2_kb = (g_cfg->tile_l2_cache_kb > 0)? g_cfg->tile_l2_cache_kb : TILE_L2_CACHE_DEFAULT_KB;
+	g_view.blob_cache = tilecache_l2_new(l2_kb * 1024);
 
 	g_view.pos_wgs84.lat = g_cfg->last_lat;
 	g_view.pos_wgs84.lon = g_cfg->last_lon;
@@ -0,0 +1,465 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "omgps.h"
+#include "tile.h"
+#include "util.h"
+
+/**
+ * Offline tile bundle: tiles of one map repository in a bbox and zoom range,
+ * packed into a single file, so that an area can be prepared on a desktop and
+ * copied to the device (or shared) instead of being downloaded tile by tile.
+ *
+ * Export and import run headless, see "omgps --export-tiles / --import-tiles".
+ *
+ * File layout (host byte order, like tiles.pack):
+ *
+ *   header          bundle_header_t
+ *   chunks          zlib deflated, each one holds the image bytes of a run of
+ *                   tiles, about BUNDLE_CHUNK_SIZE bytes before compression.
+ *   chunk table     bundle_chunk_t[chunk_count], at <index_offset>
+ *   tile index      bundle_tile_t[tile_count], right after chunk table,
+ *                   sorted by (zoom, x, y).
+ *
+ * Import reads the index first, and a chunk is only inflated if some of its tiles
+ * are not in store yet (memory lookup, see tile_store_exists()).
+ */
+
+#define BUNDLE_MAGIC		"OMGPSBDL"
+#define BUNDLE_VERSION		1
+#define BUNDLE_CHUNK_SIZE	(256 * 1024)
+
+typedef struct __bundle_header_t
+{
+	char magic[8];
+	guint32 version;
+	guint32 tile_count;
+	guint32 chunk_count;
+	guint32 reserved;
+	guint64 index_offset;
+	/* image type of the map, e.g., "png", NUL padded */
+	char image_type[8];
+} bundle_header_t;
+
+typedef struct __bundle_chunk_t
+{
+	guint64 offset;
+	guint32 comp_len;
+	guint32 raw_len;
+} bundle_chunk_t;
+
+typedef struct __bundle_tile_t
+{
+	guint32 zoom;
+	guint32 x;
+	guint32 y;
+	guint32 chunk;
+	/* offset in the inflated chunk */
+	guint32 offset;
+	guint32 len;
+} bundle_tile_t;
+
+static gboolean write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *)buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return FALSE;
+		}
+		p += n;
+		len -= n;
+	}
+	return TRUE;
+}
+
+static gboolean read_all(int fd, void *buf, size_t len, off_t offset)
+{
+	char *p = (char *)buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = pread(fd, p, len, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return FALSE;
+		p += n;
+		len -= n;
+		offset += n;
+	}
+	return TRUE;
+}
+
+/**
+ * Deflate <raw> and append to <fd>, record it as the <chunk>th chunk.
+ */
+static gboolean write_chunk(int fd, guint64 *file_offset, const guchar *raw, int raw_len,
+	bundle_chunk_t *chunk)
+{
+	uLongf comp_len = compressBound(raw_len);
+	guchar *comp = (guchar *)g_malloc(comp_len);
+	gboolean ret = FALSE;
+
+	if (compress2(comp, &comp_len, raw, raw_len, Z_BEST_COMPRESSION) != Z_OK) {
+		log_error("tile bundle: compress chunk failed");
+		goto END;
+	}
+
+	if (! write_all(fd, comp, comp_len)) {
+		log_error("tile bundle: write chunk failed: %s", strerror(errno));
+		goto END;
+	}
+
+	chunk->offset = *file_offset;
+	chunk->comp_len = comp_len;
+	chunk->raw_len = raw_len;
+	*file_offset += comp_len;
+
+	ret = TRUE;
+
+END:
+
+	g_free(comp);
+	return ret;
+}
+
+/**
+ * Export tiles of <repo> within [<min_zoom>, <max_zoom>] and the bbox whose top left
+ * and bottom right corners are <tl_wgs84> and <br_wgs84> to <path>.
+ * Only tiles that are in store are exported, nothing is downloaded. Tiles are
+ * peeked, so the export doesn't make them recently used for the quota.
+ * Return number of exported tiles, or -1 on error.
+ */
+int tile_bundle_export(map_repo_t *repo, const char *path, int min_zoom, int max_zoom,
+	coord_t tl_wgs84, coord_t br_wgs84)
+{
+	bundle_header_t header;
+	bundle_chunk_t *chunks = NULL;
+	bundle_tile_t *tiles = NULL;
+	int chunk_count = 0, chunk_bound = 0;
+	int tile_count = 0, tile_bound = 0;
+	guchar *raw = NULL;
+	int raw_len = 0;
+	guint64 file_offset;
+	int zoom, x, y, len;
+	guchar *data;
+	gboolean absent;
+	point_t tl_tile, br_tile;
+	int ret = -1;
+
+	char tmp_path[256];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		log_error("tile bundle: unable to create file: %s, error=%s", tmp_path, strerror(errno));
+		return -1;
+	}
+
+	/* placeholder, rewritten at last */
+	memset(&header, 0, sizeof(header));
+	if (! write_all(fd, &header, sizeof(header)))
+		goto END;
+	file_offset = sizeof(header);
+
+	raw = (guchar *)g_malloc(BUNDLE_CHUNK_SIZE);
+
+	for (zoom = min_zoom; zoom <= max_zoom; zoom++) {
+		int max_tile_no = (1 << zoom) - 1;
+
+		tl_tile = wgs84_to_tile(tl_wgs84, zoom, repo);
+		br_tile = wgs84_to_tile(br_wgs84, zoom, repo);
+
+		tl_tile.x = MIN(MAX(tl_tile.x, 0), max_tile_no);
+		tl_tile.y = MIN(MAX(tl_tile.y, 0), max_tile_no);
+		br_tile.x = MIN(MAX(br_tile.x, 0), max_tile_no);
+		br_tile.y = MIN(MAX(br_tile.y, 0), max_tile_no);
+
+		/* x then y: the index is sorted by (zoom, x, y) as it is written */
+		for (x = tl_tile.x; x <= br_tile.x; x++) {
+			for (y = tl_tile.y; y <= br_tile.y; y++) {
+
+				if (! tile_store_exists(repo, zoom, x, y))
+					continue;
+
+				data = tile_store_peek(repo, zoom, x, y, &len, &absent);
+				if (! data) {
+					if (! absent)
+						log_warn("tile bundle: read tile failed: zoom=%d, x=%d, y=%d", zoom, x, y);
+					continue;
+				}
+
+				/* flush full chunk, a large tile gets a chunk of its own */
+				if (raw_len > 0 && raw_len + len > BUNDLE_CHUNK_SIZE) {
+					if (chunk_count == chunk_bound) {
+						chunk_bound = chunk_bound? chunk_bound * 2 : 64;
+						chunks = (bundle_chunk_t *)g_realloc(chunks, sizeof(bundle_chunk_t) * chunk_bound);
+					}
+					if (! write_chunk(fd, &file_offset, raw, raw_len, &chunks[chunk_count])) {
+						g_free(data);
+						goto END;
+					}
+					++chunk_count;
+					raw_len = 0;
+				}
+
+				if (len > BUNDLE_CHUNK_SIZE)
+					raw = (guchar *)g_realloc(raw, len);
+
+				memcpy(raw + raw_len, data, len);
+				g_free(data);
+
+				if (tile_count == tile_bound) {
+					tile_bound = tile_bound? tile_bound * 2 : 1024;
+					tiles = (bundle_tile_t *)g_realloc(tiles, sizeof(bundle_tile_t) * tile_bound);
+				}
+				tiles[tile_count].zoom = zoom;
+				tiles[tile_count].x = x;
+				tiles[tile_count].y = y;
+				tiles[tile_count].chunk = chunk_count;
+				tiles[tile_count].offset = raw_len;
+				tiles[tile_count].len = len;
+				++tile_count;
+
+				raw_len += len;
+			}
+		}
+	}
+
+	if (raw_len > 0) {
+		if (chunk_count == chunk_bound) {
+			chunk_bound = chunk_bound? chunk_bound + 1 : 1;
+			chunks = (bundle_chunk_t *)g_realloc(chunks, sizeof(bundle_chunk_t) * chunk_bound);
+		}
+		if (! write_chunk(fd, &file_offset, raw, raw_len, &chunks[chunk_count]))
+			goto END;
+		++chunk_count;
+	}
+
+	if ((chunk_count > 0 && ! write_all(fd, chunks, sizeof(bundle_chunk_t) * chunk_count)) ||
+		(tile_count > 0 && ! write_all(fd, tiles, sizeof(bundle_tile_t) * tile_count))) {
+		log_error("tile bundle: write index failed: %s", strerror(errno));
+		goto END;
+	}
+
+	memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+	header.version = BUNDLE_VERSION;
+	header.tile_count = tile_count;
+	header.chunk_count = chunk_count;
+	header.index_offset = file_offset;
+	strncpy(header.image_type, repo->image_type, sizeof(header.image_type));
+
+	if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || fsync(fd) < 0) {
+		log_error("tile bundle: write header failed: %s", strerror(errno));
+		goto END;
+	}
+
+	close(fd);
+	fd = -1;
+
+	if (rename(tmp_path, path) < 0) {
+		log_error("tile bundle: rename %s failed: %s", tmp_path, strerror(errno));
+		goto END;
+	}
+
+	ret = tile_count;
+
+END:
+
+	if (fd >= 0)
+		close(fd);
+	if (ret < 0)
+		unlink(tmp_path);
+
+	g_free(raw);
+	g_free(chunks);
+	g_free(tiles);
+
+	return ret;
+}
+
+/**
+ * Write image bytes of a tile into store, via the temp file as tile downloader does.
+ */
+static gboolean import_tile(map_repo_t *repo, bundle_tile_t *tile, const guchar *data)
+{
+	char path[256];
+	struct stat st;
+
+	if (! tile_store_tmp_path(repo, tile->zoom, tile->x, tile->y, path, sizeof(path)))
+		return FALSE;
+
+	char *dir = g_path_get_dirname(path);
+	if (stat(dir, &st) != 0 && g_mkdir_with_parents(dir, 0700) != 0) {
+		log_error("tile bundle: failed to mkdir: %s", dir);
+		g_free(dir);
+		return FALSE;
+	}
+	g_free(dir);
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		log_error("tile bundle: unable to open file: %s, error=%s", path, strerror(errno));
+		return FALSE;
+	}
+
+	gboolean ok = write_all(fd, data, tile->len);
+	close(fd);
+
+	if (! ok) {
+		log_error("tile bundle: write file failed: %s, error=%s", path, strerror(errno));
+		unlink(path);
+		return FALSE;
+	}
+
+	return tile_store_commit(repo, tile->zoom, tile->x, tile->y, path);
+}
+
+/**
+ * Import tiles in bundle file <path> into store of <repo>. Tiles that are already
+ * in store are skipped, the number of them is set to <skipped>.
+ * Return number of imported tiles, or -1 on error.
+ */
+int tile_bundle_import(map_repo_t *repo, const char *path, int *skipped)
+{
+	bundle_header_t header;
+	bundle_chunk_t *chunks = NULL;
+	bundle_tile_t *tiles = NULL;
+	gboolean *wanted = NULL;
+	guchar *comp = NULL, *raw = NULL;
+	struct stat st;
+	int i, j, imported = 0;
+	int ret = -1;
+
+	*skipped = 0;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		log_error("tile bundle: unable to open file: %s, error=%s", path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0 || ! read_all(fd, &header, sizeof(header), 0) ||
+		memcmp(header.magic, BUNDLE_MAGIC, sizeof(header.magic)) != 0) {
+		log_error("tile bundle: not a tile bundle: %s", path);
+		goto END;
+	}
+
+	if (header.version != BUNDLE_VERSION) {
+		log_error("tile bundle: unsupported version: %u", header.version);
+		goto END;
+	}
+
+	if (strncmp(header.image_type, repo->image_type, sizeof(header.image_type)) != 0) {
+		log_error("tile bundle: image type mismatch, bundle=%.8s, map=%s",
+			header.image_type, repo->image_type);
+		goto END;
+	}
+
+	guint64 index_len = (guint64)sizeof(bundle_chunk_t) * header.chunk_count +
+		(guint64)sizeof(bundle_tile_t) * header.tile_count;
+
+	if (header.index_offset < sizeof(header) || header.index_offset + index_len != st.st_size) {
+		log_error("tile bundle: broken index: %s", path);
+		goto END;
+	}
+
+	if (header.tile_count == 0) {
+		ret = 0;
+		goto END;
+	}
+
+	chunks = (bundle_chunk_t *)g_malloc(sizeof(bundle_chunk_t) * header.chunk_count);
+	tiles = (bundle_tile_t *)g_malloc(sizeof(bundle_tile_t) * header.tile_count);
+
+	if (! read_all(fd, chunks, sizeof(bundle_chunk_t) * header.chunk_count, header.index_offset) ||
+		! read_all(fd, tiles, sizeof(bundle_tile_t) * header.tile_count,
+			header.index_offset + sizeof(bundle_chunk_t) * header.chunk_count)) {
+		log_error("tile bundle: read index failed: %s", path);
+		goto END;
+	}
+
+	/* validate all entries before touching the store */
+	for (i=0; i<header.chunk_count; i++) {
+		if (chunks[i].offset < sizeof(header) ||
+			chunks[i].offset + chunks[i].comp_len > header.index_offset) {
+			log_error("tile bundle: broken chunk table: %s", path);
+			goto END;
+		}
+	}
+
+	for (i=0; i<header.tile_count; i++) {
+		bundle_tile_t *t = &tiles[i];
+		if (t->zoom >= MAX_ZOOM_LEVELS || t->chunk >= header.chunk_count ||
+			(guint64)t->offset + t->len > chunks[t->chunk].raw_len ||
+			t->x >= (1U << t->zoom) || t->y >= (1U << t->zoom)) {
+			log_error("tile bundle: broken tile index: %s", path);
+			goto END;
+		}
+	}
+
+	/* tiles of a chunk are continuous in the index */
+	wanted = (gboolean *)g_malloc(sizeof(gboolean) * header.tile_count);
+
+	for (i=0; i<header.tile_count; ) {
+		int chunk_no = tiles[i].chunk;
+		gboolean need_chunk = FALSE;
+
+		for (j=i; j<header.tile_count && tiles[j].chunk == chunk_no; j++) {
+			wanted[j] = (tiles[j].zoom >= repo->min_zoom && tiles[j].zoom <= repo->max_zoom &&
+				! tile_store_exists(repo, tiles[j].zoom, tiles[j].x, tiles[j].y));
+			if (wanted[j])
+				need_chunk = TRUE;
+			else
+				++(*skipped);
+		}
+
+		if (need_chunk) {
+			bundle_chunk_t *c = &chunks[chunk_no];
+			uLongf raw_len = c->raw_len;
+
+			comp = (guchar *)g_realloc(comp, c->comp_len);
+			raw = (guchar *)g_realloc(raw, c->raw_len);
+
+			if (! read_all(fd, comp, c->comp_len, c->offset) ||
+				uncompress(raw, &raw_len, comp, c->comp_len) != Z_OK || raw_len != c->raw_len) {
+				log_error("tile bundle: broken chunk #%d: %s", chunk_no, path);
+				goto END;
+			}
+
+			for (; i<j; i++) {
+				if (! wanted[i])
+					continue;
+				if (import_tile(repo, &tiles[i], raw + tiles[i].offset))
+					++imported;
+				else
+					log_warn("tile bundle: import tile failed: zoom=%u, x=%u, y=%u",
+						tiles[i].zoom, tiles[i].x, tiles[i].y);
+			}
+		}
+
+		i = j;
+	}
+
+	ret = imported;
+
+END:
+
+	close(fd);
+
+	g_free(chunks);
+	g_free(tiles);
+	g_free(wanted);
+	g_free(comp);
+	g_free(raw);
+
+	return ret;
+}
@@ -3,47 +3,297 @@
 #include "omgps.h"
 
 /**
- * Cache tile image. The image is loaded into memory as a GDK object (pixbuf or image).
+ * Two level tile cache.
  *
- * According the nature of map navigating, this cache slots are organized into
- * a LRU linked list. The capacity is a fixed value.
- * (1) To find a slot, traverse the list from head to tail.
- * (2) To add a slot, find if it exists, if not add to tail, if no space, remove the head.
- * A normal jpg (256 * 256) map tile takes about (4~15 KB)
+ * L1 caches decoded tile images (pixbuf) per map view layer. A normal jpg (256 * 256)
+ * map tile takes about (4~15 KB) on disk, but about 192 KB (RGB) or 256 KB (RGBA)
+ * after being decoded, so the cache accounts rowstride * height of each pixbuf against
+ * its budget.
+ *
+ * L2 caches raw PNG/JPEG bytes of recently used tiles of all map repos. A L1 miss
+ * decodes from L2 memory instead of reading flash storage. With the same memory
+ * budget, L2 keeps about 20 times more tiles than L1.
+ *
+ * Both levels share the same engine. Entries embed a tilecache_node_t, indexed by
+ * a hash table keyed on (repo, zoom, x, y), and linked into a doubly linked recency
+ * list, so:
+ * (1) To find an entry, hash the key and walk the (short) bucket chain, then move the
+ *     entry to the tail of the recency list.
+ * (2) To add an entry, evict from head until the new one fits into the byte budget,
+ *     link new entry to bucket and tail.
+ * All these operations are O(1) per entry.
+ *
+ * L1 tiles are reference counted, so tiles can be drawn, decoded or prefetched by
+ * different threads without holding the GDK lock. tilecache_acquire() returns a
+ * reference that must be dropped with tile_release(). Eviction only unlinks the
+ * tile from the cache and drops the reference of the cache.
+ *
+ * A negative lookup cache remembers tiles that are known to be absent on disk or
+ * being downloaded, so repeated redraws of a missing area don't touch storage,
+ * network interfaces or Python. It's a direct-mapped table: a colliding entry
+ * simply replaces the old one. Entries expire, and are cleared when downloaded.
+ *
+ * Identical tile images (sea, empty land, "no imagery") are decoded once: decoded
+ * pixbufs are indexed by content hash of the raw image in a small direct-mapped
+ * table of weak references, a tile with the same bytes shares the pixbuf. Only
+ * decoding is saved: each tile is accounted the full pixbuf size, as caches of
+ * layers have their own budgets and a sharer may outlive the tile it shares with.
  *
  * Call new_tilecache when start or map repo is changed at runtime.
  */
 
-typedef struct __tilecache_slot_t
+#define MIN_BUCKET_COUNT	16
+
+static tile_shared_pixbuf_t shared_slots[TILE_SHARED_PIXBUF_SLOTS];
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static tile_absent_t absent_slots[TILE_ABSENT_SLOTS];
+static pthread_mutex_t absent_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* usual size of a raw tile image */
+#define TILE_BLOB_BYTES		(10 * 1024)
+
+/**
+ * The new tile holds one reference of the caller. It takes over <pixbuf>.
+ */
+tile_t* tile_new(map_repo_t *repo, int zoom, int x, int y, GdkPixbuf *pixbuf)
 {
-	tile_t *tile;
-	struct __tilecache_slot_t *next;
-} tilecache_slot_t;
+	/* links are zeroed out by calloc() */
+	tile_t *tile = (tile_t*) calloc(1, sizeof(tile_t));
+	if (! tile)
+		return NULL;
+
+	tile->node.repo = repo;
+	tile->node.zoom = zoom;
+	tile->node.x = x;
+	tile->node.y = y;
+	tile->pixbuf = pixbuf;
+	tile->refcount = 1;
+
+	return tile;
+}
 
-static void free_slot_tile(tile_t *tile)
+void tile_release(tile_t *tile)
 {
-	assert(tile);
+	assert(tile && g_atomic_int_get(&tile->refcount) > 0);
+
+	if (! g_atomic_int_dec_and_test(&tile->refcount))
+		return;
 
 	if (tile->pixbuf)
 		g_object_unref(tile->pixbuf);
 	tile->pixbuf = NULL;
-	tile->cached = FALSE;
 	free(tile);
 }
 
-tilecache_t * tilecache_new(int capacity)
+static void tile_release_func(tilecache_node_t *node)
+{
+	tile_release((tile_t *)node);
+}
+
+static void blob_release_func(tilecache_node_t *node)
+{
+	tile_blob_t *blob = (tile_blob_t *)node;
+	g_free(blob->data);
+	free(blob);
+}
+
+static inline guint hash_key(map_repo_t *repo, int zoom, int x, int y)
+{
+	guint h = (guint)((gulong)repo >> 4);
+	h = h * 31 + (guint)zoom;
+	h = h * 0x9E3779B1 + (guint)x;
+	h = h * 0x85EBCA77 + (guint)y;
+	return h ^ (h >> 15);
+}
+
+#define BUCKET_OF(cache, repo, zoom, x, y) \
+	(&((cache)->buckets[hash_key(repo, zoom, x, y) & ((cache)->bucket_count - 1)]))
+
+static inline void lru_unlink(tilecache_t *cache, tilecache_node_t *node)
+{
+	if (node->lru_prev)
+		node->lru_prev->lru_next = node->lru_next;
+	else
+		cache->head = node->lru_next;
+
+	if (node->lru_next)
+		node->lru_next->lru_prev = node->lru_prev;
+	else
+		cache->tail = node->lru_prev;
+
+	node->lru_prev = node->lru_next = NULL;
+}
+
+static inline void lru_append(tilecache_t *cache, tilecache_node_t *node)
+{
+	node->lru_next = NULL;
+	node->lru_prev = cache->tail;
+
+	if (cache->tail)
+		cache->tail->lru_next = node;
+	else
+		cache->head = node;
+
+	cache->tail = node;
+}
+
+/**
+ * Return the address of the link that points to the matched entry,
+ * or the address of the terminating NULL link of the bucket chain.
+ */
+static inline tilecache_node_t** hash_find(tilecache_t *cache, map_repo_t *repo,
+	int zoom, int x, int y)
+{
+	tilecache_node_t **link = BUCKET_OF(cache, repo, zoom, x, y);
+
+	for (; *link; link = &((*link)->hash_next)) {
+		tilecache_node_t *n = *link;
+		if (n->x == x && n->y == y && n->zoom == zoom && n->repo == repo)
+			break;
+	}
+
+	return link;
+}
+
+static inline int buckets_for_budget(tilecache_t *cache, int budget)
+{
+	/* keep load factor <= 0.5 */
+	int n = MIN_BUCKET_COUNT;
+	int count = budget / cache->entry_bytes + 1;
+	while (n < (count << 1))
+		n <<= 1;
+	return n;
+}
+
+/**
+ * Re-link all entries into <n> buckets. Recency list is unchanged.
+ */
+static gboolean rehash(tilecache_t *cache, int n)
+{
+	tilecache_node_t **buckets = (tilecache_node_t **)calloc(n, sizeof(tilecache_node_t *));
+	if (! buckets)
+		return FALSE;
+
+	free(cache->buckets);
+	cache->buckets = buckets;
+	cache->bucket_count = n;
+
+	tilecache_node_t *node, **link;
+	for (node = cache->head; node; node = node->lru_next) {
+		link = BUCKET_OF(cache, node->repo, node->zoom, node->x, node->y);
+		node->hash_next = *link;
+		*link = node;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Unlink from both hash chain and recency list, then drop the cache's reference.
+ * A L1 tile is freed here only if nobody else holds it.
+ */
+static void evict(tilecache_t *cache, tilecache_node_t *node)
+{
+	tilecache_node_t **link = hash_find(cache, node->repo, node->zoom, node->x, node->y);
+
+	assert(*link == node);
+	*link = node->hash_next;
+	node->hash_next = NULL;
+
+	lru_unlink(cache, node);
+	--cache->count;
+	cache->size -= node->size;
+
+	(*cache->release_func)(node);
+}
+
+/**
+ * Link <node> as the most recently used one, replace the old entry with the
+ * same key if any. Caller must hold cache lock.
+ */
+static void insert(tilecache_t *cache, tilecache_node_t *node)
+{
+	tilecache_node_t *old = *hash_find(cache, node->repo, node->zoom, node->x, node->y);
+	if (old)
+		evict(cache, old);
+
+	/* purge least recently used ones. A single entry is always admitted */
+	while (cache->size + node->size > cache->budget && cache->head)
+		evict(cache, cache->head);
+
+	tilecache_node_t **link = BUCKET_OF(cache, node->repo, node->zoom, node->x, node->y);
+	node->hash_next = *link;
+	*link = node;
+
+	lru_append(cache, node);
+	++cache->count;
+	cache->size += node->size;
+
+	/* entries smaller than estimated, keep chains short */
+	if (cache->count > cache->bucket_count)
+		rehash(cache, cache->bucket_count << 1);
+}
+
+/**
+ * Find and promote to the most recently used position.
+ * Caller must hold cache lock.
+ */
+static tilecache_node_t* lookup(tilecache_t *cache, map_repo_t *repo, int zoom, int x, int y)
+{
+	tilecache_node_t *node = *hash_find(cache, repo, zoom, x, y);
+
+	if (node && node != cache->tail) {
+		lru_unlink(cache, node);
+		lru_append(cache, node);
+	}
+
+	return node;
+}
+
+static tilecache_t * cache_new(int budget, int entry_bytes, tilecache_release_func_t release_func)
 {
 	tilecache_t *cache = (tilecache_t*)malloc(sizeof(tilecache_t));
-	if (cache) {
-		cache->count = 0;
-		cache->capacity = capacity;
-		cache->head = cache->tail = NULL;
-		pthread_mutex_init(&(cache->lock), NULL);
+	if (! cache)
+		return NULL;
+
+	cache->entry_bytes = entry_bytes;
+	cache->release_func = release_func;
+
+	int n = buckets_for_budget(cache, budget);
+
+	cache->buckets = (tilecache_node_t **)calloc(n, sizeof(tilecache_node_t *));
+	if (! cache->buckets) {
+		free(cache);
+		return NULL;
 	}
 
+	cache->bucket_count = n;
+	cache->count = 0;
+	cache->size = 0;
+	cache->budget = budget;
+	cache->head = cache->tail = NULL;
+	pthread_mutex_init(&(cache->lock), NULL);
+
 	return cache;
 }
 
+/**
+ * L1 cache, <budget>: bytes of decoded pixbufs
+ */
+tilecache_t * tilecache_new(int budget)
+{
+	return cache_new(budget, TILE_DECODED_BYTES, tile_release_func);
+}
+
+/**
+ * L2 cache, <budget>: bytes of raw tile images
+ */
+tilecache_t * tilecache_l2_new(int budget)
+{
+	return cache_new(budget, TILE_BLOB_BYTES, blob_release_func);
+}
+
 void tilecache_cleanup(tilecache_t *cache, gboolean free_cache)
 {
 	if (! cache)
@@ -51,87 +301,294 @@ void tilecache_cleanup(tilecache_t *cache, gboolean free_cache)
 
 	LOCK_MUTEX(&cache->lock);
 
-	tilecache_slot_t *slot = cache->head, *next;
-	while(slot) {
-		next = slot->next;
-		free_slot_tile(slot->tile);
-		free(slot);
-		slot = next;
+	tilecache_node_t *node = cache->head, *next;
+	while(node) {
+		next = node->lru_next;
+		node->hash_next = node->lru_prev = node->lru_next = NULL;
+		(*cache->release_func)(node);
+		node = next;
 	}
 	cache->head = cache->tail = NULL;
 	cache->count = 0;
+	cache->size = 0;
+	memset(cache->buckets, 0, sizeof(tilecache_node_t *) * cache->bucket_count);
 
 	UNLOCK_MUTEX(&cache->lock);
 
 	if (free_cache) {
 		pthread_mutex_destroy(&(cache->lock));
+		free(cache->buckets);
 		free(cache);
 	}
 }
 
-tile_t* tilecache_get(tilecache_t *cache, int zoom, int x, int y)
+/**
+ * Change budget at runtime, e.g., drawing area is resized or user configured.
+ * Least recently used entries are evicted if the cache is over the new budget.
+ */
+void tilecache_set_budget(tilecache_t *cache, int budget)
 {
 	LOCK_MUTEX(&cache->lock);
 
-	tilecache_slot_t *slot = cache->head;
-	tile_t *tile = NULL;
-	gboolean found = FALSE;
+	cache->budget = budget;
 
-	for (; slot; slot=slot->next) {
-		tile = slot->tile;
-		if (tile->zoom == zoom && tile->x == x && tile->y == y) {
-			found = TRUE;
-			//log_debug("tilecache_get: x=%d, y=%d, zoom=%d, found", x, y, zoom);
-			break;
-		}
-	}
+	while (cache->size > cache->budget && cache->head)
+		evict(cache, cache->head);
+
+	int n = buckets_for_budget(cache, budget);
+	if (n > cache->bucket_count && ! rehash(cache, n))
+		log_warn("tile cache: rehash to %d buckets failed", n);
 
 	UNLOCK_MUTEX(&cache->lock);
+}
 
-	if (found)
-		return tile;
-	else
-		return NULL;
+/**
+ * A hit is promoted to the most recently used position.
+ * Caller must call tile_release() on the returned tile.
+ */
+tile_t* tilecache_acquire(tilecache_t *cache, map_repo_t *repo, int zoom, int x, int y)
+{
+	LOCK_MUTEX(&cache->lock);
+
+	tile_t *tile = (tile_t *)lookup(cache, repo, zoom, x, y);
+	if (tile)
+		g_atomic_int_inc(&tile->refcount);
+
+	UNLOCK_MUTEX(&cache->lock);
+
+	return tile;
 }
 
+/**
+ * The cache takes its own reference, caller still holds its one.
+ * A provisional tile never replaces the real one.
+ */
 gboolean tilecache_add(tilecache_t *cache, tile_t *tile)
 {
+	gboolean ret = TRUE;
+
 	assert(tile && tile->pixbuf);
 
+	tile->node.size = gdk_pixbuf_get_rowstride(tile->pixbuf) *
+		gdk_pixbuf_get_height(tile->pixbuf);
+
 	LOCK_MUTEX(&cache->lock);
 
-	tilecache_slot_t *slot = NULL;
-
-	if (cache->count >= cache->capacity) {
-		/* purge head */
-		slot = cache->head;
-		cache->head = slot->next;
-		free_slot_tile(slot->tile);
-		--cache->count;
-		//log_debug("tilecache_add: x=%d, y=%d, zoom=%d, head purged", tile->x, tile->y, tile->zoom);
-	} else {
-		/* create new slot */
-		slot = (tilecache_slot_t *)malloc(sizeof(tilecache_slot_t));
-		//log_debug("tilecache_add: x=%d, y=%d, zoom=%d, new slot", tile->x, tile->y, tile->zoom);
+	if (tile->provisional) {
+		tile_t *old = (tile_t *)*hash_find(cache, tile->node.repo, tile->node.zoom,
+			tile->node.x, tile->node.y);
+		if (old && ! old->provisional) {
+			ret = FALSE;
+			goto END;
+		}
 	}
 
-	if (slot) {
-		tile->cached = TRUE;
-		slot->tile = tile;
-		slot->next = NULL;
+	g_atomic_int_inc(&tile->refcount);
+	insert(cache, &tile->node);
 
-		/* enqueue to tail */
-		if(cache->tail)
-			cache->tail->next = slot;
-		else
-			cache->head = cache->tail = slot;
+END:
+
+	UNLOCK_MUTEX(&cache->lock);
 
-		cache->tail = slot;
+	return ret;
+}
 
-		++cache->count;
+/**
+ * The cache takes over <data>, which must be allocated with g_malloc().
+ */
+gboolean tilecache_l2_put(tilecache_t *cache, map_repo_t *repo, int zoom, int x, int y,
+	guchar *data, int len)
+{
+	/* links are zeroed out by calloc() */
+	tile_blob_t *blob = (tile_blob_t *)calloc(1, sizeof(tile_blob_t));
+	if (! blob) {
+		g_free(data);
+		return FALSE;
 	}
 
+	blob->node.repo = repo;
+	blob->node.zoom = zoom;
+	blob->node.x = x;
+	blob->node.y = y;
+	blob->node.size = len;
+	blob->data = data;
+
+	LOCK_MUTEX(&cache->lock);
+	insert(cache, &blob->node);
+	UNLOCK_MUTEX(&cache->lock);
+
+	return TRUE;
+}
+
+/**
+ * Return a copy of the raw image (caller must g_free() it), or NULL if not cached.
+ * Copying a few KB is cheaper than holding the lock during decoding.
+ */
+guchar* tilecache_l2_get(tilecache_t *cache, map_repo_t *repo, int zoom, int x, int y, int *len)
+{
+	guchar *data = NULL;
+
+	LOCK_MUTEX(&cache->lock);
+
+	tile_blob_t *blob = (tile_blob_t *)lookup(cache, repo, zoom, x, y);
+	if (blob) {
+		data = (guchar *)g_memdup(blob->data, blob->node.size);
+		*len = blob->node.size;
+	}
+
+	UNLOCK_MUTEX(&cache->lock);
+
+	return data;
+}
+
+/**
+ * Drop the cached raw image of a tile, e.g., it is corrupt (see tile_scrub.c).
+ */
+void tilecache_l2_remove(tilecache_t *cache, map_repo_t *repo, int zoom, int x, int y)
+{
+	LOCK_MUTEX(&cache->lock);
+
+	tilecache_node_t *node = *hash_find(cache, repo, zoom, x, y);
+	if (node)
+		evict(cache, node);
+
+	UNLOCK_MUTEX(&cache->lock);
+}
+
+/**
+ * Mark the decoded tile outdated, e.g., a newer image is downloaded (see
+ * tile_meta.c). It's still drawn until it's loaded again, like a provisional one.
+ */
+void tilecache_invalidate(tilecache_t *cache, map_repo_t *repo, int zoom, int x, int y)
+{
+	LOCK_MUTEX(&cache->lock);
+
+	tile_t *tile = (tile_t *)*hash_find(cache, repo, zoom, x, y);
+	if (tile)
+		tile->provisional = TRUE;
+
 	UNLOCK_MUTEX(&cache->lock);
+}
+
+#define ABSENT_SLOT_OF(repo, zoom, x, y) \
+	(&absent_slots[hash_key(repo, zoom, x, y) & (TILE_ABSENT_SLOTS - 1)])
+
+#define ABSENT_MATCH(a, _repo, _zoom, _x, _y) \
+	((a)->x == (_x) && (a)->y == (_y) && (a)->zoom == (_zoom) && (a)->repo == (_repo))
+
+/**
+ * Return TRUE if the tile is known to be absent, so there is no need to look up
+ * storage again. If <dl_if_absent>, a tile that is absent locally but has not been
+ * tried to download is not seen as absent.
+ */
+gboolean tilecache_absent_test(map_repo_t *repo, int zoom, int x, int y, gboolean dl_if_absent)
+{
+	gboolean ret = FALSE;
+	tile_absent_t *a = ABSENT_SLOT_OF(repo, zoom, x, y);
+
+	LOCK_MUTEX(&absent_lock);
+
+	if (a->state != TILE_ABSENT_NONE && ABSENT_MATCH(a, repo, zoom, x, y)) {
+		if (a->expire <= time(NULL))
+			a->state = TILE_ABSENT_NONE;
+		else
+			ret = ! (dl_if_absent && a->state == TILE_ABSENT_LOCAL);
+	}
+
+	UNLOCK_MUTEX(&absent_lock);
+
+	return ret;
+}
+
+void tilecache_absent_set(map_repo_t *repo, int zoom, int x, int y, TILE_ABSENT_STATE state)
+{
+	tile_absent_t *a = ABSENT_SLOT_OF(repo, zoom, x, y);
+
+	LOCK_MUTEX(&absent_lock);
+
+	a->repo = repo;
+	a->zoom = zoom;
+	a->x = x;
+	a->y = y;
+	a->state = state;
+	a->expire = time(NULL) +
+		((state == TILE_ABSENT_DOWNLOADING)? TILE_ABSENT_DL_TTL : TILE_ABSENT_TTL);
+
+	UNLOCK_MUTEX(&absent_lock);
+}
+
+void tilecache_absent_clear(map_repo_t *repo, int zoom, int x, int y)
+{
+	tile_absent_t *a = ABSENT_SLOT_OF(repo, zoom, x, y);
+
+	LOCK_MUTEX(&absent_lock);
+
+	if (ABSENT_MATCH(a, repo, zoom, x, y))
+		a->state = TILE_ABSENT_NONE;
+
+	UNLOCK_MUTEX(&absent_lock);
+}
+
+/**
+ * FNV-1a, 64 bits.
+ */
+guint64 tile_content_hash(const guchar *data, int len)
+{
+	guint64 h = 0xCBF29CE484222325ULL;
+	int i;
+
+	for (i=0; i<len; i++) {
+		h ^= data[i];
+		h *= 0x100000001B3ULL;
+	}
+
+	return h;
+}
+
+static void shared_pixbuf_finalized(gpointer data, GObject *obj)
+{
+	tile_shared_pixbuf_t *slot = (tile_shared_pixbuf_t *)data;
+
+	LOCK_MUTEX(&shared_lock);
+	if (slot->pixbuf == (GdkPixbuf *)obj)
+		slot->pixbuf = NULL;
+	UNLOCK_MUTEX(&shared_lock);
+}
+
+/**
+ * Return a new reference of the decoded pixbuf of an image with the same
+ * <hash> and <len>, or NULL.
+ */
+GdkPixbuf * tilecache_shared_pixbuf_get(guint64 hash, int len)
+{
+	GdkPixbuf *pixbuf = NULL;
+	tile_shared_pixbuf_t *slot = &(shared_slots[hash & (TILE_SHARED_PIXBUF_SLOTS - 1)]);
+
+	LOCK_MUTEX(&shared_lock);
+	if (slot->pixbuf && slot->hash == hash && slot->len == len)
+		pixbuf = (GdkPixbuf *)g_object_ref(slot->pixbuf);
+	UNLOCK_MUTEX(&shared_lock);
+
+	return pixbuf;
+}
+
+/**
+ * Index a decoded <pixbuf>, no reference is taken.
+ */
+void tilecache_shared_pixbuf_put(guint64 hash, int len, GdkPixbuf *pixbuf)
+{
+	tile_shared_pixbuf_t *slot = &(shared_slots[hash & (TILE_SHARED_PIXBUF_SLOTS - 1)]);
+
+	LOCK_MUTEX(&shared_lock);
+
+	if (slot->pixbuf != pixbuf) {
+		if (slot->pixbuf)
+			g_object_weak_unref(G_OBJECT(slot->pixbuf), shared_pixbuf_finalized, slot);
+		g_object_weak_ref(G_OBJECT(pixbuf), shared_pixbuf_finalized, slot);
+		slot->pixbuf = pixbuf;
+	}
+	slot->hash = hash;
+	slot->len = len;
 
-	return (slot != NULL);
+	UNLOCK_MUTEX(&shared_lock);
 }
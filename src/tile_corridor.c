@@ -0,0 +1,211 @@
+#include <math.h>
+
+#include "omgps.h"
+#include "tile.h"
+#include "util.h"
+
+/**
+ * Tiles along a path (e.g., a recorded track), see batch_download_prepare().
+ *
+ * The path is buffered by <buffer_m> metres: a tile is in the corridor if some
+ * point of the path is within that distance to the tile. Distances are computed
+ * in pixels of each zoom level, each segment of the path is buffered with the
+ * scale (metres per pixel) of its endpoint nearer to a pole, so the corridor is
+ * never narrower than asked. Only tiles near each segment are tested, so the cost
+ * is proportional to the corridor, not to its bounding box.
+ */
+
+#define EARTH_CIRCUMFERENCE		(2 * M_PI * WGS84_SEMI_MAJOR_AXIS)
+/* metres per degree of latitude, the least one, at the equator */
+#define METRES_PER_DEGREE_LAT	110574.0
+/* mercator limit */
+#define MAX_LAT					85.0511
+
+static double sqr(double v)
+{
+	return v * v;
+}
+
+/**
+ * Square of distance from point (px, py) to segment (ax, ay) - (bx, by).
+ */
+static double point_seg_dist2(double px, double py, double ax, double ay, double bx, double by)
+{
+	double dx = bx - ax, dy = by - ay;
+	double len2 = dx * dx + dy * dy;
+	double t = 0;
+
+	if (len2 > 0) {
+		t = ((px - ax) * dx + (py - ay) * dy) / len2;
+		t = MIN(MAX(t, 0), 1);
+	}
+
+	return sqr(ax + t * dx - px) + sqr(ay + t * dy - py);
+}
+
+static double point_rect_dist2(double px, double py, double x0, double y0, double x1, double y1)
+{
+	double dx = (px < x0)? x0 - px : (px > x1)? px - x1 : 0;
+	double dy = (py < y0)? y0 - py : (py > y1)? py - y1 : 0;
+
+	return dx * dx + dy * dy;
+}
+
+/**
+ * Liang-Barsky: does segment cross rectangle (x0, y0) - (x1, y1)?
+ */
+static gboolean seg_hits_rect(double ax, double ay, double bx, double by,
+	double x0, double y0, double x1, double y1)
+{
+	double p[4] = { ax - bx, bx - ax, ay - by, by - ay };
+	double q[4] = { ax - x0, x1 - ax, ay - y0, y1 - ay };
+	double t0 = 0, t1 = 1, r;
+	int i;
+
+	for (i=0; i<4; i++) {
+		if (p[i] == 0) {
+			if (q[i] < 0)
+				return FALSE;
+			continue;
+		}
+		r = q[i] / p[i];
+		if (p[i] < 0)
+			t0 = MAX(t0, r);
+		else
+			t1 = MIN(t1, r);
+		if (t0 > t1)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static double seg_rect_dist2(double ax, double ay, double bx, double by,
+	double x0, double y0, double x1, double y1)
+{
+	double d;
+
+	if (seg_hits_rect(ax, ay, bx, by, x0, y0, x1, y1))
+		return 0;
+
+	/* closest points: an endpoint of the segment, or a corner of the rectangle */
+	d = MIN(point_rect_dist2(ax, ay, x0, y0, x1, y1), point_rect_dist2(bx, by, x0, y0, x1, y1));
+	d = MIN(d, point_seg_dist2(x0, y0, ax, ay, bx, by));
+	d = MIN(d, point_seg_dist2(x1, y0, ax, ay, bx, by));
+	d = MIN(d, point_seg_dist2(x0, y1, ax, ay, bx, by));
+	d = MIN(d, point_seg_dist2(x1, y1, ax, ay, bx, by));
+
+	return d;
+}
+
+/**
+ * Bounding box of the corridor: <path> buffered by <buffer_m> metres.
+ * Return FALSE if the path is empty.
+ */
+gboolean tile_corridor_bounds(const coord_t *path, int count, int buffer_m,
+	coord_t *tl_wgs84, coord_t *br_wgs84)
+{
+	double min_lat = 90, max_lat = -90, min_lon = 180, max_lon = -180;
+	double dlat, dlon, cos_lat;
+	int i;
+
+	if (count <= 0)
+		return FALSE;
+
+	for (i=0; i<count; i++) {
+		min_lat = MIN(min_lat, path[i].lat);
+		max_lat = MAX(max_lat, path[i].lat);
+		min_lon = MIN(min_lon, path[i].lon);
+		max_lon = MAX(max_lon, path[i].lon);
+	}
+
+	cos_lat = cos(MIN(MAX(fabs(min_lat), fabs(max_lat)), MAX_LAT) * M_PI / 180);
+	dlat = buffer_m / METRES_PER_DEGREE_LAT;
+	dlon = buffer_m / (METRES_PER_DEGREE_LAT * cos_lat);
+
+	tl_wgs84->lat = MIN(max_lat + dlat, MAX_LAT);
+	tl_wgs84->lon = MAX(min_lon - dlon, -180);
+	br_wgs84->lat = MAX(min_lat - dlat, -MAX_LAT);
+	br_wgs84->lon = MIN(max_lon + dlon, 180);
+
+	return TRUE;
+}
+
+/**
+ * Set bits of the tiles of a zoom level that are in the corridor: tile (x, y) of
+ * the range <tl_tile>, <cols> x <rows> is bit <first> + (x - tl_tile.x) * rows +
+ * (y - tl_tile.y) of <bits>, same as batch_level_t.
+ * Return number of tiles in the corridor.
+ */
+int tile_corridor_mark(map_repo_t *repo, const coord_t *path, int count, int buffer_m,
+	int zoom, point_t tl_tile, int cols, int rows, guint8 *bits, int first)
+{
+	double ax, ay, bx, by, r, r2, lat, t0, t1, ya, yb;
+	int i, cx, cy, cx1, cy1, index, num = 0;
+	point_t a, b;
+
+	/* metres per pixel at the equator */
+	double mpp = EARTH_CIRCUMFERENCE / ((double)TILE_SIZE * (1 << zoom));
+
+	if (count <= 0)
+		return 0;
+
+	b = wgs84_to_tilepixel(path[0], zoom, repo);
+
+	for (i=0; i<count; i++) {
+		a = b;
+		if (i + 1 < count)
+			b = wgs84_to_tilepixel(path[i+1], zoom, repo);
+		else if (count > 1)
+			break;
+
+		ax = a.x; ay = a.y;
+		bx = b.x; by = b.y;
+
+		lat = MAX(fabs(path[i].lat), fabs(path[MIN(i+1, count-1)].lat));
+		/* +1: pixels are rounded */
+		r = buffer_m / (mpp * cos(MIN(lat, MAX_LAT) * M_PI / 180)) + 1;
+		r2 = r * r;
+
+		cx = MAX((int)floor((MIN(ax, bx) - r) / TILE_SIZE), tl_tile.x);
+		cx1 = MIN((int)floor((MAX(ax, bx) + r) / TILE_SIZE), tl_tile.x + cols - 1);
+
+		for (; cx <= cx1; cx++) {
+			double x0 = (double)cx * TILE_SIZE, x1 = x0 + TILE_SIZE;
+
+			/* rows near the part of the segment over the column */
+			if (ax == bx) {
+				t0 = 0;
+				t1 = 1;
+			} else {
+				t0 = (x0 - r - ax) / (bx - ax);
+				t1 = (x1 + r - ax) / (bx - ax);
+				if (t0 > t1) {
+					double t = t0; t0 = t1; t1 = t;
+				}
+				t0 = MAX(t0, 0);
+				t1 = MIN(t1, 1);
+				if (t0 > t1)
+					continue;
+			}
+			ya = ay + t0 * (by - ay);
+			yb = ay + t1 * (by - ay);
+
+			cy = MAX((int)floor((MIN(ya, yb) - r) / TILE_SIZE), tl_tile.y);
+			cy1 = MIN((int)floor((MAX(ya, yb) + r) / TILE_SIZE), tl_tile.y + rows - 1);
+
+			for (; cy <= cy1; cy++) {
+				index = first + (cx - tl_tile.x) * rows + (cy - tl_tile.y);
+				if (bits[index >> 3] & (1 << (index & 7)))
+					continue;
+				if (seg_rect_dist2(ax, ay, bx, by, x0, (double)cy * TILE_SIZE,
+					x1, (double)(cy + 1) * TILE_SIZE) > r2)
+					continue;
+				bits[index >> 3] |= (1 << (index & 7));
+				++num;
+			}
+		}
+	}
+
+	return num;
+}
@@ -2,6 +2,8 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
 #include <sys/file.h>
 
 #include "omgps.h"
@@ -9,28 +11,12 @@
 #include "network.h"
 #include "util.h"
 
-#define MAX_IDLE_MS		10000
-
 static pthread_attr_t pthread_attr;
 static update_ui_thread_t update_ui_thread;
 
-static void * download_routine(void *args);
-static gboolean tile_downloader_create_thread(tile_downloader_t *td);
 static batch_dl_t *pending_free_list = NULL;
 static batch_dl_t *pending_free_list_tail = NULL;
 
-/**
- * Format tile fullpath to <buf>
- */
-gboolean format_tile_file_path(map_repo_t *repo, int zoom, int x, int y, char *buf, int buflen)
-{
-	if (snprintf(buf, buflen, "%s/%d/%d/%d.%s",	repo->dir, zoom, x, y, repo->image_type) <= 0) {
-		log_error("snprintf tile file path failed");
-		return FALSE;
-	}
-	return TRUE;
-}
-
 /**
  * we limit max un-finished batch
  */
@@ -46,293 +32,515 @@ gboolean batch_download_check(map_repo_t *repo)
 	return ret;
 }
 
-static inline gboolean test_image_header(char *dest, char *src, int n)
+static void report_error(const char *url, const char *err)
 {
-	int i;
-	for (i=0; i<n; i++) {
-		if (src[i] != dest[i])
-			return FALSE;
+	LOCK_UI();
+	batch_dl_report_error(strdup(url), strdup(err));
+	UNLOCK_UI();
+}
+
+/**
+ * Batch journal: <dir>/.batches/<name> of each unfinished batch, the region and
+ * zoom levels of the batch, then a bitmap of done tiles of its range.
+ * Bits of tiles already on disk, or out of the corridor of a corridor batch, are
+ * set when the batch is created, bits of
+ * downloaded tiles are written every BATCH_JOURNAL_CHECKPOINT tiles and on exit.
+ * There is no fsync: a bit lost on power failure costs an existence check (memory
+ * lookup) on resume, not a download. Failed tiles are tried again on resume.
+ * The file is removed when the batch is finished or canceled, unfinished batches
+ * are resumed by tile_downloader_module_init().
+ */
+
+#define JOURNAL_DIR		".batches"
+#define JOURNAL_MAGIC	"OMGPSBAT"
+
+typedef struct __batch_journal_head_t
+{
+	char magic[8];
+	coord_t tl_wgs84;
+	coord_t br_wgs84;
+	gint32 min_zoom;
+	gint32 max_zoom;
+	/* number of bits */
+	gint32 num_in_range;
+	/* buffer (metres) of corridor batch, 0: rectangle */
+	gint32 corridor_m;
+} batch_journal_head_t;
+
+#define JOURNAL_TEST(j, i) ((j)->bits[(i) >> 3] & (1 << ((i) & 7)))
+
+static void journal_init(batch_journal_t *j)
+{
+	j->path = NULL;
+	j->fd = -1;
+	j->bits = NULL;
+	j->bits_len = 0;
+	j->dirty_lo = G_MAXINT;
+	j->dirty_hi = -1;
+	j->pending = 0;
+}
+
+/**
+ * Write changed bits. NOTE: require lock of the downloader once the batch is queued.
+ */
+static void journal_flush(batch_journal_t *j)
+{
+	if (j->fd >= 0 && j->dirty_hi >= j->dirty_lo) {
+		int len = j->dirty_hi - j->dirty_lo + 1;
+		if (pwrite(j->fd, j->bits + j->dirty_lo, len,
+			sizeof(batch_journal_head_t) + j->dirty_lo) != len)
+			log_warn("batch journal: write %s failed", j->path);
+	}
+
+	j->dirty_lo = G_MAXINT;
+	j->dirty_hi = -1;
+	j->pending = 0;
+}
+
+static void journal_mark(batch_journal_t *j, int index)
+{
+	int i = index >> 3;
+
+	if (! j->bits || index < 0 || i >= j->bits_len)
+		return;
+
+	j->bits[i] |= (1 << (index & 7));
+	j->dirty_lo = MIN(j->dirty_lo, i);
+	j->dirty_hi = MAX(j->dirty_hi, i);
+
+	if (++(j->pending) >= BATCH_JOURNAL_CHECKPOINT)
+		journal_flush(j);
+}
+
+static gboolean journal_create(batch_dl_t *batch)
+{
+	batch_journal_t *j = &(batch->journal);
+	batch_journal_head_t head;
+	char path[256];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", batch->repo->dir, JOURNAL_DIR);
+	if (g_mkdir_with_parents(path, 0700) != 0)
+		goto FAIL;
+
+	snprintf(path, sizeof(path), "%s/%s/XXXXXX", batch->repo->dir, JOURNAL_DIR);
+	if ((fd = mkstemp(path)) < 0)
+		goto FAIL;
+
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, JOURNAL_MAGIC, sizeof(head.magic));
+	head.tl_wgs84 = batch->tl_wgs84;
+	head.br_wgs84 = batch->br_wgs84;
+	head.min_zoom = batch->min_zoom;
+	head.max_zoom = batch->max_zoom;
+	head.num_in_range = batch->num_in_range;
+	head.corridor_m = batch->corridor_m;
+
+	if (write(fd, &head, sizeof(head)) != sizeof(head) ||
+		write(fd, j->bits, j->bits_len) != j->bits_len ||
+		fsync(fd) < 0 || ! (j->path = strdup(path))) {
+		close(fd);
+		unlink(path);
+		goto FAIL;
 	}
+
+	j->fd = fd;
 	return TRUE;
+
+FAIL:
+
+	log_warn("batch journal: unable to create %s, batch can't be resumed", path);
+	return FALSE;
+}
+
+/**
+ * Write changed bits and close the journal, or remove it if <remove>.
+ */
+static void journal_close(batch_journal_t *j, gboolean remove)
+{
+	if (j->fd >= 0) {
+		if (! remove)
+			journal_flush(j);
+		close(j->fd);
+		if (remove)
+			unlink(j->path);
+	}
+
+	free(j->bits);
+	free(j->path);
+	journal_init(j);
 }
 
 /**
- * Donwload tile
+ * Prepare the temp file of <task> (see tile_store_tmp_path()), it's opened and
+ * locked to <*file_fd>.
+ * Return 1 if the tile should be downloaded, 0 if there is nothing to do, or < 0
+ * on local error (-5: no space). Called by download engine without lock.
  */
-static int download_tile(map_repo_t *repo, pthread_mutex_t *lock, dl_task_t *task)
+int tile_download_begin(map_repo_t *repo, dl_task_t *task, int *file_fd)
 {
-	char *path = strdup(task->path);
-	char *url = strdup(task->url);
 	int ret = -1;
-	gboolean unlocked = FALSE;
 	struct stat st;
-	char buf[256];
 	char *err = NULL;
 
-	snprintf(buf, sizeof(buf), "%s/%d/%d/",	repo->dir, task->zoom, task->x);
+	*file_fd = -1;
+
+	char *dir = g_path_get_dirname(task->path);
 
 	/* Mkdir if not exists */
-	if (stat(buf, &st) != 0 && g_mkdir_with_parents(buf, 0700) != 0) {
+	if (stat(dir, &st) != 0 && g_mkdir_with_parents(dir, 0700) != 0) {
+		g_free(dir);
 		err = "failed to parent mkdir";
 		goto END;
 	}
+	g_free(dir);
 
 	/* already exists, don't see this as error */
-	if (stat(path, &st) == 0) {
+	if (! task->refresh && tile_store_stat(repo, task->zoom, task->x, task->y) >= 0) {
 		ret = 0;
 		goto END;
 	}
 
-	/* NOTE: use temp file and rename, instead of override */
-	snprintf(buf, sizeof(buf), "%s.tmp", path);
+	if (! tile_quota_check_space(repo)) {
+		err = "no space left on device";
+		ret = -5;
+		goto END;
+	}
 
-	int fd = open(buf, O_WRONLY | O_CREAT, 0644);
+	/* NOTE: write to temp file then commit to store, instead of override */
+	int fd = open(task->path, O_WRONLY | O_CREAT, 0644);
 	if (fd < 0) {
-		err = "unable to open file";
+		err = (errno == ENOSPC)? "no space left on device" : "unable to open file";
 		goto END;
 	}
 
-	/* being processed by another thread, don't see this as error */
+	/* being processed by another process, don't see this as error */
 	if (flock(fd, LOCK_EX | LOCK_NB) < 0 &&	(errno == EWOULDBLOCK)) {
+		close(fd);
 		ret = 0;
 		goto END;
 	}
 
-	/* unlock */
-	unlocked = TRUE;
-	UNLOCK_MUTEX(lock);
+	/* left by an interrupted download */
+	if (ftruncate(fd, 0) < 0) {
+		flock(fd, LOCK_UN);
+		close(fd);
+		err = "unable to truncate file";
+		goto END;
+	}
 
-	http_get_result_t result;
-	http_get(url, fd, 15, 15, &result);
+	*file_fd = fd;
+	ret = 1;
 
-	flock(fd, LOCK_UN);
-	close(fd);
+END:
+
+	if (ret < 0 && err)
+		report_error(task->url, err);
+
+	return ret;
+}
 
-	ret = 0;
+/**
+ * Close the temp file, check the response and commit the tile to store.
+ * Return 0 on success, 1 if the tile is not modified (revalidated), or < 0 on error:
+ * -2 remote error, -3 bad content type, -4 commit failed.
+ */
+int tile_download_end(map_repo_t *repo, dl_task_t *task, int file_fd, http_get_result_t *result)
+{
+	int ret = 0;
+	char *err = NULL;
 
-	/* post processing */
+	flock(file_fd, LOCK_UN);
+	close(file_fd);
 
-	if (result.error_no != HTTP_GET_ERROR_NONE) {
-		err = result.err_buf;
+	if (result->error_no == HTTP_GET_ERROR_NOT_MODIFIED) {
+		unlink(task->path);
+		tile_meta_update(repo, task->zoom, task->x, task->y, result);
+		ret = 1;
+	} else if (result->error_no != HTTP_GET_ERROR_NONE) {
+		err = result->err_buf;
 		/* cancel the temp fie explicitly. If failed, OS will reclaim it */
-		unlink(buf);
+		unlink(task->path);
 		ret = -2;
 	} else {
 		gboolean bad = FALSE;
 
 		/* FIXME: (1) jpg/jpeg, (2) use enum instead of compare each one */
 		if (strcmp(repo->image_type, "png") == 0) {
-			if (strcmp(result.content_type, "image/png") != 0)
+			if (strcmp(result->content_type, "image/png") != 0)
 				bad = TRUE;
 		} else if (strcmp(repo->image_type, "jpg") == 0) {
-			if (strcmp(result.content_type, "image/jpg") != 0 &&
-				strcmp(result.content_type, "image/jpeg") != 0)
+			if (strcmp(result->content_type, "image/jpg") != 0 &&
+				strcmp(result->content_type, "image/jpeg") != 0)
 				bad = TRUE;
-        }
-
-    	if (bad) {
-    		unlink(buf);
-    		err = "bad image or image type is not expected";
-    		ret = -3;
-    	} else {
-			if (rename(buf, path) < 0) {
-				log_debug("%s: remame failed: %s", path, strerror(errno));
+		}
+
+		if (bad) {
+			unlink(task->path);
+			err = "bad image or image type is not expected";
+			ret = -3;
+		} else {
+			if (tile_store_commit(repo, task->zoom, task->x, task->y, task->path))
+				tile_meta_update(repo, task->zoom, task->x, task->y, result);
+			else
 				ret = -4;
-			}
-    	}
+		}
 	}
 
-END:
+	if (ret < 0 && err)
+		report_error(task->url, err);
 
-	if (! unlocked)
-		UNLOCK_MUTEX(lock);
+	return ret;
+}
 
-	if (ret != 0 && err) {
-		LOCK_UI();
-		batch_dl_report_error(strdup(url), strdup(err));
-		UNLOCK_UI();
+static void free_shares(tile_sched_entry_t *e)
+{
+	tile_sched_share_t *share, *next;
+
+	for (share = e->shares; share; share = next) {
+		next = share->next;
+		free(share);
 	}
+	e->shares = NULL;
+}
 
-	free(url);
-	free(path);
+/**
+ * Called by the scheduler on a task that is removed without being downloaded.
+ */
+static void drop_task(tile_sched_entry_t *e, void *arg)
+{
+	tile_downloader_t *td = (tile_downloader_t *)arg;
 
-	sleep_ms(DL_SLEEP_MS);
+	/* so tile loader can request it again when it comes back to view */
+	tilecache_absent_clear(td->repo, e->task.zoom, e->task.x, e->task.y);
 
-	return ret;
+	free_shares(e);
+	free(e->task.path);
+	free(e->task.url);
+	free(e);
 }
 
 /**
- * The behavior is similiar to pthread_cond_timedwait();
+ * Take the first task of the scheduler for download engine, if a download slot
+ * of the map and the host of the task are free. The slot of the map is put back
+ * with tile_downloader_put(), the slot of the host (<*host>) with dl_host_put().
+ * Return NULL if there is nothing to download now, <*wait_ms> is the time the
+ * host is held for (see dl_host_try_acquire()).
  */
-static void download_next_front(tile_downloader_t *td)
+tile_sched_entry_t * tile_downloader_take(tile_downloader_t *td, dl_host_t **host, int *wait_ms)
 {
-	front_task_t *ft, *next;
-	ft = td->front_tasks;
-	next = ft->next;
-	/* copy: ft will be freed  */
-	dl_task_t task = ft->task;
-	free(ft);
+	tile_sched_entry_t *e;
+
+	*host = NULL;
+	*wait_ms = 0;
+
+	LOCK_MUTEX(&(td->lock));
+
+	if (td->stop || td->active >= td->repo->dl_max_conns ||
+		! (e = tile_sched_peek(&(td->sched)))) {
+		e = NULL;
+		goto END;
+	}
 
-	ft = td->front_tasks = next;
-	if (! ft) {
-		td->front_tasks_tail= NULL;
-		td->front_task_count = 0;
+	/* NOTE: a held host also holds tasks of other hosts queued behind it */
+	if (! dl_host_try_acquire(e->task.url, td->repo->dl_max_conns, host, wait_ms)) {
+		e = NULL;
+		goto END;
 	}
 
-	/* will release lock before perform download */
-	download_tile(td->repo, &(td->lock), &task);
+	tile_sched_pop(&(td->sched));
+	++(td->active);
 
-	map_front_download_callback_func(td->repo, task.zoom, task.x, task.y);
+	//log_debug("task: zoom=%d, x=%d, y=%d", e->task.zoom, e->task.x, e->task.y);
 
-	/* lock again */
-	LOCK_MUTEX(&(td->lock));
+	if (e->batch) {
+		/* no tasks to be processed in this batch */
+		if (++(e->batch->cur_task_id) == e->batch->num_dl_total)
+			e->batch->state = BATCH_DL_STATE_FINISHING;
+		else
+			e->batch->state = BATCH_DL_STATE_PROCESSING;
+	}
+
+END:
 
-	free(task.path);
-	free(task.url);
-	task.path = NULL;
-	task.url = NULL;
+	UNLOCK_MUTEX(&(td->lock));
+
+	return e;
 }
 
-static inline void set_next_cur_batch(tile_downloader_t *td)
+/**
+ * Count a task of <batch> as done. Return TRUE if the batch is finished.
+ * NOTE: require lock.
+ */
+static gboolean batch_task_done(tile_downloader_t *td, batch_dl_t *batch, gboolean failed)
 {
-	if (! td->cur_batch)
-		return;
+	if (failed)
+		++(batch->num_dl_failed);
 
-	batch_dl_t *next = td->cur_batch->next;
-	if (next) {
-		td->cur_batch = next;
-		td->cur_batch->cur_task_id = 0;
-		td->cur_batch->state = BATCH_DL_STATE_PROCESSING;
-	} else {
-		td->cur_batch = NULL;
-	}
+	if (++(batch->num_dl_done) < batch->num_dl_total)
+		return FALSE;
+
+	batch->state = BATCH_DL_STATE_FINISHED;
+	--(td->unfinished_batch_count);
+	journal_close(&(batch->journal), TRUE);
+
+	return TRUE;
 }
 
-void download_cancel_batch(batch_dl_t *batch)
+/**
+ * Called by download engine when the task <e> taken with tile_downloader_take()
+ * is done, <ret> is the result of tile_download_begin() or tile_download_end().
+ * <e> is freed.
+ */
+void tile_downloader_done(tile_downloader_t *td, tile_sched_entry_t *e, int ret)
 {
-	tile_downloader_t *td = (tile_downloader_t *)batch->repo->downloader;
+	/* batch may be canceled, but it is not freed before module cleanup */
+	batch_dl_t *batch = e->batch;
+	gboolean front = e->front;
+	gboolean background = (e->base == TILE_SCHED_BACKGROUND);
+	tile_sched_share_t *share;
+	int finished = 0;
+
+	if (ret == 0 && (front || background)) {
+		map_front_download_callback_func(td->repo, e->task.zoom, e->task.x, e->task.y);
+	} else if (front && (ret == -2 || ret == -3)) {
+		/* remote error or bad content */
+		tilecache_absent_set(td->repo, e->task.zoom, e->task.x, e->task.y, TILE_ABSENT_REMOTE);
+	} else {
+		/* a revalidated tile (1) is already shown; after a local error (e.g., no
+		 * space or commit failed) the tile loader may request it again */
+		tilecache_absent_clear(td->repo, e->task.zoom, e->task.x, e->task.y);
+	}
 
 	LOCK_MUTEX(&(td->lock));
 
-	batch_dl_t *prev = batch->prev;
-	batch_dl_t *next = batch->next;
-	if (prev)
-		prev->next = next;
-	if (next)
-		next->prev = prev;
-	if (td->batches == batch)
-		td->batches = next;
-	if (td->batches_tail == batch)
-		td->batches_tail = prev;
-	batch->prev = batch->next = NULL;
+	if (batch && batch->state != BATCH_DL_STATE_CANCELED) {
+		/* update the batch that contains the task */
+		if (ret >= 0)
+			journal_mark(&(batch->journal), e->task.index);
 
-	if (batch->tasks) {
-		int i;
-		for (i = 0; i<batch->num_dl_total; i++) {
-			if (batch->tasks[i].path) {
-				free(batch->tasks[i].path);
-				batch->tasks[i].path = NULL;
-			}
-			if (batch->tasks[i].url) {
-				free(batch->tasks[i].url);
-				batch->tasks[i].url = NULL;
-			}
-		}
-		free(batch->tasks);
-		batch->tasks = NULL;
+		finished += batch_task_done(td, batch, ret < 0);
 	}
 
-	/* download threads may hold reference to this batch, can't free */
-
-	if (batch == td->cur_batch) {
-		if (next) {
-			td->cur_batch = next;
-			td->cur_batch->cur_task_id = 0;
-			td->cur_batch->state = BATCH_DL_STATE_PROCESSING;
-		} else {
-			td->cur_batch = NULL;
-		}
-	} else {
-		if (pending_free_list_tail)
-			pending_free_list_tail = pending_free_list_tail->next = batch;
-		else
-			pending_free_list = pending_free_list_tail = batch;
+	/* same tile of other batches */
+	for (share = e->shares; share; share = share->next) {
+		if (share->batch->state == BATCH_DL_STATE_CANCELED)
+			continue;
+		if (ret >= 0)
+			journal_mark(&(share->batch->journal), share->index);
+		finished += batch_task_done(td, share->batch, ret < 0);
 	}
 
-	if (batch->state != BATCH_DL_STATE_FINISHED) {
-		--(td->unfinished_batch_count);
-		--update_ui_thread.num_downloading_batches;
+	UNLOCK_MUTEX(&(td->lock));
+
+	if (finished > 0) {
+		LOCK_UI();
+		update_ui_thread.num_downloading_batches -= finished;
+		UNLOCK_UI();
 	}
 
-	--(td->batch_count);
+	free_shares(e);
+	free(e->task.path);
+	free(e->task.url);
+	free(e);
+}
 
-	batch->state = BATCH_DL_STATE_CANCELED;
+/**
+ * Called by download engine when it is stopped with the task <e> in flight.
+ * <e> is freed, its slot of the map is put back.
+ */
+void tile_downloader_abort(tile_downloader_t *td, tile_sched_entry_t *e)
+{
+	free_shares(e);
+	free(e->task.path);
+	free(e->task.url);
+	free(e);
+
+	tile_downloader_put(td);
+}
 
+/**
+ * Put back the slot taken by tile_downloader_take().
+ */
+void tile_downloader_put(tile_downloader_t *td)
+{
+	LOCK_MUTEX(&(td->lock));
+	--(td->active);
 	UNLOCK_MUTEX(&(td->lock));
 }
 
 /**
- *
- * The behavior is similiar to pthread_cond_timedwait();
- * NOTE: when this function is called by a thread, td->lock is locked
+ * Drop the batch's tasks, except the ones also wanted by another batch or
+ * requested by front-end.
  */
-static void download_next_batch(tile_downloader_t *td)
+static gboolean keep_unless_batch(tile_sched_entry_t *e, void *arg)
 {
-	/* keep the reference since we will update it later */
-	batch_dl_t *batch = td->cur_batch;
+	tile_sched_share_t *share;
+
+	if (e->batch != (batch_dl_t *)arg)
+		return TRUE;
+
+	/* hand over to another batch */
+	while ((share = e->shares)) {
+		e->shares = share->next;
+		if (share->batch->state != BATCH_DL_STATE_CANCELED) {
+			e->batch = share->batch;
+			e->task.index = share->index;
+			free(share);
+			return TRUE;
+		}
+		free(share);
+	}
 
-	if (! batch) {
-		UNLOCK_MUTEX(&(td->lock));
-		sleep(1);
-		LOCK_MUTEX(&(td->lock));
-		return;
+	if (e->front) {
+		e->batch = NULL;
+		e->base = TILE_SCHED_NONE;
+		return TRUE;
 	}
 
-	dl_task_t *task = &(batch->tasks[(batch->cur_task_id)++]);
+	return FALSE;
+}
 
-	//log_debug("task: zoom=%d, x=%d, y=%d", task->zoom, task->x, task->y);
+void download_cancel_batch(batch_dl_t *batch)
+{
+	tile_downloader_t *td = (tile_downloader_t *)batch->repo->downloader;
 
-	/* no tasks to be processed in current batch */
-	if (batch->cur_task_id == batch->num_dl_total) {
-		batch->state = BATCH_DL_STATE_FINISHING;
-		batch->cur_task_id = -1; /* invalid */
-		set_next_cur_batch(td);
-	}
+	LOCK_MUTEX(&(td->lock));
 
-	/* will release lock before perform download */
-	int ret = download_tile(td->repo, &(td->lock), task);
+	batch_dl_t *prev = batch->prev;
+	batch_dl_t *next = batch->next;
+	if (prev)
+		prev->next = next;
+	if (next)
+		next->prev = prev;
+	if (td->batches == batch)
+		td->batches = next;
+	if (td->batches_tail == batch)
+		td->batches_tail = prev;
+	batch->prev = batch->next = NULL;
 
-	LOCK_MUTEX(&(td->lock));
+	if (batch->state != BATCH_DL_STATE_FINISHED)
+		tile_sched_filter(&(td->sched), keep_unless_batch, batch);
 
-	if (batch->state == BATCH_DL_STATE_CANCELED)
-		return;
+	journal_close(&(batch->journal), TRUE);
 
-	/* If the task was canceled, the path and url are set as NULL */
-	assert(task->path);
-	assert(task->url);
-	if (task->path)
-		free(task->path);
-	if (task->url)
-		free(task->url);
-	task->path = NULL;
-	task->url = NULL;
+	/* tasks in flight may hold reference to this batch, can't free */
 
-	/* update the batch that contains previous task */
-	if (ret < 0)
-		++(batch->num_dl_failed);
+	if (pending_free_list_tail)
+		pending_free_list_tail = pending_free_list_tail->next = batch;
+	else
+		pending_free_list = pending_free_list_tail = batch;
 
-	if (++(batch->num_dl_done) == batch->num_dl_total) {
-		batch->state = BATCH_DL_STATE_FINISHED;
+	if (batch->state != BATCH_DL_STATE_FINISHED) {
 		--(td->unfinished_batch_count);
-		free(batch->tasks);
-		batch->tasks = NULL;
-
-		UNLOCK_MUTEX(&(td->lock));
-		LOCK_UI();
 		--update_ui_thread.num_downloading_batches;
-		UNLOCK_UI();
-		LOCK_MUTEX(&(td->lock));
 	}
+
+	--(td->batch_count);
+
+	batch->state = BATCH_DL_STATE_CANCELED;
+
+	UNLOCK_MUTEX(&(td->lock));
 }
 
 static void free_pending_frees()
@@ -349,154 +557,200 @@ static void free_pending_frees()
 }
 
 /**
- * Download thread routine.
- *
- * Some map provider suspects we're malicious crawler.
- * FIXME: adjust download frequency or stop downloading if we can detect that we are refused?
+ * front-end download request, when update view.
+ * <path> and <url> are taken over. Return TRUE if the tile is queued, FALSE if
+ * it is out of view (see tile_sched.c).
  */
-static void * download_routine(void *arg)
+gboolean add_front_download_task(map_repo_t *repo, int zoom, int x, int y, char *path, char *url)
 {
-	dl_thread_t *thread = (dl_thread_t *)arg;
-	tile_downloader_t *td = thread->downloader;
+	tile_downloader_t *td = (tile_downloader_t *)repo->downloader;
+	tile_sched_entry_t *e;
+	gboolean ret = FALSE, queued = FALSE;
 
-	sigset_t sig_set;
-	sigemptyset(&sig_set);
-	sigaddset(&sig_set, SIGINT);
-	pthread_sigmask(SIG_BLOCK, &sig_set, NULL);
+	LOCK_MUTEX(&(td->lock));
 
-	pthread_context_t *ctx = register_thread("download tile thread (batch)", NULL, NULL);
+	/* check duplicate */
+	if ((e = tile_sched_find(&(td->sched), zoom, x, y))) {
+		if (! e->front) {
+			e->front = TRUE;
+			tile_sched_update(&(td->sched), e);
+		}
+		ret = TRUE;
+		goto END;
+	}
 
-	pthread_mutex_t *lock = &(td->lock);
-	pthread_cond_t *cv = &(td->cv);
+	e = (tile_sched_entry_t*) calloc(1, sizeof(tile_sched_entry_t));
+	if (! e)
+		goto END;
+	e->task.zoom = zoom;
+	e->task.x = x;
+	e->task.y = y;
+	e->task.path = path;
+	e->task.url = url;
+	e->front = TRUE;
+	e->base = TILE_SCHED_NONE;
+
+	if (! tile_sched_add(&(td->sched), e)) {
+		free(e);
+		goto END;
+	}
+	ret = queued = TRUE;
+	path = url = NULL;
 
-	/* Other fields of <thread> are zeroed out by calloc() */
+END:
 
-	thread->tid = pthread_self();
+	UNLOCK_MUTEX(&(td->lock));
 
-	while (! td->stop) {
-		LOCK_MUTEX(lock);
+	if (queued)
+		dl_engine_wakeup();
 
-HARD_WORKER:
+	free(path);
+	free(url);
 
-		/* during download, the lock is unlocked then locked, so
-		 * If the downloader needs to lock this thread's lock when on new download task,
-		 * it can grasp the lock */
-		while ((td->front_task_count > 0) || (td->unfinished_batch_count > 0)) {
-			if (td->front_task_count > 0)
-				download_next_front(td);
-			else
-				download_next_batch(td);
-			if (td->stop)
-				goto END;
-		}
+	return ret;
+}
 
-		/* wait also release lock */
-		int ret = wait_ms(MAX_IDLE_MS, cv, lock, FALSE);
-		/* and the lock is grasped again*/
-		if (td->stop)
-			goto END;
-
-		if (ETIMEDOUT == ret) {
-			if ((td->front_task_count > 0) || (td->unfinished_batch_count > 0))
-				goto HARD_WORKER;
-			else {
-				--(thread->downloader->dl_threads_count);
-				thread->downloader->dl_threads[thread->id].tid = 0;
-				UNLOCK_MUTEX(lock);
-				goto END;
-			}
-		} else {
-			goto HARD_WORKER;
+/**
+ * If the tile is queued, e.g., by a batch, mark it as requested by front-end so
+ * it is scheduled as a visible tile. This saves a call of mapcfg_get_dl_url().
+ * Return TRUE if the tile is queued.
+ */
+gboolean promote_front_download_task(map_repo_t *repo, int zoom, int x, int y)
+{
+	tile_downloader_t *td = (tile_downloader_t *)repo->downloader;
+	tile_sched_entry_t *e;
+	gboolean ret = FALSE;
+
+	LOCK_MUTEX(&(td->lock));
+
+	if ((e = tile_sched_find(&(td->sched), zoom, x, y))) {
+		if (! e->front) {
+			e->front = TRUE;
+			tile_sched_update(&(td->sched), e);
 		}
+		ret = TRUE;
 	}
 
-END:
-
-	free_pending_frees();
-	free(ctx);
+	UNLOCK_MUTEX(&(td->lock));
 
-	return NULL;
+	return ret;
 }
 
 /**
- * front-end download request, when update view.
+ * Called when view range or zoom level of <repo> changes: queued front-end tasks
+ * are re-ordered by distance to the new view center, demoted or dropped.
  */
-void add_front_download_task(map_repo_t *repo, int zoom, int x, int y, char *path, char *url)
+void tile_downloader_set_view(map_repo_t *repo, int zoom, point_t tl_tile, point_t br_tile,
+	point_t center_pixel)
+{
+	tile_downloader_t *td = (tile_downloader_t *)repo->downloader;
+
+	if (! td)
+		return;
+
+	LOCK_MUTEX(&(td->lock));
+	tile_sched_set_view(&(td->sched), zoom, tl_tile, br_tile, center_pixel);
+	UNLOCK_MUTEX(&(td->lock));
+}
+
+static gboolean add_background_task(map_repo_t *repo, int zoom, int x, int y, char *path, char *url,
+	gboolean refresh)
 {
 	tile_downloader_t *td = (tile_downloader_t *)repo->downloader;
+	tile_sched_entry_t *e;
+	gboolean ret = FALSE;
 
 	LOCK_MUTEX(&(td->lock));
 
+	if (td->stop || td->sched.class_count[TILE_SCHED_BACKGROUND] >= MAX_BG_DL)
+		goto END;
+
 	/* check duplicate */
-	front_task_t *ft = td->front_tasks;
-	while (ft) {
-		if (ft->task.zoom == zoom && ft->task.x == x && ft->task.y == y)
-			goto END;
-		ft = ft->next;
-	}
-
-	ft = (front_task_t*) malloc(sizeof(front_task_t));
-	ft->task.zoom = zoom;
-	ft->task.x = x;
-	ft->task.y = y;
-	ft->task.path = path;
-	ft->task.url = url;
-	ft->next = NULL;
-
-	if (td->front_task_count == 0) {
-		td->front_tasks = td->front_tasks_tail = ft;
-	} else {
-		td->front_tasks_tail->next = ft;
-		td->front_tasks_tail = ft;
-	}
-	++(td->front_task_count);
+	if (tile_sched_find(&(td->sched), zoom, x, y))
+		goto END;
 
-	if ((td->front_task_count > (td->dl_threads_count << 2)) &&
-		(td->dl_threads_count < TILE_DL_THREADS_LIMIT)) {
-		tile_downloader_create_thread(td);
+	e = (tile_sched_entry_t*) calloc(1, sizeof(tile_sched_entry_t));
+	if (! e)
+		goto END;
+	e->task.zoom = zoom;
+	e->task.x = x;
+	e->task.y = y;
+	e->task.path = path;
+	e->task.url = url;
+	e->task.refresh = refresh;
+	e->base = TILE_SCHED_BACKGROUND;
+
+	if (! tile_sched_add(&(td->sched), e)) {
+		free(e);
+		goto END;
 	}
-	pthread_cond_broadcast(&(td->cv));
+
+	ret = TRUE;
 
 END:
 
 	UNLOCK_MUTEX(&(td->lock));
+
+	if (ret) {
+		dl_engine_wakeup();
+	} else {
+		free(path);
+		free(url);
+	}
+
+	return ret;
 }
 
-int batch_download_prepare(batch_dl_t *batch)
+/**
+ * Queue a background download task, e.g., re-download a corrupt tile (see
+ * tile_scrub.c). It runs only when there are no front-end and batch tasks.
+ * <path> and <url> are taken over, they are freed if the task is dropped because
+ * the same tile is queued or the queue is full.
+ */
+gboolean add_background_download_task(map_repo_t *repo, int zoom, int x, int y, char *path, char *url)
 {
-	int levels = batch->max_zoom - batch->min_zoom + 1;
-	int cur_zoom = batch->min_zoom;
-	map_repo_t *repo = batch->repo;
+	return add_background_task(repo, zoom, x, y, path, url, FALSE);
+}
 
-	struct stat st;
-	char buf[256], *url;
-	point_t tl_tile, br_tile;
-	int i, j, k, x, y, idx, max_tile_no, size;
+/**
+ * Same as add_background_download_task(), but the tile is downloaded even if it
+ * exists, with the validators of tile_meta_get(): an unchanged tile is not sent
+ * again (304 Not Modified).
+ */
+gboolean add_refresh_download_task(map_repo_t *repo, int zoom, int x, int y, char *path, char *url)
+{
+	return add_background_task(repo, zoom, x, y, path, url, TRUE);
+}
 
-	batch->num_in_range = 0;
-	batch->num_dl_total = 0;
-	batch->num_dl_done = 0;
-	batch->num_dl_failed = 0;
+static void batch_tile_range(batch_dl_t *batch, int zoom, point_t *tl_tile, point_t *br_tile)
+{
+	int max_tile_no = (1 << zoom) - 1;
 
-	/* sizeof(dl_task_t) == 20, 4096 / 20 == 204 */
-	const int step = 200;
-	int up_bound = step;
+	*tl_tile = wgs84_to_tile(batch->tl_wgs84, zoom, batch->repo);
+	*br_tile = wgs84_to_tile(batch->br_wgs84, zoom, batch->repo);
 
-	dl_task_t *bulk = (dl_task_t*)calloc(step, sizeof(dl_task_t));
-	if (! bulk)
-		return -1;
+	tl_tile->x = MIN(MAX(tl_tile->x, 0), max_tile_no);
+	tl_tile->y = MIN(MAX(tl_tile->y, 0), max_tile_no);
+}
 
-	idx = 0;
-	size = 0;
+/**
+ * Compute tile range of each zoom level of the batch.
+ * Return number of tiles in the range, -1 if it's too large.
+ */
+static int batch_init_levels(batch_dl_t *batch)
+{
+	int levels = MIN(batch->max_zoom - batch->min_zoom + 1, BATCH_DL_MAX_LEVELS);
+	int cur_zoom = batch->min_zoom;
+	point_t tl_tile, br_tile;
+	batch_level_t *level;
+	gint64 n = 0;
+	int i;
+
+	batch->num_levels = 0;
 
 	for (i=0; i<levels; i++) {
 		++cur_zoom;
-		max_tile_no = (1 << cur_zoom) - 1;
-		tl_tile = wgs84_to_tile(batch->tl_wgs84, cur_zoom, repo);
-		br_tile = wgs84_to_tile(batch->br_wgs84, cur_zoom, repo);
-
-		tl_tile.x = MIN(MAX(tl_tile.x, 0), max_tile_no);
-		tl_tile.y = MIN(MAX(tl_tile.y, 0), max_tile_no);
+		batch_tile_range(batch, cur_zoom, &tl_tile, &br_tile);
 
 		int rows = br_tile.y - tl_tile.y + 1;
 		int cols = br_tile.x - tl_tile.x + 1;
@@ -504,67 +758,236 @@ int batch_download_prepare(batch_dl_t *batch)
 		if (rows <= 0 || cols <= 0)
 			continue;
 
-		for (j=0; j<cols; j++) {
-			for (k=0; k<rows; k++) {
-				x = tl_tile.x + j;
-				y = tl_tile.y + k;
-				++batch->num_in_range;
+		level = &(batch->levels[batch->num_levels++]);
+		level->zoom = cur_zoom;
+		level->tl_tile = tl_tile;
+		level->cols = cols;
+		level->rows = rows;
+		level->first = (int)n;
 
-				if (! format_tile_file_path(repo, cur_zoom, x, y, buf, sizeof(buf)))
-					continue;
+		n += (gint64)cols * rows;
+		if (n > BATCH_DL_MAX_TILES)
+			return -1;
+	}
+
+	return (int)n;
+}
+
+/**
+ * Tile <index> of the batch range.
+ */
+static void batch_tile_at(batch_dl_t *batch, int index, int *zoom, int *x, int *y)
+{
+	batch_level_t *level = &(batch->levels[0]);
+	int i;
+
+	for (i=1; i<batch->num_levels && index >= batch->levels[i].first; i++)
+		level = &(batch->levels[i]);
+
+	index -= level->first;
+	*zoom = level->zoom;
+	*x = level->tl_tile.x + index / level->rows;
+	*y = level->tl_tile.y + index % level->rows;
+}
+
+/**
+ * Pin the corridor of a level: columns are grouped into at most
+ * BATCH_DL_MAX_CORRIDOR_PINS ranges, each one covers the rows of the corridor
+ * in its columns. Pins are checked one by one when tiles are pruned, so a few
+ * tiles out of the corridor are pinned rather than many small ranges.
+ */
+static void pin_corridor_level(batch_dl_t *batch, batch_level_t *level)
+{
+	int group = (level->cols + BATCH_DL_MAX_CORRIDOR_PINS - 1) / BATCH_DL_MAX_CORRIDOR_PINS;
+	int col, end, row, index, y1, y2;
+
+	for (col=0; col<level->cols; col+=group) {
+		end = MIN(col + group, level->cols);
+		y1 = G_MAXINT;
+		y2 = -1;
+		for (index=level->first + col * level->rows;
+			index<level->first + end * level->rows; index++) {
+			if (batch->mask[index >> 3] & (1 << (index & 7))) {
+				row = (index - level->first) % level->rows;
+				y1 = MIN(y1, row);
+				y2 = MAX(y2, row);
+			}
+		}
+		if (y2 >= 0)
+			tile_quota_pin(batch->repo, level->zoom, level->tl_tile.x + col,
+				level->tl_tile.y + y1, level->tl_tile.x + end - 1, level->tl_tile.y + y2);
+	}
+}
+
+/**
+ * Protect tiles of the batch from being pruned, see tile_quota.c
+ * Call it before batch_download().
+ */
+void batch_download_pin(batch_dl_t *batch)
+{
+	batch_level_t *level;
+	int i;
+
+	for (i=0; i<batch->num_levels; i++) {
+		level = &(batch->levels[i]);
+		if (batch->mask)
+			pin_corridor_level(batch, level);
+		else
+			tile_quota_pin(batch->repo, level->zoom, level->tl_tile.x, level->tl_tile.y,
+				level->tl_tile.x + level->cols - 1, level->tl_tile.y + level->rows - 1);
+	}
+
+	tile_quota_save_pins(batch->repo);
+}
+
+/* number of existing tiles to stat() for the size estimation */
+#define SIZE_SAMPLES	32
+
+/**
+ * Count the tiles to download: the ones not done (see batch journal) and not on
+ * disk. Memory lookups only, tasks are created later by tile_downloader_refill().
+ * Return estimated size (bytes) of existing tiles.
+ */
+static int scan_range(batch_dl_t *batch)
+{
+	batch_journal_t *journal = &(batch->journal);
+	map_repo_t *repo = batch->repo;
+	int index, zoom, x, y, tile_size;
+	int num_existing = 0, num_sampled = 0;
+	gint64 sampled_size = 0;
+
+	batch->num_dl_total = 0;
+	batch->num_dl_done = 0;
+	batch->num_dl_failed = 0;
 
-				if (stat(buf, &st) == 0) {
-					size += st.st_size;
-				} else {
-					/* SPECIAL NOTE: also synchronize access to Python interpreter! */
-					url = mapcfg_get_dl_url(repo, cur_zoom, x, y);
-					if (! url) {
-						log_error("download tile: can't get url for map: %s", repo->name);
-						continue;
-					}
-
-					if (idx == up_bound) {
-						up_bound += step;
-						/* 1. needless to clear newly allocated region
-						 * 2. at most 6 levels (< 10 KB), highly chances that we can get
-						 * this amount fo continuous memory */
-						bulk = (dl_task_t*)realloc(bulk, sizeof(dl_task_t) * up_bound);
-						if (! bulk) {
-							log_error("realloc for batch download failed.");
-							return -1;
-						}
-					}
-					bulk[idx].x = x;
-					bulk[idx].y = y;
-					bulk[idx].zoom = cur_zoom;
-					bulk[idx].path = strdup(buf);
-					bulk[idx].url = url;
-					++idx;
-					++batch->num_dl_total;
-				}
+	for (index=0; index<batch->num_in_range; index++) {
+		/* done before restart */
+		if (JOURNAL_TEST(journal, index))
+			continue;
+
+		batch_tile_at(batch, index, &zoom, &x, &y);
+
+		/* stat() only a few samples for size estimation */
+		if (tile_store_exists(repo, zoom, x, y)) {
+			journal_mark(journal, index);
+			++num_existing;
+			if (num_sampled < SIZE_SAMPLES &&
+				(tile_size = tile_store_stat(repo, zoom, x, y)) >= 0) {
+				sampled_size += tile_size;
+				++num_sampled;
 			}
+		} else {
+			++batch->num_dl_total;
 		}
 	}
 
-	batch->tasks = bulk;
+	/* resumed batch: tiles downloaded by others */
+	journal_flush(journal);
 
-	/* size (bytes) of existing tiles */
-	return size;
+	/* estimated size (bytes) of existing tiles */
+	if (num_sampled == 0)
+		return 0;
+	return (int)MIN(sampled_size * num_existing / num_sampled, G_MAXINT);
 }
 
 /**
- * enqueue
+ * Mark tiles of the range in the corridor of <batch->path>, the others are seen
+ * as done: set in journal, so they are neither queued nor resumed.
  */
-void batch_download(batch_dl_t *batch)
+static gboolean init_corridor(batch_dl_t *batch)
 {
-	++(update_ui_thread.num_downloading_batches);
+	batch_journal_t *journal = &(batch->journal);
+	batch_level_t *level;
+	int i;
 
+	batch->mask = (guint8 *)calloc(MAX(journal->bits_len, 1), 1);
+	if (! batch->mask)
+		return FALSE;
+
+	batch->num_tiles = 0;
+
+	for (i=0; i<batch->num_levels; i++) {
+		level = &(batch->levels[i]);
+		batch->num_tiles += tile_corridor_mark(batch->repo, batch->path, batch->path_len,
+			batch->corridor_m, level->zoom, level->tl_tile, level->cols, level->rows,
+			batch->mask, level->first);
+	}
+
+	for (i=0; i<journal->bits_len; i++)
+		journal->bits[i] = ~(batch->mask[i]);
+
+	return TRUE;
+}
+
+/**
+ * Return estimated size (bytes) of existing tiles, or -1 if the range is too
+ * large or out of memory.
+ * For a corridor batch, the region is set from <batch->path> and <batch->corridor_m>.
+ */
+int batch_download_prepare(batch_dl_t *batch)
+{
+	journal_init(&(batch->journal));
+	batch->mask = NULL;
+
+	if (batch->corridor_m > 0 && ! tile_corridor_bounds(batch->path, batch->path_len,
+		batch->corridor_m, &(batch->tl_wgs84), &(batch->br_wgs84)))
+		return -1;
+
+	batch->num_in_range = batch_init_levels(batch);
+	if (batch->num_in_range < 0) {
+		log_warn("batch download: too many tiles");
+		return -1;
+	}
+
+	batch->journal.bits_len = (batch->num_in_range + 7) >> 3;
+	batch->journal.bits = (guint8 *)calloc(MAX(batch->journal.bits_len, 1), 1);
+	if (! batch->journal.bits)
+		return -1;
+
+	if (batch->corridor_m > 0) {
+		if (! init_corridor(batch))
+			return -1;
+	} else {
+		batch->num_tiles = batch->num_in_range;
+	}
+
+	batch->path = NULL;
+	batch->path_len = 0;
+
+	return scan_range(batch);
+}
+
+/**
+ * Free a prepared batch that is not queued with batch_download().
+ */
+void batch_download_free(batch_dl_t *batch)
+{
+	journal_close(&(batch->journal), FALSE);
+	free(batch->mask);
+	free(batch);
+}
+
+/**
+ * enqueue: add the batch to the downloader, its tasks are created by
+ * tile_downloader_refill().
+ */
+void batch_download(batch_dl_t *batch)
+{
 	tile_downloader_t *td = (tile_downloader_t *)batch->repo->downloader;
 
+	/* pinned already, the corridor is in journal */
+	free(batch->mask);
+	batch->mask = NULL;
+
+	/* not a resumed one */
+	if (batch->journal.fd < 0 && batch->journal.bits && batch->num_dl_total > 0)
+		journal_create(batch);
+
 	LOCK_MUTEX(&(td->lock));
 
 	batch->state = BATCH_DL_STATE_PENDING;
 	batch->next = NULL;
+	batch->cursor = 0;
 	batch->cur_task_id = 0;
 
 	if (td->batches) {
@@ -574,60 +997,164 @@ void batch_download(batch_dl_t *batch)
 		td->batches = td->batches_tail = batch;
 		batch->prev = NULL;
 	}
-	if (td->cur_batch == NULL) {
-		td->cur_batch = batch;
-		td->cur_batch->state = BATCH_DL_STATE_PROCESSING;
-	}
 
 	++(td->batch_count);
-	++(td->unfinished_batch_count);
 
-	int new_thread_count = batch->num_dl_total / 5;
-	if (new_thread_count == 0)
-		new_thread_count = 1;
-	new_thread_count = MIN(new_thread_count, (TILE_DL_THREADS_LIMIT - td->dl_threads_count));
-
-	int i;
-	for (i=0; i<new_thread_count; i++) {
-		tile_downloader_create_thread(td);
+	if (batch->num_dl_total == 0) {
+		batch->state = BATCH_DL_STATE_FINISHED;
+		journal_close(&(batch->journal), TRUE);
+		UNLOCK_MUTEX(&(td->lock));
+		return;
 	}
-	pthread_cond_broadcast(&(td->cv));
+
+	++(td->unfinished_batch_count);
+	++(update_ui_thread.num_downloading_batches);
 
 	UNLOCK_MUTEX(&(td->lock));
 
+	dl_engine_wakeup();
+
 	if (update_ui_thread.thread_tid == 0) {
 		pthread_create(&update_ui_thread.thread_tid, &pthread_attr,
 			batch_download_update_ui_routine, NULL);
 	}
 }
 
+typedef struct __refill_task_t
+{
+	batch_dl_t *batch;
+	dl_task_t task;
+} refill_task_t;
+
 /**
- * NOTE:
- * (1) require <td>'s lock being locked;
- * (2) invariant: dl_threads_count == TILE_DL_THREADS_LIMIT
- * return slot id
+ * Called by download engine before it takes tasks: queue next tasks of the batches
+ * of <td>, so that at most BATCH_DL_WINDOW batch tasks are waiting. Path and url
+ * of a task are created here, then memory doesn't grow with the size of batches.
+ * Tiles that exist by now (e.g., downloaded for the view) are counted as done, a
+ * tile queued by another batch is done when that task is done.
  */
-gboolean tile_downloader_create_thread(tile_downloader_t *td)
+void tile_downloader_refill(tile_downloader_t *td)
 {
-	int i;
-	for (i=0; i<TILE_DL_THREADS_LIMIT; i++) {
-		if (td->dl_threads[i].tid == 0) {
-			td->dl_threads[i].downloader = td;
-			td->dl_threads[i].id = i;
-			if (pthread_create(&td->dl_threads[i].tid, &pthread_attr, download_routine, &(td->dl_threads[i])) == 0) {
-				while (td->dl_threads[i].tid == 0)
-					sleep_ms(100);
-				++(td->dl_threads_count);
-				return TRUE;
+	refill_task_t tasks[BATCH_DL_WINDOW];
+	map_repo_t *repo = td->repo;
+	tile_sched_entry_t *e;
+	tile_sched_share_t *share;
+	batch_dl_t *batch;
+	dl_task_t *task;
+	char buf[256];
+	int i, n = 0, need, finished = 0;
+
+	LOCK_MUTEX(&(td->lock));
+
+	need = BATCH_DL_WINDOW - td->sched.class_count[TILE_SCHED_BATCH];
+
+	for (batch = td->batches; batch && ! td->stop && n < need; batch = batch->next) {
+		if (batch->state == BATCH_DL_STATE_FINISHED)
+			continue;
+		for (; batch->cursor < batch->num_in_range && n < need; batch->cursor++) {
+			if (JOURNAL_TEST(&(batch->journal), batch->cursor))
+				continue;
+			tasks[n].batch = batch;
+			task = &(tasks[n].task);
+			memset(task, 0, sizeof(dl_task_t));
+			task->index = batch->cursor;
+			batch_tile_at(batch, batch->cursor, &(task->zoom), &(task->x), &(task->y));
+			++n;
+		}
+	}
+
+	UNLOCK_MUTEX(&(td->lock));
+
+	if (n == 0)
+		return;
+
+	/* without lock: url may be created by Python */
+	for (i=0; i<n; i++) {
+		task = &(tasks[i].task);
+
+		if (tile_store_exists(repo, task->zoom, task->x, task->y) ||
+			! tile_store_tmp_path(repo, task->zoom, task->x, task->y, buf, sizeof(buf)))
+			continue;
+
+		/* SPECIAL NOTE: also synchronize access to Python interpreter! */
+		if (! (task->url = mapcfg_get_dl_url(repo, task->zoom, task->x, task->y))) {
+			log_error("download tile: can't get url for map: %s", repo->name);
+			continue;
+		}
+
+		if (! (task->path = strdup(buf))) {
+			free(task->url);
+			task->url = NULL;
+		}
+	}
+
+	LOCK_MUTEX(&(td->lock));
+
+	for (i=0; i<n; i++) {
+		batch = tasks[i].batch;
+		task = &(tasks[i].task);
+
+		if (batch->state == BATCH_DL_STATE_CANCELED)
+			goto NEXT;
+
+		if (! task->url) {
+			/* exists by now, or no url */
+			if (tile_store_exists(repo, task->zoom, task->x, task->y)) {
+				journal_mark(&(batch->journal), task->index);
+				finished += batch_task_done(td, batch, FALSE);
 			} else {
-				log_error("create download pthread failed");
-				return FALSE;
+				finished += batch_task_done(td, batch, TRUE);
 			}
+			++(batch->cur_task_id);
+			goto NEXT;
 		}
+
+		if ((e = tile_sched_find(&(td->sched), task->zoom, task->x, task->y))) {
+			if (! e->batch) {
+				/* queued by front-end or background: take it over */
+				e->batch = batch;
+				e->base = TILE_SCHED_BATCH;
+				e->task.index = task->index;
+				tile_sched_update(&(td->sched), e);
+				goto NEXT;
+			}
+			/* queued by another batch: done with that task, see tile_downloader_done() */
+			share = (tile_sched_share_t *)malloc(sizeof(tile_sched_share_t));
+			if (share) {
+				share->batch = batch;
+				share->index = task->index;
+				share->next = e->shares;
+				e->shares = share;
+			} else {
+				finished += batch_task_done(td, batch, TRUE);
+			}
+		} else {
+			e = (tile_sched_entry_t*) calloc(1, sizeof(tile_sched_entry_t));
+			if (e) {
+				e->task = *task;
+				e->base = TILE_SCHED_BATCH;
+				e->batch = batch;
+				if (tile_sched_add(&(td->sched), e))
+					continue;
+				free(e);
+			}
+			finished += batch_task_done(td, batch, TRUE);
+		}
+
+		++(batch->cur_task_id);
+
+NEXT:
+		free(task->path);
+		free(task->url);
 	}
 
-	/* should not go here */
-	return FALSE;
+	UNLOCK_MUTEX(&(td->lock));
+
+	if (finished > 0) {
+		LOCK_UI();
+		update_ui_thread.num_downloading_batches -= finished;
+		UNLOCK_UI();
+	}
 }
 
 void* batch_download_update_ui_routine(void *arg)
@@ -680,16 +1207,13 @@ static void init_repo_tile_downloader(map_repo_t *repo, void *arg)
 	td->unfinished_batch_count = 0;
 	td->batches = NULL;
 	td->batches_tail = NULL;
-	td->cur_batch = NULL;
 	td->batch_count = 0;
-	td->dl_threads_count = 0;
-	td->front_task_count = 0;
-	td->front_tasks = NULL;
-	td->front_tasks_tail = NULL;
+	td->active = 0;
 	td->stop = FALSE;
 
+	tile_sched_init(&(td->sched), drop_task, td);
+
 	pthread_mutex_init(&(td->lock), NULL);
-	pthread_cond_init(&(td->cv), NULL);
 }
 
 static void cleanup_repo_tile_downloader(map_repo_t *repo, void *arg)
@@ -698,43 +1222,112 @@ static void cleanup_repo_tile_downloader(map_repo_t *repo, void *arg)
 
 	LOCK_MUTEX(&(td->lock));
 
-	if (td->dl_threads_count > 0) {
-		int i;
-		dl_thread_t *thread;
+	batch_dl_t *batch, *next;
+	for (batch = td->batches; batch; batch = next) {
+		next = batch->next;
+		/* unfinished: resumed on next start */
+		journal_close(&(batch->journal), FALSE);
+		free(batch);
+	}
+	td->batches = td->batches_tail = NULL;
 
-		td->stop = TRUE;
+	tile_sched_cleanup(&(td->sched));
 
-		for (i = 0; i<td->dl_threads_count; i++) {
-			thread = &(td->dl_threads[i]);
-			pthread_kill(thread->tid, SIGUSR1);
-			sleep_ms(100);
-			pthread_join(thread->tid, NULL);
-		}
+	UNLOCK_MUTEX(&(td->lock));
+	free(td);
+}
 
-		batch_dl_t *batch, *next;
-		batch = td->batches;
-		while (batch) {
-			next = batch->next;
-			if (batch->tasks) {
-				for (i = 0; i<batch->num_dl_total; i++) {
-					if (batch->tasks[i].path) {
-						free(batch->tasks[i].path);
-						batch->tasks[i].path = NULL;
-					}
-					if (batch->tasks[i].url) {
-						free(batch->tasks[i].url);
-						batch->tasks[i].url = NULL;
-					}
-				}
-				free(batch->tasks);
-				free(batch);
-			}
-			batch = next;
-		}
+/**
+ * Queue the unfinished batch of journal <path> again. A bad journal, or one whose
+ * range doesn't match any more (e.g., map config has changed), is removed.
+ */
+static void resume_batch(map_repo_t *repo, const char *path)
+{
+	batch_journal_head_t head;
+	batch_dl_t *batch = NULL;
+	int fd;
+
+	if ((fd = open(path, O_RDWR)) < 0)
+		return;
+
+	if (read(fd, &head, sizeof(head)) != sizeof(head) ||
+		memcmp(head.magic, JOURNAL_MAGIC, sizeof(head.magic)) != 0 ||
+		head.num_in_range <= 0)
+		goto DROP;
+
+	batch = (batch_dl_t *)calloc(1, sizeof(batch_dl_t));
+	if (! batch) {
+		close(fd);
+		return;
 	}
 
-	UNLOCK_MUTEX(&(td->lock));
-	free(td);
+	batch->repo = repo;
+	batch->tl_wgs84 = head.tl_wgs84;
+	batch->br_wgs84 = head.br_wgs84;
+	batch->min_zoom = head.min_zoom;
+	batch->max_zoom = head.max_zoom;
+	batch->corridor_m = head.corridor_m;
+	journal_init(&(batch->journal));
+
+	if (batch->min_zoom < repo->min_zoom || batch->max_zoom > repo->max_zoom ||
+		(batch->num_in_range = batch_init_levels(batch)) != head.num_in_range)
+		goto DROP;
+
+	batch->journal.bits_len = (head.num_in_range + 7) >> 3;
+	batch->journal.bits = (guint8 *)malloc(batch->journal.bits_len);
+	if (! batch->journal.bits ||
+		read(fd, batch->journal.bits, batch->journal.bits_len) != batch->journal.bits_len)
+		goto DROP;
+
+	batch->journal.fd = fd;
+	if (! (batch->journal.path = strdup(path))) {
+		batch_download_free(batch);
+		return;
+	}
+
+	scan_range(batch);
+
+	if (batch->num_dl_total == 0) {
+		journal_close(&(batch->journal), TRUE);
+		batch_download_free(batch);
+		return;
+	}
+
+	log_info("batch download: resume map=%s, zoom=%d-%d, corridor=%dm, %d tiles left",
+		repo->name, batch->min_zoom, batch->max_zoom, batch->corridor_m, batch->num_dl_total);
+
+	batch_download(batch);
+	return;
+
+DROP:
+
+	log_warn("batch journal: drop %s", path);
+	close(fd);
+	unlink(path);
+	if (batch) {
+		free(batch->journal.bits);
+		free(batch);
+	}
+}
+
+static void resume_repo_batches(map_repo_t *repo, void *arg)
+{
+	char path[256];
+	struct dirent *ent;
+	DIR *dp;
+
+	snprintf(path, sizeof(path), "%s/%s", repo->dir, JOURNAL_DIR);
+	if (! (dp = opendir(path)))
+		return;
+
+	while ((ent = readdir(dp))) {
+		if (ent->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s/%s", repo->dir, JOURNAL_DIR, ent->d_name);
+		resume_batch(repo, path);
+	}
+
+	closedir(dp);
 }
 
 /**
@@ -750,12 +1343,33 @@ void tile_downloader_module_init()
 	pthread_attr_setdetachstate(&pthread_attr, PTHREAD_CREATE_DETACHED);
 
 	mapcfg_iterate_maplist(init_repo_tile_downloader, NULL);
+
+	dl_engine_start();
+
+	/* batches unfinished on last exit */
+	mapcfg_iterate_maplist(resume_repo_batches, NULL);
+}
+
+static void stop_repo_tile_downloader(map_repo_t *repo, void *arg)
+{
+	tile_downloader_t *td = (tile_downloader_t *)repo->downloader;
+
+	LOCK_MUTEX(&(td->lock));
+	td->stop = TRUE;
+	UNLOCK_MUTEX(&(td->lock));
 }
 
 void tile_downloader_module_cleanup()
 {
+	/* no more tasks are taken, then tasks in flight are aborted */
+	mapcfg_iterate_maplist(stop_repo_tile_downloader, NULL);
+	dl_engine_stop();
+
 	mapcfg_iterate_maplist(cleanup_repo_tile_downloader, NULL);
 
+	http_pool_cleanup();
+	dl_host_cleanup();
+
 	if (update_ui_thread.thread_tid > 0) {
 		update_ui_thread.stop = TRUE;
 		pthread_kill(update_ui_thread.thread_tid, SIGUSR1);
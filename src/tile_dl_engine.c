@@ -0,0 +1,719 @@
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "omgps.h"
+#include "tile.h"
+#include "network.h"
+#include "util.h"
+
+/**
+ * Tile download engine.
+ *
+ * One thread downloads tasks of all maps with non-blocking sockets on epoll, so
+ * concurrency is limited by the server and the link instead of thread count:
+ * at most <DL_ENGINE_MAX_XFERS> transfers in flight, at most "dl-max-conns" of
+ * a map, and as many of a host as its controller allows (see tile_dl_host.c).
+ *
+ * Tasks are taken from downloaders in scheduler order (see tile_sched.c). A
+ * transfer resolves the host (DNS cache, never blocks), connects or reuses an
+ * idle keep-alive connection, sends the request, then reads the response into
+ * memory until it is complete, see http_parse_response(). The body is written
+ * to the temp file and committed to store as before, then the connection goes
+ * back to the pool.
+ *
+ * After a transfer, the slots of its map and host are held for the delay of the
+ * host (cool down) without a socket, so polite limits are kept.
+ *
+ * Other threads call dl_engine_wakeup() when tasks are queued.
+ */
+
+typedef enum
+{
+	XFER_STARTING,
+	XFER_RESOLVING,
+	XFER_CONNECTING,
+	XFER_SENDING,
+	XFER_RECEIVING,
+	XFER_COOLDOWN,
+	/* freed at the end of the loop */
+	XFER_DONE
+} XFER_STATE;
+
+typedef struct __dl_xfer_t
+{
+	XFER_STATE state;
+
+	tile_downloader_t *downloader;
+	/* NULL after the task is done */
+	tile_sched_entry_t *entry;
+	dl_host_t *host;
+
+	/* temp file of the task */
+	int file_fd;
+
+	int sock_fd;
+	/* <sock_fd> is added to epoll */
+	gboolean watched;
+	/* <sock_fd> is an idle connection of the pool */
+	gboolean reused;
+	/* a reused connection failed, tried a new one */
+	gboolean retried;
+
+	/* a copy of url, split by parse_http_url() */
+	char *url;
+	char *hostname;
+	char *port;
+	char *path;
+
+	struct addrinfo *addrs;
+	struct addrinfo *next_addr;
+
+	/* validators of the stored tile, for a refresh task */
+	gboolean conditional;
+	tile_meta_t meta;
+
+	char req[1024];
+	int req_len;
+	int req_sent;
+
+	char *resp;
+	int resp_len;
+	int resp_size;
+
+	gint64 start_ms;
+	/* timeout of current state, or end of cool down */
+	gint64 deadline_ms;
+
+	struct __dl_xfer_t *next;
+} dl_xfer_t;
+
+#define MAX_EVENTS		64
+/* ms, poll interval of pending DNS lookups */
+#define RESOLVE_POLL_MS	50
+#define RESP_INIT_SIZE	(16 << 10)
+
+static int epoll_fd = -1;
+static int wakeup_pipe[2] = {-1, -1};
+
+static pthread_t engine_tid = 0;
+static gboolean stop = FALSE;
+
+static dl_xfer_t *xfers = NULL;
+/* transfers that are not cooling down */
+static int xfer_count = 0;
+
+/* the least time a held host is waited for, -1: none */
+static int feed_wait_ms;
+
+static void xfer_connect(dl_xfer_t *x);
+
+static void xfer_watch(dl_xfer_t *x, guint32 events)
+{
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.ptr = x;
+
+	if (epoll_ctl(epoll_fd, x->watched? EPOLL_CTL_MOD : EPOLL_CTL_ADD, x->sock_fd, &ev) == 0)
+		x->watched = TRUE;
+	else
+		log_warn("download engine: epoll_ctl failed: %s", strerror(errno));
+}
+
+/**
+ * Close the socket, or put it back to pool if <keep_alive>.
+ */
+static void xfer_close_socket(dl_xfer_t *x, gboolean keep_alive)
+{
+	if (x->sock_fd < 0)
+		return;
+
+	if (x->watched) {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, x->sock_fd, NULL);
+		x->watched = FALSE;
+	}
+
+	if (keep_alive) {
+		/* the pool is shared with http_get() */
+		fcntl(x->sock_fd, F_SETFL, fcntl(x->sock_fd, F_GETFL) & ~O_NONBLOCK);
+		http_pool_release(x->hostname, x->port, x->sock_fd);
+	} else {
+		close(x->sock_fd);
+	}
+
+	x->sock_fd = -1;
+}
+
+static void xfer_free_buffers(dl_xfer_t *x)
+{
+	free(x->url);
+	free(x->resp);
+	if (x->addrs)
+		free_remote_addr(x->addrs);
+
+	x->url = x->hostname = x->port = x->path = NULL;
+	x->resp = NULL;
+	x->addrs = x->next_addr = NULL;
+}
+
+/**
+ * Put back the slots of map and host.
+ */
+static void xfer_release(dl_xfer_t *x)
+{
+	dl_host_put(x->host);
+	x->host = NULL;
+	tile_downloader_put(x->downloader);
+	x->state = XFER_DONE;
+}
+
+/**
+ * The task is done: commit the tile, feed the host controller, notify the
+ * downloader, then cool down.
+ */
+static void xfer_finish(dl_xfer_t *x, http_get_result_t *result, gboolean keep_alive)
+{
+	tile_downloader_t *td = x->downloader;
+	int latency, delay, ret;
+
+	xfer_close_socket(x, keep_alive);
+
+	latency = (int)(monotonic_ms() - x->start_ms);
+
+	ret = tile_download_end(td->repo, &(x->entry->task), x->file_fd, result);
+	x->file_fd = -1;
+
+	delay = dl_host_feedback(x->host, result, latency, td->repo->dl_min_delay_ms);
+
+	tile_downloader_done(td, x->entry, ret);
+	x->entry = NULL;
+
+	xfer_free_buffers(x);
+	--xfer_count;
+
+	if (x->host && delay > 0) {
+		x->state = XFER_COOLDOWN;
+		x->deadline_ms = monotonic_ms() + delay;
+	} else {
+		xfer_release(x);
+	}
+}
+
+static void xfer_fail(dl_xfer_t *x, int error_no)
+{
+	http_get_result_t result;
+
+	http_result_init(&result);
+	http_result_set_error(&result, error_no);
+
+	xfer_finish(x, &result, FALSE);
+}
+
+/**
+ * A reused connection may have been closed by remote just before the request,
+ * try once more on a new connection.
+ */
+static gboolean xfer_retry(dl_xfer_t *x)
+{
+	if (! x->reused || x->retried)
+		return FALSE;
+
+	xfer_close_socket(x, FALSE);
+	x->retried = TRUE;
+	x->reused = FALSE;
+	x->resp_len = 0;
+
+	xfer_connect(x);
+
+	return TRUE;
+}
+
+static void xfer_send(dl_xfer_t *x)
+{
+	int n;
+
+	while (x->req_sent < x->req_len) {
+		n = send(x->sock_fd, x->req + x->req_sent, x->req_len - x->req_sent, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				xfer_watch(x, EPOLLOUT);
+				return;
+			}
+			if (! xfer_retry(x))
+				xfer_fail(x, HTTP_GET_ERROR_WRITE_REMOTE);
+			return;
+		}
+		x->req_sent += n;
+	}
+
+	x->state = XFER_RECEIVING;
+	x->resp_len = 0;
+	x->deadline_ms = monotonic_ms() + DL_ENGINE_IO_TIMEOUT * 1000;
+	xfer_watch(x, EPOLLIN);
+}
+
+static void xfer_send_begin(dl_xfer_t *x)
+{
+	x->req_len = http_format_request(x->req, sizeof(x->req), x->hostname, x->path,
+		x->conditional? x->meta.etag : NULL, x->conditional? x->meta.last_modified : NULL);
+	if (x->req_len < 0) {
+		xfer_fail(x, HTTP_GET_ERROR_URL);
+		return;
+	}
+
+	x->req_sent = 0;
+	x->state = XFER_SENDING;
+	x->deadline_ms = monotonic_ms() + DL_ENGINE_IO_TIMEOUT * 1000;
+
+	xfer_send(x);
+}
+
+/**
+ * Connect to the next address of the host.
+ */
+static void xfer_connect_next(dl_xfer_t *x)
+{
+	struct addrinfo *rp;
+	int fd;
+
+	while ((rp = x->next_addr)) {
+		x->next_addr = rp->ai_next;
+
+		fd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, rp->ai_protocol);
+		if (fd < 0)
+			continue;
+
+		x->sock_fd = fd;
+		x->deadline_ms = monotonic_ms() + DL_ENGINE_CONNECT_TIMEOUT * 1000;
+
+		if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+			xfer_send_begin(x);
+			return;
+		}
+
+		if (errno == EINPROGRESS) {
+			x->state = XFER_CONNECTING;
+			xfer_watch(x, EPOLLOUT);
+			return;
+		}
+
+		xfer_close_socket(x, FALSE);
+	}
+
+	xfer_fail(x, HTTP_GET_ERROR_CONNECT);
+}
+
+static void xfer_connect(dl_xfer_t *x)
+{
+	gboolean pending;
+	int fd;
+
+	if (! x->retried && (fd = http_pool_acquire(x->hostname, x->port)) >= 0) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		x->sock_fd = fd;
+		x->reused = TRUE;
+		xfer_send_begin(x);
+		return;
+	}
+
+	if (! x->addrs) {
+		x->addrs = get_remote_addr_nowait(x->hostname, x->port, AF_UNSPEC, SOCK_STREAM, 0, &pending);
+		if (! x->addrs) {
+			if (! pending) {
+				xfer_fail(x, HTTP_GET_ERROR_CONNECT);
+			} else if (x->state != XFER_RESOLVING) {
+				/* polled by check_timers() */
+				x->state = XFER_RESOLVING;
+				x->deadline_ms = monotonic_ms() + DNS_RESOLVE_TIMEOUT * 1000;
+			}
+			return;
+		}
+	}
+
+	x->next_addr = x->addrs;
+	xfer_connect_next(x);
+}
+
+static void xfer_on_connected(dl_xfer_t *x)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if (getsockopt(x->sock_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+		xfer_close_socket(x, FALSE);
+		xfer_connect_next(x);
+		return;
+	}
+
+	xfer_send_begin(x);
+}
+
+static void xfer_recv(dl_xfer_t *x)
+{
+	http_get_result_t result;
+	gboolean closed = FALSE, failed = FALSE, no_response, keep_alive;
+	int n, err;
+
+	while (TRUE) {
+		if (x->resp_len == x->resp_size) {
+			int size = x->resp_size? (x->resp_size << 1) : RESP_INIT_SIZE;
+			char *resp;
+			if (size > DL_ENGINE_MAX_RESPONSE || ! (resp = (char *)realloc(x->resp, size))) {
+				log_warn("download engine: response is too large: %s", x->url);
+				xfer_fail(x, HTTP_GET_ERROR_READ_REMOTE);
+				return;
+			}
+			x->resp = resp;
+			x->resp_size = size;
+		}
+
+		n = recv(x->sock_fd, x->resp + x->resp_len, x->resp_size - x->resp_len, 0);
+		if (n > 0) {
+			x->resp_len += n;
+		} else if (n == 0) {
+			closed = TRUE;
+			break;
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			break;
+		} else {
+			closed = failed = TRUE;
+			break;
+		}
+	}
+
+	/* dry run: is the response complete? */
+	err = http_parse_response(x->resp, x->resp_len, closed, -1, &result, &no_response, &keep_alive);
+
+	if (err == HTTP_PARSE_PENDING) {
+		if (closed) {
+			if (x->resp_len > 0 || ! xfer_retry(x))
+				xfer_fail(x, HTTP_GET_ERROR_READ_REMOTE);
+		} else {
+			x->deadline_ms = monotonic_ms() + DL_ENGINE_IO_TIMEOUT * 1000;
+		}
+		return;
+	}
+
+	if (no_response && xfer_retry(x))
+		return;
+
+	if (failed)
+		keep_alive = FALSE;
+
+	/* write the body to temp file */
+	if (err == HTTP_GET_ERROR_NONE)
+		http_parse_response(x->resp, x->resp_len, closed, x->file_fd, &result, &no_response, &keep_alive);
+
+	xfer_finish(x, &result, keep_alive && ! closed);
+}
+
+static void xfer_on_event(dl_xfer_t *x, guint32 events)
+{
+	switch (x->state) {
+	case XFER_CONNECTING:
+		xfer_on_connected(x);
+		break;
+	case XFER_SENDING:
+		xfer_send(x);
+		break;
+	case XFER_RECEIVING:
+		xfer_recv(x);
+		break;
+	default:
+		break;
+	}
+}
+
+static void xfer_start(tile_downloader_t *td, tile_sched_entry_t *e, dl_host_t *host)
+{
+	dl_xfer_t *x = NULL;
+	int file_fd;
+
+	int ret = tile_download_begin(td->repo, &(e->task), &file_fd);
+	if (ret <= 0)
+		goto DONE;
+
+	x = (dl_xfer_t *)calloc(1, sizeof(dl_xfer_t));
+	if (! x || ! (x->url = strdup(e->task.url)) ||
+		parse_http_url(x->url, &(x->hostname), &(x->port), &(x->path)) < 0) {
+		if (x)
+			free(x->url);
+		free(x);
+		x = NULL;
+
+		http_get_result_t result;
+		http_result_init(&result);
+		http_result_set_error(&result, HTTP_GET_ERROR_URL);
+		ret = tile_download_end(td->repo, &(e->task), file_fd, &result);
+		goto DONE;
+	}
+
+	x->downloader = td;
+	x->entry = e;
+	x->host = host;
+	x->file_fd = file_fd;
+	x->sock_fd = -1;
+	x->start_ms = monotonic_ms();
+
+	/* the tile may be removed (quota) after the task is queued */
+	if (e->task.refresh && tile_store_exists(td->repo, e->task.zoom, e->task.x, e->task.y))
+		x->conditional = tile_meta_get(td->repo, e->task.zoom, e->task.x, e->task.y, &(x->meta));
+
+	x->next = xfers;
+	xfers = x;
+	++xfer_count;
+
+	xfer_connect(x);
+	return;
+
+DONE:
+
+	dl_host_put(host);
+	tile_downloader_done(td, e, ret);
+	tile_downloader_put(td);
+}
+
+/**
+ * Take tasks of <repo> as long as there are free slots.
+ */
+static void feed_repo(map_repo_t *repo, void *arg)
+{
+	tile_downloader_t *td = (tile_downloader_t *)repo->downloader;
+	tile_sched_entry_t *e;
+	dl_host_t *host;
+	int wait;
+
+	tile_downloader_refill(td);
+
+	while (! stop && xfer_count < DL_ENGINE_MAX_XFERS) {
+		if (! (e = tile_downloader_take(td, &host, &wait))) {
+			if (wait > 0 && (feed_wait_ms < 0 || wait < feed_wait_ms))
+				feed_wait_ms = wait;
+			break;
+		}
+		xfer_start(td, e, host);
+	}
+}
+
+/**
+ * Handle timeouts and pending DNS lookups, free done transfers.
+ * Return epoll timeout (ms): the time to the nearest deadline, or -1.
+ */
+static int check_timers()
+{
+	dl_xfer_t *x, **link;
+	gint64 now = monotonic_ms();
+	gint64 next = -1;
+
+	for (x = xfers; x; x = x->next) {
+		if (x->state == XFER_RESOLVING && now < x->deadline_ms)
+			xfer_connect(x);
+
+		if (x->state != XFER_DONE && now >= x->deadline_ms) {
+			switch (x->state) {
+			case XFER_RESOLVING:
+				xfer_fail(x, HTTP_GET_ERROR_CONNECT);
+				break;
+			case XFER_CONNECTING:
+				xfer_close_socket(x, FALSE);
+				xfer_connect_next(x);
+				break;
+			case XFER_SENDING:
+				xfer_fail(x, HTTP_GET_ERROR_WRITE_REMOTE);
+				break;
+			case XFER_RECEIVING:
+				xfer_fail(x, HTTP_GET_ERROR_READ_REMOTE);
+				break;
+			case XFER_COOLDOWN:
+				xfer_release(x);
+				break;
+			default:
+				break;
+			}
+		}
+
+		if (x->state == XFER_DONE)
+			continue;
+
+		gint64 deadline = (x->state == XFER_RESOLVING)?
+			MIN(x->deadline_ms, now + RESOLVE_POLL_MS) : x->deadline_ms;
+		if (next < 0 || deadline < next)
+			next = deadline;
+	}
+
+	link = &xfers;
+	while ((x = *link)) {
+		if (x->state == XFER_DONE) {
+			*link = x->next;
+			free(x);
+		} else {
+			link = &(x->next);
+		}
+	}
+
+	return (next < 0)? -1 : (int)MAX(next - now, 0);
+}
+
+/**
+ * Abort transfers in flight, the temp files are removed.
+ */
+static void abort_all()
+{
+	dl_xfer_t *x, *next;
+
+	for (x = xfers; x; x = next) {
+		next = x->next;
+
+		xfer_close_socket(x, FALSE);
+
+		if (x->entry) {
+			flock(x->file_fd, LOCK_UN);
+			close(x->file_fd);
+			unlink(x->entry->task.path);
+			tile_downloader_abort(x->downloader, x->entry);
+		} else if (x->state != XFER_DONE) {
+			tile_downloader_put(x->downloader);
+		}
+
+		dl_host_put(x->host);
+		xfer_free_buffers(x);
+		free(x);
+	}
+
+	xfers = NULL;
+	xfer_count = 0;
+}
+
+static void* dl_engine_routine(void *arg)
+{
+	struct epoll_event events[MAX_EVENTS];
+	char buf[64];
+	int n, i, timeout;
+
+	sigset_t sig_set;
+	sigemptyset(&sig_set);
+	sigaddset(&sig_set, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sig_set, NULL);
+
+	pthread_context_t *ctx = register_thread("tile download engine thread", NULL, NULL);
+
+	while (! stop) {
+		feed_wait_ms = -1;
+		mapcfg_iterate_maplist(feed_repo, NULL);
+
+		timeout = check_timers();
+		if (feed_wait_ms >= 0 && (timeout < 0 || feed_wait_ms < timeout))
+			timeout = feed_wait_ms;
+
+		n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+		if (n < 0) {
+			if (errno != EINTR) {
+				log_error("download engine: epoll_wait failed: %s", strerror(errno));
+				sleep_ms(100);
+			}
+			continue;
+		}
+
+		for (i=0; i<n; i++) {
+			if (events[i].data.ptr == NULL) {
+				while (read(wakeup_pipe[0], buf, sizeof(buf)) > 0)
+					;
+				continue;
+			}
+			xfer_on_event((dl_xfer_t *)events[i].data.ptr, events[i].events);
+		}
+
+		check_timers();
+	}
+
+	abort_all();
+
+	free(ctx);
+
+	return NULL;
+}
+
+/**
+ * Tasks are queued, called by any thread.
+ */
+void dl_engine_wakeup()
+{
+	/* if the pipe is full, the engine is awake anyway */
+	if (wakeup_pipe[1] >= 0 && write(wakeup_pipe[1], "", 1) < 0 && errno != EAGAIN)
+		log_warn("download engine: wake up failed: %s", strerror(errno));
+}
+
+void dl_engine_start()
+{
+	struct epoll_event ev;
+
+	stop = FALSE;
+
+	if (pipe2(wakeup_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+		log_error("download engine: create pipe failed");
+		wakeup_pipe[0] = wakeup_pipe[1] = -1;
+		return;
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		log_error("download engine: epoll_create1 failed");
+		goto FAIL;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_pipe[0], &ev) < 0) {
+		log_error("download engine: epoll_ctl failed");
+		goto FAIL;
+	}
+
+	if (pthread_create(&engine_tid, NULL, dl_engine_routine, NULL) != 0) {
+		log_error("create download engine thread failed");
+		engine_tid = 0;
+		goto FAIL;
+	}
+
+	return;
+
+FAIL:
+
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+	close(wakeup_pipe[0]);
+	close(wakeup_pipe[1]);
+	epoll_fd = wakeup_pipe[0] = wakeup_pipe[1] = -1;
+}
+
+/**
+ * Transfers in flight are aborted.
+ * Must be called before downloaders are cleaned up.
+ */
+void dl_engine_stop()
+{
+	stop = TRUE;
+
+	if (engine_tid > 0) {
+		dl_engine_wakeup();
+		pthread_join(engine_tid, NULL);
+		engine_tid = 0;
+	}
+
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+	if (wakeup_pipe[0] >= 0) {
+		close(wakeup_pipe[0]);
+		close(wakeup_pipe[1]);
+	}
+	epoll_fd = wakeup_pipe[0] = wakeup_pipe[1] = -1;
+}
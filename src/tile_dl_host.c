@@ -0,0 +1,272 @@
+#include <pthread.h>
+
+#include "omgps.h"
+#include "tile.h"
+#include "network.h"
+#include "util.h"
+
+/**
+ * Per host download rate control.
+ *
+ * Each download takes a slot of its host: at most <limit> downloads of a host
+ * run at the same time, and none starts before <hold_until>. After a download
+ * the slot is held for <delay_ms> of the host (see tile_dl_engine.c).
+ *
+ * Healthy downloads (200 OK, latency within DL_HOST_LATENCY_FACTOR of the least
+ * latency seen) raise <limit> by one per <limit> downloads, up to map config
+ * "dl-max-conns", and cut the delay by 1/4, down to "dl-min-delay-ms".
+ * Rising latency lowers <limit> by one. Errors, timeouts and responses that
+ * suggest we are refused (403, 429, 5xx) halve <limit>, at least double the
+ * delay and hold the host for that delay, or for the time of Retry-After.
+ * 404 and local errors don't change anything.
+ *
+ * Hosts are shared by maps, e.g., several maps from one tile server.
+ */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static dl_host_t *hosts = NULL;
+static int host_count = 0;
+
+/* ms, least latency to compare with, for very fast links */
+#define MIN_RTT_FLOOR	50
+
+typedef enum
+{
+	OUTCOME_OK,
+	OUTCOME_NEUTRAL,
+	OUTCOME_BACKOFF
+} OUTCOME;
+
+static gboolean host_of(const char *url, char *buf, int buflen)
+{
+	char *_url = strdup(url);
+	char *host, *port, *path;
+	gboolean ret = FALSE;
+
+	if (_url && parse_http_url(_url, &host, &port, &path) == 0 && *host) {
+		snprintf(buf, buflen, "%s", host);
+		ret = TRUE;
+	}
+
+	free(_url);
+	return ret;
+}
+
+/**
+ * NOTE: require lock. Return NULL if there are too many hosts.
+ */
+static dl_host_t * find_host(const char *name, gboolean add)
+{
+	dl_host_t *h;
+
+	for (h = hosts; h; h = h->next) {
+		if (strcmp(h->name, name) == 0)
+			return h;
+	}
+
+	if (! add || host_count >= DL_HOST_MAX)
+		return NULL;
+
+	h = (dl_host_t *)calloc(1, sizeof(dl_host_t));
+	if (! h)
+		return NULL;
+
+	snprintf(h->name, sizeof(h->name), "%s", name);
+	h->limit = DL_HOST_INIT_LIMIT;
+	h->delay_ms = DL_SLEEP_MS;
+
+	h->next = hosts;
+	hosts = h;
+	++host_count;
+
+	return h;
+}
+
+static OUTCOME classify(http_get_result_t *result)
+{
+	switch (result->error_no) {
+	case HTTP_GET_ERROR_NONE:
+	case HTTP_GET_ERROR_NOT_MODIFIED:
+		return OUTCOME_OK;
+	case HTTP_GET_ERROR_NOT_200_OK:
+		/* tile doesn't exist, server is fine */
+		if (result->http_code == 404 || result->http_code == 410 || result->http_code == 204)
+			return OUTCOME_NEUTRAL;
+		return OUTCOME_BACKOFF;
+	case HTTP_GET_ERROR_CONNECT:
+	case HTTP_GET_ERROR_READ_REMOTE:
+	case HTTP_GET_ERROR_WRITE_REMOTE:
+		return OUTCOME_BACKOFF;
+	default:
+		return OUTCOME_NEUTRAL;
+	}
+}
+
+/**
+ * Take a download slot of the host of <url>, at most <max_limit> downloads of the
+ * host run at the same time. Never blocks.
+ * Return FALSE if no slot is free, <*wait_ms> is set to the time the host is held
+ * for, or 0 if it is busy: wait until a download of the host is done.
+ * Return TRUE if the download may start. <*host> is NULL if url is bad or there
+ * are too many hosts, in this case the download is not throttled.
+ */
+gboolean dl_host_try_acquire(const char *url, int max_limit, dl_host_t **host, int *wait_ms)
+{
+	char name[64];
+	dl_host_t *h;
+	gint64 now;
+	gboolean ret = TRUE;
+
+	*host = NULL;
+	*wait_ms = 0;
+
+	if (! host_of(url, name, sizeof(name)))
+		return TRUE;
+
+	LOCK_MUTEX(&lock);
+
+	if (! (h = find_host(name, TRUE)))
+		goto END;
+
+	/* don't grow beyond what the map allows */
+	if (h->limit > max_limit)
+		h->limit = MAX(max_limit, 1);
+
+	now = monotonic_ms();
+	if (now < h->hold_until) {
+		*wait_ms = (int)(h->hold_until - now);
+		ret = FALSE;
+	} else if (h->active >= MIN(h->limit, max_limit)) {
+		ret = FALSE;
+	} else {
+		++(h->active);
+		*host = h;
+	}
+
+END:
+
+	UNLOCK_MUTEX(&lock);
+
+	return ret;
+}
+
+/**
+ * Feed the result of a download to the controller of its host.
+ * Return delay (ms) the slot should be held for before it's put back.
+ */
+int dl_host_feedback(dl_host_t *h, http_get_result_t *result, int latency_ms, int min_delay_ms)
+{
+	int delay;
+
+	if (! h)
+		return MAX(DL_SLEEP_MS, min_delay_ms);
+
+	LOCK_MUTEX(&lock);
+
+	switch (classify(result)) {
+	case OUTCOME_OK:
+		h->srtt_ms = (h->srtt_ms == 0)? latency_ms : (7 * h->srtt_ms + latency_ms) / 8;
+		/* let the least latency drift up slowly, network may change */
+		h->min_rtt_ms = (h->min_rtt_ms == 0)? latency_ms :
+			MIN(latency_ms, h->min_rtt_ms + h->min_rtt_ms / 64 + 1);
+
+		if (h->srtt_ms <= DL_HOST_LATENCY_FACTOR * MAX(h->min_rtt_ms, MIN_RTT_FLOOR)) {
+			if (++(h->good) >= h->limit) {
+				h->good = 0;
+				if (h->limit < TILE_DL_CONNS_LIMIT)
+					++(h->limit);
+			}
+			h->delay_ms -= (h->delay_ms + 3) >> 2;
+		} else {
+			/* server or link is getting busy */
+			h->good = 0;
+			if (h->limit > 1)
+				--(h->limit);
+		}
+		break;
+
+	case OUTCOME_BACKOFF:
+		h->good = 0;
+		h->limit = MAX(h->limit >> 1, 1);
+		h->delay_ms = MIN(MAX(h->delay_ms << 1, DL_HOST_BACKOFF_MS), DL_HOST_MAX_DELAY_MS);
+
+		if (result->retry_after > 0) {
+			h->hold_until = monotonic_ms() +
+				(gint64)MIN(result->retry_after, DL_HOST_MAX_RETRY_AFTER) * 1000;
+			log_info("download: host %s asks to retry after %d seconds",
+				h->name, result->retry_after);
+		} else {
+			h->hold_until = monotonic_ms() + h->delay_ms;
+		}
+
+		log_debug("download: host %s backs off: http code=%d, limit=%d, delay=%dms",
+			h->name, result->http_code, h->limit, h->delay_ms);
+		break;
+
+	default:
+		break;
+	}
+
+	delay = MAX(h->delay_ms, min_delay_ms);
+
+	UNLOCK_MUTEX(&lock);
+
+	return delay;
+}
+
+/**
+ * Put back the slot taken by dl_host_try_acquire().
+ */
+void dl_host_put(dl_host_t *h)
+{
+	if (! h)
+		return;
+
+	LOCK_MUTEX(&lock);
+	--(h->active);
+	UNLOCK_MUTEX(&lock);
+}
+
+/**
+ * Estimated download rate (tiles per second) of the host of <url>, from measured
+ * latency and current limit and delay. Return 0 if nothing has been measured.
+ */
+double dl_host_rate(const char *url, int max_limit)
+{
+	char name[64];
+	dl_host_t *h;
+	double rate = 0;
+
+	if (! host_of(url, name, sizeof(name)))
+		return 0;
+
+	LOCK_MUTEX(&lock);
+
+	h = find_host(name, FALSE);
+	if (h && h->srtt_ms > 0)
+		rate = 1000.0 * MIN(h->limit, max_limit) / (h->srtt_ms + h->delay_ms);
+
+	UNLOCK_MUTEX(&lock);
+
+	return rate;
+}
+
+/**
+ * Must be called after download engine is stopped.
+ */
+void dl_host_cleanup()
+{
+	dl_host_t *h, *next;
+
+	LOCK_MUTEX(&lock);
+
+	for (h = hosts; h; h = next) {
+		next = h->next;
+		free(h);
+	}
+	hosts = NULL;
+	host_count = 0;
+
+	UNLOCK_MUTEX(&lock);
+}
@@ -0,0 +1,476 @@
+#include <signal.h>
+#include <pthread.h>
+
+#include "omgps.h"
+#include "tile.h"
+#include "network.h"
+#include "util.h"
+
+/**
+ * Tile loader: decode tile images off the UI thread.
+ *
+ * map_update_tile_pixbuf() only looks up the decoded tile cache, and queues
+ * a load request on miss. A pool of <TILE_LOADER_THREADS> threads reads the raw
+ * image from the L2 cache or tile store, decodes it, adds the tile to the layer's
+ * tile cache, then calls map_tile_loaded_callback_func() to redraw that tile's
+ * rectangle. Missing tiles are queued to the downloader here, so that the
+ * Python interpreter is not called on the UI thread.
+ *
+ * There are two queues: visible tiles, and prefetched tiles which are served
+ * only if no visible tile is waiting. Prefetched tiles are warmed from L2 or disk
+ * into tile cache, they are never downloaded. Pending prefetches are canceled
+ * when the prediction of view motion changes.
+ *
+ * Requests are de-duplicated on (repo, zoom, x, y). Queues are bounded: when
+ * a queue is full, the oldest request is dropped, it is most likely out of view now.
+ */
+
+typedef struct __tile_load_req_t
+{
+	tilecache_t *tile_cache;
+	map_repo_t *repo;
+	int zoom;
+	int x;
+	int y;
+	gboolean dl_if_absent;
+	struct __tile_load_req_t *next;
+} tile_load_req_t;
+
+typedef struct __tile_load_queue_t
+{
+	tile_load_req_t *head;
+	tile_load_req_t *tail;
+	int count;
+	int limit;
+} tile_load_queue_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
+
+static pthread_t loader_tids[TILE_LOADER_THREADS];
+static gboolean stop = FALSE;
+
+/* FIFO */
+static tile_load_queue_t visible_queue = {NULL, NULL, 0, TILE_LOADER_MAX_PENDING};
+static tile_load_queue_t prefetch_queue = {NULL, NULL, 0, TILE_LOADER_MAX_PREFETCH};
+
+/* requests being processed, indexed by thread id */
+static tile_load_req_t *loading[TILE_LOADER_THREADS];
+
+#define SAME_TILE(r, _repo, _zoom, _x, _y) \
+	((r)->x == (_x) && (r)->y == (_y) && (r)->zoom == (_zoom) && (r)->repo == (_repo))
+
+/**
+ * Decode PNG/JPEG image from memory.
+ */
+static GdkPixbuf* decode_tile_image(const guchar *data, int len)
+{
+	GError *error = NULL;
+	GdkPixbuf *pixbuf = NULL;
+	GdkPixbufLoader *loader = gdk_pixbuf_loader_new();
+
+	if (! gdk_pixbuf_loader_write(loader, data, len, &error) ||
+		! gdk_pixbuf_loader_close(loader, &error)) {
+		log_warn("decode tile image failed: %s", error->message);
+		g_error_free(error);
+		goto END;
+	}
+
+	pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+	if (pixbuf)
+		g_object_ref(pixbuf);
+
+END:
+
+	g_object_unref(loader);
+	return pixbuf;
+}
+
+/**
+ * Queue a refresh task if the stored tile is stale (see tile_meta.c). The old
+ * image is shown meanwhile, a changed one replaces it when it's downloaded.
+ */
+static void refresh_if_stale(map_repo_t *repo, int zoom, int x, int y)
+{
+	char path[256];
+	char *url;
+
+	if (! tile_meta_is_stale(repo, zoom, x, y) || count_network_interfaces() == 0)
+		return;
+
+	/* SPECIAL NOTE: also synchronize access to Python interpreter! */
+	url = mapcfg_get_dl_url(repo, zoom, x, y);
+	if (! url)
+		return;
+
+	if (! tile_store_tmp_path(repo, zoom, x, y, path, sizeof(path))) {
+		free(url);
+		return;
+	}
+
+	add_refresh_download_task(repo, zoom, x, y, strdup(path), url);
+}
+
+/**
+ * Return an acquired tile, caller must release it.
+ * Lookup order: decoded tile cache (L1), raw image cache (L2), tile store.
+ * A L1 miss decodes from L2 memory if possible, to avoid touching storage.
+ * NOTE: this may be slow, don't call it on UI thread.
+ */
+tile_t * tile_load(tilecache_t *tile_cache, map_repo_t *repo, int zoom, int x, int y,
+	gboolean dl_if_absent)
+{
+	tile_t *tile = NULL;
+	guchar *data = NULL;
+	int len = 0;
+
+	tile = tilecache_acquire(tile_cache, repo, zoom, x, y);
+	if (tile != NULL) {
+		if (! tile->provisional)
+			return tile;
+		tile_release(tile);
+		tile = NULL;
+	}
+
+	if (tilecache_absent_test(repo, zoom, x, y, dl_if_absent))
+		return NULL;
+
+	data = tilecache_l2_get(g_view.blob_cache, repo, zoom, x, y, &len);
+
+	if (! data) {
+		gboolean absent;
+
+		data = tile_store_read(repo, zoom, x, y, &len, &absent);
+
+		if (! data) {
+			if (absent) {
+				TILE_ABSENT_STATE state = TILE_ABSENT_LOCAL;
+				if (dl_if_absent) {
+					state = TILE_ABSENT_REMOTE;
+					if (promote_front_download_task(repo, zoom, x, y)) {
+						state = TILE_ABSENT_DOWNLOADING;
+					} else if (count_network_interfaces() > 0) {
+						char path[256];
+						/* SPECIAL NOTE: also synchronize access to Python interpreter! */
+						char * url = mapcfg_get_dl_url(repo, zoom, x, y);
+						if (! url) {
+							log_warn("download tile: can't get url for map: %s", repo->name);
+						} else if (! tile_store_tmp_path(repo, zoom, x, y, path, sizeof(path))) {
+							free(url);
+						} else {
+							/* out of view now: not queued, not absent either */
+							state = add_front_download_task(repo, zoom, x, y, strdup(path), url)?
+								TILE_ABSENT_DOWNLOADING : TILE_ABSENT_NONE;
+						}
+					}
+				}
+				tilecache_absent_set(repo, zoom, x, y, state);
+			}
+			return NULL;
+		}
+
+		/* L2 takes over its own copy */
+		tilecache_l2_put(g_view.blob_cache, repo, zoom, x, y,
+			(guchar *)g_memdup(data, len), len);
+
+		if (dl_if_absent)
+			refresh_if_stale(repo, zoom, x, y);
+	}
+
+	/* identical images share one pixbuf */
+	guint64 hash = tile_content_hash(data, len);
+	GdkPixbuf *pixbuf = tilecache_shared_pixbuf_get(hash, len);
+	if (! pixbuf) {
+		pixbuf = decode_tile_image(data, len);
+		if (pixbuf)
+			tilecache_shared_pixbuf_put(hash, len, pixbuf);
+	}
+	g_free(data);
+
+	if (! pixbuf)
+		return NULL;
+
+	tile = tile_new(repo, zoom, x, y, pixbuf);
+	if (tile == NULL) {
+		log_warn("allocate memory for tile_t failed\n");
+		g_object_unref(pixbuf);
+		return NULL;
+	}
+
+	if (! tilecache_add(tile_cache, tile))
+		log_warn("add tile to cache failed.");
+
+	return tile;
+}
+
+/**
+ * Return the link that points to the matched request, or NULL.
+ */
+static tile_load_req_t ** queue_find(tile_load_queue_t *q, map_repo_t *repo, int zoom, int x, int y)
+{
+	tile_load_req_t **link;
+
+	for (link = &(q->head); *link; link = &((*link)->next)) {
+		if (SAME_TILE(*link, repo, zoom, x, y))
+			return link;
+	}
+
+	return NULL;
+}
+
+static tile_load_req_t * queue_unlink(tile_load_queue_t *q, tile_load_req_t **link)
+{
+	tile_load_req_t *req = *link, *prev = NULL;
+
+	if (req == q->tail && q->head != req) {
+		for (prev = q->head; prev->next != req; prev = prev->next)
+			;
+	}
+
+	*link = req->next;
+	if (req == q->tail)
+		q->tail = prev;
+	req->next = NULL;
+	--q->count;
+
+	return req;
+}
+
+static void queue_append(tile_load_queue_t *q, tile_load_req_t *req)
+{
+	if (q->count == q->limit)
+		free(queue_unlink(q, &(q->head)));
+
+	req->next = NULL;
+	if (q->head)
+		q->tail->next = req;
+	else
+		q->head = req;
+	q->tail = req;
+	++q->count;
+}
+
+static void queue_clear(tile_load_queue_t *q)
+{
+	tile_load_req_t *req = q->head, *next;
+	while (req) {
+		next = req->next;
+		free(req);
+		req = next;
+	}
+	q->head = q->tail = NULL;
+	q->count = 0;
+}
+
+static gboolean is_loading(map_repo_t *repo, int zoom, int x, int y)
+{
+	int i;
+	for (i=0; i<TILE_LOADER_THREADS; i++) {
+		if (loading[i] && SAME_TILE(loading[i], repo, zoom, x, y))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static tile_load_req_t * new_request(tilecache_t *tile_cache, map_repo_t *repo,
+	int zoom, int x, int y, gboolean dl_if_absent)
+{
+	tile_load_req_t *req = (tile_load_req_t *)malloc(sizeof(tile_load_req_t));
+	if (! req) {
+		log_warn("allocate memory for tile load request failed");
+		return NULL;
+	}
+
+	req->tile_cache = tile_cache;
+	req->repo = repo;
+	req->zoom = zoom;
+	req->x = x;
+	req->y = y;
+	req->dl_if_absent = dl_if_absent;
+	req->next = NULL;
+
+	return req;
+}
+
+/**
+ * Queue a load request of a visible tile, it is ignored if the same tile is
+ * queued or being loaded. A pending prefetch of the same tile is promoted.
+ */
+void tile_loader_request(tilecache_t *tile_cache, map_repo_t *repo, int zoom, int x, int y,
+	gboolean dl_if_absent)
+{
+	tile_load_req_t *req, **link;
+
+	LOCK_MUTEX(&lock);
+
+	if (stop || is_loading(repo, zoom, x, y))
+		goto END;
+
+	if ((link = queue_find(&visible_queue, repo, zoom, x, y))) {
+		/* a later request may enable downloading */
+		(*link)->dl_if_absent |= dl_if_absent;
+		goto END;
+	}
+
+	if ((link = queue_find(&prefetch_queue, repo, zoom, x, y))) {
+		req = queue_unlink(&prefetch_queue, link);
+		req->dl_if_absent = dl_if_absent;
+	} else if (! (req = new_request(tile_cache, repo, zoom, x, y, dl_if_absent))) {
+		goto END;
+	}
+
+	queue_append(&visible_queue, req);
+	pthread_cond_signal(&cv);
+
+END:
+
+	UNLOCK_MUTEX(&lock);
+}
+
+/**
+ * Queue a low priority load request of an invisible tile.
+ */
+void tile_loader_prefetch(tilecache_t *tile_cache, map_repo_t *repo, int zoom, int x, int y)
+{
+	tile_load_req_t *req;
+
+	LOCK_MUTEX(&lock);
+
+	if (stop || is_loading(repo, zoom, x, y) ||
+		queue_find(&visible_queue, repo, zoom, x, y) ||
+		queue_find(&prefetch_queue, repo, zoom, x, y))
+		goto END;
+
+	if ((req = new_request(tile_cache, repo, zoom, x, y, FALSE))) {
+		queue_append(&prefetch_queue, req);
+		pthread_cond_signal(&cv);
+	}
+
+END:
+
+	UNLOCK_MUTEX(&lock);
+}
+
+/**
+ * Drop all pending prefetches, the ones being loaded are not interrupted.
+ */
+void tile_loader_cancel_prefetch()
+{
+	LOCK_MUTEX(&lock);
+	queue_clear(&prefetch_queue);
+	UNLOCK_MUTEX(&lock);
+}
+
+/**
+ * TRUE if no tile is queued or being loaded. Background I/O (see tile_scrub.c)
+ * backs off while it is FALSE.
+ */
+gboolean tile_loader_is_idle()
+{
+	gboolean idle;
+	int i;
+
+	LOCK_MUTEX(&lock);
+	idle = (! visible_queue.head && ! prefetch_queue.head);
+	for (i=0; idle && i<TILE_LOADER_THREADS; i++) {
+		if (loading[i])
+			idle = FALSE;
+	}
+	UNLOCK_MUTEX(&lock);
+
+	return idle;
+}
+
+static void * tile_loader_routine(void *arg)
+{
+	int id = (int)(long)arg;
+	tile_load_req_t *req;
+	tile_t *tile;
+
+	sigset_t sig_set;
+	sigemptyset(&sig_set);
+	sigaddset(&sig_set, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sig_set, NULL);
+
+	pthread_context_t *ctx = register_thread("tile loader thread", NULL, NULL);
+
+	while (! stop) {
+		LOCK_MUTEX(&lock);
+
+		while (! stop && ! visible_queue.head && ! prefetch_queue.head)
+			pthread_cond_wait(&cv, &lock);
+
+		if (stop) {
+			UNLOCK_MUTEX(&lock);
+			break;
+		}
+
+		if (visible_queue.head)
+			req = queue_unlink(&visible_queue, &(visible_queue.head));
+		else
+			req = queue_unlink(&prefetch_queue, &(prefetch_queue.head));
+		loading[id] = req;
+
+		UNLOCK_MUTEX(&lock);
+
+		/* stale: zoom level has been changed */
+		if (req->zoom == req->repo->zoom) {
+			tile = tile_load(req->tile_cache, req->repo, req->zoom, req->x, req->y,
+				req->dl_if_absent);
+			/* a prefetched tile may be visible now */
+			if (tile) {
+				tile_release(tile);
+				map_tile_loaded_callback_func(req->repo, req->zoom, req->x, req->y);
+			}
+		}
+
+		LOCK_MUTEX(&lock);
+		loading[id] = NULL;
+		UNLOCK_MUTEX(&lock);
+
+		free(req);
+	}
+
+	free(ctx);
+
+	return NULL;
+}
+
+void tile_loader_module_init()
+{
+	int i;
+
+	stop = FALSE;
+
+	for (i=0; i<TILE_LOADER_THREADS; i++) {
+		loading[i] = NULL;
+		if (pthread_create(&loader_tids[i], NULL, tile_loader_routine, (void *)(long)i) != 0) {
+			log_error("create tile loader thread failed");
+			loader_tids[i] = 0;
+		}
+	}
+}
+
+void tile_loader_module_cleanup()
+{
+	int i;
+
+	LOCK_MUTEX(&lock);
+	stop = TRUE;
+	pthread_cond_broadcast(&cv);
+	UNLOCK_MUTEX(&lock);
+
+	sleep_ms(100);
+
+	for (i=0; i<TILE_LOADER_THREADS; i++) {
+		if (loader_tids[i] > 0) {
+			/* may be blocked by UI lock */
+			pthread_kill(loader_tids[i], SIGUSR1);
+			pthread_join(loader_tids[i], NULL);
+			loader_tids[i] = 0;
+		}
+	}
+
+	queue_clear(&visible_queue);
+	queue_clear(&prefetch_queue);
+}
@@ -0,0 +1,438 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "omgps.h"
+#include "tile.h"
+#include "network.h"
+#include "util.h"
+
+/**
+ * Per tile HTTP metadata, to refresh stale tiles cheaply.
+ *
+ * For each downloaded tile, ETag, Last-Modified, fetch time and max-age (from
+ * Cache-Control or Expires) are appended to <dir>/tiles.meta as a fixed size
+ * record, for both store backends. The last record of a tile wins. The file is
+ * loaded on first use into an index of (zoom, x, y) -> (fetch time, max-age,
+ * record number), validators are read from file only for a refresh request.
+ * A torn record at the end of file (crash) is cut off when loaded. On exit,
+ * the file is rewritten without overwritten records and records of removed
+ * tiles, if they take more than half of it.
+ *
+ * With map config "max-age-days", a tile shown from store is stale when it's
+ * older than max-age-days, or the max-age of the server if that is longer.
+ * Then it's queued as a background download task (see tile_loader.c) with
+ * If-None-Match and If-Modified-Since, an unchanged tile costs a 304 response
+ * without body, which just updates the fetch time here. Tiles without metadata,
+ * e.g., downloaded by older versions or imported from bundles, are stale.
+ */
+
+#define META_FILE		"tiles.meta"
+#define META_NEW_SUFFIX	".new"
+#define META_MAGIC		"OMGPSMTA"
+
+/* records read or written in one system call */
+#define META_IO_RECORDS	256
+
+typedef struct __meta_file_head_t
+{
+	char magic[8];
+	/* sizeof(tile_meta_t), the file is dropped if it doesn't match */
+	guint32 record_size;
+	guint32 reserved;
+} meta_file_head_t;
+
+#define RECORD_OFFSET(rec) ((off_t)sizeof(meta_file_head_t) + (off_t)(rec) * sizeof(tile_meta_t))
+
+#define BUCKET_OF(m, zoom, x, y) \
+	((((guint32)(x) * 73856093u) ^ ((guint32)(y) * 19349663u) ^ ((guint32)(zoom) * 83492791u)) \
+		& ((m)->bucket_count - 1))
+
+static tile_meta_entry_t * find_entry(tile_meta_index_t *m, int zoom, int x, int y)
+{
+	tile_meta_entry_t *e = m->buckets[BUCKET_OF(m, zoom, x, y)];
+
+	for (; e; e = e->next) {
+		if (e->x == x && e->y == y && e->zoom == zoom)
+			return e;
+	}
+
+	return NULL;
+}
+
+/**
+ * Keep load factor <= 1. If allocation fails, the old table is still usable.
+ */
+static void grow_buckets(tile_meta_index_t *m)
+{
+	int n = m->bucket_count << 1;
+	tile_meta_entry_t **buckets = (tile_meta_entry_t **)calloc(n, sizeof(tile_meta_entry_t *));
+	tile_meta_entry_t *e, *next, **old = m->buckets;
+	int i, old_count = m->bucket_count;
+
+	if (! buckets)
+		return;
+
+	m->buckets = buckets;
+	m->bucket_count = n;
+
+	for (i=0; i<old_count; i++) {
+		for (e = old[i]; e; e = next) {
+			next = e->next;
+			e->next = m->buckets[BUCKET_OF(m, e->zoom, e->x, e->y)];
+			m->buckets[BUCKET_OF(m, e->zoom, e->x, e->y)] = e;
+		}
+	}
+
+	free(old);
+}
+
+/**
+ * Return the entry of <rec>, NULL if out of memory.
+ */
+static tile_meta_entry_t * put_entry(tile_meta_index_t *m, tile_meta_t *rec, guint32 rec_no)
+{
+	tile_meta_entry_t *e = find_entry(m, rec->zoom, rec->x, rec->y);
+
+	if (! e) {
+		e = (tile_meta_entry_t *)malloc(sizeof(tile_meta_entry_t));
+		if (! e)
+			return NULL;
+		e->zoom = rec->zoom;
+		e->x = rec->x;
+		e->y = rec->y;
+		e->next = m->buckets[BUCKET_OF(m, e->zoom, e->x, e->y)];
+		m->buckets[BUCKET_OF(m, e->zoom, e->x, e->y)] = e;
+		if (++(m->count) > m->bucket_count)
+			grow_buckets(m);
+	}
+
+	e->fetched = rec->fetched;
+	e->max_age = rec->max_age;
+	e->rec = rec_no;
+
+	return e;
+}
+
+static gboolean write_head(int fd)
+{
+	meta_file_head_t head;
+
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, META_MAGIC, sizeof(head.magic));
+	head.record_size = sizeof(tile_meta_t);
+
+	return (ftruncate(fd, 0) == 0 &&
+		pwrite(fd, &head, sizeof(head), 0) == sizeof(head));
+}
+
+/**
+ * Open meta file and build the index. NOTE: require lock.
+ */
+static void load(tile_meta_index_t *m)
+{
+	char path[256];
+	meta_file_head_t head;
+	tile_meta_t *buf;
+	int i, n;
+
+	m->loaded = TRUE;
+
+	snprintf(path, sizeof(path), "%s/%s", m->repo->dir, META_FILE);
+
+	m->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (m->fd < 0) {
+		log_warn("tile meta: unable to open %s", path);
+		return;
+	}
+
+	if (pread(m->fd, &head, sizeof(head), 0) != sizeof(head) ||
+		memcmp(head.magic, META_MAGIC, sizeof(head.magic)) != 0 ||
+		head.record_size != sizeof(tile_meta_t)) {
+		if (! write_head(m->fd)) {
+			log_warn("tile meta: unable to write %s", path);
+			close(m->fd);
+			m->fd = -1;
+		}
+		return;
+	}
+
+	buf = (tile_meta_t *)malloc(META_IO_RECORDS * sizeof(tile_meta_t));
+	if (! buf) {
+		log_warn("tile meta: allocate memory failed");
+		close(m->fd);
+		m->fd = -1;
+		return;
+	}
+
+	while ((n = pread(m->fd, buf, META_IO_RECORDS * sizeof(tile_meta_t),
+		RECORD_OFFSET(m->rec_count))) > 0) {
+		n /= sizeof(tile_meta_t);
+		if (n == 0)
+			break;
+		for (i=0; i<n; i++) {
+			if (! put_entry(m, &buf[i], m->rec_count + i))
+				log_warn("tile meta: allocate memory failed");
+		}
+		m->rec_count += n;
+	}
+
+	free(buf);
+
+	/* torn record */
+	if (ftruncate(m->fd, RECORD_OFFSET(m->rec_count)) < 0)
+		log_warn("tile meta: unable to truncate %s", path);
+
+	log_debug("tile meta: map=%s, %d tiles, %u records", m->repo->name, m->count, m->rec_count);
+}
+
+/**
+ * Return locked index of <repo>, loaded. NULL if module is not initialized,
+ * e.g., bundle import/export.
+ */
+static tile_meta_index_t * lock_index(map_repo_t *repo)
+{
+	tile_meta_index_t *m = (tile_meta_index_t *)repo->meta;
+
+	if (! m)
+		return NULL;
+
+	LOCK_MUTEX(&(m->lock));
+	if (! m->loaded)
+		load(m);
+
+	return m;
+}
+
+/**
+ * Record metadata of a tile after it's downloaded (200) or revalidated (304).
+ * A 304 response may omit validators, the old ones are kept then.
+ */
+void tile_meta_update(map_repo_t *repo, int zoom, int x, int y, http_get_result_t *result)
+{
+	tile_meta_index_t *m = lock_index(repo);
+	tile_meta_entry_t *e;
+	tile_meta_t rec;
+
+	if (! m)
+		return;
+
+	memset(&rec, 0, sizeof(rec));
+
+	if (result->error_no == HTTP_GET_ERROR_NOT_MODIFIED && m->fd >= 0 &&
+		(e = find_entry(m, zoom, x, y)) &&
+		pread(m->fd, &rec, sizeof(rec), RECORD_OFFSET(e->rec)) != sizeof(rec))
+		memset(&rec, 0, sizeof(rec));
+
+	rec.zoom = zoom;
+	rec.x = x;
+	rec.y = y;
+	rec.fetched = (guint32)time(NULL);
+	if (result->max_age > 0 || result->error_no != HTTP_GET_ERROR_NOT_MODIFIED)
+		rec.max_age = (guint32)result->max_age;
+	if (result->etag[0] || result->error_no != HTTP_GET_ERROR_NOT_MODIFIED)
+		snprintf(rec.etag, sizeof(rec.etag), "%s", result->etag);
+	if (result->last_modified[0] || result->error_no != HTTP_GET_ERROR_NOT_MODIFIED)
+		snprintf(rec.last_modified, sizeof(rec.last_modified), "%s", result->last_modified);
+
+	/* without a file, fetch time is still known for this run */
+	if (m->fd >= 0) {
+		if (pwrite(m->fd, &rec, sizeof(rec), RECORD_OFFSET(m->rec_count)) != sizeof(rec)) {
+			log_warn("tile meta: write failed, map=%s", repo->name);
+		} else {
+			put_entry(m, &rec, m->rec_count);
+			++(m->rec_count);
+		}
+	} else {
+		put_entry(m, &rec, G_MAXUINT32);
+	}
+
+	UNLOCK_MUTEX(&(m->lock));
+}
+
+/**
+ * Read metadata of a tile. Return FALSE if there is none.
+ */
+gboolean tile_meta_get(map_repo_t *repo, int zoom, int x, int y, tile_meta_t *meta)
+{
+	tile_meta_index_t *m = lock_index(repo);
+	tile_meta_entry_t *e;
+	gboolean ret = FALSE;
+
+	if (! m)
+		return FALSE;
+
+	if ((e = find_entry(m, zoom, x, y)) && m->fd >= 0 && e->rec != G_MAXUINT32 &&
+		pread(m->fd, meta, sizeof(tile_meta_t), RECORD_OFFSET(e->rec)) == sizeof(tile_meta_t) &&
+		meta->zoom == zoom && meta->x == x && meta->y == y) {
+		ret = TRUE;
+	}
+
+	UNLOCK_MUTEX(&(m->lock));
+
+	return ret;
+}
+
+/**
+ * Return TRUE if the tile should be revalidated, see map config "max-age-days".
+ * Memory lookup only, except the first call which loads meta file.
+ */
+gboolean tile_meta_is_stale(map_repo_t *repo, int zoom, int x, int y)
+{
+	tile_meta_index_t *m;
+	tile_meta_entry_t *e;
+	gboolean ret = TRUE;
+
+	if (repo->max_age_days <= 0)
+		return FALSE;
+
+	if (! (m = lock_index(repo)))
+		return FALSE;
+
+	if ((e = find_entry(m, zoom, x, y))) {
+		guint32 lifetime = MAX((guint32)repo->max_age_days * 24 * 3600, e->max_age);
+		ret = ((guint32)time(NULL) - e->fetched >= lifetime);
+	}
+
+	UNLOCK_MUTEX(&(m->lock));
+
+	return ret;
+}
+
+/**
+ * Rewrite meta file with the last record of each existing tile.
+ * NOTE: require lock, tile store is still open.
+ */
+static void compact(tile_meta_index_t *m)
+{
+	char path[256], new_path[256];
+	tile_meta_t *buf;
+	tile_meta_entry_t *e;
+	guint32 rec_count = 0;
+	int i, n = 0, fd;
+
+	snprintf(path, sizeof(path), "%s/%s", m->repo->dir, META_FILE);
+	snprintf(new_path, sizeof(new_path), "%s%s", path, META_NEW_SUFFIX);
+
+	buf = (tile_meta_t *)malloc(META_IO_RECORDS * sizeof(tile_meta_t));
+	if (! buf)
+		return;
+
+	fd = open(new_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ! write_head(fd))
+		goto FAIL;
+
+	for (i=0; i<m->bucket_count; i++) {
+		for (e = m->buckets[i]; e; e = e->next) {
+			if (e->rec == G_MAXUINT32 || ! tile_store_exists(m->repo, e->zoom, e->x, e->y))
+				continue;
+			if (pread(m->fd, &buf[n], sizeof(tile_meta_t), RECORD_OFFSET(e->rec)) != sizeof(tile_meta_t))
+				goto FAIL;
+			if (++n == META_IO_RECORDS) {
+				if (pwrite(fd, buf, n * sizeof(tile_meta_t), RECORD_OFFSET(rec_count)) !=
+					(ssize_t)(n * sizeof(tile_meta_t)))
+					goto FAIL;
+				rec_count += n;
+				n = 0;
+			}
+		}
+	}
+
+	if (n > 0 && pwrite(fd, buf, n * sizeof(tile_meta_t), RECORD_OFFSET(rec_count)) !=
+		(ssize_t)(n * sizeof(tile_meta_t)))
+		goto FAIL;
+	rec_count += n;
+
+	if (fsync(fd) < 0 || close(fd) < 0) {
+		fd = -1;
+		goto FAIL;
+	}
+
+	if (rename(new_path, path) < 0) {
+		unlink(new_path);
+		log_warn("tile meta: rename %s failed", new_path);
+	} else {
+		log_info("tile meta: map=%s, compacted %u -> %u records",
+			m->repo->name, m->rec_count, rec_count);
+	}
+
+	free(buf);
+	return;
+
+FAIL:
+
+	log_warn("tile meta: compact %s failed", path);
+	if (fd >= 0)
+		close(fd);
+	unlink(new_path);
+	free(buf);
+}
+
+static void init_repo_meta(map_repo_t *repo, void *arg)
+{
+	tile_meta_index_t *m = (tile_meta_index_t *)calloc(1, sizeof(tile_meta_index_t));
+	if (! m) {
+		log_warn("allocate memory failed");
+		exit(0);
+	}
+
+	m->buckets = (tile_meta_entry_t **)calloc(TILE_META_INIT_BUCKETS, sizeof(tile_meta_entry_t *));
+	if (! m->buckets) {
+		log_warn("allocate memory failed");
+		exit(0);
+	}
+	m->bucket_count = TILE_META_INIT_BUCKETS;
+
+	m->repo = repo;
+	m->fd = -1;
+	pthread_mutex_init(&(m->lock), NULL);
+
+	repo->meta = m;
+}
+
+static void cleanup_repo_meta(map_repo_t *repo, void *arg)
+{
+	tile_meta_index_t *m = (tile_meta_index_t *)repo->meta;
+	tile_meta_entry_t *e, *next;
+	int i;
+
+	if (! m)
+		return;
+
+	LOCK_MUTEX(&(m->lock));
+
+	if (m->fd >= 0) {
+		if (m->rec_count > (guint32)m->count * 2 + META_IO_RECORDS)
+			compact(m);
+		close(m->fd);
+	}
+
+	for (i=0; i<m->bucket_count; i++) {
+		for (e = m->buckets[i]; e; e = next) {
+			next = e->next;
+			free(e);
+		}
+	}
+	free(m->buckets);
+
+	UNLOCK_MUTEX(&(m->lock));
+
+	pthread_mutex_destroy(&(m->lock));
+	free(m);
+	repo->meta = NULL;
+}
+
+void tile_meta_module_init()
+{
+	mapcfg_iterate_maplist(init_repo_meta, NULL);
+}
+
+/**
+ * Must be called after tile downloader is stopped, before tile store is closed.
+ */
+void tile_meta_module_cleanup()
+{
+	mapcfg_iterate_maplist(cleanup_repo_meta, NULL);
+}
@@ -0,0 +1,671 @@
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "omgps.h"
+#include "tile.h"
+#include "util.h"
+
+/**
+ * Disk quota of tiles, per map repository (map config "disk-quota-mb").
+ *
+ * Access times are not taken from atime (often disabled by noatime, and not
+ * available for pack store): each tile read from store is recorded into a
+ * buffer, which is appended to the access log <dir>/.access when it is full.
+ *
+ * Disk usage is a counter updated on commit and remove, saved to <dir>/.usage on
+ * exit. The file is removed on first change, so after a crash usage is counted
+ * again by listing all tiles: by the pruner for maps with quota, for other maps
+ * only when the usage is shown (see tile_quota_get_usage()). Tiles that are
+ * stored once for many (see tile_store.c) are counted for each, listing corrects
+ * the counter.
+ *
+ * A background pruner thread checks maps with quota every
+ * <TILE_QUOTA_PRUNE_INTERVAL> seconds, or when a downloaded tile pushes usage
+ * over quota. To prune, it lists all tiles (access time defaults to file mtime),
+ * applies the access log, removes least recently used tiles until usage is below
+ * <TILE_QUOTA_LOW_WATERMARK> percent of quota, then rewrites the access log with
+ * the remaining tiles. Tiles are not listed while usage is under quota, unless
+ * the access log is to be compacted. Pack store is compacted if more than a
+ * quarter of it is garbage.
+ *
+ * Tiles in pinned batch download regions are never removed. Pinned tile ranges
+ * are saved as text lines "zoom x1 y1 x2 y2" in <dir>/.pinned, remove lines to
+ * unpin.
+ */
+
+#define ACCESS_LOG_FILE		".access"
+#define PINNED_FILE			".pinned"
+#define USAGE_FILE			".usage"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
+
+static pthread_t pruner_tid = 0;
+static gboolean stop = FALSE;
+static gboolean wakeup = FALSE;
+
+static void wakeup_pruner()
+{
+	LOCK_MUTEX(&lock);
+	wakeup = TRUE;
+	pthread_cond_signal(&cv);
+	UNLOCK_MUTEX(&lock);
+}
+
+/**
+ * Caller must hold quota lock.
+ */
+static void flush_access_log(tile_quota_t *q)
+{
+	char path[256];
+
+	if (q->access_count == 0)
+		return;
+
+	snprintf(path, sizeof(path), "%s/%s", q->repo->dir, ACCESS_LOG_FILE);
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd >= 0) {
+		size_t n = q->access_count * sizeof(tile_access_t);
+		if (write(fd, q->access_buf, n) != n)
+			log_warn("tile quota: write access log %s failed", path);
+		close(fd);
+	}
+
+	q->access_count = 0;
+}
+
+void tile_quota_touch(map_repo_t *repo, int zoom, int x, int y)
+{
+	tile_quota_t *q = (tile_quota_t *)repo->quota;
+	if (! q || q->quota_bytes == 0)
+		return;
+
+	LOCK_MUTEX(&(q->lock));
+
+	tile_access_t *a = &(q->access_buf[q->access_count++]);
+	a->zoom = zoom;
+	a->x = x;
+	a->y = y;
+	a->time = (guint32)time(NULL);
+
+	if (q->access_count == TILE_ACCESS_BUF_SIZE)
+		flush_access_log(q);
+
+	UNLOCK_MUTEX(&(q->lock));
+}
+
+static void remove_usage_file(map_repo_t *repo)
+{
+	char path[256];
+
+	snprintf(path, sizeof(path), "%s/%s", repo->dir, USAGE_FILE);
+	unlink(path);
+}
+
+/**
+ * The saved usage is out of date once it is changed.
+ * Caller must hold quota lock.
+ */
+static void usage_changed(tile_quota_t *q)
+{
+	if (q->usage_saved) {
+		remove_usage_file(q->repo);
+		q->usage_saved = FALSE;
+	}
+}
+
+/**
+ * <size> is store bytes of the committed tile, as counted by tile_store_list().
+ * <old_size> is that of the replaced tile, or -1.
+ */
+void tile_quota_on_commit(map_repo_t *repo, int zoom, int x, int y, int size, int old_size)
+{
+	tile_quota_t *q = (tile_quota_t *)repo->quota;
+	gboolean over = FALSE;
+
+	/* headless import (see main.c): quota is not loaded */
+	if (! q) {
+		remove_usage_file(repo);
+		return;
+	}
+
+	/* a downloaded tile is being viewed or pinned */
+	tile_quota_touch(repo, zoom, x, y);
+
+	LOCK_MUTEX(&(q->lock));
+	usage_changed(q);
+	if (q->usage_bytes >= 0) {
+		if (old_size >= 0) {
+			q->usage_bytes += size - old_size;
+		} else {
+			q->usage_bytes += size;
+			++q->tile_count;
+		}
+		over = (q->quota_bytes > 0 && q->usage_bytes > q->quota_bytes);
+	}
+	UNLOCK_MUTEX(&(q->lock));
+
+	if (over)
+		wakeup_pruner();
+}
+
+void tile_quota_on_remove(map_repo_t *repo, int size)
+{
+	tile_quota_t *q = (tile_quota_t *)repo->quota;
+
+	if (! q) {
+		remove_usage_file(repo);
+		return;
+	}
+
+	LOCK_MUTEX(&(q->lock));
+	usage_changed(q);
+	if (q->usage_bytes >= 0) {
+		q->usage_bytes = MAX(q->usage_bytes - size, 0);
+		q->tile_count = MAX(q->tile_count - 1, 0);
+	}
+	UNLOCK_MUTEX(&(q->lock));
+}
+
+/**
+ * Return FALSE if the file system of map dir is (almost) full. Downloading
+ * should be skipped, the pruner is woken up to make room if quota is set.
+ */
+gboolean tile_quota_check_space(map_repo_t *repo)
+{
+	struct statvfs st;
+
+	if (statvfs(repo->dir, &st) != 0)
+		return TRUE;
+
+	if ((guint64)st.f_bavail * st.f_bsize >= (guint64)TILE_MIN_FREE_KB * 1024)
+		return TRUE;
+
+	tile_quota_t *q = (tile_quota_t *)repo->quota;
+	if (q && q->quota_bytes > 0)
+		wakeup_pruner();
+
+	return FALSE;
+}
+
+/**
+ * Return FALSE if usage is not counted yet, the pruner is asked to count it.
+ */
+gboolean tile_quota_get_usage(map_repo_t *repo, gint64 *usage_bytes, guint64 *quota_bytes,
+	int *tile_count)
+{
+	tile_quota_t *q = (tile_quota_t *)repo->quota;
+	gboolean wanted = FALSE;
+
+	if (! q)
+		return FALSE;
+
+	LOCK_MUTEX(&(q->lock));
+	*usage_bytes = q->usage_bytes;
+	*quota_bytes = q->quota_bytes;
+	*tile_count = q->tile_count;
+	if (q->usage_bytes < 0 && ! q->count_wanted)
+		wanted = q->count_wanted = TRUE;
+	UNLOCK_MUTEX(&(q->lock));
+
+	if (wanted)
+		wakeup_pruner();
+
+	return (*usage_bytes >= 0);
+}
+
+static void load_usage(tile_quota_t *q)
+{
+	char path[256];
+	long long usage;
+	int count;
+
+	snprintf(path, sizeof(path), "%s/%s", q->repo->dir, USAGE_FILE);
+
+	FILE *fp = fopen(path, "r");
+	if (! fp)
+		return;
+
+	if (fscanf(fp, "%lld %d", &usage, &count) == 2 && usage >= 0 && count >= 0) {
+		q->usage_bytes = usage;
+		q->tile_count = count;
+		q->usage_saved = TRUE;
+	}
+
+	fclose(fp);
+}
+
+static void save_usage(tile_quota_t *q)
+{
+	char path[256];
+
+	if (q->usage_bytes < 0 || q->usage_saved)
+		return;
+
+	snprintf(path, sizeof(path), "%s/%s", q->repo->dir, USAGE_FILE);
+
+	FILE *fp = fopen(path, "w");
+	if (! fp)
+		return;
+
+	fprintf(fp, "%lld %d\n", (long long)q->usage_bytes, q->tile_count);
+	if (fclose(fp) != 0) {
+		log_warn("tile quota: save %s failed", path);
+		unlink(path);
+	}
+}
+
+static void add_pin(tile_quota_t *q, int zoom, int x1, int y1, int x2, int y2)
+{
+	tile_pin_t *pin = (tile_pin_t *)malloc(sizeof(tile_pin_t));
+	if (! pin)
+		return;
+
+	pin->zoom = zoom;
+	pin->x1 = x1;
+	pin->y1 = y1;
+	pin->x2 = x2;
+	pin->y2 = y2;
+	pin->next = q->pins;
+	q->pins = pin;
+}
+
+/**
+ * Pin tile range of a batch download region, call tile_quota_save_pins() after
+ * all zoom levels are pinned.
+ */
+void tile_quota_pin(map_repo_t *repo, int zoom, int x1, int y1, int x2, int y2)
+{
+	tile_quota_t *q = (tile_quota_t *)repo->quota;
+	if (! q)
+		return;
+
+	LOCK_MUTEX(&(q->lock));
+	add_pin(q, zoom, x1, y1, x2, y2);
+	UNLOCK_MUTEX(&(q->lock));
+}
+
+void tile_quota_save_pins(map_repo_t *repo)
+{
+	tile_quota_t *q = (tile_quota_t *)repo->quota;
+	char path[256];
+	tile_pin_t *pin;
+
+	if (! q)
+		return;
+
+	if (g_mkdir_with_parents(repo->dir, 0700) != 0)
+		return;
+
+	snprintf(path, sizeof(path), "%s/%s", repo->dir, PINNED_FILE);
+
+	LOCK_MUTEX(&(q->lock));
+
+	FILE *fp = fopen(path, "w");
+	if (fp) {
+		for (pin = q->pins; pin; pin = pin->next)
+			fprintf(fp, "%d %d %d %d %d\n", pin->zoom, pin->x1, pin->y1, pin->x2, pin->y2);
+		fclose(fp);
+	} else {
+		log_warn("tile quota: save %s failed", path);
+	}
+
+	UNLOCK_MUTEX(&(q->lock));
+}
+
+static void load_pins(tile_quota_t *q)
+{
+	char path[256], line[128];
+	int zoom, x1, y1, x2, y2;
+
+	snprintf(path, sizeof(path), "%s/%s", q->repo->dir, PINNED_FILE);
+
+	FILE *fp = fopen(path, "r");
+	if (! fp)
+		return;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%d %d %d %d %d", &zoom, &x1, &y1, &x2, &y2) == 5)
+			add_pin(q, zoom, x1, y1, x2, y2);
+	}
+
+	fclose(fp);
+}
+
+/**
+ * Caller must hold quota lock.
+ */
+static gboolean is_pinned(tile_quota_t *q, tile_store_entry_t *e)
+{
+	tile_pin_t *pin;
+	for (pin = q->pins; pin; pin = pin->next) {
+		if (pin->zoom == e->zoom && e->x >= pin->x1 && e->x <= pin->x2 &&
+			e->y >= pin->y1 && e->y <= pin->y2)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static int compare_key(const void *a, const void *b)
+{
+	const tile_store_entry_t *e1 = (const tile_store_entry_t *)a;
+	const tile_store_entry_t *e2 = (const tile_store_entry_t *)b;
+
+	if (e1->zoom != e2->zoom)
+		return e1->zoom - e2->zoom;
+	if (e1->x != e2->x)
+		return e1->x - e2->x;
+	return e1->y - e2->y;
+}
+
+static int compare_atime(const void *a, const void *b)
+{
+	const tile_store_entry_t *e1 = (const tile_store_entry_t *)a;
+	const tile_store_entry_t *e2 = (const tile_store_entry_t *)b;
+
+	if (e1->atime != e2->atime)
+		return (e1->atime < e2->atime)? -1 : 1;
+	return 0;
+}
+
+/**
+ * Apply access log records of <fp> to <list> sorted by key.
+ */
+static void apply_access_log(FILE *fp, tile_store_entry_t *list, int count)
+{
+	tile_access_t a;
+	tile_store_entry_t key, *e;
+
+	while (fread(&a, sizeof(a), 1, fp) == 1) {
+		key.zoom = a.zoom;
+		key.x = a.x;
+		key.y = a.y;
+		e = (tile_store_entry_t *)bsearch(&key, list, count, sizeof(tile_store_entry_t),
+			compare_key);
+		if (e && a.time > e->atime)
+			e->atime = a.time;
+	}
+}
+
+/**
+ * Rewrite access log: one record per remaining tile, plus records that are
+ * appended after the log was read at <read_offset>.
+ */
+static void rewrite_access_log(tile_quota_t *q, tile_store_entry_t *list, int count,
+	long read_offset)
+{
+	char path[256], tmp_path[256];
+	tile_access_t a;
+	int i;
+	gboolean ok = TRUE;
+
+	snprintf(path, sizeof(path), "%s/%s", q->repo->dir, ACCESS_LOG_FILE);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	FILE *fp = fopen(tmp_path, "wb");
+	if (! fp)
+		return;
+
+	for (i=0; ok && i<count; i++) {
+		if (list[i].size < 0)
+			continue;
+		a.zoom = list[i].zoom;
+		a.x = list[i].x;
+		a.y = list[i].y;
+		a.time = list[i].atime;
+		ok = (fwrite(&a, sizeof(a), 1, fp) == 1);
+	}
+
+	/* no more appending until renamed */
+	LOCK_MUTEX(&(q->lock));
+
+	FILE *log = fopen(path, "rb");
+	if (log) {
+		if (fseek(log, read_offset, SEEK_SET) == 0) {
+			while (ok && fread(&a, sizeof(a), 1, log) == 1)
+				ok = (fwrite(&a, sizeof(a), 1, fp) == 1);
+		}
+		fclose(log);
+	}
+
+	if (fclose(fp) != 0)
+		ok = FALSE;
+
+	if (! ok || rename(tmp_path, path) != 0) {
+		log_warn("tile quota: rewrite access log %s failed", path);
+		unlink(tmp_path);
+	}
+
+	UNLOCK_MUTEX(&(q->lock));
+}
+
+/**
+ * Return TRUE if access log has many more records than <count> tiles.
+ */
+static gboolean access_log_is_long(tile_quota_t *q, int count)
+{
+	char path[256];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/%s", q->repo->dir, ACCESS_LOG_FILE);
+
+	return (stat(path, &st) == 0 &&
+		st.st_size > (off_t)MAX(count, TILE_ACCESS_BUF_SIZE) * sizeof(tile_access_t) * 4);
+}
+
+/**
+ * Count usage if it's unknown, and remove least recently used tiles if quota
+ * is exceeded.
+ */
+static void prune(tile_quota_t *q)
+{
+	char path[256];
+	tile_store_entry_t *list;
+	int count, i;
+	long read_offset = 0;
+	gboolean over;
+	gint64 usage = 0, target;
+	int removed = 0;
+
+	map_repo_t *repo = q->repo;
+
+	LOCK_MUTEX(&(q->lock));
+	usage = q->usage_bytes;
+	count = q->tile_count;
+	flush_access_log(q);
+	UNLOCK_MUTEX(&(q->lock));
+
+	/* nothing to do without listing the tiles */
+	if (usage >= 0 && (q->quota_bytes == 0 ||
+		(usage <= q->quota_bytes && ! access_log_is_long(q, count))))
+		return;
+
+	list = tile_store_list(repo, &count);
+
+	for (i=0, usage=0; i<count; i++)
+		usage += list[i].size;
+
+	LOCK_MUTEX(&(q->lock));
+	usage_changed(q);
+	q->usage_bytes = usage;
+	q->tile_count = count;
+	q->count_wanted = FALSE;
+	UNLOCK_MUTEX(&(q->lock));
+
+	if (q->quota_bytes == 0 || ! list)
+		goto END;
+
+	snprintf(path, sizeof(path), "%s/%s", repo->dir, ACCESS_LOG_FILE);
+
+	over = (usage > q->quota_bytes);
+	if (! over && ! access_log_is_long(q, count))
+		goto END;
+
+	if (over)
+		log_info("tile quota: map %s uses %lld of %llu bytes, prune", repo->name,
+			(long long)usage, (unsigned long long)q->quota_bytes);
+
+	qsort(list, count, sizeof(tile_store_entry_t), compare_key);
+
+	FILE *fp = fopen(path, "rb");
+	if (fp) {
+		apply_access_log(fp, list, count);
+		read_offset = ftell(fp);
+		fclose(fp);
+	}
+
+	if (! over)
+		goto REWRITE;
+
+	qsort(list, count, sizeof(tile_store_entry_t), compare_atime);
+
+	target = q->quota_bytes / 100 * TILE_QUOTA_LOW_WATERMARK;
+
+	for (i=0; i<count && usage > target && ! stop; i++) {
+		LOCK_MUTEX(&(q->lock));
+		gboolean pinned = is_pinned(q, &list[i]);
+		UNLOCK_MUTEX(&(q->lock));
+
+		if (pinned)
+			continue;
+
+		/* usage is updated by tile_quota_on_remove() */
+		if (tile_store_remove(repo, list[i].zoom, list[i].x, list[i].y) >= 0) {
+			usage -= list[i].size;
+			++removed;
+		}
+		/* excluded from access log */
+		list[i].size = -1;
+	}
+
+	log_info("tile quota: removed %d tiles of map %s, usage: %lld bytes", removed,
+		repo->name, (long long)usage);
+
+	if (usage > target)
+		log_warn("tile quota: map %s is over quota, the rest tiles are pinned", repo->name);
+
+	if (tile_store_garbage_size(repo) > usage / 4)
+		tile_store_compact(repo);
+
+REWRITE:
+
+	rewrite_access_log(q, list, count, read_offset);
+
+END:
+
+	free(list);
+}
+
+static void prune_repo(map_repo_t *repo, void *arg)
+{
+	tile_quota_t *q = (tile_quota_t *)repo->quota;
+
+	if (stop || ! q)
+		return;
+
+	/* usage of maps without quota is counted only for display */
+	if (q->quota_bytes > 0 || q->count_wanted)
+		prune(q);
+}
+
+static void* tile_quota_pruner_routine(void *arg)
+{
+	sigset_t sig_set;
+	sigemptyset(&sig_set);
+	sigaddset(&sig_set, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sig_set, NULL);
+
+	pthread_context_t *ctx = register_thread("tile quota pruner thread", NULL, NULL);
+
+	while (! stop) {
+		mapcfg_iterate_maplist(prune_repo, NULL);
+
+		LOCK_MUTEX(&lock);
+		if (! stop && ! wakeup)
+			wait_ms(TILE_QUOTA_PRUNE_INTERVAL * 1000, &cv, &lock, FALSE);
+		wakeup = FALSE;
+		UNLOCK_MUTEX(&lock);
+	}
+
+	free(ctx);
+
+	return NULL;
+}
+
+static void init_repo_quota(map_repo_t *repo, void *arg)
+{
+	tile_quota_t *q = (tile_quota_t *)calloc(1, sizeof(tile_quota_t));
+	if (! q) {
+		log_error("allocate memory for tile quota failed");
+		exit(0);
+	}
+
+	q->repo = repo;
+	q->quota_bytes = (guint64)repo->disk_quota_mb * 1024 * 1024;
+	q->usage_bytes = -1;
+	pthread_mutex_init(&(q->lock), NULL);
+
+	load_pins(q);
+	load_usage(q);
+
+	repo->quota = q;
+}
+
+static void cleanup_repo_quota(map_repo_t *repo, void *arg)
+{
+	tile_quota_t *q = (tile_quota_t *)repo->quota;
+	tile_pin_t *pin, *next;
+
+	if (! q)
+		return;
+
+	LOCK_MUTEX(&(q->lock));
+	flush_access_log(q);
+	save_usage(q);
+	UNLOCK_MUTEX(&(q->lock));
+
+	for (pin = q->pins; pin; pin = next) {
+		next = pin->next;
+		free(pin);
+	}
+
+	pthread_mutex_destroy(&(q->lock));
+	free(q);
+	repo->quota = NULL;
+}
+
+void tile_quota_module_init()
+{
+	mapcfg_iterate_maplist(init_repo_quota, NULL);
+
+	stop = FALSE;
+	if (pthread_create(&pruner_tid, NULL, tile_quota_pruner_routine, NULL) != 0) {
+		log_error("create tile quota pruner thread failed");
+		pruner_tid = 0;
+	}
+}
+
+/**
+ * Must be called before tile store is closed.
+ */
+void tile_quota_module_cleanup()
+{
+	LOCK_MUTEX(&lock);
+	stop = TRUE;
+	pthread_cond_signal(&cv);
+	UNLOCK_MUTEX(&lock);
+
+	/* not killed: it may be holding store lock, it checks <stop> between tiles */
+	if (pruner_tid > 0) {
+		pthread_join(pruner_tid, NULL);
+		pruner_tid = 0;
+	}
+
+	mapcfg_iterate_maplist(cleanup_repo_quota, NULL);
+}
@@ -0,0 +1,358 @@
+#include "omgps.h"
+#include "tile.h"
+#include "util.h"
+
+/**
+ * Tile download scheduler, one per downloader.
+ *
+ * Front-end, batch and background tasks are kept in one binary heap ordered by
+ * (class, rank, seq): visible tiles nearest to the view center first, then tiles
+ * just out of view, then batch tasks, then background tasks. Batch and background
+ * tasks are FIFO, since their rank is always 0.
+ *
+ * When the view changes, front-end tasks are re-classified: a task of another
+ * zoom level or more than <TILE_SCHED_MARGIN> tiles out of view is dropped, or
+ * demoted to its base class if it is also owned by a batch or background task.
+ * A queued batch task that becomes visible is promoted the same way.
+ *
+ * A hash table on (zoom, x, y) makes duplicate check O(1). It is per downloader,
+ * so repository is not part of the key.
+ *
+ * NOTE: not thread safe, the caller must hold the downloader's lock.
+ */
+
+#define INITIAL_CAPACITY	64
+#define INITIAL_BUCKETS		64
+
+/* 1/16 tile */
+#define SUBTILE_SHIFT		4
+
+#define BUCKET_OF(s, zoom, x, y) \
+	((((guint32)(x) * 73856093u) ^ ((guint32)(y) * 19349663u) ^ ((guint32)(zoom) * 83492791u)) \
+		& ((s)->bucket_count - 1))
+
+static inline gboolean before(tile_sched_entry_t *a, tile_sched_entry_t *b)
+{
+	if (a->klass != b->klass)
+		return a->klass < b->klass;
+	if (a->rank != b->rank)
+		return a->rank < b->rank;
+	return (gint32)(a->seq - b->seq) < 0;
+}
+
+static inline void heap_set(tile_sched_t *s, int i, tile_sched_entry_t *e)
+{
+	s->heap[i] = e;
+	e->heap_index = i;
+}
+
+static void sift_up(tile_sched_t *s, int i)
+{
+	tile_sched_entry_t *e = s->heap[i];
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) >> 1;
+		if (! before(e, s->heap[parent]))
+			break;
+		heap_set(s, i, s->heap[parent]);
+		i = parent;
+	}
+	heap_set(s, i, e);
+}
+
+static void sift_down(tile_sched_t *s, int i)
+{
+	tile_sched_entry_t *e = s->heap[i];
+	int child;
+
+	while ((child = (i << 1) + 1) < s->count) {
+		if (child + 1 < s->count && before(s->heap[child + 1], s->heap[child]))
+			++child;
+		if (! before(s->heap[child], e))
+			break;
+		heap_set(s, i, s->heap[child]);
+		i = child;
+	}
+	heap_set(s, i, e);
+}
+
+static void heapify(tile_sched_t *s)
+{
+	int i;
+	for (i = (s->count >> 1) - 1; i >= 0; i--)
+		sift_down(s, i);
+}
+
+static void heap_remove(tile_sched_t *s, tile_sched_entry_t *e)
+{
+	int i = e->heap_index;
+	tile_sched_entry_t *last = s->heap[--(s->count)];
+
+	if (last != e) {
+		heap_set(s, i, last);
+		sift_down(s, i);
+		sift_up(s, last->heap_index);
+	}
+	e->heap_index = -1;
+}
+
+static void hash_insert(tile_sched_t *s, tile_sched_entry_t *e)
+{
+	tile_sched_entry_t **bucket = &(s->buckets[BUCKET_OF(s, e->task.zoom, e->task.x, e->task.y)]);
+	e->hash_next = *bucket;
+	*bucket = e;
+}
+
+static void hash_remove(tile_sched_t *s, tile_sched_entry_t *e)
+{
+	tile_sched_entry_t **link = &(s->buckets[BUCKET_OF(s, e->task.zoom, e->task.x, e->task.y)]);
+
+	for (; *link; link = &((*link)->hash_next)) {
+		if (*link == e) {
+			*link = e->hash_next;
+			break;
+		}
+	}
+	e->hash_next = NULL;
+}
+
+/**
+ * Keep load factor <= 1. If allocation fails, the old table is still usable.
+ */
+static void hash_grow(tile_sched_t *s)
+{
+	int n = s->bucket_count << 1;
+	tile_sched_entry_t **buckets = (tile_sched_entry_t **)calloc(n, sizeof(tile_sched_entry_t *));
+	if (! buckets)
+		return;
+
+	free(s->buckets);
+	s->buckets = buckets;
+	s->bucket_count = n;
+
+	int i;
+	for (i=0; i<s->count; i++)
+		hash_insert(s, s->heap[i]);
+}
+
+static TILE_SCHED_CLASS classify(tile_sched_t *s, tile_sched_entry_t *e)
+{
+	e->rank = 0;
+
+	if (e->front) {
+		/* no view yet: FIFO */
+		if (! s->has_view)
+			return TILE_SCHED_VISIBLE;
+
+		if (e->task.zoom == s->zoom &&
+			e->task.x >= s->tl_tile.x - TILE_SCHED_MARGIN &&
+			e->task.x <= s->br_tile.x + TILE_SCHED_MARGIN &&
+			e->task.y >= s->tl_tile.y - TILE_SCHED_MARGIN &&
+			e->task.y <= s->br_tile.y + TILE_SCHED_MARGIN) {
+
+			gint64 dx = ((gint64)e->task.x << SUBTILE_SHIFT) + (1 << (SUBTILE_SHIFT - 1)) - s->cx;
+			gint64 dy = ((gint64)e->task.y << SUBTILE_SHIFT) + (1 << (SUBTILE_SHIFT - 1)) - s->cy;
+			e->rank = (guint32)MIN(dx * dx + dy * dy, (gint64)G_MAXUINT32);
+
+			if (e->task.x >= s->tl_tile.x && e->task.x <= s->br_tile.x &&
+				e->task.y >= s->tl_tile.y && e->task.y <= s->br_tile.y)
+				return TILE_SCHED_VISIBLE;
+			else
+				return TILE_SCHED_PREFETCH;
+		}
+
+		/* left the view: not wanted by front-end any more */
+		e->front = FALSE;
+	}
+
+	return e->base;
+}
+
+/**
+ * Re-classify all entries and rebuild the heap.
+ * Entries for which <keep> returns FALSE are dropped.
+ */
+static void rebuild(tile_sched_t *s, gboolean (*keep)(tile_sched_entry_t *e, void *arg), void *arg)
+{
+	tile_sched_entry_t *e;
+	int i, n = 0;
+
+	memset(s->class_count, 0, sizeof(s->class_count));
+
+	for (i=0; i<s->count; i++) {
+		e = s->heap[i];
+		if ((keep && ! keep(e, arg)) || (e->klass = classify(s, e)) == TILE_SCHED_NONE) {
+			hash_remove(s, e);
+			e->heap_index = -1;
+			(*s->drop)(e, s->drop_arg);
+		} else {
+			++(s->class_count[e->klass]);
+			heap_set(s, n++, e);
+		}
+	}
+
+	s->count = n;
+	heapify(s);
+}
+
+void tile_sched_init(tile_sched_t *s, tile_sched_drop_func_t drop, void *drop_arg)
+{
+	memset(s, 0, sizeof(tile_sched_t));
+
+	s->heap = (tile_sched_entry_t **)malloc(INITIAL_CAPACITY * sizeof(tile_sched_entry_t *));
+	s->capacity = s->heap? INITIAL_CAPACITY : 0;
+
+	s->buckets = (tile_sched_entry_t **)calloc(INITIAL_BUCKETS, sizeof(tile_sched_entry_t *));
+	if (! s->buckets) {
+		log_warn("allocate memory failed");
+		exit(0);
+	}
+	s->bucket_count = INITIAL_BUCKETS;
+
+	s->drop = drop;
+	s->drop_arg = drop_arg;
+}
+
+/**
+ * Drop all entries and free the scheduler's memory.
+ */
+void tile_sched_cleanup(tile_sched_t *s)
+{
+	int i;
+
+	for (i=0; i<s->count; i++)
+		(*s->drop)(s->heap[i], s->drop_arg);
+
+	free(s->heap);
+	free(s->buckets);
+	s->heap = NULL;
+	s->buckets = NULL;
+	s->count = s->capacity = s->bucket_count = 0;
+	memset(s->class_count, 0, sizeof(s->class_count));
+}
+
+tile_sched_entry_t * tile_sched_find(tile_sched_t *s, int zoom, int x, int y)
+{
+	tile_sched_entry_t *e = s->buckets[BUCKET_OF(s, zoom, x, y)];
+
+	for (; e; e = e->hash_next) {
+		if (e->task.x == x && e->task.y == y && e->task.zoom == zoom)
+			return e;
+	}
+
+	return NULL;
+}
+
+/**
+ * Queue <e>, caller must set its task, <front>, <base> and <batch> fields, and
+ * check duplicate with tile_sched_find().
+ * Return FALSE if <e> is not queued: it is out of view, or out of memory.
+ */
+gboolean tile_sched_add(tile_sched_t *s, tile_sched_entry_t *e)
+{
+	if ((e->klass = classify(s, e)) == TILE_SCHED_NONE)
+		return FALSE;
+
+	if (s->count == s->capacity) {
+		int capacity = s->capacity? (s->capacity << 1) : INITIAL_CAPACITY;
+		tile_sched_entry_t **heap = (tile_sched_entry_t **)realloc(s->heap,
+			capacity * sizeof(tile_sched_entry_t *));
+		if (! heap) {
+			log_warn("tile scheduler: allocate memory failed");
+			return FALSE;
+		}
+		s->heap = heap;
+		s->capacity = capacity;
+	}
+
+	e->seq = (s->seq)++;
+
+	heap_set(s, s->count++, e);
+	sift_up(s, e->heap_index);
+
+	hash_insert(s, e);
+	if (s->count > s->bucket_count)
+		hash_grow(s);
+
+	++(s->class_count[e->klass]);
+
+	return TRUE;
+}
+
+/**
+ * Return the first entry without removing it, or NULL if empty.
+ */
+tile_sched_entry_t * tile_sched_peek(tile_sched_t *s)
+{
+	return (s->count > 0)? s->heap[0] : NULL;
+}
+
+/**
+ * Remove and return the first entry, or NULL if empty. Caller owns it.
+ */
+tile_sched_entry_t * tile_sched_pop(tile_sched_t *s)
+{
+	if (s->count == 0)
+		return NULL;
+
+	tile_sched_entry_t *e = s->heap[0];
+
+	heap_remove(s, e);
+	hash_remove(s, e);
+	--(s->class_count[e->klass]);
+
+	return e;
+}
+
+/**
+ * Re-classify a queued entry after caller changed its <front>, <base> or <batch>.
+ */
+void tile_sched_update(tile_sched_t *s, tile_sched_entry_t *e)
+{
+	--(s->class_count[e->klass]);
+
+	if ((e->klass = classify(s, e)) == TILE_SCHED_NONE) {
+		heap_remove(s, e);
+		hash_remove(s, e);
+		(*s->drop)(e, s->drop_arg);
+		return;
+	}
+
+	++(s->class_count[e->klass]);
+	sift_down(s, e->heap_index);
+	sift_up(s, e->heap_index);
+}
+
+/**
+ * Drop entries for which <keep> returns FALSE. <keep> may change <front>, <base>
+ * or <batch> of the entries it keeps, they are re-classified.
+ */
+void tile_sched_filter(tile_sched_t *s, gboolean (*keep)(tile_sched_entry_t *e, void *arg), void *arg)
+{
+	rebuild(s, keep, arg);
+}
+
+/**
+ * Called when view range or zoom level of the repository changes.
+ */
+void tile_sched_set_view(tile_sched_t *s, int zoom, point_t tl_tile, point_t br_tile,
+	point_t center_pixel)
+{
+	int cx = (int)(((gint64)center_pixel.x << SUBTILE_SHIFT) / TILE_SIZE);
+	int cy = (int)(((gint64)center_pixel.y << SUBTILE_SHIFT) / TILE_SIZE);
+
+	if (s->has_view && s->zoom == zoom && s->cx == cx && s->cy == cy &&
+		s->tl_tile.x == tl_tile.x && s->tl_tile.y == tl_tile.y &&
+		s->br_tile.x == br_tile.x && s->br_tile.y == br_tile.y)
+		return;
+
+	s->has_view = TRUE;
+	s->zoom = zoom;
+	s->tl_tile = tl_tile;
+	s->br_tile = br_tile;
+	s->cx = cx;
+	s->cy = cy;
+
+	rebuild(s, NULL, NULL);
+}
@@ -0,0 +1,348 @@
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "omgps.h"
+#include "tile.h"
+#include "network.h"
+#include "util.h"
+
+/**
+ * Background tile integrity scrubber.
+ *
+ * Downloader only checks Content-Type, so a truncated or corrupt image may be
+ * saved, then fails to decode on every redraw. A low priority thread walks all
+ * tiles of each map once per <TILE_SCRUB_INTERVAL> seconds and checks the image
+ * structure: PNG chunk chain and CRCs up to IEND at the end of data, JPEG markers
+ * up to SOS and EOI at the end of data. Nothing is decoded. Maps of other image
+ * types are not scrubbed, and tiles of unknown format are not seen as corrupt.
+ *
+ * A corrupt tile is moved to <dir>/.quarantine/<z>-<x>-<y>.<ext> and removed
+ * from store. With map config "scrub=redownload", it is queued to the downloader
+ * as a background task, which runs only when there is nothing else to download.
+ *
+ * It is throttled: it reads <TILE_SCRUB_BATCH> tiles, then pauses, and it backs
+ * off as long as tile loader is busy. Tiles are read with tile_store_peek(),
+ * which does not count as access of disk quota (see tile_quota.c). The time of
+ * last completed pass is saved to <dir>/.scrubbed.
+ */
+
+#define SCRUBBED_FILE		".scrubbed"
+#define QUARANTINE_DIR		".quarantine"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
+
+static pthread_t scrubber_tid = 0;
+static gboolean stop = FALSE;
+
+static const guchar png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+#define BE32(p) (((guint32)(p)[0] << 24) | ((guint32)(p)[1] << 16) | \
+	((guint32)(p)[2] << 8) | (guint32)(p)[3])
+
+static gboolean check_png(const guchar *data, int len)
+{
+	const guchar *p = data + sizeof(png_signature);
+	const guchar *end = data + len;
+	gboolean first = TRUE;
+	guint32 n;
+
+	/* chunk: length, type, data, CRC of type and data */
+	while (end - p >= 12) {
+		n = BE32(p);
+		if (n > (guint32)(end - p) - 12)
+			return FALSE;
+
+		if (first && memcmp(p + 4, "IHDR", 4) != 0)
+			return FALSE;
+		first = FALSE;
+
+		if (crc32(crc32(0L, Z_NULL, 0), p + 4, n + 4) != BE32(p + 8 + n))
+			return FALSE;
+
+		if (memcmp(p + 4, "IEND", 4) == 0)
+			return (p + 12 + n == end);
+
+		p += 12 + n;
+	}
+
+	return FALSE;
+}
+
+static gboolean check_jpeg(const guchar *data, int len)
+{
+	const guchar *p = data + 2;
+	const guchar *end = data + len;
+	int n;
+
+	/* segments up to start of scan */
+	while (end - p >= 4) {
+		if (p[0] != 0xFF)
+			return FALSE;
+		if (p[1] == 0xFF) {
+			/* fill byte */
+			++p;
+			continue;
+		}
+		if (p[1] == 0xD9)
+			return FALSE;
+
+		n = (p[2] << 8) | p[3];
+		if (n < 2 || n > end - p - 2)
+			return FALSE;
+
+		if (p[1] == 0xDA)
+			break;
+
+		p += 2 + n;
+	}
+
+	if (end - p < 4)
+		return FALSE;
+
+	/* entropy coded data is not parsed, but it must end with EOI.
+	 * Some encoders pad zero bytes after it */
+	while (end - p > 2 && end[-1] == 0)
+		--end;
+
+	return (end[-2] == 0xFF && end[-1] == 0xD9);
+}
+
+/**
+ * Check structure of PNG or JPEG image <data>. Other formats are not known, they
+ * are never reported as bad.
+ */
+TILE_IMAGE_CHECK tile_image_check(const guchar *data, int len)
+{
+	/* empty file is bad in any format */
+	if (len <= 0)
+		return TILE_IMAGE_BAD;
+
+	if (len > (int)sizeof(png_signature) &&
+		memcmp(data, png_signature, sizeof(png_signature)) == 0)
+		return check_png(data, len)? TILE_IMAGE_OK : TILE_IMAGE_BAD;
+
+	if (len > 4 && data[0] == 0xFF && data[1] == 0xD8)
+		return check_jpeg(data, len)? TILE_IMAGE_OK : TILE_IMAGE_BAD;
+
+	return TILE_IMAGE_UNKNOWN;
+}
+
+/**
+ * Only PNG and JPEG maps are scrubbed, see tile_image_check().
+ */
+static gboolean scrubbable(map_repo_t *repo)
+{
+	return repo->image_type && (strcmp(repo->image_type, "png") == 0 ||
+		strcmp(repo->image_type, "jpg") == 0 || strcmp(repo->image_type, "jpeg") == 0);
+}
+
+/**
+ * Wait <ms>, return TRUE if the module is being stopped.
+ */
+static gboolean pause_ms(int ms)
+{
+	gboolean ret;
+
+	LOCK_MUTEX(&lock);
+	if (! stop)
+		wait_ms(ms, &cv, &lock, FALSE);
+	ret = stop;
+	UNLOCK_MUTEX(&lock);
+
+	return ret;
+}
+
+static time_t load_scrubbed_time(map_repo_t *repo)
+{
+	char path[256], buf[32];
+	time_t t = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", repo->dir, SCRUBBED_FILE);
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	int n = read(fd, buf, sizeof(buf) - 1);
+	if (n > 0) {
+		buf[n] = '\0';
+		t = (time_t)atol(buf);
+	}
+	close(fd);
+
+	return t;
+}
+
+static void save_scrubbed_time(map_repo_t *repo, time_t t)
+{
+	char path[256], buf[32];
+
+	snprintf(path, sizeof(path), "%s/%s", repo->dir, SCRUBBED_FILE);
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		log_warn("tile scrub: unable to save %s", path);
+		return;
+	}
+
+	int n = snprintf(buf, sizeof(buf), "%ld\n", (long)t);
+	if (write(fd, buf, n) != n)
+		log_warn("tile scrub: write %s failed", path);
+	close(fd);
+}
+
+/**
+ * Keep a copy of the corrupt tile for inspection, then remove it from store.
+ */
+static void quarantine(map_repo_t *repo, int zoom, int x, int y, const guchar *data, int len)
+{
+	char path[256];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/%s", repo->dir, QUARANTINE_DIR);
+	if (stat(path, &st) != 0 && g_mkdir_with_parents(path, 0700) != 0) {
+		log_warn("tile scrub: failed to mkdir: %s", path);
+	} else {
+		snprintf(path, sizeof(path), "%s/%s/%d-%d-%d.%s",
+			repo->dir, QUARANTINE_DIR, zoom, x, y, repo->image_type);
+		int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd >= 0) {
+			if (write(fd, data, len) != len)
+				log_warn("tile scrub: write %s failed", path);
+			close(fd);
+		}
+	}
+
+	tile_store_remove(repo, zoom, x, y);
+
+	if (g_view.blob_cache)
+		tilecache_l2_remove(g_view.blob_cache, repo, zoom, x, y);
+}
+
+static void redownload(map_repo_t *repo, int zoom, int x, int y)
+{
+	char path[256];
+
+	if (! g_context.dl_if_absent || count_network_interfaces() == 0)
+		return;
+
+	if (! tile_store_tmp_path(repo, zoom, x, y, path, sizeof(path)))
+		return;
+
+	/* SPECIAL NOTE: also synchronize access to Python interpreter! */
+	char *url = mapcfg_get_dl_url(repo, zoom, x, y);
+	if (! url) {
+		log_warn("tile scrub: can't get url for map: %s", repo->name);
+		return;
+	}
+
+	add_background_download_task(repo, zoom, x, y, strdup(path), url);
+}
+
+static void scrub_repo(map_repo_t *repo, void *arg)
+{
+	tile_store_entry_t *list, *e;
+	guchar *data;
+	gboolean absent;
+	int count, len, i, checked = 0, bad = 0;
+
+	if (stop || (repo->scrub && strcmp(repo->scrub, "off") == 0) || ! scrubbable(repo))
+		return;
+
+	time_t start = time(NULL);
+	if (start - load_scrubbed_time(repo) < TILE_SCRUB_INTERVAL)
+		return;
+
+	list = tile_store_list(repo, &count);
+
+	for (i=0; i<count; i++) {
+		e = &list[i];
+
+		/* give way to tile loader */
+		while (! tile_loader_is_idle()) {
+			if (pause_ms(TILE_SCRUB_PAUSE_MS))
+				goto END;
+		}
+
+		data = tile_store_peek(repo, e->zoom, e->x, e->y, &len, &absent);
+		if (! data)
+			continue;
+
+		/* an image of unknown format is left alone */
+		if (tile_image_check(data, len) == TILE_IMAGE_BAD) {
+			log_warn("tile scrub: corrupt tile: map=%s, zoom=%d, x=%d, y=%d, len=%d",
+				repo->name, e->zoom, e->x, e->y, len);
+			quarantine(repo, e->zoom, e->x, e->y, data, len);
+			if (repo->scrub && strcmp(repo->scrub, "redownload") == 0)
+				redownload(repo, e->zoom, e->x, e->y);
+			++bad;
+		}
+		g_free(data);
+
+		if (++checked % TILE_SCRUB_BATCH == 0 && pause_ms(TILE_SCRUB_PAUSE_MS))
+			goto END;
+	}
+
+	save_scrubbed_time(repo, start);
+	log_info("tile scrub: map=%s, checked %d tiles, %d corrupt", repo->name, checked, bad);
+
+END:
+
+	free(list);
+}
+
+static void* tile_scrubber_routine(void *arg)
+{
+	sigset_t sig_set;
+	sigemptyset(&sig_set);
+	sigaddset(&sig_set, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sig_set, NULL);
+
+	pthread_context_t *ctx = register_thread("tile scrubber thread", NULL, NULL);
+
+	/* don't slow down start up */
+	pause_ms(TILE_SCRUB_START_DELAY * 1000);
+
+	while (! stop) {
+		mapcfg_iterate_maplist(scrub_repo, NULL);
+
+		/* due time is checked per map */
+		pause_ms(TILE_SCRUB_CHECK_INTERVAL * 1000);
+	}
+
+	free(ctx);
+
+	return NULL;
+}
+
+void tile_scrub_module_init()
+{
+	stop = FALSE;
+	if (pthread_create(&scrubber_tid, NULL, tile_scrubber_routine, NULL) != 0) {
+		log_error("create tile scrubber thread failed");
+		scrubber_tid = 0;
+	}
+}
+
+/**
+ * Must be called before tile downloader and tile store are cleaned up.
+ */
+void tile_scrub_module_cleanup()
+{
+	LOCK_MUTEX(&lock);
+	stop = TRUE;
+	pthread_cond_signal(&cv);
+	UNLOCK_MUTEX(&lock);
+
+	/* not killed: it may be holding store lock, it checks <stop> between tiles */
+	if (scrubber_tid > 0) {
+		pthread_join(scrubber_tid, NULL);
+		scrubber_tid = 0;
+	}
+}
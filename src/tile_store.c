@@ -0,0 +1,1547 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "omgps.h"
+#include "tile.h"
+#include "util.h"
+
+/**
+ * Tile storage, per map repository. Tile loader, downloader and batch downloader
+ * read and write tiles through this interface only.
+ *
+ * Two backends, selected with "store=" of map config:
+ *
+ * (1) dir (default): each tile is a file <dir>/<z>/<x>/<y>.<ext>
+ *
+ * (2) pack: all tiles are appended to <dir>/tiles.pack, each one is prefixed with
+ *     a record header. <dir>/tiles.idx is a mmapped open addressing hash table
+ *     (linear probing) that maps (z, x, y) to (offset, len) of the pack file.
+ *     A re-written tile is appended again and its slot is updated, the old bytes
+ *     are left as garbage. If the index is missing, broken or was not closed
+ *     cleanly (e.g., power lost while tiles were being written), it is rebuilt by
+ *     scanning record headers of the pack file.
+ *
+ * Downloaded tiles are first written to a temp file (see tile_store_tmp_path()),
+ * then committed to the store with tile_store_commit().
+ *
+ * Existence checks are memory lookups for both backends. Pack backend looks up
+ * the index. Dir backend keeps a sparse presence bitmap per zoom level: blocks of
+ * 64 * 64 tiles in a small hash table. It is loaded on first use from
+ * <dir>/.presence/<z>, or rebuilt by reading directories <dir>/<z>/<x>/ (one
+ * readdir() per column instead of one stat() per tile), and updated on commit.
+ * The file is removed on first change (also of a zoom level that is not loaded)
+ * and saved again on exit, so a crash causes a rebuild instead of a stale bitmap.
+ * It is also rebuilt if mtime of <dir>/<z> or of any column <dir>/<z>/<x> has
+ * changed, e.g., tiles are copied in or removed by hand.
+ *
+ * Tiles can be removed (see tile_quota.c). Removed bytes of pack file are left
+ * as garbage until tile_store_compact() rewrites the pack file.
+ *
+ * Identical tiles (sea, empty land, "no imagery") are stored once. Content hash
+ * of recently committed tiles is kept in a small direct-mapped table; if a new
+ * tile has the same hash, length and bytes as the indexed one, dir backend
+ * hardlinks the existing file (file systems without hardlinks, e.g., vfat, just
+ * store the new file), pack backend appends a link record that points to the
+ * existing bytes instead of the bytes.
+ */
+
+#define PACK_DATA_FILE		"tiles.pack"
+#define PACK_INDEX_FILE		"tiles.idx"
+#define PACK_NEW_SUFFIX		".new"
+#define PACK_TMP_DIR		"tmp"
+
+#define PACK_INDEX_MAGIC	"OMGPSIX2"
+#define PACK_RECORD_MAGIC	0x54494C45	/* "TILE" */
+/* record of a duplicated tile: the payload is guint64 offset of the image bytes */
+#define PACK_LINK_MAGIC		0x4C494E4B	/* "LINK" */
+
+/* initial slots, power of 2 */
+#define PACK_INDEX_MIN_CAPACITY	4096
+
+#define PRESENCE_DIR		".presence"
+#define PRESENCE_MAGIC		"OMGPSPR2"
+
+#define PRESENCE_BLOCK_MASK	((1 << TILE_PRESENCE_BLOCK_SHIFT) - 1)
+
+/* presence file header, followed by <block_count> of (bx, by, bits) */
+typedef struct __presence_file_head_t
+{
+	char magic[8];
+	guint32 block_count;
+	guint32 count;
+	/* see zoom_dir_stamp() */
+	gint64 dir_stamp;
+} presence_file_head_t;
+
+#define INDEX_FILE_SIZE(capacity) \
+	(sizeof(tile_pack_index_head_t) + (capacity) * sizeof(tile_pack_slot_t))
+
+static inline guint slot_hash(int zoom, int x, int y)
+{
+	guint h = (guint)zoom;
+	h = h * 0x9E3779B1 + (guint)x;
+	h = h * 0x85EBCA77 + (guint)y;
+	return h ^ (h >> 15);
+}
+
+/**
+ * Format tile fullpath of dir backend to <buf>
+ */
+gboolean format_tile_file_path(map_repo_t *repo, int zoom, int x, int y, char *buf, int buflen)
+{
+	if (snprintf(buf, buflen, "%s/%d/%d/%d.%s",	repo->dir, zoom, x, y, repo->image_type) <= 0) {
+		log_error("snprintf tile file path failed");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static inline tile_presence_block_t ** presence_bucket(tile_presence_t *p, int bx, int by)
+{
+	guint h = (guint)bx * 0x9E3779B1 + (guint)by;
+	return &(p->buckets[(h ^ (h >> 15)) & (TILE_PRESENCE_BUCKETS - 1)]);
+}
+
+static tile_presence_block_t * presence_find_block(tile_presence_t *p, int bx, int by,
+	gboolean create)
+{
+	tile_presence_block_t **bucket = presence_bucket(p, bx, by);
+	tile_presence_block_t *b;
+
+	for (b = *bucket; b; b = b->next) {
+		if (b->bx == bx && b->by == by)
+			return b;
+	}
+
+	if (! create)
+		return NULL;
+
+	b = (tile_presence_block_t *)calloc(1, sizeof(tile_presence_block_t));
+	if (! b) {
+		log_error("allocate memory for tile presence failed");
+		exit(0);
+	}
+	b->bx = bx;
+	b->by = by;
+	b->next = *bucket;
+	*bucket = b;
+	++p->block_count;
+
+	return b;
+}
+
+#define PRESENCE_BIT(x, y) \
+	((((y) & PRESENCE_BLOCK_MASK) << TILE_PRESENCE_BLOCK_SHIFT) | ((x) & PRESENCE_BLOCK_MASK))
+
+static gboolean presence_get(tile_presence_t *p, int x, int y)
+{
+	tile_presence_block_t *b = presence_find_block(p,
+		x >> TILE_PRESENCE_BLOCK_SHIFT, y >> TILE_PRESENCE_BLOCK_SHIFT, FALSE);
+	if (! b)
+		return FALSE;
+
+	int i = PRESENCE_BIT(x, y);
+	return (b->bits[i >> 5] & (1U << (i & 31))) != 0;
+}
+
+/**
+ * Return TRUE if the bit is changed.
+ */
+static gboolean presence_set(tile_presence_t *p, int x, int y, gboolean present)
+{
+	tile_presence_block_t *b = presence_find_block(p,
+		x >> TILE_PRESENCE_BLOCK_SHIFT, y >> TILE_PRESENCE_BLOCK_SHIFT, present);
+	if (! b)
+		return FALSE;
+
+	int i = PRESENCE_BIT(x, y);
+	guint32 mask = 1U << (i & 31);
+	gboolean old = (b->bits[i >> 5] & mask) != 0;
+
+	if (old == present)
+		return FALSE;
+
+	if (present) {
+		b->bits[i >> 5] |= mask;
+		++p->count;
+	} else {
+		b->bits[i >> 5] &= ~mask;
+		--p->count;
+	}
+
+	return TRUE;
+}
+
+static void presence_free(tile_presence_t *p)
+{
+	tile_presence_block_t *b, *next;
+	int i;
+
+	for (i=0; i<TILE_PRESENCE_BUCKETS; i++) {
+		for (b = p->buckets[i]; b; b = next) {
+			next = b->next;
+			free(b);
+		}
+	}
+	free(p);
+}
+
+static inline guint64 stamp_mix(guint64 h)
+{
+	h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+	return h ^ (h >> 31);
+}
+
+/**
+ * Return a stamp of <dir>/<zoom> and its columns <dir>/<zoom>/<x>, it changes when
+ * a tile file is added to or removed from any column. -1 if there is no such dir.
+ * One stat() per column.
+ */
+static gint64 zoom_dir_stamp(map_repo_t *repo, int zoom)
+{
+	char path[256];
+	struct stat st;
+	struct dirent *xe;
+	DIR *zdir;
+	char *end;
+	int x;
+
+	snprintf(path, sizeof(path), "%s/%d", repo->dir, zoom);
+	if (stat(path, &st) != 0 || ! (zdir = opendir(path)))
+		return -1;
+
+	guint64 stamp = stamp_mix((guint64)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec);
+
+	while ((xe = readdir(zdir))) {
+		x = strtol(xe->d_name, &end, 10);
+		if (end == xe->d_name || *end != '\0')
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%d/%d", repo->dir, zoom, x);
+		if (stat(path, &st) != 0)
+			continue;
+
+		/* sum: independent of readdir order */
+		stamp += stamp_mix(((guint64)x << 32) ^
+			((guint64)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec));
+	}
+
+	closedir(zdir);
+
+	return (gint64)(stamp & G_MAXINT64);
+}
+
+static gboolean presence_read_file(tile_store_t *store, int zoom, tile_presence_t *p)
+{
+	char path[256];
+	presence_file_head_t head;
+	gint32 bxy[2];
+	guint32 i;
+	gboolean ret = FALSE;
+
+	snprintf(path, sizeof(path), "%s/%s/%d", store->repo->dir, PRESENCE_DIR, zoom);
+
+	FILE *fp = fopen(path, "rb");
+	if (! fp)
+		return FALSE;
+
+	if (fread(&head, sizeof(head), 1, fp) != 1 ||
+		memcmp(head.magic, PRESENCE_MAGIC, sizeof(head.magic)) != 0 ||
+		head.dir_stamp != zoom_dir_stamp(store->repo, zoom))
+		goto END;
+
+	for (i=0; i<head.block_count; i++) {
+		if (fread(bxy, sizeof(bxy), 1, fp) != 1)
+			goto END;
+		tile_presence_block_t *b = presence_find_block(p, bxy[0], bxy[1], TRUE);
+		if (fread(b->bits, sizeof(b->bits), 1, fp) != 1)
+			goto END;
+	}
+
+	p->count = head.count;
+	ret = TRUE;
+
+END:
+
+	fclose(fp);
+	if (! ret)
+		log_warn("tile store: presence file is out of date: %s", path);
+	return ret;
+}
+
+static void presence_write_file(tile_store_t *store, int zoom, tile_presence_t *p)
+{
+	char path[256], tmp_path[256];
+	presence_file_head_t head;
+	tile_presence_block_t *b;
+	gint32 bxy[2];
+	int i;
+	gboolean ok = TRUE;
+
+	head.dir_stamp = zoom_dir_stamp(store->repo, zoom);
+	if (head.dir_stamp < 0)
+		return;
+
+	snprintf(path, sizeof(path), "%s/%s", store->repo->dir, PRESENCE_DIR);
+	if (g_mkdir_with_parents(path, 0700) != 0)
+		return;
+
+	snprintf(path, sizeof(path), "%s/%s/%d", store->repo->dir, PRESENCE_DIR, zoom);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	FILE *fp = fopen(tmp_path, "wb");
+	if (! fp)
+		return;
+
+	memcpy(head.magic, PRESENCE_MAGIC, sizeof(head.magic));
+	head.block_count = p->block_count;
+	head.count = p->count;
+	ok = (fwrite(&head, sizeof(head), 1, fp) == 1);
+
+	for (i=0; ok && i<TILE_PRESENCE_BUCKETS; i++) {
+		for (b = p->buckets[i]; ok && b; b = b->next) {
+			bxy[0] = b->bx;
+			bxy[1] = b->by;
+			ok = fwrite(bxy, sizeof(bxy), 1, fp) == 1 &&
+				fwrite(b->bits, sizeof(b->bits), 1, fp) == 1;
+		}
+	}
+
+	if (fclose(fp) != 0)
+		ok = FALSE;
+
+	if (! ok || rename(tmp_path, path) != 0) {
+		log_warn("tile store: save presence file %s failed", path);
+		unlink(tmp_path);
+	}
+}
+
+/**
+ * Read all columns of <dir>/<zoom>/, set bits of files named <y>.<ext>
+ */
+static void presence_rebuild(tile_store_t *store, int zoom, tile_presence_t *p)
+{
+	char path[256];
+	DIR *zdir, *xdir;
+	struct dirent *xe, *ye;
+	char *end;
+	int x, y;
+
+	snprintf(path, sizeof(path), "%s/%d", store->repo->dir, zoom);
+	if (! (zdir = opendir(path)))
+		return;
+
+	log_info("tile store: build presence of map %s, zoom %d", store->repo->name, zoom);
+
+	while ((xe = readdir(zdir))) {
+		x = strtol(xe->d_name, &end, 10);
+		if (end == xe->d_name || *end != '\0')
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%d/%d", store->repo->dir, zoom, x);
+		if (! (xdir = opendir(path)))
+			continue;
+
+		while ((ye = readdir(xdir))) {
+			y = strtol(ye->d_name, &end, 10);
+			/* skip temp files */
+			if (end == ye->d_name || *end != '.' ||
+				strcmp(end + 1, store->repo->image_type) != 0)
+				continue;
+			presence_set(p, x, y, TRUE);
+		}
+
+		closedir(xdir);
+	}
+
+	closedir(zdir);
+}
+
+/**
+ * Return presence of <zoom>, load it on first use.
+ * Caller must hold store lock (read), the lock may be re-acquired as write lock.
+ */
+static tile_presence_t * presence_of(tile_store_t *store, int zoom)
+{
+	tile_presence_t *p = store->presence[zoom];
+	if (p)
+		return p;
+
+	pthread_rwlock_unlock(&(store->lock));
+	pthread_rwlock_wrlock(&(store->lock));
+
+	/* double check */
+	if ((p = store->presence[zoom]))
+		return p;
+
+	p = (tile_presence_t *)calloc(1, sizeof(tile_presence_t));
+	if (! p) {
+		log_error("allocate memory for tile presence failed");
+		exit(0);
+	}
+
+	if (! presence_read_file(store, zoom, p)) {
+		presence_free(p);
+		p = (tile_presence_t *)calloc(1, sizeof(tile_presence_t));
+		if (! p) {
+			log_error("allocate memory for tile presence failed");
+			exit(0);
+		}
+		presence_rebuild(store, zoom, p);
+		p->dirty = TRUE;
+	}
+
+	store->presence[zoom] = p;
+
+	return p;
+}
+
+/**
+ * Caller must hold store write lock.
+ */
+static void presence_update(tile_store_t *store, int zoom, int x, int y, gboolean present)
+{
+	tile_presence_t *p = store->presence[zoom];
+	char path[256];
+
+	/* not loaded yet: the file is out of date, it will be rebuilt from disk */
+	if (! p) {
+		snprintf(path, sizeof(path), "%s/%s/%d", store->repo->dir, PRESENCE_DIR, zoom);
+		unlink(path);
+		return;
+	}
+
+	if (! presence_set(p, x, y, present))
+		return;
+
+	if (! p->dirty) {
+		snprintf(path, sizeof(path), "%s/%s/%d", store->repo->dir, PRESENCE_DIR, zoom);
+		unlink(path);
+		p->dirty = TRUE;
+	}
+}
+
+static void presence_cleanup(tile_store_t *store)
+{
+	int i;
+	for (i=0; i<MAX_ZOOM_LEVELS; i++) {
+		if (store->presence[i]) {
+			if (store->presence[i]->dirty)
+				presence_write_file(store, i, store->presence[i]);
+			presence_free(store->presence[i]);
+			store->presence[i] = NULL;
+		}
+	}
+}
+
+/**
+ * Return the indexed tile of <hash> and <len>, or NULL.
+ * Caller must hold store write lock.
+ */
+static tile_dedup_t * dedup_lookup(tile_store_t *store, guint64 hash, int len)
+{
+	tile_dedup_t *e = &(store->dedup[hash & (TILE_DEDUP_SLOTS - 1)]);
+	return (e->len == len && e->hash == hash)? e : NULL;
+}
+
+/**
+ * Index a new tile. A popular entry (hits > 0) is kept, but aged.
+ * Caller must hold store write lock.
+ */
+static void dedup_record(tile_store_t *store, guint64 hash, int len, int zoom, int x, int y,
+	guint64 offset)
+{
+	tile_dedup_t *e = &(store->dedup[hash & (TILE_DEDUP_SLOTS - 1)]);
+
+	if (e->len > 0 && e->hash != hash && e->hits-- > 0)
+		return;
+
+	e->hash = hash;
+	e->len = len;
+	e->hits = 0;
+	e->zoom = zoom;
+	e->x = x;
+	e->y = y;
+	e->offset = offset;
+}
+
+/**
+ * Return the slot of the tile, or the empty slot to insert it.
+ * Caller must hold store lock.
+ */
+static tile_pack_slot_t * pack_find_slot(tile_store_t *store, int zoom, int x, int y)
+{
+	guint mask = store->index->capacity - 1;
+	guint i = slot_hash(zoom, x, y) & mask;
+	tile_pack_slot_t *slot;
+
+	for (;; i = (i + 1) & mask) {
+		slot = &(store->slots[i]);
+		if (slot->zoom == 0 ||
+			(slot->zoom == zoom + 1 && slot->x == x && slot->y == y))
+			return slot;
+	}
+}
+
+static inline void pack_set_slot(tile_pack_slot_t *slot, int zoom, int x, int y,
+	guint64 offset, int len)
+{
+	slot->x = x;
+	slot->y = y;
+	slot->len = len;
+	slot->offset = offset;
+	/* key marker is set last */
+	slot->zoom = zoom + 1;
+}
+
+static void pack_unmap_index(tile_store_t *store)
+{
+	if (store->index) {
+		msync(store->index, store->index_size, MS_SYNC);
+		munmap(store->index, store->index_size);
+		store->index = NULL;
+		store->slots = NULL;
+	}
+	if (store->index_fd >= 0) {
+		close(store->index_fd);
+		store->index_fd = -1;
+	}
+}
+
+/**
+ * Create an empty index file <path> with <capacity> slots and map it.
+ */
+static gboolean pack_create_index(tile_store_t *store, const char *path, guint capacity)
+{
+	size_t size = INDEX_FILE_SIZE(capacity);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		log_error("tile store: create index %s failed: %s", path, strerror(errno));
+		return FALSE;
+	}
+
+	/* sparse file, reads as zero: all slots are empty */
+	if (ftruncate(fd, size) != 0) {
+		log_error("tile store: truncate index %s failed: %s", path, strerror(errno));
+		close(fd);
+		return FALSE;
+	}
+
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		log_error("tile store: mmap index %s failed: %s", path, strerror(errno));
+		close(fd);
+		return FALSE;
+	}
+
+	store->index_fd = fd;
+	store->index_size = size;
+	store->index = (tile_pack_index_head_t *)p;
+	store->slots = (tile_pack_slot_t *)((char *)p + sizeof(tile_pack_index_head_t));
+
+	memcpy(store->index->magic, PACK_INDEX_MAGIC, sizeof(store->index->magic));
+	store->index->capacity = capacity;
+	store->index->count = 0;
+	store->index->clean = FALSE;
+
+	return TRUE;
+}
+
+/**
+ * Open and map index <path>. It is refused if it was not closed cleanly: pack file
+ * and slots are written without ordering, a slot may point to bytes that never
+ * reached the disk. Slots beyond end of pack file are also refused.
+ * Data file must be opened first.
+ */
+static gboolean pack_open_index(tile_store_t *store, const char *path)
+{
+	struct stat st;
+	tile_pack_index_head_t head;
+	tile_pack_slot_t *slot;
+	guint i;
+
+	int fd = open(path, O_RDWR);
+	if (fd < 0)
+		return FALSE;
+
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(head) ||
+		read(fd, &head, sizeof(head)) != sizeof(head) ||
+		memcmp(head.magic, PACK_INDEX_MAGIC, sizeof(head.magic)) != 0 ||
+		head.capacity < PACK_INDEX_MIN_CAPACITY || (head.capacity & (head.capacity - 1)) ||
+		st.st_size != INDEX_FILE_SIZE(head.capacity)) {
+		log_warn("tile store: bad index file: %s", path);
+		close(fd);
+		return FALSE;
+	}
+
+	if (! head.clean) {
+		log_warn("tile store: index file was not closed cleanly: %s", path);
+		close(fd);
+		return FALSE;
+	}
+
+	void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		close(fd);
+		return FALSE;
+	}
+
+	store->index_fd = fd;
+	store->index_size = st.st_size;
+	store->index = (tile_pack_index_head_t *)p;
+	store->slots = (tile_pack_slot_t *)((char *)p + sizeof(tile_pack_index_head_t));
+
+	for (i=0; i<store->index->capacity; i++) {
+		slot = &(store->slots[i]);
+		if (slot->zoom != 0 && slot->offset + slot->len > store->data_size) {
+			log_warn("tile store: index file points beyond pack file: %s", path);
+			pack_unmap_index(store);
+			return FALSE;
+		}
+	}
+
+	/* in use: a crash from now on makes it rebuilt */
+	store->index->clean = FALSE;
+	msync(store->index, sizeof(tile_pack_index_head_t), MS_SYNC);
+
+	return TRUE;
+}
+
+/**
+ * Double the index: build a new index file, then replace the old one.
+ * Caller must hold store write lock.
+ */
+static gboolean pack_grow_index(tile_store_t *store)
+{
+	char path[256], new_path[256];
+	tile_store_t tmp;
+	guint i;
+
+	snprintf(path, sizeof(path), "%s/%s", store->repo->dir, PACK_INDEX_FILE);
+	snprintf(new_path, sizeof(new_path), "%s.new", path);
+
+	memset(&tmp, 0, sizeof(tmp));
+	if (! pack_create_index(&tmp, new_path, store->index->capacity << 1))
+		return FALSE;
+
+	tile_pack_slot_t *slot;
+	for (i=0; i<store->index->capacity; i++) {
+		slot = &(store->slots[i]);
+		if (slot->zoom == 0)
+			continue;
+		*pack_find_slot(&tmp, slot->zoom - 1, slot->x, slot->y) = *slot;
+		++tmp.index->count;
+	}
+
+	msync(tmp.index, tmp.index_size, MS_SYNC);
+
+	if (rename(new_path, path) != 0) {
+		log_error("tile store: replace index failed: %s", strerror(errno));
+		pack_unmap_index(&tmp);
+		unlink(new_path);
+		return FALSE;
+	}
+
+	pack_unmap_index(store);
+	store->index_fd = tmp.index_fd;
+	store->index_size = tmp.index_size;
+	store->index = tmp.index;
+	store->slots = tmp.slots;
+
+	return TRUE;
+}
+
+/**
+ * Scan record headers of pack file to rebuild the index. A broken tail
+ * (e.g., power lost during append) is truncated.
+ */
+static gboolean pack_rebuild_index(tile_store_t *store, const char *path)
+{
+	tile_pack_record_t rec;
+	guint64 offset = 0;
+
+	if (store->data_size > 0)
+		log_info("tile store: rebuild index of map: %s", store->repo->name);
+
+	if (! pack_create_index(store, path, PACK_INDEX_MIN_CAPACITY))
+		return FALSE;
+
+	tile_pack_record_t target;
+	guint64 data_offset;
+	int len;
+
+	while (pread(store->data_fd, &rec, sizeof(rec), offset) == sizeof(rec)) {
+		if ((rec.magic != PACK_RECORD_MAGIC && rec.magic != PACK_LINK_MAGIC) ||
+			offset + sizeof(rec) + rec.len > store->data_size)
+			break;
+
+		if (rec.magic == PACK_RECORD_MAGIC) {
+			data_offset = offset + sizeof(rec);
+			len = rec.len;
+		} else {
+			/* link: to bytes of an earlier record */
+			if (rec.len != sizeof(data_offset) ||
+				pread(store->data_fd, &data_offset, sizeof(data_offset),
+					offset + sizeof(rec)) != sizeof(data_offset) ||
+				data_offset < sizeof(target) || data_offset > offset ||
+				pread(store->data_fd, &target, sizeof(target),
+					data_offset - sizeof(target)) != sizeof(target) ||
+				target.magic != PACK_RECORD_MAGIC)
+				break;
+			len = target.len;
+		}
+
+		if ((store->index->count + 1) << 1 > store->index->capacity &&
+			! pack_grow_index(store))
+			return FALSE;
+
+		tile_pack_slot_t *slot = pack_find_slot(store, rec.zoom, rec.x, rec.y);
+		if (slot->zoom == 0)
+			++store->index->count;
+		pack_set_slot(slot, rec.zoom, rec.x, rec.y, data_offset, len);
+
+		offset += sizeof(rec) + rec.len;
+	}
+
+	if (offset < store->data_size) {
+		log_warn("tile store: truncate broken tail of %s/%s at %llu",
+			store->repo->dir, PACK_DATA_FILE, (unsigned long long)offset);
+		if (ftruncate(store->data_fd, offset) == 0)
+			store->data_size = offset;
+	}
+
+	return TRUE;
+}
+
+static gboolean pack_open(tile_store_t *store)
+{
+	char path[256];
+	struct stat st;
+
+	map_repo_t *repo = store->repo;
+
+	if (stat(repo->dir, &st) != 0 && g_mkdir_with_parents(repo->dir, 0700) != 0) {
+		log_error("tile store: mkdir %s failed", repo->dir);
+		return FALSE;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", repo->dir, PACK_DATA_FILE);
+	store->data_fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (store->data_fd < 0) {
+		log_error("tile store: open %s failed: %s", path, strerror(errno));
+		return FALSE;
+	}
+
+	if (fstat(store->data_fd, &st) != 0) {
+		close(store->data_fd);
+		store->data_fd = -1;
+		return FALSE;
+	}
+	store->data_size = st.st_size;
+
+	snprintf(path, sizeof(path), "%s/%s", repo->dir, PACK_INDEX_FILE);
+	if (! pack_open_index(store, path) && ! pack_rebuild_index(store, path)) {
+		pack_unmap_index(store);
+		close(store->data_fd);
+		store->data_fd = -1;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void open_repo_store(map_repo_t *repo, void *arg)
+{
+	tile_store_t *store = (tile_store_t *)calloc(1, sizeof(tile_store_t));
+	if (! store) {
+		log_error("allocate memory for tile store failed");
+		exit(0);
+	}
+
+	store->repo = repo;
+	store->type = TILE_STORE_DIR;
+	store->data_fd = store->index_fd = -1;
+	pthread_rwlock_init(&(store->lock), NULL);
+
+	store->dedup = (tile_dedup_t *)calloc(TILE_DEDUP_SLOTS, sizeof(tile_dedup_t));
+	if (! store->dedup) {
+		log_error("allocate memory for tile store failed");
+		exit(0);
+	}
+
+	if (repo->store_type && strcmp(repo->store_type, "pack") == 0) {
+		if (pack_open(store))
+			store->type = TILE_STORE_PACK;
+		else
+			log_warn("tile store: open pack of map %s failed, use dir instead", repo->name);
+	}
+
+	repo->store = store;
+}
+
+static void close_repo_store(map_repo_t *repo, void *arg)
+{
+	tile_store_t *store = (tile_store_t *)repo->store;
+	if (! store)
+		return;
+
+	pthread_rwlock_wrlock(&(store->lock));
+
+	if (store->type == TILE_STORE_PACK) {
+		/* tiles, then slots, then the flag */
+		if (store->index && fsync(store->data_fd) == 0 &&
+			msync(store->index, store->index_size, MS_SYNC) == 0)
+			store->index->clean = TRUE;
+		pack_unmap_index(store);
+		close(store->data_fd);
+		store->data_fd = -1;
+	} else {
+		presence_cleanup(store);
+	}
+
+	pthread_rwlock_unlock(&(store->lock));
+
+	pthread_rwlock_destroy(&(store->lock));
+	free(store->dedup);
+	free(store);
+	repo->store = NULL;
+}
+
+void tile_store_module_init()
+{
+	mapcfg_iterate_maplist(open_repo_store, NULL);
+}
+
+void tile_store_module_cleanup()
+{
+	mapcfg_iterate_maplist(close_repo_store, NULL);
+}
+
+/**
+ * Memory lookup only.
+ */
+gboolean tile_store_exists(map_repo_t *repo, int zoom, int x, int y)
+{
+	tile_store_t *store = (tile_store_t *)repo->store;
+	gboolean ret;
+
+	if (zoom < 0 || zoom >= MAX_ZOOM_LEVELS)
+		return FALSE;
+
+	pthread_rwlock_rdlock(&(store->lock));
+
+	if (store->type == TILE_STORE_PACK)
+		ret = (pack_find_slot(store, zoom, x, y)->zoom != 0);
+	else
+		ret = presence_get(presence_of(store, zoom), x, y);
+
+	pthread_rwlock_unlock(&(store->lock));
+
+	return ret;
+}
+
+/**
+ * Return size (bytes) of the tile, or -1 if it does not exist.
+ */
+int tile_store_stat(map_repo_t *repo, int zoom, int x, int y)
+{
+	tile_store_t *store = (tile_store_t *)repo->store;
+	int size = -1;
+
+	if (store->type == TILE_STORE_PACK) {
+		pthread_rwlock_rdlock(&(store->lock));
+		tile_pack_slot_t *slot = pack_find_slot(store, zoom, x, y);
+		if (slot->zoom)
+			size = slot->len;
+		pthread_rwlock_unlock(&(store->lock));
+	} else if (tile_store_exists(repo, zoom, x, y)) {
+		char path[256];
+		struct stat st;
+		if (format_tile_file_path(repo, zoom, x, y, path, sizeof(path)) &&
+			stat(path, &st) == 0)
+			size = st.st_size;
+	}
+
+	return size;
+}
+
+static guchar * store_read(map_repo_t *repo, int zoom, int x, int y, int *len, gboolean *absent)
+{
+	tile_store_t *store = (tile_store_t *)repo->store;
+	guchar *data = NULL;
+
+	*absent = FALSE;
+
+	if (store->type == TILE_STORE_PACK) {
+		int n = -1;
+
+		/* read with lock held: tile_store_compact() swaps the pack file and
+		 * moves the offsets under write lock */
+		pthread_rwlock_rdlock(&(store->lock));
+		tile_pack_slot_t *slot = pack_find_slot(store, zoom, x, y);
+		if (slot->zoom) {
+			n = slot->len;
+			data = (guchar *)g_malloc(n);
+			if (pread(store->data_fd, data, n, slot->offset) != n) {
+				g_free(data);
+				data = NULL;
+			}
+		}
+		pthread_rwlock_unlock(&(store->lock));
+
+		if (n < 0) {
+			*absent = TRUE;
+			return NULL;
+		}
+
+		if (! data) {
+			log_warn("tile store: read tile failed: map=%s, zoom=%d, x=%d, y=%d",
+				repo->name, zoom, x, y);
+			return NULL;
+		}
+		*len = n;
+	} else {
+		char path[256];
+		gsize size;
+		GError *error = NULL;
+
+		if (! tile_store_exists(repo, zoom, x, y)) {
+			*absent = TRUE;
+			return NULL;
+		}
+
+		if (! format_tile_file_path(repo, zoom, x, y, path, sizeof(path)))
+			return NULL;
+
+		if (! g_file_get_contents(path, (gchar **)&data, &size, &error)) {
+			if (g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+				*absent = TRUE;
+			else
+				log_warn("read tile file failed: %s", error->message);
+			g_error_free(error);
+			return NULL;
+		}
+		*len = (int)size;
+	}
+
+	return data;
+}
+
+/**
+ * Return the raw image, caller must g_free() it. If NULL is returned, <absent>
+ * tells whether the tile does not exist, or it can't be read.
+ */
+guchar * tile_store_read(map_repo_t *repo, int zoom, int x, int y, int *len, gboolean *absent)
+{
+	guchar *data = store_read(repo, zoom, x, y, len, absent);
+
+	if (data)
+		tile_quota_touch(repo, zoom, x, y);
+
+	return data;
+}
+
+/**
+ * Same as tile_store_read(), but it is not recorded as an access of the tile,
+ * for background readers (see tile_scrub.c) that must not affect pruning.
+ */
+guchar * tile_store_peek(map_repo_t *repo, int zoom, int x, int y, int *len, gboolean *absent)
+{
+	return store_read(repo, zoom, x, y, len, absent);
+}
+
+/**
+ * Format path of the temp file that a downloading tile is written to.
+ */
+gboolean tile_store_tmp_path(map_repo_t *repo, int zoom, int x, int y, char *buf, int buflen)
+{
+	tile_store_t *store = (tile_store_t *)repo->store;
+	int n;
+
+	if (store->type == TILE_STORE_PACK)
+		n = snprintf(buf, buflen, "%s/%s/%d-%d-%d.%s",
+			repo->dir, PACK_TMP_DIR, zoom, x, y, repo->image_type);
+	else
+		n = snprintf(buf, buflen, "%s/%d/%d/%d.%s.tmp",
+			repo->dir, zoom, x, y, repo->image_type);
+
+	if (n <= 0 || n >= buflen) {
+		log_error("snprintf tile temp file path failed");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * Return TRUE if the file bytes at <offset> equal to <data>.
+ */
+static gboolean pack_bytes_equal(tile_store_t *store, guint64 offset, const guchar *data, int len)
+{
+	gboolean ret = FALSE;
+
+	if (offset + len > store->data_size)
+		return FALSE;
+
+	guchar *buf = (guchar *)g_malloc(len);
+	if (pread(store->data_fd, buf, len, offset) == len)
+		ret = (memcmp(buf, data, len) == 0);
+	g_free(buf);
+
+	return ret;
+}
+
+/**
+ * <*bytes> is set to pack bytes taken by the new record, <*old_bytes> to
+ * those of the replaced tile (as if not deduplicated), or -1.
+ */
+static gboolean pack_append(tile_store_t *store, int zoom, int x, int y,
+	const guchar *data, int len, int *bytes, int *old_bytes)
+{
+	gboolean ret = FALSE;
+	tile_pack_record_t rec = {PACK_RECORD_MAGIC, zoom, x, y, len};
+	guint64 hash = tile_content_hash(data, len);
+	guint64 data_offset;
+	const void *payload = data;
+	int payload_len = len;
+
+	pthread_rwlock_wrlock(&(store->lock));
+
+	if ((store->index->count + 1) << 1 > store->index->capacity &&
+		! pack_grow_index(store))
+		goto END;
+
+	guint64 offset = store->data_size;
+	data_offset = offset + sizeof(rec);
+
+	tile_dedup_t *dup = dedup_lookup(store, hash, len);
+	if (dup && pack_bytes_equal(store, dup->offset, data, len)) {
+		++dup->hits;
+		rec.magic = PACK_LINK_MAGIC;
+		rec.len = sizeof(guint64);
+		data_offset = dup->offset;
+		payload = &data_offset;
+		payload_len = sizeof(guint64);
+	}
+
+	if (pwrite(store->data_fd, &rec, sizeof(rec), offset) != sizeof(rec) ||
+		pwrite(store->data_fd, payload, payload_len, offset + sizeof(rec)) != payload_len) {
+		log_error("tile store: append to pack of map %s failed: %s",
+			store->repo->name, strerror(errno));
+		/* drop partially written record */
+		if (ftruncate(store->data_fd, offset) != 0)
+			log_warn("tile store: truncate pack failed");
+		goto END;
+	}
+
+	store->data_size = offset + sizeof(rec) + payload_len;
+	*bytes = sizeof(rec) + payload_len;
+
+	/* index is updated after data is written */
+	tile_pack_slot_t *slot = pack_find_slot(store, zoom, x, y);
+	if (slot->zoom == 0)
+		++store->index->count;
+	else
+		*old_bytes = sizeof(tile_pack_record_t) + slot->len;
+	pack_set_slot(slot, zoom, x, y, data_offset, len);
+
+	if (rec.magic == PACK_RECORD_MAGIC)
+		dedup_record(store, hash, len, zoom, x, y, data_offset);
+
+	ret = TRUE;
+
+END:
+
+	pthread_rwlock_unlock(&(store->lock));
+
+	return ret;
+}
+
+/**
+ * If the temp file is identical to an indexed tile file, hardlink that file as
+ * <path> and remove the temp file. Otherwise, index the temp file as <zoom, x, y>
+ * and return FALSE.
+ */
+static gboolean dir_commit_duplicate(tile_store_t *store, int zoom, int x, int y,
+	const char *tmp_path, const char *path)
+{
+	gchar *data = NULL, *old = NULL;
+	gsize len, old_len;
+	char dup_path[256], link_path[256];
+	tile_dedup_t dup, *e;
+	gboolean found = FALSE, ret = FALSE;
+
+	if (! g_file_get_contents(tmp_path, &data, &len, NULL))
+		return FALSE;
+
+	guint64 hash = tile_content_hash((guchar *)data, len);
+
+	pthread_rwlock_wrlock(&(store->lock));
+	if ((e = dedup_lookup(store, hash, len))) {
+		dup = *e;
+		found = TRUE;
+	}
+	pthread_rwlock_unlock(&(store->lock));
+
+	if (found &&
+		format_tile_file_path(store->repo, dup.zoom, dup.x, dup.y, dup_path, sizeof(dup_path)) &&
+		g_file_get_contents(dup_path, &old, &old_len, NULL) &&
+		old_len == len && memcmp(old, data, len) == 0) {
+		snprintf(link_path, sizeof(link_path), "%s.lnk", tmp_path);
+		unlink(link_path);
+		if (link(dup_path, link_path) == 0) {
+			if (rename(link_path, path) == 0) {
+				unlink(tmp_path);
+				ret = TRUE;
+			} else {
+				unlink(link_path);
+			}
+		}
+	}
+
+	pthread_rwlock_wrlock(&(store->lock));
+	if (! ret)
+		dedup_record(store, hash, len, zoom, x, y, 0);
+	else if ((e = dedup_lookup(store, hash, len)))
+		++e->hits;
+	pthread_rwlock_unlock(&(store->lock));
+
+	g_free(data);
+	g_free(old);
+
+	return ret;
+}
+
+/**
+ * Move the downloaded temp file <tmp_path> into store.
+ * The temp file no longer exists after this call.
+ */
+gboolean tile_store_commit(map_repo_t *repo, int zoom, int x, int y, const char *tmp_path)
+{
+	tile_store_t *store = (tile_store_t *)repo->store;
+	gboolean ret = FALSE;
+
+	/* store bytes, counted like tile_store_list() does */
+	int bytes = 0, old_bytes = -1;
+
+	if (store->type == TILE_STORE_PACK) {
+		gchar *data = NULL;
+		gsize size;
+		GError *error = NULL;
+
+		if (! g_file_get_contents(tmp_path, &data, &size, &error)) {
+			log_warn("tile store: read %s failed: %s", tmp_path, error->message);
+			g_error_free(error);
+		} else {
+			ret = pack_append(store, zoom, x, y, (guchar *)data, (int)size,
+				&bytes, &old_bytes);
+			g_free(data);
+		}
+		unlink(tmp_path);
+	} else {
+		char path[256];
+		struct stat st;
+		if (stat(tmp_path, &st) == 0)
+			bytes = (int)st.st_size;
+		if (format_tile_file_path(repo, zoom, x, y, path, sizeof(path))) {
+			/* a refreshed tile replaces the old one */
+			if (stat(path, &st) == 0)
+				old_bytes = (int)(st.st_size / MAX(st.st_nlink, 1));
+			if (dir_commit_duplicate(store, zoom, x, y, tmp_path, path)) {
+				/* hardlink takes no more space */
+				bytes = 0;
+				ret = TRUE;
+			} else if (rename(tmp_path, path) == 0)
+				ret = TRUE;
+			else
+				log_debug("%s: rename failed: %s", path, strerror(errno));
+		}
+		if (ret && zoom >= 0 && zoom < MAX_ZOOM_LEVELS) {
+			pthread_rwlock_wrlock(&(store->lock));
+			presence_update(store, zoom, x, y, TRUE);
+			pthread_rwlock_unlock(&(store->lock));
+		}
+		if (! ret)
+			unlink(tmp_path);
+	}
+
+	if (ret)
+		tile_quota_on_commit(repo, zoom, x, y, bytes, old_bytes);
+
+	return ret;
+}
+
+/**
+ * Remove slot at <i>, move following slots of the probe sequence backward
+ * so that lookups need no tombstones.
+ * Caller must hold store write lock.
+ */
+static void pack_remove_slot(tile_store_t *store, guint i)
+{
+	guint mask = store->index->capacity - 1;
+	guint j = i, k;
+	tile_pack_slot_t *slot;
+
+	for (;;) {
+		j = (j + 1) & mask;
+		slot = &(store->slots[j]);
+		if (slot->zoom == 0)
+			break;
+		k = slot_hash(slot->zoom - 1, slot->x, slot->y) & mask;
+		/* move it back if its home <k> is not in (i, j] cyclically */
+		if ((i <= j)? (k <= i || k > j) : (k <= i && k > j)) {
+			store->slots[i] = *slot;
+			i = j;
+		}
+	}
+
+	store->slots[i].zoom = 0;
+	--store->index->count;
+}
+
+/**
+ * Return size of the removed tile, or -1 if it does not exist.
+ */
+int tile_store_remove(map_repo_t *repo, int zoom, int x, int y)
+{
+	tile_store_t *store = (tile_store_t *)repo->store;
+	int size = -1, bytes = 0;
+
+	if (zoom < 0 || zoom >= MAX_ZOOM_LEVELS)
+		return -1;
+
+	if (store->type == TILE_STORE_PACK) {
+		pthread_rwlock_wrlock(&(store->lock));
+		tile_pack_slot_t *slot = pack_find_slot(store, zoom, x, y);
+		if (slot->zoom) {
+			size = slot->len;
+			bytes = sizeof(tile_pack_record_t) + size;
+			pack_remove_slot(store, slot - store->slots);
+		}
+		pthread_rwlock_unlock(&(store->lock));
+	} else {
+		char path[256];
+		struct stat st;
+
+		if (! format_tile_file_path(repo, zoom, x, y, path, sizeof(path)))
+			return -1;
+
+		if (stat(path, &st) == 0 && unlink(path) == 0) {
+			size = (int)st.st_size;
+			bytes = (int)(st.st_size / MAX(st.st_nlink, 1));
+		}
+
+		pthread_rwlock_wrlock(&(store->lock));
+		presence_update(store, zoom, x, y, FALSE);
+		pthread_rwlock_unlock(&(store->lock));
+	}
+
+	if (size >= 0)
+		tile_quota_on_remove(repo, bytes);
+
+	return size;
+}
+
+static int compare_slot_offset(const void *a, const void *b)
+{
+	const tile_pack_slot_t *s1 = *(const tile_pack_slot_t **)a;
+	const tile_pack_slot_t *s2 = *(const tile_pack_slot_t **)b;
+
+	if (s1->offset != s2->offset)
+		return (s1->offset < s2->offset)? -1 : 1;
+	return 0;
+}
+
+/**
+ * Return used slots sorted by offset: slots that share image bytes are adjacent.
+ * Caller must hold store lock, and free() the array.
+ */
+static tile_pack_slot_t ** pack_sorted_slots(tile_store_t *store)
+{
+	guint i, n = 0;
+
+	tile_pack_slot_t **slots = (tile_pack_slot_t **)malloc(
+		(store->index->count + 1) * sizeof(tile_pack_slot_t *));
+	if (! slots) {
+		log_error("allocate memory for tile list failed");
+		exit(0);
+	}
+
+	for (i=0; i<store->index->capacity && n<store->index->count; i++) {
+		if (store->slots[i].zoom)
+			slots[n++] = &(store->slots[i]);
+	}
+
+	qsort(slots, n, sizeof(tile_pack_slot_t *), compare_slot_offset);
+
+	return slots;
+}
+
+/* pack bytes of slot <i> of sorted slots: a record, or a link record */
+#define PACK_SLOT_BYTES(slots, i) \
+	(((i) > 0 && (slots)[i]->offset == (slots)[(i)-1]->offset)? \
+		sizeof(tile_pack_record_t) + sizeof(guint64) : \
+		sizeof(tile_pack_record_t) + (slots)[i]->len)
+
+static void list_append(tile_store_entry_t **list, int *count, int *capacity,
+	int zoom, int x, int y, int size, guint32 atime)
+{
+	if (*count == *capacity) {
+		*capacity = (*capacity)? (*capacity) << 1 : 1024;
+		*list = (tile_store_entry_t *)realloc(*list, *capacity * sizeof(tile_store_entry_t));
+		if (! *list) {
+			log_error("allocate memory for tile list failed");
+			exit(0);
+		}
+	}
+
+	tile_store_entry_t *e = &((*list)[(*count)++]);
+	e->zoom = zoom;
+	e->x = x;
+	e->y = y;
+	e->size = size;
+	e->atime = atime;
+}
+
+/**
+ * List all tiles of the store, caller must free() the returned array.
+ * <atime> of dir backend is initialized as mtime of the file, 0 for pack.
+ * Dir backend stat()s every file: call it from background thread only.
+ */
+tile_store_entry_t * tile_store_list(map_repo_t *repo, int *count)
+{
+	tile_store_t *store = (tile_store_t *)repo->store;
+	tile_store_entry_t *list = NULL;
+	int capacity = 0;
+	guint i;
+
+	*count = 0;
+
+	if (store->type == TILE_STORE_PACK) {
+		pthread_rwlock_rdlock(&(store->lock));
+		tile_pack_slot_t **slots = pack_sorted_slots(store);
+		for (i=0; i<store->index->count; i++)
+			list_append(&list, count, &capacity, slots[i]->zoom - 1, slots[i]->x, slots[i]->y,
+				PACK_SLOT_BYTES(slots, i), 0);
+		pthread_rwlock_unlock(&(store->lock));
+		free(slots);
+		return list;
+	}
+
+	char path[256];
+	DIR *xdir, *ydir;
+	struct dirent *xe, *ye;
+	struct stat st;
+	char *end;
+	int zoom, x, y;
+
+	for (zoom=repo->min_zoom; zoom<=repo->max_zoom; zoom++) {
+		snprintf(path, sizeof(path), "%s/%d", repo->dir, zoom);
+		if (! (xdir = opendir(path)))
+			continue;
+
+		while ((xe = readdir(xdir))) {
+			x = strtol(xe->d_name, &end, 10);
+			if (end == xe->d_name || *end != '\0')
+				continue;
+
+			snprintf(path, sizeof(path), "%s/%d/%d", repo->dir, zoom, x);
+			if (! (ydir = opendir(path)))
+				continue;
+
+			while ((ye = readdir(ydir))) {
+				y = strtol(ye->d_name, &end, 10);
+				if (end == ye->d_name || *end != '.' ||
+					strcmp(end + 1, repo->image_type) != 0)
+					continue;
+				snprintf(path, sizeof(path), "%s/%d/%d/%s", repo->dir, zoom, x, ye->d_name);
+				/* hardlinked duplicates share the size */
+				if (stat(path, &st) == 0)
+					list_append(&list, count, &capacity, zoom, x, y,
+						(int)(st.st_size / MAX(st.st_nlink, 1)), (guint32)st.st_mtime);
+			}
+
+			closedir(ydir);
+		}
+
+		closedir(xdir);
+	}
+
+	return list;
+}
+
+/**
+ * Bytes of pack file that are not used by any tile, 0 for dir backend.
+ */
+guint64 tile_store_garbage_size(map_repo_t *repo)
+{
+	tile_store_t *store = (tile_store_t *)repo->store;
+	guint64 used = 0;
+	guint i;
+
+	if (store->type != TILE_STORE_PACK)
+		return 0;
+
+	pthread_rwlock_rdlock(&(store->lock));
+	tile_pack_slot_t **slots = pack_sorted_slots(store);
+	for (i=0; i<store->index->count; i++)
+		used += PACK_SLOT_BYTES(slots, i);
+	guint64 size = store->data_size;
+	pthread_rwlock_unlock(&(store->lock));
+
+	free(slots);
+
+	return (size > used)? size - used : 0;
+}
+
+/**
+ * Copy live tiles of the pack file to a new pack file with a new index,
+ * then replace the old ones. The old index is removed first: if power is lost
+ * in between, the index is rebuilt from whichever pack file is in place.
+ * Readers are blocked until it is done. No-op for dir backend.
+ */
+gboolean tile_store_compact(map_repo_t *repo)
+{
+	tile_store_t *store = (tile_store_t *)repo->store;
+	char data_path[256], index_path[256], new_data_path[256], new_index_path[256];
+	tile_store_t tmp;
+	tile_pack_record_t rec;
+	tile_pack_slot_t **slots = NULL;
+	guint buf_len = 4096;
+	guchar *buf = (guchar *)g_malloc(buf_len);
+	guint64 offset = 0, data_offset = 0;
+	guint i;
+	gboolean ret = FALSE;
+
+	if (store->type != TILE_STORE_PACK) {
+		g_free(buf);
+		return TRUE;
+	}
+
+	snprintf(data_path, sizeof(data_path), "%s/%s", repo->dir, PACK_DATA_FILE);
+	snprintf(index_path, sizeof(index_path), "%s/%s", repo->dir, PACK_INDEX_FILE);
+	snprintf(new_data_path, sizeof(new_data_path), "%s%s", data_path, PACK_NEW_SUFFIX);
+	snprintf(new_index_path, sizeof(new_index_path), "%s%s", index_path, PACK_NEW_SUFFIX);
+
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.index_fd = -1;
+
+	pthread_rwlock_wrlock(&(store->lock));
+
+	log_info("tile store: compact pack of map: %s", repo->name);
+
+	tmp.data_fd = open(new_data_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (tmp.data_fd < 0) {
+		log_error("tile store: create %s failed: %s", new_data_path, strerror(errno));
+		goto END;
+	}
+
+	if (! pack_create_index(&tmp, new_index_path, store->index->capacity))
+		goto END;
+
+	/* in offset order, so that tiles sharing bytes still share them */
+	slots = pack_sorted_slots(store);
+
+	for (i=0; i<store->index->count; i++) {
+		tile_pack_slot_t *slot = slots[i];
+		gboolean link = (i > 0 && slot->offset == slots[i-1]->offset);
+		int n;
+
+		rec.zoom = slot->zoom - 1;
+		rec.x = slot->x;
+		rec.y = slot->y;
+
+		if (link) {
+			rec.magic = PACK_LINK_MAGIC;
+			rec.len = sizeof(guint64);
+			memcpy(buf, &data_offset, sizeof(guint64));
+		} else {
+			if (slot->len + sizeof(guint64) > buf_len) {
+				buf_len = slot->len + sizeof(guint64);
+				buf = (guchar *)g_realloc(buf, buf_len);
+			}
+			rec.magic = PACK_RECORD_MAGIC;
+			rec.len = slot->len;
+			data_offset = offset + sizeof(rec);
+			if (pread(store->data_fd, buf, slot->len, slot->offset) != slot->len) {
+				log_error("tile store: read pack of map %s failed: %s", repo->name, strerror(errno));
+				goto END;
+			}
+		}
+
+		n = rec.len;
+		if (pwrite(tmp.data_fd, &rec, sizeof(rec), offset) != sizeof(rec) ||
+			pwrite(tmp.data_fd, buf, n, offset + sizeof(rec)) != n) {
+			log_error("tile store: copy tile to %s failed: %s", new_data_path, strerror(errno));
+			goto END;
+		}
+
+		pack_set_slot(pack_find_slot(&tmp, rec.zoom, rec.x, rec.y),
+			rec.zoom, rec.x, rec.y, data_offset, slot->len);
+		++tmp.index->count;
+
+		offset += sizeof(rec) + n;
+	}
+
+	if (fsync(tmp.data_fd) != 0)
+		goto END;
+	msync(tmp.index, tmp.index_size, MS_SYNC);
+
+	unlink(index_path);
+	pack_unmap_index(store);
+
+	if (rename(new_data_path, data_path) != 0) {
+		log_error("tile store: replace pack failed: %s", strerror(errno));
+		pack_rebuild_index(store, index_path);
+		goto END;
+	}
+
+	log_info("tile store: pack size %llu -> %llu", (unsigned long long)store->data_size,
+		(unsigned long long)offset);
+
+	close(store->data_fd);
+	store->data_fd = tmp.data_fd;
+	store->data_size = offset;
+	tmp.data_fd = -1;
+
+	if (rename(new_index_path, index_path) != 0) {
+		log_error("tile store: replace index failed: %s", strerror(errno));
+		pack_rebuild_index(store, index_path);
+		goto END;
+	}
+
+	store->index_fd = tmp.index_fd;
+	store->index_size = tmp.index_size;
+	store->index = tmp.index;
+	store->slots = tmp.slots;
+	tmp.index_fd = -1;
+	tmp.index = NULL;
+
+	ret = TRUE;
+
+END:
+
+	if (! ret) {
+		pack_unmap_index(&tmp);
+		if (tmp.data_fd >= 0)
+			close(tmp.data_fd);
+		unlink(new_data_path);
+		unlink(new_index_path);
+	}
+
+	/* offsets are changed */
+	memset(store->dedup, 0, TILE_DEDUP_SLOTS * sizeof(tile_dedup_t));
+
+	pthread_rwlock_unlock(&(store->lock));
+
+	free(slots);
+	g_free(buf);
+
+	return ret;
+}
@@ -0,0 +1,371 @@
+#include <ctype.h>
+
+#include "map_repo.h"
+#include "util.h"
+#include "omgps.h"
+
+/**
+ * Native tile url templates, see data/etc/map.py.
+ *
+ * A template is literal text with integer expressions in braces, e.g.:
+ *	"http://tile.openstreetmap.org/{z}/{x}/{y}.png"
+ *	"http://host/ximg?x={x}&y={2^(z-1)-1-y}&z={z+1}"
+ * Expressions take z, x, y, integers, + - * / % ^ (power), unary minus and
+ * parentheses. They are compiled once to reverse polish notation, so formatting
+ * an url needs neither Python interpreter nor memory allocation.
+ */
+
+typedef enum
+{
+	OP_TEXT,	/* literal text: <value> is offset into <text>, <len> bytes */
+	OP_CONST,
+	OP_Z,
+	OP_X,
+	OP_Y,
+	OP_NEG,
+	OP_ADD,
+	OP_SUB,
+	OP_MUL,
+	OP_DIV,
+	OP_MOD,
+	OP_POW,
+	OP_EMIT,	/* pop and print */
+	/* only on operator stack while compiling */
+	OP_LPAREN
+} URL_OP;
+
+#define OP_STACK_MAX	URL_TEMPLATE_MAX_STACK
+
+typedef struct __compiler_t
+{
+	url_template_t *t;
+	const char *src;
+	const char *p;
+	int depth;
+	char *errbuf;
+	int errbuf_len;
+} compiler_t;
+
+static int precedence(URL_OP op)
+{
+	switch (op) {
+	case OP_ADD:
+	case OP_SUB:
+		return 1;
+	case OP_MUL:
+	case OP_DIV:
+	case OP_MOD:
+		return 2;
+	case OP_NEG:
+		return 3;
+	case OP_POW:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+static gboolean emit(compiler_t *c, URL_OP code, gint64 value, int len)
+{
+	url_template_t *t = c->t;
+
+	if (t->count == t->capacity) {
+		int capacity = t->capacity? t->capacity << 1 : 16;
+		url_template_op_t *ops = (url_template_op_t *)realloc(t->ops,
+			capacity * sizeof(url_template_op_t));
+		if (! ops) {
+			snprintf(c->errbuf, c->errbuf_len, "out of memory");
+			return FALSE;
+		}
+		t->ops = ops;
+		t->capacity = capacity;
+	}
+
+	t->ops[t->count].code = code;
+	t->ops[t->count].value = value;
+	t->ops[t->count].len = len;
+	++(t->count);
+
+	/* track evaluation stack depth */
+	switch (code) {
+	case OP_CONST:
+	case OP_Z:
+	case OP_X:
+	case OP_Y:
+		if (++(c->depth) > OP_STACK_MAX) {
+			snprintf(c->errbuf, c->errbuf_len, "expression is too complex");
+			return FALSE;
+		}
+		break;
+	case OP_ADD:
+	case OP_SUB:
+	case OP_MUL:
+	case OP_DIV:
+	case OP_MOD:
+	case OP_POW:
+		--(c->depth);
+		break;
+	case OP_EMIT:
+		--(c->depth);
+		break;
+	default:
+		break;
+	}
+
+	return TRUE;
+}
+
+static gboolean fail(compiler_t *c, const char *err)
+{
+	snprintf(c->errbuf, c->errbuf_len, "%s at column %d", err, (int)(c->p - c->src) + 1);
+	return FALSE;
+}
+
+/**
+ * Compile expression at <c->p> until '}' with shunting-yard algorithm.
+ */
+static gboolean compile_expr(compiler_t *c)
+{
+	URL_OP ops[OP_STACK_MAX];
+	int nops = 0;
+	/* expecting an operand, so '-' is unary */
+	gboolean operand = TRUE;
+	URL_OP op;
+
+	for (;;) {
+		while (isspace((unsigned char)*(c->p)))
+			++(c->p);
+
+		char ch = *(c->p);
+
+		if (ch == '\0') {
+			return fail(c, "missing '}'");
+		} else if (ch == '}') {
+			if (operand)
+				return fail(c, "missing operand");
+			break;
+		} else if (isdigit((unsigned char)ch)) {
+			if (! operand)
+				return fail(c, "missing operator");
+			char *end;
+			gint64 v = strtoll(c->p, &end, 10);
+			c->p = end;
+			if (! emit(c, OP_CONST, v, 0))
+				return FALSE;
+			operand = FALSE;
+			continue;
+		} else if (ch == 'z' || ch == 'x' || ch == 'y') {
+			if (! operand)
+				return fail(c, "missing operator");
+			if (! emit(c, (ch == 'z')? OP_Z : (ch == 'x')? OP_X : OP_Y, 0, 0))
+				return FALSE;
+			++(c->p);
+			operand = FALSE;
+			continue;
+		} else if (ch == '(') {
+			if (! operand)
+				return fail(c, "missing operator");
+			if (nops == OP_STACK_MAX)
+				return fail(c, "expression is too complex");
+			ops[nops++] = OP_LPAREN;
+			++(c->p);
+			continue;
+		} else if (ch == ')') {
+			if (operand)
+				return fail(c, "missing operand");
+			while (nops > 0 && ops[nops-1] != OP_LPAREN) {
+				if (! emit(c, ops[--nops], 0, 0))
+					return FALSE;
+			}
+			if (nops == 0)
+				return fail(c, "unbalanced ')'");
+			--nops;
+			++(c->p);
+			continue;
+		}
+
+		switch (ch) {
+		case '+': op = OP_ADD; break;
+		case '-': op = operand? OP_NEG : OP_SUB; break;
+		case '*': op = OP_MUL; break;
+		case '/': op = OP_DIV; break;
+		case '%': op = OP_MOD; break;
+		case '^': op = OP_POW; break;
+		default:
+			return fail(c, "unexpected character");
+		}
+
+		if (operand && op != OP_NEG)
+			return fail(c, "missing operand");
+
+		/* unary minus and power are right associative */
+		if (op != OP_NEG) {
+			while (nops > 0 && ops[nops-1] != OP_LPAREN &&
+				(precedence(ops[nops-1]) > precedence(op) ||
+				(precedence(ops[nops-1]) == precedence(op) && op != OP_POW))) {
+				if (! emit(c, ops[--nops], 0, 0))
+					return FALSE;
+			}
+		}
+
+		if (nops == OP_STACK_MAX)
+			return fail(c, "expression is too complex");
+		ops[nops++] = op;
+		operand = TRUE;
+		++(c->p);
+	}
+
+	while (nops > 0) {
+		if (ops[--nops] == OP_LPAREN)
+			return fail(c, "unbalanced '('");
+		if (! emit(c, ops[nops], 0, 0))
+			return FALSE;
+	}
+
+	/* skip '}' */
+	++(c->p);
+
+	return emit(c, OP_EMIT, 0, 0);
+}
+
+/**
+ * Compile <template>. Return NULL on error, with reason in <errbuf>.
+ */
+url_template_t * url_template_compile(const char *template, char *errbuf, int errbuf_len)
+{
+	compiler_t c;
+	const char *start;
+
+	url_template_t *t = (url_template_t *)calloc(1, sizeof(url_template_t));
+	if (! t || ! (t->text = strdup(template))) {
+		snprintf(errbuf, errbuf_len, "out of memory");
+		free(t);
+		return NULL;
+	}
+
+	c.t = t;
+	c.src = template;
+	c.p = template;
+	c.depth = 0;
+	c.errbuf = errbuf;
+	c.errbuf_len = errbuf_len;
+
+	while (*c.p) {
+		if (*c.p == '{') {
+			++c.p;
+			if (! compile_expr(&c))
+				goto FAIL;
+		} else if (*c.p == '}') {
+			fail(&c, "unbalanced '}'");
+			goto FAIL;
+		} else {
+			start = c.p;
+			while (*c.p && *c.p != '{' && *c.p != '}')
+				++c.p;
+			if (! emit(&c, OP_TEXT, start - template, c.p - start))
+				goto FAIL;
+		}
+	}
+
+	return t;
+
+FAIL:
+
+	url_template_free(t);
+	return NULL;
+}
+
+static gint64 ipow(gint64 base, gint64 exp)
+{
+	gint64 r = 1;
+
+	/* integer: 2^-1 == 0 */
+	if (exp < 0)
+		return (base == 1)? 1 : 0;
+
+	while (exp > 0 && r != 0) {
+		if (exp & 1)
+			r *= base;
+		base *= base;
+		exp >>= 1;
+	}
+
+	return r;
+}
+
+/**
+ * Format url of tile (zoom, x, y) to <buf>.
+ * Return length of the url, -1 if <buf> is too small or division by zero.
+ */
+int url_template_format(const url_template_t *t, int zoom, int x, int y, char *buf, int len)
+{
+	gint64 stack[OP_STACK_MAX];
+	int sp = 0, n = 0, i, ret;
+	url_template_op_t *op;
+	gint64 a, b;
+
+	for (i=0; i<t->count; i++) {
+		op = &(t->ops[i]);
+		switch (op->code) {
+		case OP_TEXT:
+			if (n + op->len >= len)
+				return -1;
+			memcpy(buf + n, t->text + op->value, op->len);
+			n += op->len;
+			break;
+		case OP_CONST:
+			stack[sp++] = op->value;
+			break;
+		case OP_Z:
+			stack[sp++] = zoom;
+			break;
+		case OP_X:
+			stack[sp++] = x;
+			break;
+		case OP_Y:
+			stack[sp++] = y;
+			break;
+		case OP_NEG:
+			stack[sp-1] = -stack[sp-1];
+			break;
+		case OP_EMIT:
+			ret = snprintf(buf + n, len - n, "%lld", (long long)stack[--sp]);
+			if (ret < 0 || ret >= len - n)
+				return -1;
+			n += ret;
+			break;
+		default:
+			b = stack[--sp];
+			a = stack[sp-1];
+			switch (op->code) {
+			case OP_ADD: a += b; break;
+			case OP_SUB: a -= b; break;
+			case OP_MUL: a *= b; break;
+			case OP_DIV:
+			case OP_MOD:
+				if (b == 0)
+					return -1;
+				a = (op->code == OP_DIV)? a / b : a % b;
+				break;
+			case OP_POW: a = ipow(a, b); break;
+			default: break;
+			}
+			stack[sp-1] = a;
+			break;
+		}
+	}
+
+	buf[n] = '\0';
+
+	return n;
+}
+
+void url_template_free(url_template_t *t)
+{
+	if (! t)
+		return;
+
+	free(t->ops);
+	free(t->text);
+	free(t);
+}
@@ -88,6 +88,16 @@ void sleep_ms(long ms)
 	nanosleep(&ts, NULL);
 }
 
+/**
+ * Milliseconds of monotonic clock, for timeouts and latency.
+ */
+gint64 monotonic_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (gint64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 int wait_ms(long span_ms, pthread_cond_t *cond, pthread_mutex_t *mutex, gboolean lock)
 {
 	struct timeval tv;
@@ -0,0 +1,586 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "network.h"
+#include "util.h"
+
+/**
+ * Checks of response parsing (see http_parse_response()) and DNS cache, without
+ * network: responses are parsed from memory, addresses come from a stub resolver.
+ * http_get() is checked against a forked server on loopback, which writes
+ * responses in small pieces, closes kept-alive connections and stalls.
+ * Run by "make check".
+ */
+
+static int failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (! (cond)) { \
+			fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, \
+				__func__, #cond); \
+			++failures; \
+		} \
+	} while (0)
+
+#define BODY	"0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz"
+
+/**
+ * Parse response <data> of <len> bytes, decoded body is read back into <body>.
+ * Return error no, or HTTP_PARSE_PENDING.
+ */
+static int parse(const char *data, int len, gboolean closed, http_get_result_t *result,
+	gboolean *keep_alive, char *body, int body_len)
+{
+	char path[] = "/tmp/check_network.XXXXXX";
+	gboolean no_response;
+	int fd, ret, n;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		exit(1);
+	}
+	unlink(path);
+
+	ret = http_parse_response(data, len, closed, fd, result, &no_response, keep_alive);
+
+	n = pread(fd, body, body_len - 1, 0);
+	body[(n > 0)? n : 0] = '\0';
+	close(fd);
+
+	return ret;
+}
+
+/**
+ * Compress <src> as gzip (wbits 31), zlib (15) or raw deflate (-15).
+ */
+static int compress_body(const char *src, char *dst, int dst_len, int wbits)
+{
+	z_stream zs;
+	int n;
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, wbits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return -1;
+
+	zs.next_in = (Bytef *)src;
+	zs.avail_in = strlen(src);
+	zs.next_out = (Bytef *)dst;
+	zs.avail_out = dst_len;
+
+	n = (deflate(&zs, Z_FINISH) == Z_STREAM_END)? (int)zs.total_out : -1;
+	deflateEnd(&zs);
+
+	return n;
+}
+
+/**
+ * Response with <encoding> and Content-Length, compressed with <wbits>.
+ */
+static int encoded_response(char *buf, int buf_len, const char *encoding, int wbits, int truncate)
+{
+	char z[1024];
+	int n, head;
+
+	n = compress_body(BODY, z, sizeof(z), wbits);
+	if (n <= truncate)
+		return -1;
+	n -= truncate;
+
+	head = snprintf(buf, buf_len, "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\n"
+		"Content-Encoding: %s\r\nContent-Length: %d\r\n\r\n", encoding, n);
+	memcpy(buf + head, z, n);
+
+	return head + n;
+}
+
+static void check_content_length()
+{
+	const char *data = "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\n"
+		"Content-Length: 72\r\n\r\n" BODY;
+	http_get_result_t result;
+	gboolean keep_alive;
+	char body[256];
+
+	CHECK(parse(data, strlen(data), FALSE, &result, &keep_alive, body, sizeof(body)) ==
+		HTTP_GET_ERROR_NONE);
+	CHECK(strcmp(body, BODY) == 0);
+	CHECK(result.content_length == strlen(BODY));
+	CHECK(strcmp(result.content_type, "image/png") == 0);
+	CHECK(keep_alive);
+
+	/* incomplete: more data is needed */
+	CHECK(parse(data, strlen(data) - 10, FALSE, &result, &keep_alive, body, sizeof(body)) ==
+		HTTP_PARSE_PENDING);
+	CHECK(parse(data, 20, FALSE, &result, &keep_alive, body, sizeof(body)) ==
+		HTTP_PARSE_PENDING);
+}
+
+static void check_chunked()
+{
+	/* chunk extensions and trailers */
+	const char *data = "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\n"
+		"Transfer-Encoding: chunked\r\n\r\n"
+		"a;name=value\r\n0123456789\r\n"
+		"3E\r\nabcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz\r\n"
+		"0\r\nX-Trailer: 1\r\nX-Other: 2\r\n\r\n";
+	http_get_result_t result;
+	gboolean keep_alive;
+	char body[256];
+
+	CHECK(parse(data, strlen(data), FALSE, &result, &keep_alive, body, sizeof(body)) ==
+		HTTP_GET_ERROR_NONE);
+	CHECK(strcmp(body, BODY) == 0);
+	CHECK(keep_alive);
+
+	/* the last empty line is missing */
+	CHECK(parse(data, strlen(data) - 2, FALSE, &result, &keep_alive, body, sizeof(body)) ==
+		HTTP_PARSE_PENDING);
+}
+
+static void check_encodings()
+{
+	http_get_result_t result;
+	gboolean keep_alive;
+	char data[2048], body[256];
+	int len;
+
+	len = encoded_response(data, sizeof(data), "gzip", MAX_WBITS + 16, 0);
+	CHECK(parse(data, len, FALSE, &result, &keep_alive, body, sizeof(body)) ==
+		HTTP_GET_ERROR_NONE);
+	CHECK(strcmp(body, BODY) == 0);
+	CHECK(result.content_length == strlen(BODY));
+	CHECK(keep_alive);
+
+	len = encoded_response(data, sizeof(data), "deflate", MAX_WBITS, 0);
+	CHECK(parse(data, len, FALSE, &result, &keep_alive, body, sizeof(body)) ==
+		HTTP_GET_ERROR_NONE);
+	CHECK(strcmp(body, BODY) == 0);
+
+	/* raw deflate data, sent as "deflate" by some servers */
+	len = encoded_response(data, sizeof(data), "deflate", -MAX_WBITS, 0);
+	CHECK(parse(data, len, FALSE, &result, &keep_alive, body, sizeof(body)) ==
+		HTTP_GET_ERROR_NONE);
+	CHECK(strcmp(body, BODY) == 0);
+
+	/* truncated gzip stream: complete response, but the stream doesn't end */
+	len = encoded_response(data, sizeof(data), "gzip", MAX_WBITS + 16, 8);
+	CHECK(parse(data, len, FALSE, &result, &keep_alive, body, sizeof(body)) ==
+		HTTP_GET_ERROR_DECODE);
+	CHECK(! keep_alive);
+}
+
+static void check_close_delimited()
+{
+	const char *data = "HTTP/1.0 200 OK\r\nContent-Type: image/png\r\n\r\n" BODY;
+	http_get_result_t result;
+	gboolean keep_alive;
+	char body[256];
+
+	/* the body ends when the connection is closed */
+	CHECK(parse(data, strlen(data), FALSE, &result, &keep_alive, body, sizeof(body)) ==
+		HTTP_PARSE_PENDING);
+	CHECK(parse(data, strlen(data), TRUE, &result, &keep_alive, body, sizeof(body)) ==
+		HTTP_GET_ERROR_NONE);
+	CHECK(strcmp(body, BODY) == 0);
+	CHECK(! keep_alive);
+}
+
+static void check_not_modified()
+{
+	const char *data = "HTTP/1.1 304 Not Modified\r\nETag: \"abc\"\r\n"
+		"Cache-Control: max-age=600\r\n\r\n";
+	http_get_result_t result;
+	gboolean keep_alive;
+	char body[256];
+
+	CHECK(parse(data, strlen(data), FALSE, &result, &keep_alive, body, sizeof(body)) ==
+		HTTP_GET_ERROR_NOT_MODIFIED);
+	CHECK(result.http_code == 304);
+	CHECK(strcmp(result.etag, "\"abc\"") == 0);
+	CHECK(result.max_age == 600);
+	CHECK(keep_alive);
+	CHECK(body[0] == '\0');
+}
+
+static void check_bad_line_ending()
+{
+	/* some servers end header lines with \r\r\n */
+	const char *data = "HTTP/1.1 200 OK\r\r\nContent-Type: image/png\r\r\n"
+		"Content-Length: 72\r\r\n\r\r\n" BODY;
+	http_get_result_t result;
+	gboolean keep_alive;
+	char body[256];
+
+	CHECK(parse(data, strlen(data), FALSE, &result, &keep_alive, body, sizeof(body)) ==
+		HTTP_GET_ERROR_NONE);
+	CHECK(strcmp(body, BODY) == 0);
+	CHECK(strcmp(result.content_type, "image/png") == 0);
+}
+
+static void check_error_response()
+{
+	const char *data = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 120\r\n"
+		"Content-Length: 4\r\n\r\nbusy";
+	http_get_result_t result;
+	gboolean keep_alive;
+	char body[256];
+
+	CHECK(parse(data, strlen(data), FALSE, &result, &keep_alive, body, sizeof(body)) ==
+		HTTP_GET_ERROR_NOT_200_OK);
+	CHECK(result.http_code == 503);
+	CHECK(result.retry_after == 120);
+	/* error body is read out, not written */
+	CHECK(keep_alive);
+	CHECK(body[0] == '\0');
+}
+
+/************************ DNS cache ************************/
+
+static int resolve_count = 0;
+static gboolean resolve_fail = FALSE;
+
+static int stub_resolve(const char *host, const char *service,
+	const struct addrinfo *hints, struct addrinfo **res)
+{
+	struct addrinfo *ai;
+	struct sockaddr_in *sa;
+
+	++resolve_count;
+
+	if (resolve_fail)
+		return EAI_NONAME;
+
+	ai = (struct addrinfo *)calloc(1, sizeof(struct addrinfo) + sizeof(struct sockaddr_in));
+	sa = (struct sockaddr_in *)(ai + 1);
+	sa->sin_family = AF_INET;
+	sa->sin_port = htons(service? atoi(service) : 80);
+	inet_pton(AF_INET, "192.0.2.1", &(sa->sin_addr));
+
+	ai->ai_family = AF_INET;
+	ai->ai_socktype = hints->ai_socktype;
+	ai->ai_addrlen = sizeof(struct sockaddr_in);
+	ai->ai_addr = (struct sockaddr *)sa;
+
+	*res = ai;
+	return 0;
+}
+
+static void stub_free(struct addrinfo *res)
+{
+	free(res);
+}
+
+static void check_dns_cache()
+{
+	struct addrinfo *info;
+	gboolean pending;
+
+	dns_cache_set_resolver(stub_resolve, stub_free);
+
+	info = get_remote_addr("tile.example.org", "80", AF_INET, SOCK_STREAM, 0, 2);
+	CHECK(info && info->ai_family == AF_INET);
+	CHECK(info && ((struct sockaddr_in *)info->ai_addr)->sin_port == htons(80));
+	free_remote_addr(info);
+	CHECK(resolve_count == 1);
+
+	/* cached */
+	info = get_remote_addr("tile.example.org", "80", AF_INET, SOCK_STREAM, 0, 2);
+	CHECK(info != NULL);
+	free_remote_addr(info);
+	info = get_remote_addr_nowait("tile.example.org", "80", AF_INET, SOCK_STREAM, 0, &pending);
+	CHECK(info != NULL && ! pending);
+	free_remote_addr(info);
+	CHECK(resolve_count == 1);
+
+	/* another port is another entry */
+	info = get_remote_addr("tile.example.org", "8080", AF_INET, SOCK_STREAM, 0, 2);
+	CHECK(info != NULL);
+	free_remote_addr(info);
+	CHECK(resolve_count == 2);
+
+	/* failures are cached too */
+	resolve_fail = TRUE;
+	info = get_remote_addr("bad.example.org", "80", AF_INET, SOCK_STREAM, 0, 2);
+	CHECK(info == NULL);
+	info = get_remote_addr("bad.example.org", "80", AF_INET, SOCK_STREAM, 0, 2);
+	CHECK(info == NULL);
+	CHECK(resolve_count == 3);
+
+	/* entries are dropped with a new resolver */
+	resolve_fail = FALSE;
+	dns_cache_set_resolver(stub_resolve, stub_free);
+	info = get_remote_addr("tile.example.org", "80", AF_INET, SOCK_STREAM, 0, 2);
+	CHECK(info != NULL);
+	free_remote_addr(info);
+	CHECK(resolve_count == 4);
+
+	dns_cache_set_resolver(NULL, NULL);
+}
+
+/************************ loopback server ************************/
+
+/* pieces of dribbled responses */
+#define DRIBBLE_BYTES	3
+
+static pid_t server_pid = -1;
+static char server_port[16];
+
+static void send_dribble(int sock_fd, const char *data, int len)
+{
+	int n;
+
+	for (; len > 0; data += n, len -= n) {
+		n = MIN(len, DRIBBLE_BYTES);
+		if (send(sock_fd, data, n, MSG_NOSIGNAL) != n)
+			exit(1);
+		usleep(1000);
+	}
+}
+
+/**
+ * Read a request header, return FALSE if the connection is closed.
+ */
+static gboolean read_request(int sock_fd, char *path, int path_len)
+{
+	char buf[1024];
+	int len = 0, n;
+
+	buf[0] = '\0';
+	while (! strstr(buf, "\r\n\r\n")) {
+		if (len >= sizeof(buf) - 1 || (n = read(sock_fd, buf + len, sizeof(buf) - 1 - len)) <= 0)
+			return FALSE;
+		len += n;
+		buf[len] = '\0';
+	}
+
+	return sscanf(buf, "GET %s ", path) == 1 && strlen(path) < path_len;
+}
+
+/**
+ * Serve connection <conn>, the n-th one accepted.
+ * The body of "/conn" tells the connection serving the request.
+ */
+static void serve(int sock_fd, int conn)
+{
+	char path[256], buf[1024], body[64];
+	int req, len;
+
+	for (req = 1; read_request(sock_fd, path, sizeof(path)); req++) {
+		if (strcmp(path, "/dribble") == 0) {
+			len = snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\n"
+				"Content-Length: %d\r\n\r\n%s", (int)strlen(BODY), BODY);
+			send_dribble(sock_fd, buf, len);
+		} else if (strcmp(path, "/chunked") == 0) {
+			len = snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\n"
+				"Transfer-Encoding: chunked\r\n\r\n%x\r\n%s\r\n0\r\n\r\n",
+				(int)strlen(BODY), BODY);
+			send_dribble(sock_fd, buf, len);
+		} else if (strcmp(path, "/close") == 0) {
+			/* the body ends when connection is closed */
+			len = snprintf(buf, sizeof(buf), "HTTP/1.0 200 OK\r\nContent-Type: image/png\r\n"
+				"\r\n%s", BODY);
+			send_dribble(sock_fd, buf, len);
+			break;
+		} else if (strcmp(path, "/conn") == 0 || strcmp(path, "/conn-idle-close") == 0) {
+			/* a kept-alive connection is closed on the next request */
+			if (req > 1)
+				break;
+			snprintf(body, sizeof(body), "conn %d", conn);
+			len = snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\n"
+				"Content-Length: %d\r\n\r\n%s", (int)strlen(body), body);
+			send_dribble(sock_fd, buf, len);
+			/* or just after the response */
+			if (strcmp(path, "/conn-idle-close") == 0)
+				break;
+		} else if (strcmp(path, "/stall") == 0) {
+			len = snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\n");
+			send_dribble(sock_fd, buf, len);
+			sleep(5);
+			break;
+		} else {
+			break;
+		}
+	}
+
+	close(sock_fd);
+}
+
+static void start_server()
+{
+	struct sockaddr_in sa;
+	socklen_t sa_len = sizeof(sa);
+	int listen_fd, sock_fd, conn = 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+		listen(listen_fd, 16) < 0 ||
+		getsockname(listen_fd, (struct sockaddr *)&sa, &sa_len) < 0) {
+		perror("loopback server");
+		exit(1);
+	}
+	snprintf(server_port, sizeof(server_port), "%d", ntohs(sa.sin_port));
+
+	server_pid = fork();
+	if (server_pid < 0) {
+		perror("fork");
+		exit(1);
+	} else if (server_pid > 0) {
+		close(listen_fd);
+		return;
+	}
+
+	/* one process per connection, all of them are killed by stop_server() */
+	setpgid(0, 0);
+	signal(SIGCHLD, SIG_IGN);
+
+	while ((sock_fd = accept(listen_fd, NULL, NULL)) >= 0 || errno == EINTR) {
+		if (sock_fd < 0)
+			continue;
+		++conn;
+		if (fork() == 0) {
+			close(listen_fd);
+			serve(sock_fd, conn);
+			_exit(0);
+		}
+		close(sock_fd);
+	}
+
+	_exit(1);
+}
+
+static void stop_server()
+{
+	if (server_pid > 0) {
+		kill(-server_pid, SIGKILL);
+		kill(server_pid, SIGKILL);
+		waitpid(server_pid, NULL, 0);
+		server_pid = -1;
+	}
+}
+
+/**
+ * http_get() <path> of the loopback server, body is read back into <body>.
+ */
+static void get(const char *path, int timeout, http_get_result_t *result, char *body, int body_len)
+{
+	char url[256], file[] = "/tmp/check_network.XXXXXX";
+	int fd, n;
+
+	fd = mkstemp(file);
+	if (fd < 0) {
+		perror("mkstemp");
+		exit(1);
+	}
+	unlink(file);
+
+	snprintf(url, sizeof(url), "http://127.0.0.1:%s%s", server_port, path);
+	http_get(url, fd, 2, timeout, result);
+
+	n = pread(fd, body, body_len - 1, 0);
+	body[(n > 0)? n : 0] = '\0';
+	close(fd);
+}
+
+static void check_partial_reads()
+{
+	http_get_result_t result;
+	char body[256];
+
+	/* header lines and body arrive in pieces of a few bytes */
+	get("/dribble", 2, &result, body, sizeof(body));
+	CHECK(result.error_no == HTTP_GET_ERROR_NONE);
+	CHECK(strcmp(body, BODY) == 0);
+	CHECK(strcmp(result.content_type, "image/png") == 0);
+
+	get("/chunked", 2, &result, body, sizeof(body));
+	CHECK(result.error_no == HTTP_GET_ERROR_NONE);
+	CHECK(strcmp(body, BODY) == 0);
+
+	get("/close", 2, &result, body, sizeof(body));
+	CHECK(result.error_no == HTTP_GET_ERROR_NONE);
+	CHECK(strcmp(body, BODY) == 0);
+
+	http_pool_cleanup();
+}
+
+static void check_stale_connection()
+{
+	http_get_result_t result;
+	char body[256], first[256];
+
+	/* closed by server after the request is sent: retried on a new connection */
+	get("/conn", 2, &result, first, sizeof(first));
+	CHECK(result.error_no == HTTP_GET_ERROR_NONE);
+	get("/conn", 2, &result, body, sizeof(body));
+	CHECK(result.error_no == HTTP_GET_ERROR_NONE);
+	CHECK(strncmp(body, "conn ", 5) == 0 && strcmp(body, first) != 0);
+
+	http_pool_cleanup();
+
+	/* closed by server while idle: dropped from pool */
+	get("/conn-idle-close", 2, &result, first, sizeof(first));
+	CHECK(result.error_no == HTTP_GET_ERROR_NONE);
+	usleep(100000);
+	get("/conn-idle-close", 2, &result, body, sizeof(body));
+	CHECK(result.error_no == HTTP_GET_ERROR_NONE);
+	CHECK(strncmp(body, "conn ", 5) == 0 && strcmp(body, first) != 0);
+
+	http_pool_cleanup();
+}
+
+static void check_receive_timeout()
+{
+	http_get_result_t result;
+	char body[256];
+	time_t start = time(NULL);
+
+	/* server stops in the middle of header */
+	get("/stall", 1, &result, body, sizeof(body));
+	CHECK(result.error_no == HTTP_GET_ERROR_READ_REMOTE);
+	CHECK(time(NULL) - start < 4);
+
+	http_pool_cleanup();
+}
+
+int main(int argc, char **argv)
+{
+	check_content_length();
+	check_chunked();
+	check_encodings();
+	check_close_delimited();
+	check_not_modified();
+	check_bad_line_ending();
+	check_error_response();
+	check_dns_cache();
+
+	start_server();
+	check_partial_reads();
+	check_stale_connection();
+	check_receive_timeout();
+	stop_server();
+
+	if (failures > 0) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	printf("all checks passed\n");
+	return 0;
+}